@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <libusbd.h>
+#include <libusbd_loopback.h>
+
+// Endpoint API benchmarks, run against the loopback backend so the numbers
+// only cover libusbd itself. Built and run by `make -f Makefile.linux bench`.
+//
+// Every result is one JSON object per line on stdout, progress goes to stderr.
+//
+//   -s <scale>    Divide iteration counts by scale (default 1), for quick runs
+//   -f <filter>   Only run benchmarks whose name contains filter
+//   -p <pcapng>   Capture the whole run to a pcapng file, to see what that costs
+
+#define BENCH_MAX_DEPTH (16)
+#define BENCH_MAX_SIZE  (4096)
+
+#define VENDOR_ECHO (0x01)
+
+// Addresses follow the order the endpoints are added in
+#define EP_BULK_OUT (0x01)
+#define EP_BULK_IN  (0x82)
+#define EP_INTR_OUT (0x03)
+#define EP_INTR_IN  (0x84)
+
+typedef struct bench_case_t
+{
+    bool is_in;
+    bool is_async;
+    uint32_t size;
+    uint32_t depth;
+    uint64_t iterations;
+} bench_case_t;
+
+static libusbd_ctx_t* pCtx;
+static libusbd_loopback_host_t* pHost;
+static uint8_t iface_num = 0;
+static uint64_t ep_bulk_out, ep_bulk_in, ep_intr_out, ep_intr_in;
+
+static uint64_t scale = 1;
+static const char* filter = NULL;
+
+static uint8_t host_bufs[BENCH_MAX_DEPTH][BENCH_MAX_SIZE];
+
+static pthread_mutex_t host_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t host_inflight;
+static uint64_t host_completed;
+static int host_error;
+
+static uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t bench_cpu_ns()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull
+           + ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static bool bench_enabled(const char* name)
+{
+    return !filter || strstr(name, filter);
+}
+
+static int vendor_callback(libusbd_setup_callback_info_t* info)
+{
+    // Echo the request back, so IN and OUT cost the same
+    if (info->bRequest == VENDOR_ECHO) {
+        info->out_len = info->wLength;
+        return 0;
+    }
+
+    return -1;
+}
+
+//
+// Bulk throughput
+//
+
+static void host_bulk_cb(void* user, int status)
+{
+    pthread_mutex_lock(&host_mutex);
+    if (status < 0) {
+        host_error = status;
+    }
+    host_inflight--;
+    host_completed++;
+    pthread_cond_signal(&host_cond);
+    pthread_mutex_unlock(&host_mutex);
+}
+
+static void* device_bulk_thread(void* arg)
+{
+    bench_case_t* pCase = (bench_case_t*)arg;
+    uint64_t ep = pCase->is_in ? ep_bulk_in : ep_bulk_out;
+    void* pBuf;
+
+    libusbd_ep_get_buffer(pCtx, iface_num, ep, &pBuf);
+
+    for (uint64_t i = 0; i < pCase->iterations; i++)
+    {
+        int ret;
+
+        if (!pCase->is_async) {
+            if (pCase->is_in) {
+                ret = libusbd_ep_write(pCtx, iface_num, ep, pBuf, pCase->size, 0);
+            }
+            else {
+                ret = libusbd_ep_read(pCtx, iface_num, ep, pBuf, pCase->size, 0);
+            }
+        }
+        else {
+            if (pCase->is_in) {
+                ret = libusbd_ep_write_start(pCtx, iface_num, ep, pBuf, pCase->size, 0);
+            }
+            else {
+                ret = libusbd_ep_read_start(pCtx, iface_num, ep, pCase->size, 0);
+            }
+
+            while (ret >= 0 && !libusbd_ep_transfer_done(pCtx, iface_num, ep))
+            {
+                sched_yield();
+            }
+        }
+
+        if (ret < 0) {
+            fprintf(stderr, "bench: device transfer failed %d\n", ret);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_bulk(bench_case_t* pCase)
+{
+    uint8_t ep_addr = pCase->is_in ? EP_BULK_IN : EP_BULK_OUT;
+    pthread_t dev;
+
+    host_inflight = 0;
+    host_completed = 0;
+    host_error = 0;
+
+    uint64_t cpu_start = bench_cpu_ns();
+    uint64_t start = bench_now_ns();
+
+    pthread_create(&dev, NULL, device_bulk_thread, pCase);
+
+    // Keep `depth` host transfers queued until all of them have been issued
+    uint64_t submitted = 0;
+    pthread_mutex_lock(&host_mutex);
+    while (host_completed < pCase->iterations && !host_error)
+    {
+        while (submitted < pCase->iterations && host_inflight < pCase->depth)
+        {
+            host_inflight++;
+            pthread_mutex_unlock(&host_mutex);
+            int ret = libusbd_loopback_host_submit(pHost, ep_addr, host_bufs[submitted % pCase->depth], pCase->size, host_bulk_cb, NULL);
+            pthread_mutex_lock(&host_mutex);
+            if (ret < 0) {
+                host_error = ret;
+                break;
+            }
+            submitted++;
+        }
+
+        if (host_completed < pCase->iterations && !host_error) {
+            pthread_cond_wait(&host_cond, &host_mutex);
+        }
+    }
+    pthread_mutex_unlock(&host_mutex);
+
+    if (host_error) {
+        // Unblock the device side so it can be joined
+        libusbd_loopback_host_disconnect(pHost);
+        libusbd_loopback_host_enumerate(pHost, 1000);
+    }
+    pthread_join(dev, NULL);
+
+    uint64_t elapsed = bench_now_ns() - start;
+    uint64_t cpu = bench_cpu_ns() - cpu_start;
+    double bytes = (double)pCase->iterations * pCase->size;
+
+    printf("{\"bench\":\"bulk\",\"dir\":\"%s\",\"mode\":\"%s\",\"size\":%u,\"depth\":%u,\"transfers\":%llu,"
+           "\"seconds\":%.6f,\"mb_per_s\":%.2f,\"transfers_per_s\":%.0f,\"cpu_s_per_gb\":%.4f,\"error\":%d}\n",
+           pCase->is_in ? "in" : "out", pCase->is_async ? "async" : "sync", pCase->size, pCase->depth,
+           (unsigned long long)pCase->iterations, elapsed / 1e9, (bytes / 1e6) / (elapsed / 1e9),
+           pCase->iterations / (elapsed / 1e9), (cpu / 1e9) / (bytes / 1e9), host_error);
+    fflush(stdout);
+}
+
+//
+// Interrupt round trip
+//
+
+static void* device_intr_thread(void* arg)
+{
+    uint64_t iterations = *(uint64_t*)arg;
+    uint8_t buf[8];
+
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        int ret = libusbd_ep_read(pCtx, iface_num, ep_intr_out, buf, sizeof(buf), 0);
+        if (ret < 0) break;
+
+        ret = libusbd_ep_write(pCtx, iface_num, ep_intr_in, buf, ret, 0);
+        if (ret < 0) break;
+    }
+
+    return NULL;
+}
+
+static int bench_cmp_u64(const void* a, const void* b)
+{
+    uint64_t va = *(const uint64_t*)a;
+    uint64_t vb = *(const uint64_t*)b;
+    return (va > vb) - (va < vb);
+}
+
+static void bench_interrupt_rtt(uint64_t iterations)
+{
+    uint64_t* pSamples = malloc(iterations * sizeof(uint64_t));
+    uint8_t out[8] = {0};
+    uint8_t in[8];
+    pthread_t dev;
+    int ret = 0;
+
+    pthread_create(&dev, NULL, device_intr_thread, &iterations);
+
+    uint64_t i;
+    for (i = 0; i < iterations; i++)
+    {
+        out[0] = i & 0xFF;
+
+        uint64_t start = bench_now_ns();
+        ret = libusbd_loopback_host_transfer(pHost, EP_INTR_OUT, out, sizeof(out), 1000);
+        if (ret >= 0) {
+            ret = libusbd_loopback_host_transfer(pHost, EP_INTR_IN, in, sizeof(in), 1000);
+        }
+        pSamples[i] = bench_now_ns() - start;
+
+        if (ret < 0) break;
+    }
+    pthread_join(dev, NULL);
+
+    if (!i) {
+        free(pSamples);
+        return;
+    }
+
+    qsort(pSamples, i, sizeof(uint64_t), bench_cmp_u64);
+
+    printf("{\"bench\":\"interrupt_rtt\",\"samples\":%llu,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,"
+           "\"p999_us\":%.2f,\"max_us\":%.2f,\"error\":%d}\n",
+           (unsigned long long)i, pSamples[i * 50 / 100] / 1e3, pSamples[i * 90 / 100] / 1e3,
+           pSamples[i * 99 / 100] / 1e3, pSamples[i * 999 / 1000] / 1e3, pSamples[i - 1] / 1e3,
+           ret < 0 ? ret : 0);
+    fflush(stdout);
+
+    free(pSamples);
+}
+
+//
+// Control requests
+//
+
+static void bench_control(uint16_t wLength, uint64_t iterations)
+{
+    uint8_t buf[BENCH_MAX_SIZE];
+    int ret = 0;
+
+    uint64_t cpu_start = bench_cpu_ns();
+    uint64_t start = bench_now_ns();
+
+    uint64_t i;
+    for (i = 0; i < iterations; i++)
+    {
+        ret = libusbd_loopback_host_control(pHost, 0xC1, VENDOR_ECHO, 0, iface_num, buf, wLength, 1000);
+        if (ret < 0) break;
+    }
+
+    uint64_t elapsed = bench_now_ns() - start;
+    uint64_t cpu = bench_cpu_ns() - cpu_start;
+
+    printf("{\"bench\":\"control\",\"wLength\":%u,\"requests\":%llu,\"seconds\":%.6f,\"requests_per_s\":%.0f,"
+           "\"cpu_us_per_request\":%.3f,\"error\":%d}\n",
+           wLength, (unsigned long long)i, elapsed / 1e9, i / (elapsed / 1e9),
+           i ? (cpu / 1e3) / i : 0.0, ret < 0 ? ret : 0);
+    fflush(stdout);
+}
+
+static uint64_t bench_iterations(uint64_t count)
+{
+    count /= scale;
+    return count ? count : 1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* pcap_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:p:")) != -1)
+    {
+        if (opt == 's') {
+            scale = strtoull(optarg, NULL, 0);
+            if (!scale) scale = 1;
+        }
+        else if (opt == 'f') {
+            filter = optarg;
+        }
+        else if (opt == 'p') {
+            pcap_path = optarg;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-s scale] [-f filter] [-p capture.pcapng]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    libusbd_set_log_level(LIBUSBD_LOG_LEVEL_WARN);
+
+    libusbd_init(&pCtx);
+    libusbd_set_vid(pCtx, 0x1209);
+    libusbd_set_pid(pCtx, 0x0001);
+
+    libusbd_iface_alloc(pCtx, &iface_num);
+    libusbd_config_finalize(pCtx);
+
+    libusbd_iface_set_class(pCtx, iface_num, 0xFF);
+    libusbd_iface_set_class_cmd_callback(pCtx, iface_num, vendor_callback);
+
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_OUT, 512, 0, 0, &ep_bulk_out);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_IN, 512, 0, 0, &ep_bulk_in);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_INTR, USB_EP_DIR_OUT, 8, 1, 0, &ep_intr_out);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_INTR, USB_EP_DIR_IN, 8, 1, 0, &ep_intr_in);
+    libusbd_iface_finalize(pCtx, iface_num);
+
+    // Measures what capturing costs, compare against a run without it
+    if (pcap_path && libusbd_pcap_start(pCtx, pcap_path, 0) < 0) {
+        fprintf(stderr, "bench: couldn't capture to %s\n", pcap_path);
+        return -1;
+    }
+
+    libusbd_loopback_host_open(pCtx, &pHost);
+    int ret = libusbd_loopback_host_enumerate(pHost, 1000);
+    if (ret < 0) {
+        fprintf(stderr, "bench: enumerate failed %d\n", ret);
+        return -1;
+    }
+
+    if (bench_enabled("bulk")) {
+        static const uint32_t sizes[] = {64, 512, 4096};
+        static const uint32_t depths[] = {1, 4, 16};
+
+        for (int dir = 0; dir < 2; dir++)
+        {
+            for (int async = 0; async < 2; async++)
+            {
+                for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+                {
+                    for (int j = 0; j < sizeof(depths) / sizeof(depths[0]); j++)
+                    {
+                        bench_case_t c = {dir == 0, async == 1, sizes[i], depths[j], bench_iterations(20000)};
+
+                        fprintf(stderr, "bench: bulk %s %s size %u depth %u\n", c.is_in ? "in" : "out", c.is_async ? "async" : "sync", c.size, c.depth);
+                        bench_bulk(&c);
+                    }
+                }
+            }
+        }
+    }
+
+    if (bench_enabled("interrupt")) {
+        fprintf(stderr, "bench: interrupt round trip\n");
+        bench_interrupt_rtt(bench_iterations(20000));
+    }
+
+    if (bench_enabled("control")) {
+        fprintf(stderr, "bench: control requests\n");
+        bench_control(0, bench_iterations(50000));
+        bench_control(64, bench_iterations(50000));
+    }
+
+    libusbd_pcap_stop(pCtx);
+    libusbd_loopback_host_close(pHost);
+    libusbd_free(pCtx);
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libusbd.h>
+#ifdef LIBUSBD_BENCH_LOOPBACK
+#include <libusbd_loopback.h>
+#endif
+
+// Time-to-enumeration: wall time from libusbd_init to the first completed
+// transfer, split into phases. Prints one JSON object on stdout.
+//
+// `make -f Makefile.linux bench-startup` runs it on FunctionFS, which needs
+// root and a UDC with a host plugged in. Run it twice to see the cost with
+// and without an existing gadget tree to reuse. The loopback build (part of
+// `make -f Makefile.linux bench`) only covers libusbd's own overhead.
+//
+//   -t <ms>    Give up waiting for the host after this long (default 10000)
+//   -b <name>  Backend to time, see libusbd_get_backends (default: automatic)
+
+static uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#ifdef LIBUSBD_BENCH_LOOPBACK
+static void* host_thread(void* arg)
+{
+    libusbd_ctx_t* pCtx = (libusbd_ctx_t*)arg;
+    libusbd_loopback_host_t* pHost;
+    uint8_t buf[8];
+
+    libusbd_loopback_host_open(pCtx, &pHost);
+    if (libusbd_loopback_host_enumerate(pHost, 10000) >= 0) {
+        libusbd_loopback_host_transfer(pHost, 0x81, buf, sizeof(buf), 10000);
+    }
+
+    return pHost;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    libusbd_ctx_t* pCtx;
+    uint8_t iface_num = 0;
+    uint64_t ep_intr_in;
+    uint64_t timeout_ms = 10000;
+    const char* backend = NULL;
+    int ret;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:")) != -1)
+    {
+        if (opt == 't') {
+            timeout_ms = strtoull(optarg, NULL, 0);
+        }
+        else if (opt == 'b') {
+            backend = optarg;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-t timeout_ms] [-b backend]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    libusbd_set_log_level(LIBUSBD_LOG_LEVEL_WARN);
+
+    uint64_t start = bench_now_ns();
+
+    ret = libusbd_init_backend(&pCtx, backend);
+    if (ret < 0) {
+        fprintf(stderr, "bench: init failed %d\n", ret);
+        return -1;
+    }
+    uint64_t t_init = bench_now_ns();
+
+#ifdef LIBUSBD_BENCH_LOOPBACK
+    pthread_t host;
+    pthread_create(&host, NULL, host_thread, pCtx);
+#endif
+
+    libusbd_set_vid(pCtx, 0x1209);
+    libusbd_set_pid(pCtx, 0x0001);
+    libusbd_set_manufacturer_str(pCtx, "libusbd");
+    libusbd_set_product_str(pCtx, "Startup Bench");
+
+    libusbd_iface_alloc(pCtx, &iface_num);
+    ret = libusbd_config_finalize(pCtx);
+    uint64_t t_config = bench_now_ns();
+
+    libusbd_iface_set_class(pCtx, iface_num, 0xFF);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_INTR, USB_EP_DIR_IN, 8, 1, 0, &ep_intr_in);
+    if (!ret) {
+        ret = libusbd_iface_finalize(pCtx, iface_num);
+    }
+    uint64_t t_finalize = bench_now_ns();
+
+    // Retry until the host has enumerated us and read the packet
+    uint8_t report[8] = {0};
+    uint64_t deadline = t_finalize + timeout_ms * 1000000ull;
+    while (!ret)
+    {
+        ret = libusbd_ep_write(pCtx, iface_num, ep_intr_in, report, sizeof(report), 10);
+        if (ret >= 0) break;
+
+        if ((ret == LIBUSBD_NOT_ENUMERATED || ret == LIBUSBD_TIMEOUT) && bench_now_ns() < deadline) {
+            ret = 0;
+            continue;
+        }
+    }
+    uint64_t t_first = bench_now_ns();
+
+    printf("{\"bench\":\"startup\",\"backend\":\"%s\",\"init_ms\":%.3f,\"config_finalize_ms\":%.3f,\"iface_finalize_ms\":%.3f,"
+           "\"enumerate_ms\":%.3f,\"total_ms\":%.3f,\"error\":%d}\n",
+           libusbd_get_backend(pCtx), (t_init - start) / 1e6, (t_config - t_init) / 1e6, (t_finalize - t_config) / 1e6,
+           (t_first - t_finalize) / 1e6, (t_first - start) / 1e6, ret < 0 ? ret : 0);
+    fflush(stdout);
+
+#ifdef LIBUSBD_BENCH_LOOPBACK
+    void* pHost;
+    pthread_join(host, &pHost);
+    libusbd_loopback_host_close(pHost);
+#endif
+
+    libusbd_free(pCtx);
+
+    return ret < 0 ? -1 : 0;
+}
@@ -285,6 +285,35 @@ impl Context {
         Ok(())
     }
 
+    /// Lifts a halt set by `ep_stall` without waiting for the host to clear it.
+    pub fn ep_clear_halt(&self, iface_num: u8, ep: u64) -> Result<()> {
+        try_unsafe!(libusbd_ep_clear_halt(self.context, iface_num, ep));
+
+        Ok(())
+    }
+
+    /// Sets whether an endpoint's async transfer is kept and re-armed after the host
+    /// resets or reconfigures the device (`LIBUSBD_REARM_*`).
+    pub fn ep_set_rearm(&self, iface_num: u8, ep: u64, policy: u8) -> Result<()> {
+        try_unsafe!(libusbd_ep_set_rearm(self.context, iface_num, ep, policy));
+
+        Ok(())
+    }
+
+    /// Backs an endpoint with a dma-buf, allocating one of `size` bytes if `fd` is negative.
+    pub fn ep_set_dmabuf(&self, iface_num: u8, ep: u64, fd: i32, size: u64) -> Result<()> {
+        try_unsafe!(libusbd_ep_set_dmabuf(self.context, iface_num, ep, fd, size));
+
+        Ok(())
+    }
+
+    /// Returns the dma-buf fd backing an endpoint. The library keeps ownership of it.
+    pub fn ep_get_dmabuf(&self, iface_num: u8, ep: u64) -> Result<i32> {
+        let fd = try_unsafe!(libusbd_ep_get_dmabuf(self.context, iface_num, ep));
+
+        Ok(fd)
+    }
+
     /// Returns true if an endpoint as completed an asynchronous transfer.
     pub fn ep_transfer_done(&self, iface_num: u8, ep: u64) -> Result<bool> {
         let ret = try_unsafe!(libusbd_ep_transfer_done(self.context, iface_num, ep));
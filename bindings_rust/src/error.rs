@@ -35,6 +35,12 @@ pub enum Error {
     /// Unknown or undescribed error.
     Nondescript,
 
+    /// Transfer was cancelled before it completed.
+    Cancelled,
+
+    /// Endpoint is halted, or the request was stalled.
+    Stalled,
+
     /// Invalid value
     Invalid,
 }
@@ -51,6 +57,8 @@ impl Error {
             Error::ResourceLimit    => "Resource limit reached",
             Error::AlreadyFinalized => "Resource is already finalized and cannot be modified",
             Error::Nondescript      => "Unknown or undescribed error",
+            Error::Cancelled        => "Transfer was cancelled",
+            Error::Stalled          => "Endpoint stalled",
             Error::Invalid           => "Invalid"
         }
     }
@@ -80,6 +88,8 @@ pub fn from_libusbd(err: ::std::os::raw::c_int) -> Error {
         libusbd::libusbd_error_LIBUSBD_RESOURCE_LIMIT_REACHED  => Error::ResourceLimit,
         libusbd::libusbd_error_LIBUSBD_ALREADY_FINALIZED       => Error::AlreadyFinalized,
         libusbd::libusbd_error_LIBUSBD_NONDESCRIPT_ERROR       => Error::Nondescript,
+        libusbd::libusbd_error_LIBUSBD_CANCELLED               => Error::Cancelled,
+        libusbd::libusbd_error_LIBUSBD_STALLED                 => Error::Stalled,
         _ => Error::Invalid,
     }
 }
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <libusbd.h>
+#include <libusbd_loopback.h>
+
+// Echo device on the loopback backend: whatever the host writes to the bulk
+// OUT endpoint comes back on bulk IN, and a vendor request reports how many
+// packets have been echoed so far. The "host" runs in this same process.
+
+#define VENDOR_GET_COUNT (0x01)
+
+#define EP_BULK_OUT (0x01)
+#define EP_BULK_IN  (0x82)
+#define EP_INTR_IN  (0x83)
+
+static libusbd_ctx_t* pCtx;
+static uint8_t iface_num = 0;
+static uint64_t ep_bulk_out, ep_bulk_in, ep_intr_in;
+
+static volatile bool stop;
+static volatile uint32_t echo_count = 0;
+
+int vendor_callback(libusbd_setup_callback_info_t* info)
+{
+    static uint32_t reply;
+
+    if (info->bmRequestType == 0xC1 && info->bRequest == VENDOR_GET_COUNT) {
+        reply = echo_count;
+        info->out_data = &reply;
+        info->out_len = sizeof(reply);
+        return 0;
+    }
+
+    return -1;
+}
+
+void* device_thread(void* arg)
+{
+    uint8_t buf[512];
+
+    while (!stop)
+    {
+        int ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 100);
+        if (ret == LIBUSBD_TIMEOUT || ret == LIBUSBD_NOT_ENUMERATED) {
+            continue;
+        }
+        else if (ret < 0) {
+            printf("device: read failed %d\n", ret);
+            break;
+        }
+
+        libusbd_ep_write(pCtx, iface_num, ep_bulk_in, buf, ret, 1000);
+        echo_count++;
+
+        uint8_t notify[4] = {echo_count & 0xFF, 0, 0, 0};
+        libusbd_ep_write(pCtx, iface_num, ep_intr_in, notify, sizeof(notify), 1000);
+    }
+
+    return NULL;
+}
+
+int main()
+{
+    libusbd_init(&pCtx);
+
+    libusbd_set_vid(pCtx, 0x1209);
+    libusbd_set_pid(pCtx, 0x0001);
+    libusbd_set_version(pCtx, 0x0100);
+
+    libusbd_set_class(pCtx, 0);
+    libusbd_set_subclass(pCtx, 0);
+    libusbd_set_protocol(pCtx, 0);
+
+    libusbd_set_manufacturer_str(pCtx, "libusbd");
+    libusbd_set_product_str(pCtx, "Loopback Echo");
+    libusbd_set_serial_str(pCtx, "0001");
+
+    libusbd_iface_alloc(pCtx, &iface_num);
+    libusbd_config_finalize(pCtx);
+
+    libusbd_iface_set_class(pCtx, iface_num, 0xFF);
+    libusbd_iface_set_subclass(pCtx, iface_num, 0);
+    libusbd_iface_set_protocol(pCtx, iface_num, 0);
+    libusbd_iface_set_class_cmd_callback(pCtx, iface_num, vendor_callback);
+
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_OUT, 512, 0, 0, &ep_bulk_out);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_IN, 512, 0, 0, &ep_bulk_in);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_INTR, USB_EP_DIR_IN, 8, 1, 0, &ep_intr_in);
+    libusbd_iface_finalize(pCtx, iface_num);
+
+    pthread_t dev;
+    pthread_create(&dev, NULL, device_thread, NULL);
+
+    libusbd_loopback_host_t* pHost;
+    libusbd_loopback_host_open(pCtx, &pHost);
+
+    int ret = libusbd_loopback_host_enumerate(pHost, 1000);
+    if (ret < 0) {
+        printf("host: enumerate failed %d\n", ret);
+        return -1;
+    }
+
+    uint8_t desc[18];
+    libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0100, 0, desc, sizeof(desc), 1000);
+    printf("host: device %04x:%04x\n", desc[8] | desc[9] << 8, desc[10] | desc[11] << 8);
+
+    for (int i = 0; i < 4; i++)
+    {
+        char msg[64];
+        char echo[512];
+        uint8_t notify[8];
+
+        snprintf(msg, sizeof(msg), "hello %d", i);
+
+        libusbd_loopback_host_transfer(pHost, EP_BULK_OUT, msg, strlen(msg) + 1, 1000);
+        ret = libusbd_loopback_host_transfer(pHost, EP_BULK_IN, echo, sizeof(echo), 1000);
+        printf("host: echoed %d bytes: %s\n", ret, ret > 0 ? echo : "");
+
+        ret = libusbd_loopback_host_transfer(pHost, EP_INTR_IN, notify, sizeof(notify), 1000);
+        printf("host: interrupt %d bytes, count %u\n", ret, notify[0]);
+    }
+
+    uint32_t count = 0;
+    libusbd_loopback_host_control(pHost, 0xC1, VENDOR_GET_COUNT, 0, iface_num, &count, sizeof(count), 1000);
+    printf("host: vendor request says %u echoes\n", count);
+
+    stop = true;
+    pthread_join(dev, NULL);
+
+    libusbd_loopback_host_close(pHost);
+    libusbd_free(pCtx);
+
+    return 0;
+}
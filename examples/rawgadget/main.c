@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libusbd.h>
+
+// Checks the Raw Gadget backend's cancel paths against dummy_hcd, no host
+// program needed: the kernel enumerates the device on the dummy host side
+// and nobody ever sends it anything, so every read has to be timed out or
+// aborted. Covers the signal that pulls a thread out of a blocked ioctl,
+// both from the worker (timeouts) and from the caller's own thread
+// (timeout 0), and cancelling async and transfer object reads.
+//
+//   modprobe dummy_hcd raw_gadget
+//   LIBUSBD_RAW_GADGET_UDC=dummy_udc.0 ./example_rawgadget
+//
+// Exits non-zero if any check fails.
+
+static libusbd_ctx_t* pCtx;
+static uint8_t iface_num = 0;
+static uint64_t ep_bulk_out, ep_bulk_in;
+
+static int failures = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static void check(bool ok, const char* what, int ret, uint64_t ms)
+{
+    printf("%s: %s (ret %d, %llu ms)\n", ok ? "pass" : "FAIL", what, ret, (unsigned long long)ms);
+    if (!ok) failures++;
+}
+
+static volatile int blocked_ret;
+
+void* blocked_read_thread(void* arg)
+{
+    uint8_t buf[512];
+
+    // No timeout, runs the ioctl on this thread
+    blocked_ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 0);
+    return NULL;
+}
+
+static volatile int xfer_status;
+static volatile bool xfer_done;
+
+void xfer_callback(libusbd_transfer_t* pXfer)
+{
+    xfer_status = pXfer->status;
+    __atomic_store_n(&xfer_done, true, __ATOMIC_RELEASE);
+}
+
+static bool wait_xfer(uint64_t timeout_ms)
+{
+    uint64_t start = now_ms();
+    while (!__atomic_load_n(&xfer_done, __ATOMIC_ACQUIRE))
+    {
+        if (now_ms() - start > timeout_ms) return false;
+        usleep(1000);
+    }
+    return true;
+}
+
+int main()
+{
+    if (libusbd_init_backend(&pCtx, "raw-gadget")) {
+        printf("raw-gadget backend isn't available\n");
+        return -1;
+    }
+
+    libusbd_set_vid(pCtx, 0x1209);
+    libusbd_set_pid(pCtx, 0x0001);
+    libusbd_set_version(pCtx, 0x0100);
+
+    libusbd_set_manufacturer_str(pCtx, "libusbd");
+    libusbd_set_product_str(pCtx, "Raw Gadget check");
+    libusbd_set_serial_str(pCtx, "0001");
+
+    libusbd_iface_alloc(pCtx, &iface_num);
+    libusbd_config_finalize(pCtx);
+
+    libusbd_iface_set_class(pCtx, iface_num, 0xFF);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_OUT, 512, 0, 0, &ep_bulk_out);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_IN, 512, 0, 0, &ep_bulk_in);
+    libusbd_iface_finalize(pCtx, iface_num);
+
+    uint8_t buf[512];
+    uint64_t start = now_ms();
+    int ret;
+
+    // usbcore picks the configuration on its own
+    do {
+        ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 10);
+        if (ret == LIBUSBD_NOT_ENUMERATED) usleep(10000);
+    } while (ret == LIBUSBD_NOT_ENUMERATED && now_ms() - start < 5000);
+
+    if (ret == LIBUSBD_NOT_ENUMERATED) {
+        printf("FAIL: not enumerated after 5s, is dummy_hcd loaded?\n");
+        libusbd_free(pCtx);
+        return -1;
+    }
+    printf("enumerated after %llu ms\n", (unsigned long long)(now_ms() - start));
+
+    // The worker has to be signalled out of the ioctl
+    start = now_ms();
+    ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 200);
+    uint64_t ms = now_ms() - start;
+    check(ret == LIBUSBD_TIMEOUT && ms >= 200 && ms < 400, "sync read times out", ret, ms);
+
+    // Back to back, a leftover signal or a stuck worker shows up here
+    for (int i = 0; i < 20; i++)
+    {
+        start = now_ms();
+        ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 5);
+        ms = now_ms() - start;
+        if (ret != LIBUSBD_TIMEOUT || ms > 100) break;
+    }
+    check(ret == LIBUSBD_TIMEOUT && ms <= 100, "20 short timeouts in a row", ret, ms);
+
+    // Abort from another thread while the reader sits in the ioctl itself
+    pthread_t reader;
+    blocked_ret = 1;
+    pthread_create(&reader, NULL, blocked_read_thread, NULL);
+    usleep(100000);
+    start = now_ms();
+    libusbd_ep_abort(pCtx, iface_num, ep_bulk_out);
+    pthread_join(reader, NULL);
+    ms = now_ms() - start;
+    check(blocked_ret < 0 && ms < 100, "abort wakes a blocked read", blocked_ret, ms);
+
+    // Async read, aborted
+    ret = libusbd_ep_read_start(pCtx, iface_num, ep_bulk_out, sizeof(buf), 0);
+    usleep(50000);
+    start = now_ms();
+    libusbd_ep_abort(pCtx, iface_num, ep_bulk_out);
+    int done = libusbd_ep_transfer_done(pCtx, iface_num, ep_bulk_out);
+    ms = now_ms() - start;
+    check(ret == LIBUSBD_SUCCESS && done == 1 && ms < 100, "abort finishes an async read", done, ms);
+
+    // Async read with a timeout
+    start = now_ms();
+    ret = libusbd_ep_read_start(pCtx, iface_num, ep_bulk_out, sizeof(buf), 100);
+    while (libusbd_ep_transfer_done(pCtx, iface_num, ep_bulk_out) != 1 && now_ms() - start < 1000)
+    {
+        usleep(1000);
+    }
+    ms = now_ms() - start;
+    check(ret == LIBUSBD_SUCCESS && ms >= 100 && ms < 300, "async read times out", ret, ms);
+
+    // Transfer objects, through the timeout and the cancel path
+    libusbd_transfer_t* pXfer;
+    libusbd_transfer_alloc(pCtx, iface_num, ep_bulk_out, 512, &pXfer);
+    pXfer->callback = xfer_callback;
+
+    pXfer->timeout_ms = 100;
+    xfer_done = false;
+    start = now_ms();
+    ret = libusbd_transfer_submit(pXfer);
+    bool finished = wait_xfer(1000);
+    ms = now_ms() - start;
+    check(ret == LIBUSBD_SUCCESS && finished && xfer_status == LIBUSBD_TIMEOUT && ms < 300, "transfer times out", xfer_status, ms);
+
+    pXfer->timeout_ms = 0;
+    xfer_done = false;
+    ret = libusbd_transfer_submit(pXfer);
+    usleep(50000);
+    start = now_ms();
+    libusbd_transfer_cancel(pXfer);
+    finished = wait_xfer(1000);
+    ms = now_ms() - start;
+    check(ret == LIBUSBD_SUCCESS && finished && xfer_status == LIBUSBD_CANCELLED && ms < 100, "transfer cancel", xfer_status, ms);
+
+    libusbd_transfer_free(pXfer);
+
+    // Still usable after all that
+    start = now_ms();
+    ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 50);
+    ms = now_ms() - start;
+    check(ret == LIBUSBD_TIMEOUT, "reads still work", ret, ms);
+
+    libusbd_free(pCtx);
+
+    printf("%d failed\n", failures);
+
+    return failures ? -1 : 0;
+}
@@ -13,6 +13,13 @@
 
 #include "utils.h"
 
+// Per-command logging, too slow for the data path outside of DEBUG builds
+#if defined(DEBUG) && DEBUG
+#define ums_debug(...) printf(__VA_ARGS__)
+#else
+#define ums_debug(...) do {} while (0)
+#endif
+
 #define UMS_IN_MAGIC 0x43425355
 #define UMS_RESP_MAGIC 0x53425355
 
@@ -321,6 +328,7 @@ typedef struct __attribute__((__packed__))
 #define UMS_USB_BULKSIZE (0x200)
 #define UMS_BLOCKSIZE (0x200)
 #define UMS_WRITE_TIMEOUT (50)
+#define UMS_DATA_OUT_TIMEOUT (2500)
 
 #define UMS_BYTES_TO_LBA(bytes) ((u64)((u64)(bytes) / UMS_BLOCKSIZE))
 #define UMS_LBA_TO_BYTES(lba)   ((u64)((u64)(lba) * UMS_BLOCKSIZE))
@@ -661,7 +669,7 @@ static void ums_on_data_recv(void* pkt_data)
         fseeko(luninfo->file, UMS_LBA_TO_BYTES(lba), SEEK_SET);
         
 
-        printf("file read %i (LUN %i) %x %llx %x\n", ret, hdr->lun, lba, actual_sectors, sectors);
+        ums_debug("file read %i (LUN %i) %x %llx %x\n", ret, hdr->lun, lba, actual_sectors, sectors);
 
         void* buf;
         libusbd_ep_get_buffer(ums_ctx, ums_interface, ums_epBulkIn, &buf);
@@ -742,7 +750,7 @@ static void ums_on_data_recv(void* pkt_data)
         }
         
         fseeko(luninfo->file, UMS_LBA_TO_BYTES(lba), SEEK_SET);
-        printf("file write (LUN %i) %x %x %x\n", hdr->lun, lba, actual_sectors, sectors);
+        ums_debug("file write (LUN %i) %x %x %x\n", hdr->lun, lba, actual_sectors, sectors);
 
         void* buf;
         libusbd_ep_get_buffer(ums_ctx, ums_interface, ums_epBulkOut, &buf);
@@ -750,12 +758,8 @@ static void ums_on_data_recv(void* pkt_data)
         u64 bytes_written = 0;
         for (int i = 0; i < actual_sectors; i++)
         {
-            for (int j = 0; j < 50; j++) {
-                ret = libusbd_ep_read(ums_ctx, ums_interface, ums_epBulkOut, buf, UMS_BLOCKSIZE, UMS_WRITE_TIMEOUT);
-                libusbd_ep_abort(ums_ctx, ums_interface, ums_epBulkOut);
-                if (!ret) continue;
-                break;
-            }
+            // A timed out read cancels itself, nothing to clean up after
+            ret = libusbd_ep_read(ums_ctx, ums_interface, ums_epBulkOut, buf, UMS_BLOCKSIZE, UMS_DATA_OUT_TIMEOUT);
             //printf("UMS write - read ret %i, %i residue %i\n", ret, i, ums_residue);
 
             if (ret >= 0) {
@@ -816,7 +820,7 @@ int start_stuff = 0;
 
 int ums_setup_callback(libusbd_setup_callback_info_t* info)
 {
-    printf("UMS setup callback! %02x %02x\n", info->bmRequestType, info->bRequest);
+    ums_debug("UMS setup callback! %02x %02x\n", info->bmRequestType, info->bRequest);
 
     if (info->bmRequestType == DEV2HOST_INTERFACE_CLASS)
     {
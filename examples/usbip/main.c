@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libusbd.h>
+#include <libusbd_usbip.h>
+
+// Bulk echo device exported over USB/IP. On another Linux machine (or this
+// one, with vhci-hcd loaded):
+//
+//   sudo usbip attach -r <this host> -b 1-1
+//
+// then talk to it with anything libusb-based, ie bulk OUT 0x01, bulk IN 0x82.
+
+#define USBIP_PORT (3240)
+
+static libusbd_ctx_t* pCtx;
+static uint8_t iface_num = 0;
+static uint64_t ep_bulk_out, ep_bulk_in;
+
+void* device_thread(void* arg)
+{
+    uint8_t buf[512];
+
+    while (1)
+    {
+        int ret = libusbd_ep_read(pCtx, iface_num, ep_bulk_out, buf, sizeof(buf), 100);
+        if (ret == LIBUSBD_TIMEOUT || ret == LIBUSBD_NOT_ENUMERATED || ret == LIBUSBD_CANCELLED) {
+            continue;
+        }
+        else if (ret < 0) {
+            printf("device: read failed %d\n", ret);
+            break;
+        }
+
+        libusbd_ep_write(pCtx, iface_num, ep_bulk_in, buf, ret, 1000);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : USBIP_PORT;
+
+    libusbd_init(&pCtx);
+
+    libusbd_set_vid(pCtx, 0x1209);
+    libusbd_set_pid(pCtx, 0x0001);
+    libusbd_set_version(pCtx, 0x0100);
+
+    libusbd_set_manufacturer_str(pCtx, "libusbd");
+    libusbd_set_product_str(pCtx, "USB/IP Echo");
+    libusbd_set_serial_str(pCtx, "0001");
+
+    libusbd_iface_alloc(pCtx, &iface_num);
+    libusbd_config_finalize(pCtx);
+
+    libusbd_iface_set_class(pCtx, iface_num, 0xFF);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_OUT, 512, 0, 0, &ep_bulk_out);
+    libusbd_iface_add_endpoint(pCtx, iface_num, USB_EPATTR_TTYPE_BULK, USB_EP_DIR_IN, 512, 0, 0, &ep_bulk_in);
+    libusbd_iface_finalize(pCtx, iface_num);
+
+    pthread_t dev;
+    pthread_create(&dev, NULL, device_thread, NULL);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+        perror("bind");
+        return -1;
+    }
+
+    printf("Serving on port %d\n", port);
+
+    while (1)
+    {
+        int ret = libusbd_usbip_serve(pCtx, listen_fd);
+        printf("Session ended (%d)\n", ret);
+        if (ret < 0) break;
+    }
+
+    close(listen_fd);
+    libusbd_free(pCtx);
+
+    return 0;
+}
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Bare USB/IP client for examples/usbip, so the server can be checked
+// without vhci-hcd or root. Lists the devices, imports 1-1, reads the
+// descriptors, sets configuration 1 and pushes a bulk OUT URB through the
+// echo device and back in on the bulk IN endpoint.
+//
+//   ./example_usbip &
+//   ./example_usbip_client [host] [port]
+//
+// Exits non-zero if any check fails.
+
+#define USBIP_PORT (3240)
+
+// USB/IP 1.1.1, everything on the wire is big endian
+#define USBIP_VERSION (0x0111)
+
+#define USBIP_OP_REQ_DEVLIST (0x8005)
+#define USBIP_OP_REP_DEVLIST (0x0005)
+#define USBIP_OP_REQ_IMPORT  (0x8003)
+#define USBIP_OP_REP_IMPORT  (0x0003)
+
+#define USBIP_CMD_SUBMIT (1)
+#define USBIP_RET_SUBMIT (3)
+
+#define USBIP_DIR_OUT (0)
+#define USBIP_DIR_IN  (1)
+
+#define USBIP_BUSID "1-1"
+
+typedef struct __attribute__((packed)) usbip_op_header_t
+{
+    uint16_t version;
+    uint16_t code;
+    uint32_t status;
+} usbip_op_header_t;
+
+typedef struct __attribute__((packed)) usbip_usb_device_t
+{
+    char path[256];
+    char busid[32];
+    uint32_t busnum;
+    uint32_t devnum;
+    uint32_t speed;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bConfigurationValue;
+    uint8_t bNumConfigurations;
+    uint8_t bNumInterfaces;
+} usbip_usb_device_t;
+
+typedef struct __attribute__((packed)) usbip_usb_interface_t
+{
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t padding;
+} usbip_usb_interface_t;
+
+typedef struct __attribute__((packed)) usbip_header_t
+{
+    uint32_t command;
+    uint32_t seqnum;
+    uint32_t devid;
+    uint32_t direction;
+    uint32_t ep;
+
+    union
+    {
+        struct __attribute__((packed))
+        {
+            uint32_t transfer_flags;
+            int32_t transfer_buffer_length;
+            int32_t start_frame;
+            int32_t number_of_packets;
+            int32_t interval;
+            uint8_t setup[8];
+        } cmd_submit;
+
+        struct __attribute__((packed))
+        {
+            int32_t status;
+            int32_t actual_length;
+            int32_t start_frame;
+            int32_t number_of_packets;
+            int32_t error_count;
+            uint8_t padding[8];
+        } ret_submit;
+    };
+} usbip_header_t;
+
+static const char* host = "127.0.0.1";
+static int port = USBIP_PORT;
+
+static uint32_t seqnum = 1;
+static uint32_t devid;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, int val)
+{
+    printf("%s: %s (%d)\n", ok ? "pass" : "FAIL", what, val);
+    if (!ok) failures++;
+}
+
+static int write_all(int fd, const void* data, uint32_t len)
+{
+    const uint8_t* pIter = (const uint8_t*)data;
+
+    while (len)
+    {
+        ssize_t ret = write(fd, pIter, len);
+        if (ret <= 0) return -1;
+
+        pIter += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int read_all(int fd, void* data, uint32_t len)
+{
+    uint8_t* pIter = (uint8_t*)data;
+
+    while (len)
+    {
+        ssize_t ret = read(fd, pIter, len);
+        if (ret <= 0) return -1;
+
+        pIter += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+static int connect_server(void)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        printf("Bad address %s\n", host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// One URB at a time, so the next RET_SUBMIT is always ours. Returns the
+// URB status, with the actual length in *pActual and IN data in data.
+static int submit(int fd, uint32_t direction, uint32_t ep, const uint8_t* setup, void* data, int32_t len, int32_t* pActual)
+{
+    usbip_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    uint32_t our_seqnum = seqnum++;
+    hdr.command = htonl(USBIP_CMD_SUBMIT);
+    hdr.seqnum = htonl(our_seqnum);
+    hdr.devid = htonl(devid);
+    hdr.direction = htonl(direction);
+    hdr.ep = htonl(ep);
+    hdr.cmd_submit.transfer_buffer_length = htonl(len);
+    if (setup) {
+        memcpy(hdr.cmd_submit.setup, setup, 8);
+    }
+
+    if (write_all(fd, &hdr, sizeof(hdr))) return -1;
+    if (direction == USBIP_DIR_OUT && len && write_all(fd, data, len)) return -1;
+
+    if (read_all(fd, &hdr, sizeof(hdr))) return -1;
+    if (ntohl(hdr.command) != USBIP_RET_SUBMIT || ntohl(hdr.seqnum) != our_seqnum) {
+        printf("Unexpected reply %x for seqnum %u\n", ntohl(hdr.command), ntohl(hdr.seqnum));
+        return -1;
+    }
+
+    int32_t status = ntohl(hdr.ret_submit.status);
+    int32_t actual = ntohl(hdr.ret_submit.actual_length);
+    if (actual < 0 || actual > len) return -1;
+
+    if (direction == USBIP_DIR_IN && actual && read_all(fd, data, actual)) return -1;
+
+    *pActual = actual;
+    return status;
+}
+
+static int control(int fd, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void* data, uint16_t wLength, int32_t* pActual)
+{
+    uint8_t setup[8] = {bmRequestType, bRequest, wValue & 0xFF, wValue >> 8, wIndex & 0xFF, wIndex >> 8, wLength & 0xFF, wLength >> 8};
+
+    return submit(fd, (bmRequestType & 0x80) ? USBIP_DIR_IN : USBIP_DIR_OUT, 0, setup, data, wLength, pActual);
+}
+
+int main(int argc, char** argv)
+{
+    usbip_op_header_t op;
+    usbip_usb_device_t dev;
+    int32_t actual = 0;
+    int ret;
+
+    if (argc > 1) host = argv[1];
+    if (argc > 2) port = atoi(argv[2]);
+
+    // Device list, the server hangs up after answering
+    int fd = connect_server();
+    if (fd < 0) return -1;
+
+    op.version = htons(USBIP_VERSION);
+    op.code = htons(USBIP_OP_REQ_DEVLIST);
+    op.status = 0;
+
+    uint32_t num_devs = 0;
+    ret = write_all(fd, &op, sizeof(op)) || read_all(fd, &op, sizeof(op)) || read_all(fd, &num_devs, sizeof(num_devs));
+    check(!ret && ntohs(op.code) == USBIP_OP_REP_DEVLIST && ntohl(num_devs) == 1, "device list", ntohl(num_devs));
+    if (ret || ntohl(num_devs) != 1) {
+        close(fd);
+        return -1;
+    }
+
+    ret = read_all(fd, &dev, sizeof(dev));
+    check(!ret && !strcmp(dev.busid, USBIP_BUSID), "listed device is " USBIP_BUSID, ret);
+
+    usbip_usb_interface_t aIfaces[32];
+    if (!ret) {
+        ret = dev.bNumInterfaces > 32 || read_all(fd, aIfaces, dev.bNumInterfaces * sizeof(usbip_usb_interface_t));
+        check(!ret && dev.bNumInterfaces && aIfaces[0].bInterfaceClass == 0xFF, "interface list", dev.bNumInterfaces);
+    }
+    close(fd);
+
+    // Import, the connection stays up as the URB channel
+    fd = connect_server();
+    if (fd < 0) return -1;
+
+    char busid[32];
+    memset(busid, 0, sizeof(busid));
+    strcpy(busid, USBIP_BUSID);
+
+    op.version = htons(USBIP_VERSION);
+    op.code = htons(USBIP_OP_REQ_IMPORT);
+    op.status = 0;
+
+    ret = write_all(fd, &op, sizeof(op)) || write_all(fd, busid, sizeof(busid)) || read_all(fd, &op, sizeof(op));
+    check(!ret && ntohs(op.code) == USBIP_OP_REP_IMPORT && op.status == 0, "import", ret ? ret : (int)ntohl(op.status));
+    if (ret || op.status != 0 || read_all(fd, &dev, sizeof(dev))) {
+        close(fd);
+        return -1;
+    }
+    devid = ntohl(dev.busnum) << 16 | ntohl(dev.devnum);
+
+    // Enumerate like the kernel would
+    uint8_t desc[18];
+    ret = control(fd, 0x80, 0x06, 0x0100, 0, desc, sizeof(desc), &actual);
+    check(ret == 0 && actual == 18 && (desc[8] | desc[9] << 8) == ntohs(dev.idVendor), "GET_DESCRIPTOR device", ret ? ret : actual);
+
+    uint8_t config[0x400];
+    ret = control(fd, 0x80, 0x06, 0x0200, 0, config, sizeof(config), &actual);
+    check(ret == 0 && actual >= 9, "GET_DESCRIPTOR config", ret ? ret : actual);
+
+    // First bulk OUT and bulk IN in the configuration
+    uint8_t ep_out = 0, ep_in = 0;
+    for (int i = 0; i + 1 < actual && config[i] >= 2; i += config[i])
+    {
+        if (config[i+1] != 0x05 || i + 7 > actual || (config[i+3] & 0x3) != 0x2) continue;
+
+        if ((config[i+2] & 0x80) && !ep_in) ep_in = config[i+2];
+        else if (!(config[i+2] & 0x80) && !ep_out) ep_out = config[i+2];
+    }
+    check(ep_out && ep_in, "bulk endpoints in config", ep_out << 8 | ep_in);
+
+    ret = control(fd, 0x00, 0x09, 1, 0, NULL, 0, &actual);
+    check(ret == 0, "SET_CONFIGURATION 1", ret);
+
+    uint8_t cur_config = 0;
+    ret = control(fd, 0x80, 0x08, 0, 0, &cur_config, 1, &actual);
+    check(ret == 0 && cur_config == 1, "GET_CONFIGURATION", ret ? ret : cur_config);
+
+    // Round trip through the echo device
+    uint8_t out[64], in[512];
+    for (int i = 0; i < sizeof(out); i++)
+    {
+        out[i] = i ^ 0xA5;
+    }
+
+    if (ep_out && ep_in) {
+        ret = submit(fd, USBIP_DIR_OUT, ep_out & 0xF, NULL, out, sizeof(out), &actual);
+        check(ret == 0 && actual == sizeof(out), "bulk OUT", ret ? ret : actual);
+
+        memset(in, 0, sizeof(in));
+        ret = submit(fd, USBIP_DIR_IN, ep_in & 0xF, NULL, in, sizeof(in), &actual);
+        check(ret == 0 && actual == sizeof(out) && !memcmp(in, out, sizeof(out)), "bulk IN echoes it back", ret ? ret : actual);
+    }
+
+    // Hanging up detaches
+    close(fd);
+
+    printf("%d failed\n", failures);
+
+    return failures ? -1 : 0;
+}
@@ -23,6 +23,8 @@ enum libusbd_error
     LIBUSBD_NOT_IMPLEMENTED = -4,
     LIBUSBD_RESOURCE_LIMIT_REACHED = -5,
     LIBUSBD_ALREADY_FINALIZED = -6,
+    LIBUSBD_CANCELLED = -7,
+    LIBUSBD_STALLED = -8,
     LIBUSBD_NONDESCRIPT_ERROR = -1024,
 };
 
@@ -42,6 +44,36 @@ enum libusbd_error
 #define USB_EP_DIR_OUT (0)
 #define USB_EP_DIR_IN (1)
 
+// libusbd_ep_set_rearm policies
+//
+// With LIBUSBD_REARM_ON_ENABLE, an endpoint's async transfer (`libusbd_ep_read_start`
+// or `libusbd_ep_write_start`) is kept by the library if the host resets or
+// reconfigures the device, and is resubmitted as-is once the device is enabled again.
+// Transfers started before enumeration are held and submitted on the first enable.
+#define LIBUSBD_REARM_NONE      (0)
+#define LIBUSBD_REARM_ON_ENABLE (1)
+
+// libusbd_set_buffer_pool flags
+//
+// Endpoint, setup and transfer buffers come from one mmap'd region per context.
+// LIBUSBD_POOL_HUGETLB backs it with huge pages (transparent ones if none are
+// reserved), LIBUSBD_POOL_MLOCK locks buffers in as they're handed out and
+// LIBUSBD_POOL_PREFAULT faults them in, so transfers don't take page faults.
+#define LIBUSBD_POOL_HUGETLB  (1 << 0)
+#define LIBUSBD_POOL_MLOCK    (1 << 1)
+#define LIBUSBD_POOL_PREFAULT (1 << 2)
+
+// libusbd_set_buffer_retention policies
+//
+// With LIBUSBD_RETAIN_ALWAYS endpoint buffers are allocated once every interface
+// is finalized and kept until `libusbd_free`. With LIBUSBD_RETAIN_WHILE_ENABLED
+// they're allocated when the host enables the device and given back to the
+// buffer pool when it's disabled or unplugged, once no transfer is using them.
+// A pointer from `libusbd_ep_get_buffer` is only good until then. Endpoints with
+// a standing transfer (LIBUSBD_REARM_ON_ENABLE) or a dma-buf keep theirs.
+#define LIBUSBD_RETAIN_ALWAYS        (0)
+#define LIBUSBD_RETAIN_WHILE_ENABLED (1)
+
 //
 // bmRequestType
 //
@@ -86,6 +118,7 @@ typedef struct libusbd_setup_callback_info_t libusbd_setup_callback_info_t;
 
 // libusbd public types
 typedef int (*libusbd_setup_callback_t)(libusbd_setup_callback_info_t* info);
+
 typedef struct libusbd_setup_callback_info_t
 {
     uint8_t bmRequestType;
@@ -98,9 +131,124 @@ typedef struct libusbd_setup_callback_info_t
     void* out_data;
 } libusbd_setup_callback_info_t;
 
+// Endpoint statistics, see `libusbd_ep_get_stats`
+//
+// latency_hist[i] counts completions which took [2^i, 2^(i+1)) microseconds
+// from submission, with anything under 1us in bucket 0.
+#define LIBUSBD_STATS_HIST_BUCKETS (32)
+
+typedef struct libusbd_ep_stats_t
+{
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t errors;
+    uint64_t cancellations;
+    uint32_t queue_depth;
+    uint32_t max_queue_depth;
+    uint64_t latency_hist[LIBUSBD_STATS_HIST_BUCKETS];
+} libusbd_ep_stats_t;
+
+// Endpoint backpressure, see `libusbd_ep_get_fifo_status`
+typedef struct libusbd_ep_fifo_status_t
+{
+    int32_t fifo_bytes;   // Bytes sitting in the controller's FIFO, -1 if the backend can't tell
+    uint32_t queue_depth; // Transfers submitted through libusbd and not yet completed
+} libusbd_ep_fifo_status_t;
+
+// above is 1 when an endpoint's queue depth reaches its high watermark, and 0
+// once it has drained back down to the low one. Runs on whichever thread
+// submitted or completed the transfer, possibly with libusbd's locks held, so
+// it should only signal the producer and not call back into libusbd.
+typedef void (*libusbd_ep_watermark_callback_t)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int above, void* user);
+
+// Transfer objects, see `libusbd_transfer_alloc`
+typedef struct libusbd_transfer_t libusbd_transfer_t;
+typedef void (*libusbd_transfer_cb_t)(libusbd_transfer_t* pXfer);
+
+typedef struct libusbd_transfer_t
+{
+    libusbd_ctx_t* pCtx;
+    uint8_t iface_num;
+    uint64_t ep;
+
+    // Owned by the transfer, don't touch it while it's submitted
+    void* buffer;
+    uint32_t buffer_size;
+
+    // Set before `libusbd_transfer_submit`, timeout_ms of 0 waits forever
+    uint32_t length;
+    uint64_t timeout_ms;
+    libusbd_transfer_cb_t callback;
+    void* user_data;
+
+    // Set before callback runs. status is LIBUSBD_SUCCESS, or
+    // LIBUSBD_TIMEOUT, LIBUSBD_CANCELLED etc with actual_length 0.
+    int status;
+    uint32_t actual_length;
+} libusbd_transfer_t;
+
+// A finished transfer, see `libusbd_poll_completions`. timestamp_ns is
+// CLOCK_MONOTONIC.
+typedef struct libusbd_completion_t
+{
+    libusbd_transfer_t* transfer;
+    uint8_t iface_num;
+    uint64_t ep;
+    void* user_data;
+    int status;
+    uint32_t actual_length;
+    uint64_t timestamp_ns;
+} libusbd_completion_t;
+
+#define LIBUSBD_WAIT_FOREVER (UINT64_MAX)
+
+// Log levels, see `libusbd_set_log_level`. Messages above the build's
+// LIBUSBD_LOG_MAX_LEVEL (DEBUG for DEBUG builds, INFO otherwise) are
+// compiled out and can't be enabled at runtime.
+enum libusbd_log_level
+{
+    LIBUSBD_LOG_LEVEL_NONE = 0,
+    LIBUSBD_LOG_LEVEL_ERROR = 1,
+    LIBUSBD_LOG_LEVEL_WARN = 2,
+    LIBUSBD_LOG_LEVEL_INFO = 3,
+    LIBUSBD_LOG_LEVEL_DEBUG = 4,
+};
+
+// msg has no trailing newline. Called from libusbd's internal threads.
+typedef void (*libusbd_log_callback_t)(int level, const char* msg, void* user);
+
+// Trace ring events, see `libusbd_trace_enable`. Events not tied to an
+// interface endpoint (ep0, setup) use iface_num 0xFF.
+enum libusbd_trace_type
+{
+    LIBUSBD_TRACE_SUBMIT = 1,    // arg0 = length
+    LIBUSBD_TRACE_COMPLETE = 2,  // arg0 = (int32_t) bytes transferred or error
+    LIBUSBD_TRACE_CANCEL = 3,    // arg0 = backend request id
+    LIBUSBD_TRACE_EP0_EVENT = 4, // arg0 = backend event type
+    LIBUSBD_TRACE_SETUP = 5,     // arg0 = bmRequestType << 24 | bRequest << 16 | wValue, arg1 = wIndex << 16 | wLength
+};
+
+typedef struct libusbd_trace_event_t
+{
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+    uint64_t seq;
+    uint8_t type;
+    uint8_t iface_num;
+    uint8_t ep;
+    uint32_t arg0;
+    uint32_t arg1;
+} libusbd_trace_event_t;
+
 int libusbd_init(libusbd_ctx_t** pCtxOut);
 int libusbd_free(libusbd_ctx_t* pCtx);
 
+// Backends are picked at init: by name here or via $LIBUSBD_BACKEND, otherwise
+// the first one built in that the running system supports. get_backends fills
+// up to max names and returns how many are built in.
+int libusbd_init_backend(libusbd_ctx_t** pCtxOut, const char* backend);
+int libusbd_get_backends(const char** pOut, uint32_t max);
+const char* libusbd_get_backend(libusbd_ctx_t* pCtx);
+
 int libusbd_set_vid(libusbd_ctx_t* pCtx, uint16_t val);
 int libusbd_set_pid(libusbd_ctx_t* pCtx, uint16_t val);
 int libusbd_set_version(libusbd_ctx_t* pCtx, uint16_t val);
@@ -111,6 +259,15 @@ int libusbd_set_manufacturer_str(libusbd_ctx_t* pCtx, const char* pStr);
 int libusbd_set_product_str(libusbd_ctx_t* pCtx, const char* pStr);
 int libusbd_set_serial_str(libusbd_ctx_t* pCtx, const char* pStr);
 
+// The pool is mapped when the first buffer is handed out, by
+// `libusbd_iface_finalize` at the latest, so this has to come before that.
+// LIBUSBD_ALREADY_FINALIZED afterwards.
+int libusbd_set_buffer_pool(libusbd_ctx_t* pCtx, uint32_t flags);
+
+// Can be changed at any time, it applies from the next enable or disable on.
+// Backends that can't tell when the host disables the device always retain.
+int libusbd_set_buffer_retention(libusbd_ctx_t* pCtx, uint8_t policy);
+
 int libusbd_config_finalize(libusbd_ctx_t* pCtx);
 
 int libusbd_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name);
@@ -129,13 +286,105 @@ int libusbd_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* d
 int libusbd_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs);
 int libusbd_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
 int libusbd_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+
+// Lifts a halt from `libusbd_ep_stall` without waiting for the host's
+// CLEAR_FEATURE(ENDPOINT_HALT), and resets the data toggle
+int libusbd_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
 int libusbd_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut);
 int libusbd_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms);
 int libusbd_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms);
 
+int libusbd_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy);
+
+// Backs an endpoint with a dma-buf, once every interface is finalized. With
+// fd < 0 one of `size` bytes is allocated (udmabuf), otherwise `fd` is
+// imported as-is (the library keeps its own reference). `libusbd_ep_get_buffer`
+// returns its mapping from then on. Where FunctionFS supports dma-buf
+// transfers (Linux 6.9+) they go straight from it, otherwise through AIO on
+// the mapping. Completed dma-buf reads report the requested length.
+int libusbd_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size);
+
+// The endpoint's dma-buf fd, still owned by the library
+int libusbd_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+
 int libusbd_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
 int libusbd_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
 
+// Transfers with their own buffers, any number of which can be queued on an
+// endpoint at once. They complete in the order they were submitted, with
+// callback running on one of libusbd's threads, from which it may resubmit.
+// Submitting fails with LIBUSBD_NOT_ENUMERATED where the backend can't hold
+// transfers until the host configures the device. Cancelling is asynchronous,
+// the transfer isn't done with until its callback has run. Transfers must be
+// finished and freed before `libusbd_free`.
+int libusbd_transfer_alloc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t buffer_size, libusbd_transfer_t** pOut);
+int libusbd_transfer_submit(libusbd_transfer_t* pXfer);
+int libusbd_transfer_cancel(libusbd_transfer_t* pXfer);
+int libusbd_transfer_free(libusbd_transfer_t* pXfer);
+
+// For high-rate endpoints. `libusbd_transfer_prepare` checks the transfer
+// against its endpoint and builds what gets handed to the kernel once, after
+// which `libusbd_transfer_resubmit` sends it again with the given length and
+// nothing else redone. Prepare again after changing anything but length,
+// timeout_ms, callback or user_data.
+int libusbd_transfer_prepare(libusbd_transfer_t* pXfer);
+int libusbd_transfer_resubmit(libusbd_transfer_t* pXfer, uint32_t length);
+
+// Transfers submitted without a callback are queued here when they finish
+// instead, for apps that would rather reap completions in batches on their
+// own thread. Fills in up to max events and returns how many, waiting up to
+// timeout_ms for the first one. timeout_ms of 0 doesn't wait, unlike
+// elsewhere, LIBUSBD_WAIT_FOREVER does so indefinitely. A transfer stays in
+// flight until it's been returned here.
+int libusbd_poll_completions(libusbd_ctx_t* pCtx, libusbd_completion_t* pEvents, uint32_t max, uint64_t timeout_ms);
+
+int libusbd_ep_get_stats(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, libusbd_ep_stats_t* pOut);
+int libusbd_get_stats(libusbd_ctx_t* pCtx, libusbd_ep_stats_t* pOut);
+int libusbd_reset_stats(libusbd_ctx_t* pCtx);
+
+// For IN endpoints, fifo_bytes is data the host hasn't picked up yet, for OUT
+// endpoints data received but not yet read. Only answered once enumerated.
+int libusbd_ep_get_fifo_status(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, libusbd_ep_fifo_status_t* pOut);
+
+// Calls cb when the endpoint's queue depth crosses high going up and low going
+// down, so producers can throttle before queues grow and ramp back up as soon
+// as the host drains them. low must be below high, cb NULL turns it off.
+// Set it while the endpoint is idle.
+int libusbd_ep_set_watermarks(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t low, uint32_t high, libusbd_ep_watermark_callback_t cb, void* user);
+
+int libusbd_set_log_level(int level);
+int libusbd_set_log_callback(libusbd_log_callback_t cb, void* user);
+
+int libusbd_trace_enable(libusbd_ctx_t* pCtx, uint32_t num_events);
+int libusbd_trace_disable(libusbd_ctx_t* pCtx);
+int libusbd_trace_dump(libusbd_ctx_t* pCtx, libusbd_trace_event_t* pOut, uint32_t max_events);
+
+// Captures every setup request and endpoint transfer (with payloads and
+// timestamps) to a file until stopped, for replaying against the loopback
+// backend with `libusbd_loopback_host_replay`. Writes are buffered, so the
+// file is only complete after `libusbd_record_stop`.
+int libusbd_record_start(libusbd_ctx_t* pCtx, const char* path);
+int libusbd_record_stop(libusbd_ctx_t* pCtx);
+
+// Writes traffic as pcapng with the Linux usbmon link type, so it opens
+// directly in Wireshark. Events go through a lock-free ring drained by a
+// writer thread, and are dropped (and counted in the file) rather than
+// slowing transfers down if it can't keep up. At most snaplen bytes of each
+// payload are kept, 0 picks a default. The ring is sized by the first call.
+int libusbd_pcap_start(libusbd_ctx_t* pCtx, const char* path, uint32_t snaplen);
+int libusbd_pcap_stop(libusbd_ctx_t* pCtx);
+
+// In-place upgrades. `libusbd_handoff_export` sends a running, finalized
+// context's endpoint fds and descriptor state over a connected AF_UNIX stream
+// socket, and `libusbd_handoff_adopt` picks them up in the successor without
+// the device leaving the bus. The exporting context is stopped afterwards and
+// should only be passed to `libusbd_free`. Outstanding async transfers are
+// cancelled, except standing ones (LIBUSBD_REARM_ON_ENABLE) which the
+// successor resubmits. Setup callbacks don't carry over and must be set again.
+// Refused while transfer objects are in flight. Linux only.
+int libusbd_handoff_export(libusbd_ctx_t* pCtx, int sock_fd);
+int libusbd_handoff_adopt(libusbd_ctx_t** pCtxOut, int sock_fd);
+
 #ifdef __cplusplus
 }
 #endif
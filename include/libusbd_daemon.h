@@ -0,0 +1,78 @@
+#ifndef _LIBUSBD_DAEMON_H
+#define _LIBUSBD_DAEMON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+// Multi-process composite devices (Linux only).
+//
+// One process runs `libusbd_daemon_run` and owns the gadget. Every other
+// process connects with `libusbd_client_connect`, describes one interface
+// with the libusbd_client_* calls mirroring libusbd_iface_*, and finalizes
+// it. Once `num_clients` interfaces are in, the daemon brings the device up
+// and each client gets a private shared-memory segment holding one ring per
+// endpoint. Endpoint data never goes through the daemon's socket.
+//
+// Clients can't see each other's rings, but the device only enumerates with
+// all of its interfaces, so a client that exits leaves its interface idle
+// until the daemon is restarted. Nonstandard descriptors (ie HID reports)
+// are served by the daemon, class and vendor requests addressed to a
+// client's interface are forwarded to it (see
+// `libusbd_client_set_class_cmd_callback`).
+
+typedef struct libusbd_client_t libusbd_client_t;
+
+//
+// Daemon side
+//
+
+// pCtx must be set up to the point of `libusbd_config_finalize` (vid, pid,
+// strings, builtin interfaces), the daemon allocates and finalizes the rest.
+// Client interfaces are numbered in the order the clients' registrations
+// (`libusbd_client_finalize`) arrive. Returns once every client has
+// disconnected, or on error.
+int libusbd_daemon_run(libusbd_ctx_t* pCtx, const char* sock_path, uint8_t num_clients);
+
+//
+// Client side
+//
+
+int libusbd_client_connect(const char* sock_path, libusbd_client_t** pOut);
+int libusbd_client_close(libusbd_client_t* pClient);
+
+int libusbd_client_standard_desc(libusbd_client_t* pClient, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+int libusbd_client_nonstandard_desc(libusbd_client_t* pClient, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+int libusbd_client_add_endpoint(libusbd_client_t* pClient, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t* pEpOut);
+int libusbd_client_set_description(libusbd_client_t* pClient, const char* desc);
+int libusbd_client_set_class(libusbd_client_t* pClient, uint8_t val);
+int libusbd_client_set_subclass(libusbd_client_t* pClient, uint8_t val);
+int libusbd_client_set_protocol(libusbd_client_t* pClient, uint8_t val);
+
+// Runs func for class/vendor requests to this interface, from a thread
+// started by `libusbd_client_finalize` and stopped by `libusbd_client_close`
+// (so func can't close the client). OUT data is in out_data, an IN answer
+// goes in out_data/out_len and is cut to wLength, a negative return stalls.
+// Requests func doesn't answer within a second are stalled. Must be set
+// before finalizing.
+int libusbd_client_set_class_cmd_callback(libusbd_client_t* pClient, libusbd_setup_callback_t func);
+
+// Blocks until the daemon has heard from all of its clients and the device
+// is configured. pIfaceNumOut may be NULL.
+int libusbd_client_finalize(libusbd_client_t* pClient, uint8_t* pIfaceNumOut);
+
+// Transfers are at most 0x1000 bytes. Writes return once the data is queued
+// to the daemon, reads may return data the daemon accepted from the host
+// ahead of time. timeout_ms of 0 waits forever.
+int libusbd_client_ep_read(libusbd_client_t* pClient, uint64_t ep, void* data, uint32_t len, uint64_t timeout_ms);
+int libusbd_client_ep_write(libusbd_client_t* pClient, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_DAEMON_H
@@ -0,0 +1,78 @@
+#ifndef _LIBUSBD_LOOPBACK_H
+#define _LIBUSBD_LOOPBACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+// Host side of the in-process loopback backend (`make -f Makefile.loopback`).
+//
+// The device is configured through the normal libusbd API, then a simulated
+// host opens it, enumerates it and moves data against its endpoints. Nothing
+// leaves the process, there's no bus timing and iso endpoints behave like
+// bulk ones, but control, bulk, interrupt and iso traffic all go through the
+// same paths the device code uses on real hardware.
+//
+// Endpoints are addressed by bEndpointAddress as reported in the
+// configuration descriptor, numbered from 1 in the order they were added.
+
+typedef struct libusbd_loopback_host_t libusbd_loopback_host_t;
+
+// status is bytes transferred (>= 0) or a LIBUSBD_* error. Called without
+// any libusbd locks held, from whichever thread completed the transfer.
+typedef void (*libusbd_loopback_host_cb_t)(void* user, int status);
+
+int libusbd_loopback_host_open(libusbd_ctx_t* pCtx, libusbd_loopback_host_t** pOut);
+int libusbd_loopback_host_close(libusbd_loopback_host_t* pHost);
+
+// Waits for the device to finalize, fetches its descriptors and sets
+// configuration 1. timeout_ms of 0 waits forever.
+int libusbd_loopback_host_enumerate(libusbd_loopback_host_t* pHost, uint64_t timeout_ms);
+
+// Simulates a bus reset. Outstanding transfers are cancelled, except
+// standing device transfers with LIBUSBD_REARM_ON_ENABLE.
+int libusbd_loopback_host_disconnect(libusbd_loopback_host_t* pHost);
+
+// Returns bytes transferred in the data stage, or a LIBUSBD_* error
+// (LIBUSBD_STALLED if the device rejected the request).
+int libusbd_loopback_host_control(libusbd_loopback_host_t* pHost, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void* data, uint16_t wLength, uint64_t timeout_ms);
+
+// Bulk, interrupt or iso transfer. IN transfers complete on the device's
+// next write (short or not), OUT transfers once the device has read all of it.
+int libusbd_loopback_host_transfer(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* data, uint32_t len, uint64_t timeout_ms);
+int libusbd_loopback_host_submit(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* data, uint32_t len, libusbd_loopback_host_cb_t cb, void* user);
+
+// Cancels the oldest outstanding `libusbd_loopback_host_submit` on ep_addr
+// with a matching user pointer. Its callback runs with LIBUSBD_CANCELLED
+// before this returns. LIBUSBD_INVALID_ARGUMENT if it already completed.
+int libusbd_loopback_host_cancel(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* user);
+
+// Replays a capture from `libusbd_record_start` against the device, which
+// must already be enumerated. Setups and transfers are issued one at a time
+// in the order they completed, OUT data is sent as recorded and IN data is
+// compared against it. With LIBUSBD_REPLAY_REALTIME each one waits for its
+// recorded offset from the start, otherwise they run back to back.
+#define LIBUSBD_REPLAY_REALTIME (1 << 0)
+
+typedef struct libusbd_loopback_replay_result_t
+{
+    uint64_t setups;
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t mismatches; // completed, but not with the recorded length/data
+    uint64_t errors;     // failed or timed out
+    uint64_t elapsed_ns;
+    uint64_t max_lag_ns; // LIBUSBD_REPLAY_REALTIME only, worst lateness
+} libusbd_loopback_replay_result_t;
+
+int libusbd_loopback_host_replay(libusbd_loopback_host_t* pHost, const char* path, uint32_t flags, libusbd_loopback_replay_result_t* pOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_LOOPBACK_H
@@ -0,0 +1,30 @@
+#ifndef _LIBUSBD_USBIP_H
+#define _LIBUSBD_USBIP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+// USB/IP export for the loopback backend (`make -f Makefile.loopback`).
+//
+// Serves the device to a remote `usbip attach -r <host> -b 1-1` (or anything
+// else speaking USB/IP 1.1.1) instead of a UDC. URBs are handed to the
+// loopback host as they arrive, so any number can be outstanding per
+// endpoint, and completions are coalesced into as few socket writes as the
+// client's pace allows.
+//
+// listen_fd is a bound, listening TCP or AF_UNIX stream socket. Device list
+// requests are answered as they come in. Returns once an attached client
+// disconnects, with the device reset as if unplugged, so call it in a loop
+// to keep serving. The loopback host must not be open elsewhere meanwhile.
+int libusbd_usbip_serve(libusbd_ctx_t* pCtx, int listen_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_USBIP_H
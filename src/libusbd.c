@@ -1,23 +1,45 @@
 #include "libusbd.h"
 
 #include "libusbd_priv.h"
+#include "libusbd_arena.h"
+#include "libusbd_backend.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_pool.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+#include "libusbd_transfer.h"
+#include "libusbd_trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "plat/macos/impl.h"
 
 int libusbd_init(libusbd_ctx_t** pCtxOut)
+{
+    return libusbd_init_backend(pCtxOut, getenv("LIBUSBD_BACKEND"));
+}
+
+int libusbd_init_backend(libusbd_ctx_t** pCtxOut, const char* backend)
 {
     if (!pCtxOut) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    const libusbd_backend_ops_t* pOps = libusbd_backend_find(backend && *backend ? backend : NULL);
+    if (!pOps) {
+        LIBUSBD_LOG_ERROR("libusbd: No backend named %s", backend ? backend : "(any)");
+        return LIBUSBD_NOT_IMPLEMENTED;
+    }
+
     *pCtxOut = malloc(sizeof(libusbd_ctx_t));
     memset(*pCtxOut, 0, sizeof(**pCtxOut));
+    (*pCtxOut)->pOps = pOps;
 
-    int ret = libusbd_impl_init(*pCtxOut);
+    LIBUSBD_LOG_DEBUG("libusbd: Using backend %s", pOps->name);
+
+    int ret = pOps->init(*pCtxOut);
     if (ret < 0) {
         free(*pCtxOut);
         *pCtxOut = NULL;
@@ -33,11 +55,16 @@ int libusbd_free(libusbd_ctx_t* pCtx)
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_set_manufacturer_str(pCtx, NULL);
-    libusbd_set_product_str(pCtx, NULL);
-    libusbd_set_serial_str(pCtx, NULL);
-
-    libusbd_impl_free(pCtx);
+    libusbd_xfer_timer_stop(pCtx);
+    pCtx->pOps->free(pCtx);
+    libusbd_xfer_timer_free(pCtx);
+    libusbd_xfer_cq_free(pCtx);
+    libusbd_pool_destroy(pCtx);
+    libusbd_arena_free(pCtx);
+    libusbd_stats_free(pCtx);
+    libusbd_trace_free(pCtx);
+    libusbd_record_free(pCtx);
+    libusbd_pcap_free(pCtx);
 
     memset(pCtx, 0, sizeof(*pCtx));
     free(pCtx);
@@ -130,10 +157,6 @@ int libusbd_set_manufacturer_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (pCtx->pManufacturerStr) {
-        free(pCtx->pManufacturerStr);
-    }
-
     if (!pStr)
     {
         pCtx->pManufacturerStr = NULL;
@@ -144,8 +167,11 @@ int libusbd_set_manufacturer_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_ALREADY_FINALIZED;
     }
 
-    pCtx->pManufacturerStr = malloc(strlen(pStr)+1);
-    strcpy(pCtx->pManufacturerStr, pStr);
+    // The old one stays in the arena until libusbd_free
+    pCtx->pManufacturerStr = libusbd_arena_strdup(pCtx, pStr);
+    if (!pCtx->pManufacturerStr) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
     return LIBUSBD_SUCCESS;
 }
 
@@ -155,10 +181,6 @@ int libusbd_set_product_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (pCtx->pProductStr) {
-        free(pCtx->pProductStr);
-    }
-
     if (!pStr)
     {
         pCtx->pProductStr = NULL;
@@ -169,8 +191,11 @@ int libusbd_set_product_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_ALREADY_FINALIZED;
     }
 
-    pCtx->pProductStr = malloc(strlen(pStr)+1);
-    strcpy(pCtx->pProductStr, pStr);
+    // The old one stays in the arena until libusbd_free
+    pCtx->pProductStr = libusbd_arena_strdup(pCtx, pStr);
+    if (!pCtx->pProductStr) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
     return LIBUSBD_SUCCESS;
 }
 
@@ -180,10 +205,6 @@ int libusbd_set_serial_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (pCtx->pSerialStr) {
-        free(pCtx->pSerialStr);
-    }
-
     if (!pStr)
     {
         pCtx->pSerialStr = NULL;
@@ -194,8 +215,25 @@ int libusbd_set_serial_str(libusbd_ctx_t* pCtx, const char* pStr)
         return LIBUSBD_ALREADY_FINALIZED;
     }
 
-    pCtx->pSerialStr = malloc(strlen(pStr)+1);
-    strcpy(pCtx->pSerialStr, pStr);
+    // The old one stays in the arena until libusbd_free
+    pCtx->pSerialStr = libusbd_arena_strdup(pCtx, pStr);
+    if (!pCtx->pSerialStr) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_set_buffer_retention(libusbd_ctx_t* pCtx, uint8_t policy)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (policy != LIBUSBD_RETAIN_ALWAYS && policy != LIBUSBD_RETAIN_WHILE_ENABLED) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pCtx->buffer_retention = policy;
     return LIBUSBD_SUCCESS;
 }
 
@@ -209,7 +247,7 @@ int libusbd_config_finalize(libusbd_ctx_t* pCtx)
         return LIBUSBD_ALREADY_FINALIZED;
     }
 
-    int ret = libusbd_impl_config_finalize(pCtx);
+    int ret = pCtx->pOps->config_finalize(pCtx);
 
     if (!ret) {
         pCtx->finalized = true;
@@ -234,7 +272,7 @@ int libusbd_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
         return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
 
-    if ((ret = libusbd_impl_iface_alloc_builtin(pCtx, name)))
+    if ((ret = pCtx->pOps->iface_alloc_builtin(pCtx, name)))
         return ret;
 
     return LIBUSBD_SUCCESS;
@@ -257,7 +295,10 @@ int libusbd_iface_alloc(libusbd_ctx_t* pCtx, uint8_t* pOut)
         return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
 
-    if ((ret = libusbd_impl_iface_alloc(pCtx)))
+    if ((ret = libusbd_stats_iface_alloc(pCtx, pCtx->bNumInterfaces)))
+        return ret;
+
+    if ((ret = pCtx->pOps->iface_alloc(pCtx)))
         return ret;
 
     // TODO oob
@@ -278,22 +319,44 @@ int libusbd_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
         return LIBUSBD_NONDESCRIPT_ERROR; // TODO specific error for this
     }
 
-    return libusbd_impl_iface_finalize(pCtx, iface_num);
+    return pCtx->pOps->iface_finalize(pCtx, iface_num);
 }
 
 int libusbd_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
 {
-    return libusbd_impl_iface_standard_desc(pCtx, iface_num, descType, unk, pDesc, descSz);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->iface_standard_desc(pCtx, iface_num, descType, unk, pDesc, descSz);
 }
 
 int libusbd_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
 {
-    return libusbd_impl_iface_nonstandard_desc(pCtx, iface_num, descType, unk, pDesc, descSz);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->iface_nonstandard_desc(pCtx, iface_num, descType, unk, pDesc, descSz);
 }
 
 int libusbd_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
 {
-    return libusbd_impl_iface_add_endpoint(pCtx, iface_num, type, direction, maxPktSize, interval, unk, pEpOut);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = pCtx->pOps->iface_add_endpoint(pCtx, iface_num, type, direction, maxPktSize, interval, unk, pEpOut);
+    if (ret < 0 || !pEpOut || iface_num >= LIBUSBD_MAX_IFACES || *pEpOut >= LIBUSBD_MAX_IFACE_EPS) {
+        return ret;
+    }
+
+    libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
+    pIface->aEpAddress[*pEpOut] = ++pCtx->bNumEndpoints | (direction == USB_EP_DIR_IN ? 0x80 : 0x00);
+    pIface->aEpType[*pEpOut] = type;
+    pIface->aEpInterval[*pEpOut] = interval;
+
+    return ret;
 }
 
 int libusbd_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char * desc)
@@ -306,7 +369,7 @@ int libusbd_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_impl_iface_set_description(pCtx, iface_num, desc);
+    pCtx->pOps->iface_set_description(pCtx, iface_num, desc);
 
     return LIBUSBD_SUCCESS;
 }
@@ -324,7 +387,7 @@ int libusbd_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
     libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
 
     pIface->bClass = val;
-    libusbd_impl_iface_set_class(pCtx, iface_num, val);
+    pCtx->pOps->iface_set_class(pCtx, iface_num, val);
 
     return LIBUSBD_SUCCESS;
 }
@@ -342,7 +405,7 @@ int libusbd_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t v
     libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
 
     pIface->bSubclass = val;
-    libusbd_impl_iface_set_subclass(pCtx, iface_num, val);
+    pCtx->pOps->iface_set_subclass(pCtx, iface_num, val);
 
     return LIBUSBD_SUCCESS;
 }
@@ -360,7 +423,7 @@ int libusbd_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t v
     libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
 
     pIface->bProtocol = val;
-    libusbd_impl_iface_set_protocol(pCtx, iface_num, val);
+    pCtx->pOps->iface_set_protocol(pCtx, iface_num, val);
 
     return LIBUSBD_SUCCESS;
 }
@@ -377,52 +440,211 @@ int libusbd_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num,
 
     libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
 
-    libusbd_impl_iface_set_class_cmd_callback(pCtx, iface_num, func);
+    pCtx->pOps->iface_set_class_cmd_callback(pCtx, iface_num, func);
 
     return LIBUSBD_SUCCESS;
 }
 
+static void libusbd_capture_async_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
+{
+    if (iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) return;
+
+    __atomic_fetch_or(&pCtx->aInterfaces[iface_num].async_captured, 1 << ep, __ATOMIC_RELAXED);
+    libusbd_pcap_ep_submit(pCtx, iface_num, ep, len);
+}
+
+static void libusbd_capture_async_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) return;
+
+    libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
+    uint16_t bit = 1 << ep;
+
+    // transfer_done keeps returning 1 until the next start, only report it once
+    if (!(__atomic_fetch_and(&pIface->async_captured, ~bit, __ATOMIC_RELAXED) & bit)) {
+        return;
+    }
+
+    void* data = NULL;
+    pCtx->pOps->ep_get_buffer(pCtx, iface_num, ep, &data);
+    int32_t status = pCtx->pOps->ep_transferred_bytes(pCtx, iface_num, ep);
+    uint8_t direction = (pIface->aEpAddress[ep] & 0x80) ? USB_EP_DIR_IN : USB_EP_DIR_OUT;
+
+    libusbd_record_transfer(pCtx, iface_num, ep, direction, data, status);
+    libusbd_pcap_ep_complete(pCtx, iface_num, ep, data, status);
+}
+
 int libusbd_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
 {
-    return libusbd_impl_ep_read(pCtx, iface_num, ep, data, len, timeoutMs);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_submit(pCtx, iface_num, ep, len);
+    }
+
+    int ret = pCtx->pOps->ep_read(pCtx, iface_num, ep, data, len, timeoutMs);
+    if (pCtx->pRecord) {
+        libusbd_record_transfer(pCtx, iface_num, ep, USB_EP_DIR_OUT, data, ret);
+    }
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_complete(pCtx, iface_num, ep, data, ret);
+    }
+    return ret;
 }
 
 int libusbd_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
 {
-    return libusbd_impl_ep_write(pCtx, iface_num, ep, data, len, timeoutMs);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_submit(pCtx, iface_num, ep, len);
+    }
+
+    int ret = pCtx->pOps->ep_write(pCtx, iface_num, ep, data, len, timeoutMs);
+    if (pCtx->pRecord) {
+        libusbd_record_transfer(pCtx, iface_num, ep, USB_EP_DIR_IN, data, ret < 0 ? ret : (int32_t)len);
+    }
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_complete(pCtx, iface_num, ep, data, ret < 0 ? ret : (int32_t)len);
+    }
+    return ret;
 }
 
 int libusbd_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
-    return libusbd_impl_ep_stall(pCtx, iface_num, ep);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_stall(pCtx, iface_num, ep);
 }
 
 int libusbd_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
-    return libusbd_impl_ep_abort(pCtx, iface_num, ep);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_abort(pCtx, iface_num, ep);
+}
+
+int libusbd_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_clear_halt(pCtx, iface_num, ep);
 }
 
 int libusbd_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
 {
-    return libusbd_impl_ep_get_buffer(pCtx, iface_num, ep, pOut);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_get_buffer(pCtx, iface_num, ep, pOut);
 }
 
 int libusbd_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep,uint32_t len, uint64_t timeout_ms)
 {
-    return libusbd_impl_ep_read_start(pCtx, iface_num, ep, len, timeout_ms);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = pCtx->pOps->ep_read_start(pCtx, iface_num, ep, len, timeout_ms);
+    if (ret == LIBUSBD_SUCCESS && (pCtx->pRecord || pCtx->pPcap)) {
+        libusbd_capture_async_start(pCtx, iface_num, ep, len);
+    }
+    return ret;
 }
 
 int libusbd_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
 {
-    return libusbd_impl_ep_write_start(pCtx, iface_num, ep, data, len, timeout_ms);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = pCtx->pOps->ep_write_start(pCtx, iface_num, ep, data, len, timeout_ms);
+    if (ret == LIBUSBD_SUCCESS && (pCtx->pRecord || pCtx->pPcap)) {
+        libusbd_capture_async_start(pCtx, iface_num, ep, len);
+    }
+    return ret;
+}
+
+int libusbd_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_set_rearm(pCtx, iface_num, ep, policy);
+}
+
+int libusbd_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_set_dmabuf(pCtx, iface_num, ep, fd, size);
+}
+
+int libusbd_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_get_dmabuf(pCtx, iface_num, ep);
+}
+
+int libusbd_ep_get_fifo_status(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, libusbd_ep_fifo_status_t* pOut)
+{
+    libusbd_ep_stats_t stats;
+    int ret;
+
+    if (!pCtx || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_ep_get_stats(pCtx, iface_num, ep, &stats))) {
+        return ret;
+    }
+
+    ret = pCtx->pOps->ep_get_fifo_bytes(pCtx, iface_num, ep);
+    if (ret < 0 && ret != LIBUSBD_NOT_IMPLEMENTED) {
+        return ret;
+    }
+
+    pOut->fifo_bytes = ret < 0 ? -1 : ret;
+    pOut->queue_depth = stats.queue_depth;
+
+    return LIBUSBD_SUCCESS;
 }
 
 int libusbd_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
-    return libusbd_impl_ep_transfer_done(pCtx, iface_num, ep);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = pCtx->pOps->ep_transfer_done(pCtx, iface_num, ep);
+    if (ret == 1 && (pCtx->pRecord || pCtx->pPcap)) {
+        libusbd_capture_async_done(pCtx, iface_num, ep);
+    }
+    return ret;
 }
 
 int libusbd_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
-    return libusbd_impl_ep_transferred_bytes(pCtx, iface_num, ep);
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return pCtx->pOps->ep_transferred_bytes(pCtx, iface_num, ep);
 }
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_arena.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A one-interface device's strings and descriptors fit in the first block
+#define LIBUSBD_ARENA_BLOCK_SZ (0x400)
+#define LIBUSBD_ARENA_ALIGN    (sizeof(void*))
+
+typedef struct libusbd_arena_block_t libusbd_arena_block_t;
+
+typedef struct libusbd_arena_block_t
+{
+    libusbd_arena_block_t* pNext;
+    uint64_t size;
+    uint64_t used;
+    uint8_t data[];
+} libusbd_arena_block_t;
+
+typedef struct libusbd_arena_t
+{
+    pthread_mutex_t mutex;
+
+    // Newest first, only the head is bumped from
+    libusbd_arena_block_t* pHead;
+} libusbd_arena_t;
+
+static libusbd_arena_t* libusbd_arena_get(libusbd_ctx_t* pCtx)
+{
+    libusbd_arena_t* pArena = __atomic_load_n(&pCtx->pArena, __ATOMIC_ACQUIRE);
+    if (pArena) {
+        return pArena;
+    }
+
+    pArena = calloc(1, sizeof(libusbd_arena_t));
+    if (!pArena) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&pArena->mutex, NULL);
+
+    libusbd_arena_t* pExpected = NULL;
+    if (!__atomic_compare_exchange_n(&pCtx->pArena, &pExpected, pArena, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_destroy(&pArena->mutex);
+        free(pArena);
+        return pExpected;
+    }
+
+    return pArena;
+}
+
+void* libusbd_arena_alloc(libusbd_ctx_t* pCtx, uint64_t size)
+{
+    libusbd_arena_t* pArena = libusbd_arena_get(pCtx);
+    if (!pArena) {
+        return NULL;
+    }
+
+    size = (size + LIBUSBD_ARENA_ALIGN - 1) & ~(uint64_t)(LIBUSBD_ARENA_ALIGN - 1);
+
+    pthread_mutex_lock(&pArena->mutex);
+
+    libusbd_arena_block_t* pBlock = pArena->pHead;
+    if (!pBlock || pBlock->size - pBlock->used < size) {
+        // Big ones get a block of their own, exactly sized, behind the head so
+        // what's left of it can still be used
+        bool dedicated = size > LIBUSBD_ARENA_BLOCK_SZ / 2;
+        uint64_t blockSz = dedicated ? size : LIBUSBD_ARENA_BLOCK_SZ;
+
+        pBlock = calloc(1, sizeof(libusbd_arena_block_t) + blockSz);
+        if (!pBlock) {
+            pthread_mutex_unlock(&pArena->mutex);
+            return NULL;
+        }
+        pBlock->size = blockSz;
+
+        if (dedicated && pArena->pHead) {
+            pBlock->pNext = pArena->pHead->pNext;
+            pArena->pHead->pNext = pBlock;
+        }
+        else {
+            pBlock->pNext = pArena->pHead;
+            pArena->pHead = pBlock;
+        }
+    }
+
+    void* p = pBlock->data + pBlock->used;
+    pBlock->used += size;
+
+    pthread_mutex_unlock(&pArena->mutex);
+
+    return p;
+}
+
+char* libusbd_arena_strdup(libusbd_ctx_t* pCtx, const char* pStr)
+{
+    uint64_t len = strlen(pStr);
+
+    char* pOut = libusbd_arena_alloc(pCtx, len + 1);
+    if (pOut) {
+        memcpy(pOut, pStr, len + 1);
+    }
+
+    return pOut;
+}
+
+void libusbd_arena_free(libusbd_ctx_t* pCtx)
+{
+    libusbd_arena_t* pArena = pCtx->pArena;
+    if (!pArena) return;
+
+    libusbd_arena_block_t* pIter = pArena->pHead;
+    while (pIter)
+    {
+        libusbd_arena_block_t* pNext = pIter->pNext;
+        free(pIter);
+        pIter = pNext;
+    }
+
+    pthread_mutex_destroy(&pArena->mutex);
+    free(pArena);
+    pCtx->pArena = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef _LIBUSBD_ARENA_H
+#define _LIBUSBD_ARENA_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-context arena for configuration-time state: strings, descriptor nodes
+// and the descriptor blobs built from them. Allocations are bumped out of
+// small blocks and never freed on their own, everything goes at once in
+// libusbd_arena_free from libusbd_free. Anything replaced during
+// configuration stays until then, so it's not for per-transfer use.
+
+// Zeroed and pointer-aligned. Safe to call from any thread.
+void* libusbd_arena_alloc(libusbd_ctx_t* pCtx, uint64_t size);
+char* libusbd_arena_strdup(libusbd_ctx_t* pCtx, const char* pStr);
+
+void libusbd_arena_free(libusbd_ctx_t* pCtx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_ARENA_H
@@ -0,0 +1,89 @@
+#include "libusbd.h"
+
+#include "libusbd_backend.h"
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Preference order for `libusbd_init`
+static const libusbd_backend_ops_t* const aBackends[] = {
+#ifdef LIBUSBD_BACKEND_MACOS
+    &libusbd_backend_macos,
+#endif
+#ifdef LIBUSBD_BACKEND_LINUX
+    &libusbd_backend_linux,
+#endif
+#ifdef LIBUSBD_BACKEND_RAWGADGET
+    &libusbd_backend_rawgadget,
+#endif
+#ifdef LIBUSBD_BACKEND_LOOPBACK
+    &libusbd_backend_loopback,
+#endif
+};
+
+#define LIBUSBD_NUM_BACKENDS (sizeof(aBackends) / sizeof(aBackends[0]))
+
+const libusbd_backend_ops_t* libusbd_backend_find(const char* name)
+{
+    const libusbd_backend_ops_t* pFallback = NULL;
+
+    if (name) {
+        for (uint32_t i = 0; i < LIBUSBD_NUM_BACKENDS; i++)
+        {
+            if (!strcmp(aBackends[i]->name, name)) {
+                return aBackends[i];
+            }
+        }
+
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < LIBUSBD_NUM_BACKENDS; i++)
+    {
+        const libusbd_backend_ops_t* pOps = aBackends[i];
+
+        if (pOps->flags & LIBUSBD_BACKEND_FLAG_EXPLICIT) continue;
+
+        if (!pOps->probe || pOps->probe() == LIBUSBD_SUCCESS) {
+            return pOps;
+        }
+
+        LIBUSBD_LOG_DEBUG("libusbd: Backend %s isn't usable here", pOps->name);
+        if (!pFallback) {
+            pFallback = pOps;
+        }
+    }
+
+    // Nothing probed, let the preferred one fail in init with a real error.
+    // Builds with only explicit backends just get the first of them.
+    if (!pFallback && LIBUSBD_NUM_BACKENDS) {
+        pFallback = aBackends[0];
+    }
+
+    return pFallback;
+}
+
+int libusbd_get_backends(const char** pOut, uint32_t max)
+{
+    if (!pOut && max) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    for (uint32_t i = 0; i < LIBUSBD_NUM_BACKENDS && i < max; i++)
+    {
+        pOut[i] = aBackends[i]->name;
+    }
+
+    return LIBUSBD_NUM_BACKENDS;
+}
+
+const char* libusbd_get_backend(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pOps) {
+        return NULL;
+    }
+
+    return pCtx->pOps->name;
+}
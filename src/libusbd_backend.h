@@ -0,0 +1,131 @@
+#ifndef _LIBUSBD_BACKEND_H
+#define _LIBUSBD_BACKEND_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct libusbd_handoff_buf_t libusbd_handoff_buf_t;
+typedef struct libusbd_xfer_t libusbd_xfer_t;
+
+// Only picked when asked for by name, never by `libusbd_init` on its own
+#define LIBUSBD_BACKEND_FLAG_EXPLICIT (1 << 0)
+
+// One per platform layer, chosen at `libusbd_init` time and kept in
+// pCtx->pOps. Every entry is required; backends without a feature return
+// LIBUSBD_NOT_IMPLEMENTED.
+typedef struct libusbd_backend_ops_t
+{
+    const char* name;
+    uint32_t flags;
+
+    // Cheap check for whether the running system can host this backend,
+    // NULL if it always can. Returns LIBUSBD_SUCCESS or an error.
+    int (*probe)(void);
+
+    int (*init)(libusbd_ctx_t* pCtx);
+    int (*free)(libusbd_ctx_t* pCtx);
+
+    int (*config_finalize)(libusbd_ctx_t* pCtx);
+
+    int (*iface_alloc_builtin)(libusbd_ctx_t* pCtx, const char* name);
+    int (*iface_alloc)(libusbd_ctx_t* pCtx);
+    int (*iface_finalize)(libusbd_ctx_t* pCtx, uint8_t iface_num);
+    int (*iface_standard_desc)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+    int (*iface_nonstandard_desc)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+    int (*iface_add_endpoint)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut);
+    int (*iface_set_description)(libusbd_ctx_t* pCtx, uint8_t iface_num, const char * desc);
+    int (*iface_set_class)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+    int (*iface_set_subclass)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+    int (*iface_set_protocol)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+    int (*iface_set_class_cmd_callback)(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func);
+
+    int (*ep_read)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs);
+    int (*ep_write)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs);
+    int (*ep_stall)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_abort)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_clear_halt)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_get_buffer)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut);
+    int (*ep_read_start)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms);
+    int (*ep_write_start)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms);
+    int (*ep_set_rearm)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy);
+    int (*ep_set_dmabuf)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size);
+    int (*ep_get_dmabuf)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_get_fifo_bytes)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_transfer_done)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+    int (*ep_transferred_bytes)(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+
+    // Transfer objects. xfer_alloc sets pub.buffer, xfer_cancel returns
+    // LIBUSBD_INVALID_ARGUMENT if the backend is already done with it.
+    // Completions go through libusbd_xfer_complete.
+    int (*xfer_alloc)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+    int (*xfer_free)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+    int (*xfer_submit)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+    int (*xfer_cancel)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+    // xfer_prepare validates and builds the submission once, xfer_resubmit
+    // then only has pub.length to pick up
+    int (*xfer_prepare)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+    int (*xfer_resubmit)(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+
+    int (*handoff_export)(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf);
+    int (*handoff_adopt)(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf);
+} libusbd_backend_ops_t;
+
+// Defined by each platform layer, compiled in with LIBUSBD_BACKEND_<NAME>
+extern const libusbd_backend_ops_t libusbd_backend_macos;
+extern const libusbd_backend_ops_t libusbd_backend_linux;
+extern const libusbd_backend_ops_t libusbd_backend_rawgadget;
+extern const libusbd_backend_ops_t libusbd_backend_loopback;
+
+// NULL name picks the first usable non-explicit backend, in build order.
+// Returns NULL if nothing matches.
+const libusbd_backend_ops_t* libusbd_backend_find(const char* name);
+
+// Fills in a libusbd_backend_ops_t from the libusbd_<plat>_* functions
+#define LIBUSBD_BACKEND_OPS(plat) \
+    .init = libusbd_##plat##_init, \
+    .free = libusbd_##plat##_free, \
+    .config_finalize = libusbd_##plat##_config_finalize, \
+    .iface_alloc_builtin = libusbd_##plat##_iface_alloc_builtin, \
+    .iface_alloc = libusbd_##plat##_iface_alloc, \
+    .iface_finalize = libusbd_##plat##_iface_finalize, \
+    .iface_standard_desc = libusbd_##plat##_iface_standard_desc, \
+    .iface_nonstandard_desc = libusbd_##plat##_iface_nonstandard_desc, \
+    .iface_add_endpoint = libusbd_##plat##_iface_add_endpoint, \
+    .iface_set_description = libusbd_##plat##_iface_set_description, \
+    .iface_set_class = libusbd_##plat##_iface_set_class, \
+    .iface_set_subclass = libusbd_##plat##_iface_set_subclass, \
+    .iface_set_protocol = libusbd_##plat##_iface_set_protocol, \
+    .iface_set_class_cmd_callback = libusbd_##plat##_iface_set_class_cmd_callback, \
+    .ep_read = libusbd_##plat##_ep_read, \
+    .ep_write = libusbd_##plat##_ep_write, \
+    .ep_stall = libusbd_##plat##_ep_stall, \
+    .ep_abort = libusbd_##plat##_ep_abort, \
+    .ep_clear_halt = libusbd_##plat##_ep_clear_halt, \
+    .ep_get_buffer = libusbd_##plat##_ep_get_buffer, \
+    .ep_read_start = libusbd_##plat##_ep_read_start, \
+    .ep_write_start = libusbd_##plat##_ep_write_start, \
+    .ep_set_rearm = libusbd_##plat##_ep_set_rearm, \
+    .ep_set_dmabuf = libusbd_##plat##_ep_set_dmabuf, \
+    .ep_get_dmabuf = libusbd_##plat##_ep_get_dmabuf, \
+    .ep_get_fifo_bytes = libusbd_##plat##_ep_get_fifo_bytes, \
+    .ep_transfer_done = libusbd_##plat##_ep_transfer_done, \
+    .ep_transferred_bytes = libusbd_##plat##_ep_transferred_bytes, \
+    .xfer_alloc = libusbd_##plat##_xfer_alloc, \
+    .xfer_free = libusbd_##plat##_xfer_free, \
+    .xfer_submit = libusbd_##plat##_xfer_submit, \
+    .xfer_cancel = libusbd_##plat##_xfer_cancel, \
+    .xfer_prepare = libusbd_##plat##_xfer_prepare, \
+    .xfer_resubmit = libusbd_##plat##_xfer_resubmit, \
+    .handoff_export = libusbd_##plat##_handoff_export, \
+    .handoff_adopt = libusbd_##plat##_handoff_adopt
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_BACKEND_H
@@ -0,0 +1,1340 @@
+#define _GNU_SOURCE
+
+#include "libusbd.h"
+#include "libusbd_daemon.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_handoff.h"
+#include "libusbd_log.h"
+#include "libusbd_ring.h"
+#include "libusbd_stats.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Message tags, the handoff header already carries magic and version
+#define LIBUSBD_DAEMON_TAG_REGISTER (0x47455243) // 'CREG'
+#define LIBUSBD_DAEMON_TAG_REPLY    (0x50455244) // 'DREP'
+
+// Forwarded class requests, over the setup socket passed in the reply
+#define LIBUSBD_DAEMON_TAG_SETUP       (0x54455344) // 'DSET'
+#define LIBUSBD_DAEMON_TAG_SETUP_REPLY (0x50525343) // 'CSRP'
+
+// Interface setup ops, recorded by the client in call order and replayed by
+// the daemon once the configuration is finalized
+#define LIBUSBD_DAEMON_OP_END         (0)
+#define LIBUSBD_DAEMON_OP_CLASS       (1)
+#define LIBUSBD_DAEMON_OP_SUBCLASS    (2)
+#define LIBUSBD_DAEMON_OP_PROTOCOL    (3)
+#define LIBUSBD_DAEMON_OP_DESCRIPTION (4)
+#define LIBUSBD_DAEMON_OP_STD_DESC    (5)
+#define LIBUSBD_DAEMON_OP_NONSTD_DESC (6)
+#define LIBUSBD_DAEMON_OP_ENDPOINT    (7)
+#define LIBUSBD_DAEMON_OP_SETUP_CALLBACK (8)
+
+// How long endpoint threads block in libusbd before checking for shutdown
+#define LIBUSBD_DAEMON_POLL_MS (100)
+
+// Backoff while the host hasn't configured us yet
+#define LIBUSBD_DAEMON_IDLE_MS (10)
+
+// Connections that haven't sent their registration yet
+#define LIBUSBD_DAEMON_MAX_PENDING (16)
+
+// How long a client gets to finish a message once it has started one
+#define LIBUSBD_DAEMON_RECV_TIMEOUT_MS (1000)
+
+// How long a client gets to answer a forwarded class request before it's
+// stalled, well inside the 5s hosts usually give control transfers
+#define LIBUSBD_DAEMON_SETUP_TIMEOUT_MS (1000)
+
+typedef struct libusbd_daemon_client_t libusbd_daemon_client_t;
+
+typedef struct libusbd_daemon_ep_t
+{
+    libusbd_daemon_client_t* pClient;
+    uint64_t ep;
+    uint8_t direction;
+
+    libusbd_ring_t* pRing;
+    int data_fd;
+    int space_fd;
+
+    pthread_t thread;
+    int thread_started;
+} libusbd_daemon_ep_t;
+
+typedef struct libusbd_daemon_client_t
+{
+    libusbd_ctx_t* pCtx;
+    int sock_fd;
+    uint8_t iface_num;
+    libusbd_handoff_buf_t setup;
+
+    int running;
+    int stop_fd;
+
+    // Class requests go to the client over its own socket, so they don't
+    // look like a hangup on sock_fd. setup_peer_fd is the client's end
+    // until it has been sent.
+    int forward_setup;
+    int setup_fd;
+    int setup_peer_fd;
+    uint32_t setup_seq;
+    uint8_t aSetupReply[0x10000];
+
+    int shm_fd;
+    void* pShm;
+    uint64_t shm_size;
+
+    uint8_t bNumEndpoints;
+    libusbd_daemon_ep_t aEndpoints[LIBUSBD_MAX_IFACE_EPS];
+} libusbd_daemon_client_t;
+
+typedef struct libusbd_client_ep_t
+{
+    uint8_t direction;
+
+    libusbd_ring_t* pRing;
+    int data_fd;
+    int space_fd;
+} libusbd_client_ep_t;
+
+typedef struct libusbd_client_t
+{
+    int sock_fd;
+    int finalized;
+    uint8_t iface_num;
+    libusbd_handoff_buf_t setup;
+
+    void* pShm;
+    uint64_t shm_size;
+
+    libusbd_setup_callback_t setup_callback;
+    int setup_fd;
+    pthread_t setup_thread;
+    int setup_thread_started;
+    uint8_t aSetupBuffer[0x10000];
+
+    uint8_t bNumEndpoints;
+    libusbd_client_ep_t aEndpoints[LIBUSBD_MAX_IFACE_EPS];
+} libusbd_client_t;
+
+// Class request callbacks don't get a user pointer, so the forwarder finds
+// the running daemon's clients here. Held for a whole forwarded request, which
+// also keeps a disconnecting client's setup socket open until it's done.
+static pthread_mutex_t libusbd_daemon_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusbd_daemon_client_t* libusbd_daemon_setup_clients = NULL;
+static uint8_t libusbd_daemon_setup_num_clients = 0;
+
+static int libusbd_daemon_sockaddr(const char* sock_path, struct sockaddr_un* pAddr)
+{
+    if (!sock_path || strlen(sock_path) >= sizeof(pAddr->sun_path)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    memset(pAddr, 0, sizeof(*pAddr));
+    pAddr->sun_family = AF_UNIX;
+    strcpy(pAddr->sun_path, sock_path);
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Daemon
+//
+
+// Waits on the client's stop fd, so a shutdown doesn't sit out the backoff
+static void libusbd_daemon_idle(libusbd_daemon_client_t* pClient)
+{
+    struct pollfd pfd = {pClient->stop_fd, POLLIN, 0};
+    poll(&pfd, 1, LIBUSBD_DAEMON_IDLE_MS);
+}
+
+// Host IN: sends whatever the client queued. A slot is only released once
+// the backend took it, so timeouts just retry the same data.
+static void* libusbd_daemon_in_thread(void* arg)
+{
+    libusbd_daemon_ep_t* pEp = (libusbd_daemon_ep_t*)arg;
+    libusbd_daemon_client_t* pClient = pEp->pClient;
+
+    while (__atomic_load_n(&pClient->running, __ATOMIC_ACQUIRE))
+    {
+        if (libusbd_ring_wait_data(pEp->pRing, pEp->data_fd, pClient->stop_fd, 0)) {
+            break;
+        }
+
+        libusbd_ring_slot_t* pSlot = libusbd_ring_pop_begin(pEp->pRing);
+        uint32_t len = __atomic_load_n(&pSlot->len, __ATOMIC_RELAXED);
+        if (len > LIBUSBD_RING_SLOT_SIZE) {
+            len = LIBUSBD_RING_SLOT_SIZE;
+        }
+
+        int ret = libusbd_ep_write(pClient->pCtx, pClient->iface_num, pEp->ep, pSlot->data, len, LIBUSBD_DAEMON_POLL_MS);
+        if (ret == LIBUSBD_TIMEOUT) {
+            continue;
+        }
+        if (ret == LIBUSBD_NOT_ENUMERATED) {
+            libusbd_daemon_idle(pClient);
+            continue;
+        }
+        if (ret < 0) {
+            LIBUSBD_LOG_WARN("libusbd daemon: Dropped write on iface %u ep %u (%d)", pClient->iface_num, (uint32_t)pEp->ep, ret);
+        }
+
+        libusbd_ring_pop_end(pEp->pRing, pEp->space_fd);
+    }
+
+    return NULL;
+}
+
+// Host OUT: reads straight into the client's next free slot
+static void* libusbd_daemon_out_thread(void* arg)
+{
+    libusbd_daemon_ep_t* pEp = (libusbd_daemon_ep_t*)arg;
+    libusbd_daemon_client_t* pClient = pEp->pClient;
+
+    while (__atomic_load_n(&pClient->running, __ATOMIC_ACQUIRE))
+    {
+        if (libusbd_ring_wait_space(pEp->pRing, pEp->space_fd, pClient->stop_fd, 0)) {
+            break;
+        }
+
+        libusbd_ring_slot_t* pSlot = libusbd_ring_push_begin(pEp->pRing);
+
+        int ret = libusbd_ep_read(pClient->pCtx, pClient->iface_num, pEp->ep, pSlot->data, LIBUSBD_RING_SLOT_SIZE, LIBUSBD_DAEMON_POLL_MS);
+        if (ret == LIBUSBD_TIMEOUT) {
+            continue;
+        }
+        if (ret < 0) {
+            if (ret != LIBUSBD_NOT_ENUMERATED && ret != LIBUSBD_CANCELLED) {
+                LIBUSBD_LOG_WARN("libusbd daemon: Read failed on iface %u ep %u (%d)", pClient->iface_num, (uint32_t)pEp->ep, ret);
+            }
+            libusbd_daemon_idle(pClient);
+            continue;
+        }
+
+        __atomic_store_n(&pSlot->len, (uint32_t)ret, __ATOMIC_RELAXED);
+        libusbd_ring_push_end(pEp->pRing, pEp->data_fd);
+    }
+
+    return NULL;
+}
+
+// Reads a connection's registration into the next free client slot
+static int libusbd_daemon_register(libusbd_daemon_client_t* pClient, int fd)
+{
+    uint32_t tag = 0;
+
+    memset(&pClient->setup, 0, sizeof(pClient->setup));
+    if (!libusbd_handoff_recv(fd, &pClient->setup)) {
+        LIBUSBD_HANDOFF_GET(&pClient->setup, tag);
+        if (!pClient->setup.error && tag == LIBUSBD_DAEMON_TAG_REGISTER) {
+            pClient->sock_fd = fd;
+            return LIBUSBD_SUCCESS;
+        }
+    }
+
+    libusbd_handoff_buf_free(&pClient->setup);
+
+    return LIBUSBD_INVALID_ARGUMENT;
+}
+
+// Accepts connections and takes registrations in whatever order they
+// arrive, until num_clients have an interface. The listening socket and the
+// connections still registering are polled together, so a client that
+// connects and then sits on libusbd_client_finalize doesn't hold up the
+// others, and one that stops partway through a message is dropped once the
+// receive timeout runs out.
+static int libusbd_daemon_accept(libusbd_ctx_t* pCtx, int listen_fd, libusbd_daemon_client_t* aClients, uint8_t num_clients)
+{
+    struct pollfd aFds[1 + LIBUSBD_DAEMON_MAX_PENDING];
+    int aPending[LIBUSBD_DAEMON_MAX_PENDING];
+    struct timeval timeout = {LIBUSBD_DAEMON_RECV_TIMEOUT_MS / 1000, (LIBUSBD_DAEMON_RECV_TIMEOUT_MS % 1000) * 1000};
+    int num_pending = 0;
+    uint8_t num_registered = 0;
+    int ret = LIBUSBD_SUCCESS;
+
+    while (!ret && num_registered < num_clients)
+    {
+        // With every slot busy, new connections wait in the listen backlog
+        aFds[0].fd = num_pending < LIBUSBD_DAEMON_MAX_PENDING ? listen_fd : -1;
+        aFds[0].events = POLLIN;
+        aFds[0].revents = 0;
+        for (int i = 0; i < num_pending; i++)
+        {
+            aFds[1 + i].fd = aPending[i];
+            aFds[1 + i].events = POLLIN;
+            aFds[1 + i].revents = 0;
+        }
+
+        if (poll(aFds, 1 + num_pending, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            LIBUSBD_LOG_ERROR("libusbd daemon: poll failed (%s)", strerror(errno));
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+            break;
+        }
+
+        // Oldest connection first, the ones that aren't ready stay pending
+        int num_kept = 0;
+        for (int i = 0; i < num_pending; i++)
+        {
+            int fd = aPending[i];
+
+            if (!aFds[1 + i].revents || ret || num_registered >= num_clients) {
+                aPending[num_kept++] = fd;
+                continue;
+            }
+
+            libusbd_daemon_client_t* pClient = &aClients[num_registered];
+            if (libusbd_daemon_register(pClient, fd)) {
+                // A client that dies or talks nonsense before registering
+                // doesn't get a slot, keep waiting for a real one
+                LIBUSBD_LOG_WARN("libusbd daemon: Dropped bad client registration");
+                close(fd);
+                continue;
+            }
+
+            ret = libusbd_iface_alloc(pCtx, &pClient->iface_num);
+            num_registered++;
+        }
+        num_pending = num_kept;
+
+        if (ret || !aFds[0].revents || num_registered >= num_clients) continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) continue;
+
+            LIBUSBD_LOG_ERROR("libusbd daemon: accept failed (%s)", strerror(errno));
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+            break;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        aPending[num_pending++] = fd;
+    }
+
+    // Whoever was still registering when the interfaces ran out is turned
+    // away by the hangup
+    for (int i = 0; i < num_pending; i++)
+    {
+        close(aPending[i]);
+    }
+
+    return ret;
+}
+
+// Sends one class request to the client and waits for its answer. Replies
+// to earlier requests that timed out are skipped by sequence number.
+static int libusbd_daemon_setup_exchange(libusbd_daemon_client_t* pClient, libusbd_setup_callback_info_t* pInfo)
+{
+    libusbd_handoff_buf_t buf;
+    uint32_t tag = LIBUSBD_DAEMON_TAG_SETUP;
+    uint32_t seq = ++pClient->setup_seq;
+    int is_in = pInfo->bmRequestType & LIBUSBD_DEV2HOST_DIR;
+    uint32_t len = is_in ? 0 : pInfo->wLength;
+    int32_t status = 0;
+    int ret;
+
+    memset(&buf, 0, sizeof(buf));
+    LIBUSBD_HANDOFF_PUT(&buf, tag);
+    LIBUSBD_HANDOFF_PUT(&buf, seq);
+    LIBUSBD_HANDOFF_PUT(&buf, pInfo->bmRequestType);
+    LIBUSBD_HANDOFF_PUT(&buf, pInfo->bRequest);
+    LIBUSBD_HANDOFF_PUT(&buf, pInfo->wValue);
+    LIBUSBD_HANDOFF_PUT(&buf, pInfo->wIndex);
+    LIBUSBD_HANDOFF_PUT(&buf, pInfo->wLength);
+    libusbd_handoff_put(&buf, pInfo->out_data, len);
+
+    ret = buf.error;
+    if (!ret) {
+        ret = libusbd_handoff_send(pClient->setup_fd, &buf);
+    }
+    free(buf.data);
+    if (ret) {
+        return ret;
+    }
+
+    uint64_t deadline = libusbd_stats_now_ns() + LIBUSBD_DAEMON_SETUP_TIMEOUT_MS * 1000000ull;
+    while (1)
+    {
+        uint32_t reply_seq = 0;
+        uint64_t now = libusbd_stats_now_ns();
+        if (now >= deadline) {
+            return LIBUSBD_TIMEOUT;
+        }
+
+        struct pollfd pfd = {pClient->setup_fd, POLLIN, 0};
+        ret = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return ret < 0 ? LIBUSBD_NONDESCRIPT_ERROR : LIBUSBD_TIMEOUT;
+        }
+
+        memset(&buf, 0, sizeof(buf));
+        if ((ret = libusbd_handoff_recv(pClient->setup_fd, &buf))) {
+            libusbd_handoff_buf_free(&buf);
+            return ret;
+        }
+
+        LIBUSBD_HANDOFF_GET(&buf, tag);
+        LIBUSBD_HANDOFF_GET(&buf, reply_seq);
+        LIBUSBD_HANDOFF_GET(&buf, status);
+        LIBUSBD_HANDOFF_GET(&buf, len);
+        if (!buf.error && tag == LIBUSBD_DAEMON_TAG_SETUP_REPLY && reply_seq == seq) {
+            break;
+        }
+
+        libusbd_handoff_buf_free(&buf);
+    }
+
+    if (!status && is_in) {
+        if (len > pInfo->wLength) {
+            len = pInfo->wLength;
+        }
+        libusbd_handoff_get(&buf, pClient->aSetupReply, len);
+
+        pInfo->out_data = pClient->aSetupReply;
+        pInfo->out_len = len;
+    }
+
+    ret = buf.error ? buf.error : status;
+    libusbd_handoff_buf_free(&buf);
+
+    return ret;
+}
+
+// Class request callback for every client interface. Only requests
+// addressed to an interface can be matched to a client, the rest stall.
+static int libusbd_daemon_setup_forward(libusbd_setup_callback_info_t* pInfo)
+{
+    int ret = LIBUSBD_STALLED;
+
+    if ((pInfo->bmRequestType & 0x1F) != 1) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&libusbd_daemon_setup_lock);
+
+    for (int i = 0; i < libusbd_daemon_setup_num_clients; i++)
+    {
+        libusbd_daemon_client_t* pClient = &libusbd_daemon_setup_clients[i];
+
+        if (pClient->setup_fd < 0 || pClient->iface_num != (pInfo->wIndex & 0xFF)) continue;
+
+        ret = libusbd_daemon_setup_exchange(pClient, pInfo);
+        if (ret < 0 && ret != LIBUSBD_STALLED) {
+            LIBUSBD_LOG_WARN("libusbd daemon: Stalled class request %x %x on iface %u, client didn't answer (%d)", pInfo->bmRequestType, pInfo->bRequest, pClient->iface_num, ret);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&libusbd_daemon_setup_lock);
+
+    return ret;
+}
+
+// Replays the client's setup calls onto its interface
+static int libusbd_daemon_replay(libusbd_daemon_client_t* pClient)
+{
+    libusbd_handoff_buf_t* pBuf = &pClient->setup;
+    libusbd_ctx_t* pCtx = pClient->pCtx;
+    uint8_t iface_num = pClient->iface_num;
+    uint8_t op = LIBUSBD_DAEMON_OP_END;
+    int ret = LIBUSBD_SUCCESS;
+
+    do
+    {
+        uint8_t val = 0, type = 0, unk = 0, interval = 0;
+        uint32_t len = 0;
+
+        LIBUSBD_HANDOFF_GET(pBuf, op);
+        if (pBuf->error) {
+            return pBuf->error;
+        }
+
+        switch (op)
+        {
+            case LIBUSBD_DAEMON_OP_END:
+                break;
+            case LIBUSBD_DAEMON_OP_CLASS:
+            case LIBUSBD_DAEMON_OP_SUBCLASS:
+            case LIBUSBD_DAEMON_OP_PROTOCOL:
+                LIBUSBD_HANDOFF_GET(pBuf, val);
+                if (pBuf->error) break;
+
+                if (op == LIBUSBD_DAEMON_OP_CLASS) {
+                    ret = libusbd_iface_set_class(pCtx, iface_num, val);
+                }
+                else if (op == LIBUSBD_DAEMON_OP_SUBCLASS) {
+                    ret = libusbd_iface_set_subclass(pCtx, iface_num, val);
+                }
+                else {
+                    ret = libusbd_iface_set_protocol(pCtx, iface_num, val);
+                }
+                break;
+            case LIBUSBD_DAEMON_OP_DESCRIPTION:
+            {
+                char* desc = libusbd_handoff_get_str(NULL, pBuf);
+                if (desc) {
+                    ret = libusbd_iface_set_description(pCtx, iface_num, desc);
+                    free(desc);
+                }
+                break;
+            }
+            case LIBUSBD_DAEMON_OP_STD_DESC:
+            case LIBUSBD_DAEMON_OP_NONSTD_DESC:
+                LIBUSBD_HANDOFF_GET(pBuf, type);
+                LIBUSBD_HANDOFF_GET(pBuf, unk);
+                LIBUSBD_HANDOFF_GET(pBuf, len);
+                if (pBuf->error || len > pBuf->size - pBuf->pos) {
+                    pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+                    break;
+                }
+
+                if (op == LIBUSBD_DAEMON_OP_STD_DESC) {
+                    ret = libusbd_iface_standard_desc(pCtx, iface_num, type, unk, pBuf->data + pBuf->pos, len);
+                }
+                else {
+                    ret = libusbd_iface_nonstandard_desc(pCtx, iface_num, type, unk, pBuf->data + pBuf->pos, len);
+                }
+                pBuf->pos += len;
+                break;
+            case LIBUSBD_DAEMON_OP_ENDPOINT:
+            {
+                uint8_t direction = 0;
+                uint32_t maxPktSize = 0;
+                uint64_t ep = 0;
+
+                LIBUSBD_HANDOFF_GET(pBuf, type);
+                LIBUSBD_HANDOFF_GET(pBuf, direction);
+                LIBUSBD_HANDOFF_GET(pBuf, maxPktSize);
+                LIBUSBD_HANDOFF_GET(pBuf, interval);
+                if (pBuf->error) break;
+
+                if (pClient->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
+                    ret = LIBUSBD_RESOURCE_LIMIT_REACHED;
+                    break;
+                }
+
+                ret = libusbd_iface_add_endpoint(pCtx, iface_num, type, direction, maxPktSize, interval, 0, &ep);
+                if (!ret) {
+                    libusbd_daemon_ep_t* pEp = &pClient->aEndpoints[pClient->bNumEndpoints++];
+                    pEp->ep = ep;
+                    pEp->direction = direction;
+                }
+                break;
+            }
+            case LIBUSBD_DAEMON_OP_SETUP_CALLBACK:
+                ret = libusbd_iface_set_class_cmd_callback(pCtx, iface_num, libusbd_daemon_setup_forward);
+                pClient->forward_setup = !ret;
+                break;
+            default:
+                pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+                break;
+        }
+
+        if (pBuf->error) {
+            return pBuf->error;
+        }
+    }
+    while (!ret && op != LIBUSBD_DAEMON_OP_END);
+
+    if (ret) {
+        return ret;
+    }
+
+    return libusbd_iface_finalize(pCtx, iface_num);
+}
+
+// One memfd per client so nobody can map anyone else's rings
+static int libusbd_daemon_alloc_rings(libusbd_daemon_client_t* pClient)
+{
+    pClient->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pClient->stop_fd < 0) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    if (pClient->forward_setup) {
+        int aFds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, aFds) < 0) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+        pClient->setup_fd = aFds[0];
+        pClient->setup_peer_fd = aFds[1];
+
+        // Like registrations, a reply that stops halfway doesn't hang ep0
+        struct timeval timeout = {LIBUSBD_DAEMON_RECV_TIMEOUT_MS / 1000, (LIBUSBD_DAEMON_RECV_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(pClient->setup_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    if (!pClient->bNumEndpoints) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pClient->shm_size = pClient->bNumEndpoints * LIBUSBD_RING_SIZE;
+    pClient->shm_fd = memfd_create("libusbd-daemon", MFD_CLOEXEC);
+    if (pClient->shm_fd < 0 || ftruncate(pClient->shm_fd, pClient->shm_size) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd daemon: Failed to allocate rings (%s)", strerror(errno));
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pClient->pShm = mmap(NULL, pClient->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, pClient->shm_fd, 0);
+    if (pClient->pShm == MAP_FAILED) {
+        pClient->pShm = NULL;
+        LIBUSBD_LOG_ERROR("libusbd daemon: Failed to map rings (%s)", strerror(errno));
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        libusbd_daemon_ep_t* pEp = &pClient->aEndpoints[i];
+
+        pEp->pClient = pClient;
+        pEp->pRing = (libusbd_ring_t*)((uint8_t*)pClient->pShm + i * LIBUSBD_RING_SIZE);
+        libusbd_ring_init(pEp->pRing);
+
+        pEp->data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        pEp->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (pEp->data_fd < 0 || pEp->space_fd < 0) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_daemon_reply(libusbd_daemon_client_t* pClient, int32_t status)
+{
+    libusbd_handoff_buf_t buf;
+    uint32_t tag = LIBUSBD_DAEMON_TAG_REPLY;
+
+    memset(&buf, 0, sizeof(buf));
+
+    LIBUSBD_HANDOFF_PUT(&buf, tag);
+    LIBUSBD_HANDOFF_PUT(&buf, status);
+    if (!status) {
+        LIBUSBD_HANDOFF_PUT(&buf, pClient->iface_num);
+        LIBUSBD_HANDOFF_PUT(&buf, pClient->bNumEndpoints);
+        libusbd_handoff_put_fd(&buf, pClient->pShm ? pClient->shm_fd : -1);
+
+        for (int i = 0; i < pClient->bNumEndpoints; i++)
+        {
+            libusbd_handoff_put_fd(&buf, pClient->aEndpoints[i].data_fd);
+            libusbd_handoff_put_fd(&buf, pClient->aEndpoints[i].space_fd);
+        }
+        libusbd_handoff_put_fd(&buf, pClient->setup_peer_fd);
+    }
+
+    int ret = buf.error;
+    if (!ret) {
+        ret = libusbd_handoff_send(pClient->sock_fd, &buf);
+    }
+    free(buf.data);
+
+    // The client has its own copy now
+    if (pClient->setup_peer_fd >= 0) {
+        close(pClient->setup_peer_fd);
+        pClient->setup_peer_fd = -1;
+    }
+
+    return ret;
+}
+
+static int libusbd_daemon_start(libusbd_daemon_client_t* pClient)
+{
+    __atomic_store_n(&pClient->running, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        libusbd_daemon_ep_t* pEp = &pClient->aEndpoints[i];
+
+        if (pthread_create(&pEp->thread, NULL, pEp->direction == USB_EP_DIR_IN ? libusbd_daemon_in_thread : libusbd_daemon_out_thread, pEp)) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+        pEp->thread_started = 1;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static void libusbd_daemon_stop(libusbd_daemon_client_t* pClient)
+{
+    __atomic_store_n(&pClient->running, 0, __ATOMIC_RELEASE);
+    if (pClient->stop_fd >= 0) {
+        libusbd_ring_kick(pClient->stop_fd);
+    }
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        libusbd_daemon_ep_t* pEp = &pClient->aEndpoints[i];
+
+        // Wakes the client too, before it notices the socket going away
+        if (pEp->pRing) {
+            libusbd_ring_close(pEp->pRing, pEp->data_fd, pEp->space_fd);
+        }
+
+        if (!pEp->thread_started) continue;
+
+        // Knocks loose a transfer the host is sitting on
+        libusbd_ep_abort(pClient->pCtx, pClient->iface_num, pEp->ep);
+        pthread_join(pEp->thread, NULL);
+        pEp->thread_started = 0;
+    }
+}
+
+static void libusbd_daemon_client_free(libusbd_daemon_client_t* pClient)
+{
+    // Knocks a forwarded request loose, then waits for it to let go
+    if (pClient->setup_fd >= 0) {
+        shutdown(pClient->setup_fd, SHUT_RDWR);
+    }
+    pthread_mutex_lock(&libusbd_daemon_setup_lock);
+    if (pClient->setup_fd >= 0) close(pClient->setup_fd);
+    pClient->setup_fd = -1;
+    pthread_mutex_unlock(&libusbd_daemon_setup_lock);
+
+    if (pClient->setup_peer_fd >= 0) close(pClient->setup_peer_fd);
+    pClient->setup_peer_fd = -1;
+
+    libusbd_daemon_stop(pClient);
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        libusbd_daemon_ep_t* pEp = &pClient->aEndpoints[i];
+
+        if (pEp->data_fd >= 0) close(pEp->data_fd);
+        if (pEp->space_fd >= 0) close(pEp->space_fd);
+        pEp->data_fd = -1;
+        pEp->space_fd = -1;
+        pEp->pRing = NULL;
+    }
+
+    if (pClient->pShm) munmap(pClient->pShm, pClient->shm_size);
+    if (pClient->shm_fd >= 0) close(pClient->shm_fd);
+    if (pClient->stop_fd >= 0) close(pClient->stop_fd);
+    if (pClient->sock_fd >= 0) close(pClient->sock_fd);
+    libusbd_handoff_buf_free(&pClient->setup);
+
+    pClient->pShm = NULL;
+    pClient->shm_fd = -1;
+    pClient->stop_fd = -1;
+    pClient->sock_fd = -1;
+}
+
+int libusbd_daemon_run(libusbd_ctx_t* pCtx, const char* sock_path, uint8_t num_clients)
+{
+    struct sockaddr_un addr;
+    int ret;
+
+    if (!pCtx || !num_clients) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    if (pCtx->bNumInterfaces + num_clients > LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    if ((ret = libusbd_daemon_sockaddr(sock_path, &addr))) {
+        return ret;
+    }
+
+    libusbd_daemon_client_t* aClients = calloc(num_clients, sizeof(libusbd_daemon_client_t));
+    if (!aClients) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    for (int i = 0; i < num_clients; i++)
+    {
+        libusbd_daemon_client_t* pClient = &aClients[i];
+
+        pClient->pCtx = pCtx;
+        pClient->sock_fd = -1;
+        pClient->stop_fd = -1;
+        pClient->setup_fd = -1;
+        pClient->setup_peer_fd = -1;
+        pClient->shm_fd = -1;
+        for (int j = 0; j < LIBUSBD_MAX_IFACE_EPS; j++)
+        {
+            pClient->aEndpoints[j].data_fd = -1;
+            pClient->aEndpoints[j].space_fd = -1;
+        }
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        free(aClients);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    unlink(sock_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, num_clients) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd daemon: Failed to listen on %s (%s)", sock_path, strerror(errno));
+        close(listen_fd);
+        free(aClients);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    LIBUSBD_LOG_INFO("libusbd daemon: Waiting for %u clients on %s", num_clients, sock_path);
+
+    ret = libusbd_daemon_accept(pCtx, listen_fd, aClients, num_clients);
+
+    close(listen_fd);
+    unlink(sock_path);
+
+    // Claimed before replay registers any forwarding callbacks
+    pthread_mutex_lock(&libusbd_daemon_setup_lock);
+    if (!ret && libusbd_daemon_setup_clients) {
+        LIBUSBD_LOG_ERROR("libusbd daemon: Another daemon is already running in this process");
+        ret = LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    else if (!ret) {
+        libusbd_daemon_setup_clients = aClients;
+        libusbd_daemon_setup_num_clients = num_clients;
+    }
+    pthread_mutex_unlock(&libusbd_daemon_setup_lock);
+
+    if (!ret) {
+        ret = libusbd_config_finalize(pCtx);
+    }
+
+    for (int i = 0; i < num_clients && !ret; i++)
+    {
+        ret = libusbd_daemon_replay(&aClients[i]);
+        if (!ret) {
+            ret = libusbd_daemon_alloc_rings(&aClients[i]);
+        }
+    }
+
+    if (ret) {
+        LIBUSBD_LOG_ERROR("libusbd daemon: Failed to set up interfaces (%d)", ret);
+    }
+
+    // Everyone hears back, even if it's just the error
+    int num_live = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        libusbd_daemon_client_t* pClient = &aClients[i];
+
+        if (pClient->sock_fd < 0) continue;
+
+        if (libusbd_daemon_reply(pClient, ret) || ret) {
+            libusbd_daemon_client_free(pClient);
+            continue;
+        }
+
+        if (libusbd_daemon_start(pClient)) {
+            libusbd_daemon_client_free(pClient);
+            continue;
+        }
+
+        LIBUSBD_LOG_INFO("libusbd daemon: Client %u owns interface %u", i, pClient->iface_num);
+        num_live++;
+    }
+
+    // Clients never talk after setup, so anything on the socket is a hangup
+    struct pollfd aFds[LIBUSBD_MAX_IFACES];
+    while (num_live)
+    {
+        for (int i = 0; i < num_clients; i++)
+        {
+            aFds[i].fd = aClients[i].sock_fd;
+            aFds[i].events = POLLIN;
+            aFds[i].revents = 0;
+        }
+
+        if (poll(aFds, num_clients, -1) < 0) {
+            if (errno == EINTR) continue;
+
+            LIBUSBD_LOG_ERROR("libusbd daemon: poll failed (%s)", strerror(errno));
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+            break;
+        }
+
+        for (int i = 0; i < num_clients; i++)
+        {
+            if (aFds[i].fd < 0 || !aFds[i].revents) continue;
+
+            LIBUSBD_LOG_INFO("libusbd daemon: Client %u disconnected, interface %u is now idle", i, aClients[i].iface_num);
+            libusbd_daemon_client_free(&aClients[i]);
+            num_live--;
+        }
+    }
+
+    for (int i = 0; i < num_clients; i++)
+    {
+        libusbd_daemon_client_free(&aClients[i]);
+    }
+
+    // The callbacks stay registered on pCtx and stall from here on
+    pthread_mutex_lock(&libusbd_daemon_setup_lock);
+    if (libusbd_daemon_setup_clients == aClients) {
+        libusbd_daemon_setup_clients = NULL;
+        libusbd_daemon_setup_num_clients = 0;
+    }
+    pthread_mutex_unlock(&libusbd_daemon_setup_lock);
+    free(aClients);
+
+    return ret;
+}
+
+//
+// Client
+//
+
+int libusbd_client_connect(const char* sock_path, libusbd_client_t** pOut)
+{
+    struct sockaddr_un addr;
+    uint32_t tag = LIBUSBD_DAEMON_TAG_REGISTER;
+    int ret;
+
+    if (!pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_daemon_sockaddr(sock_path, &addr))) {
+        return ret;
+    }
+
+    libusbd_client_t* pClient = malloc(sizeof(libusbd_client_t));
+    if (!pClient) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pClient, 0, sizeof(*pClient));
+    pClient->setup_fd = -1;
+
+    pClient->sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (pClient->sock_fd < 0) {
+        free(pClient);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    if (connect(pClient->sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd client: Failed to connect to %s (%s)", sock_path, strerror(errno));
+        close(pClient->sock_fd);
+        free(pClient);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, tag);
+
+    *pOut = pClient;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_client_close(libusbd_client_t* pClient)
+{
+    if (!pClient) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Wakes the setup thread, which takes this as the daemon going away
+    if (pClient->setup_thread_started) {
+        shutdown(pClient->setup_fd, SHUT_RDWR);
+        pthread_join(pClient->setup_thread, NULL);
+    }
+    if (pClient->setup_fd >= 0) close(pClient->setup_fd);
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        libusbd_client_ep_t* pEp = &pClient->aEndpoints[i];
+
+        if (pEp->data_fd > 0) close(pEp->data_fd);
+        if (pEp->space_fd > 0) close(pEp->space_fd);
+    }
+
+    if (pClient->pShm) munmap(pClient->pShm, pClient->shm_size);
+    close(pClient->sock_fd);
+    libusbd_handoff_buf_free(&pClient->setup);
+    free(pClient);
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_client_put_op(libusbd_client_t* pClient, uint8_t op)
+{
+    if (!pClient) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pClient->finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, op);
+
+    return pClient->setup.error;
+}
+
+static int libusbd_client_desc(libusbd_client_t* pClient, uint8_t op, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    uint32_t len = descSz;
+    int ret;
+
+    if (!pDesc || descSz > 0xFFFF) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_client_put_op(pClient, op))) {
+        return ret;
+    }
+
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, descType);
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, unk);
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, len);
+    libusbd_handoff_put(&pClient->setup, pDesc, len);
+
+    return pClient->setup.error;
+}
+
+int libusbd_client_standard_desc(libusbd_client_t* pClient, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    return libusbd_client_desc(pClient, LIBUSBD_DAEMON_OP_STD_DESC, descType, unk, pDesc, descSz);
+}
+
+int libusbd_client_nonstandard_desc(libusbd_client_t* pClient, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    return libusbd_client_desc(pClient, LIBUSBD_DAEMON_OP_NONSTD_DESC, descType, unk, pDesc, descSz);
+}
+
+int libusbd_client_add_endpoint(libusbd_client_t* pClient, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t* pEpOut)
+{
+    int ret;
+
+    if (!pClient || !pEpOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pClient->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    if ((ret = libusbd_client_put_op(pClient, LIBUSBD_DAEMON_OP_ENDPOINT))) {
+        return ret;
+    }
+
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, type);
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, direction);
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, maxPktSize);
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, interval);
+    if (pClient->setup.error) {
+        return pClient->setup.error;
+    }
+
+    pClient->aEndpoints[pClient->bNumEndpoints].direction = direction;
+    *pEpOut = pClient->bNumEndpoints++;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_client_set_description(libusbd_client_t* pClient, const char* desc)
+{
+    int ret;
+
+    if (!desc) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_client_put_op(pClient, LIBUSBD_DAEMON_OP_DESCRIPTION))) {
+        return ret;
+    }
+
+    libusbd_handoff_put_str(&pClient->setup, desc);
+
+    return pClient->setup.error;
+}
+
+static int libusbd_client_set_u8(libusbd_client_t* pClient, uint8_t op, uint8_t val)
+{
+    int ret;
+
+    if ((ret = libusbd_client_put_op(pClient, op))) {
+        return ret;
+    }
+
+    LIBUSBD_HANDOFF_PUT(&pClient->setup, val);
+
+    return pClient->setup.error;
+}
+
+int libusbd_client_set_class(libusbd_client_t* pClient, uint8_t val)
+{
+    return libusbd_client_set_u8(pClient, LIBUSBD_DAEMON_OP_CLASS, val);
+}
+
+int libusbd_client_set_subclass(libusbd_client_t* pClient, uint8_t val)
+{
+    return libusbd_client_set_u8(pClient, LIBUSBD_DAEMON_OP_SUBCLASS, val);
+}
+
+int libusbd_client_set_protocol(libusbd_client_t* pClient, uint8_t val)
+{
+    return libusbd_client_set_u8(pClient, LIBUSBD_DAEMON_OP_PROTOCOL, val);
+}
+
+int libusbd_client_set_class_cmd_callback(libusbd_client_t* pClient, libusbd_setup_callback_t func)
+{
+    int ret;
+
+    if (!func) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_client_put_op(pClient, LIBUSBD_DAEMON_OP_SETUP_CALLBACK))) {
+        return ret;
+    }
+
+    pClient->setup_callback = func;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Answers the daemon's forwarded class requests until either side hangs up
+static void* libusbd_client_setup_thread(void* arg)
+{
+    libusbd_client_t* pClient = (libusbd_client_t*)arg;
+    libusbd_setup_callback_info_t info;
+    libusbd_handoff_buf_t buf;
+
+    while (1)
+    {
+        uint32_t tag = 0, seq = 0, len = 0;
+        int32_t status = 0;
+        uint8_t peek;
+
+        // A hangup is the normal way out, don't let the recv log it
+        struct pollfd pfd = {pClient->setup_fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (recv(pClient->setup_fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            break;
+        }
+
+        memset(&buf, 0, sizeof(buf));
+        memset(&info, 0, sizeof(info));
+        if (libusbd_handoff_recv(pClient->setup_fd, &buf)) {
+            libusbd_handoff_buf_free(&buf);
+            break;
+        }
+
+        LIBUSBD_HANDOFF_GET(&buf, tag);
+        LIBUSBD_HANDOFF_GET(&buf, seq);
+        LIBUSBD_HANDOFF_GET(&buf, info.bmRequestType);
+        LIBUSBD_HANDOFF_GET(&buf, info.bRequest);
+        LIBUSBD_HANDOFF_GET(&buf, info.wValue);
+        LIBUSBD_HANDOFF_GET(&buf, info.wIndex);
+        LIBUSBD_HANDOFF_GET(&buf, info.wLength);
+        if (!(info.bmRequestType & LIBUSBD_DEV2HOST_DIR)) {
+            libusbd_handoff_get(&buf, pClient->aSetupBuffer, info.wLength);
+        }
+        if (buf.error || tag != LIBUSBD_DAEMON_TAG_SETUP) {
+            LIBUSBD_LOG_ERROR("libusbd client: Bad class request from daemon");
+            libusbd_handoff_buf_free(&buf);
+            break;
+        }
+        libusbd_handoff_buf_free(&buf);
+
+        info.out_len = 0;
+        info.out_data = pClient->aSetupBuffer;
+        if (pClient->setup_callback(&info) < 0) {
+            status = LIBUSBD_STALLED;
+        }
+        else if (info.bmRequestType & LIBUSBD_DEV2HOST_DIR) {
+            len = info.out_len > info.wLength ? info.wLength : info.out_len;
+        }
+
+        tag = LIBUSBD_DAEMON_TAG_SETUP_REPLY;
+        memset(&buf, 0, sizeof(buf));
+        LIBUSBD_HANDOFF_PUT(&buf, tag);
+        LIBUSBD_HANDOFF_PUT(&buf, seq);
+        LIBUSBD_HANDOFF_PUT(&buf, status);
+        LIBUSBD_HANDOFF_PUT(&buf, len);
+        libusbd_handoff_put(&buf, info.out_data, len);
+
+        int ret = buf.error;
+        if (!ret) {
+            ret = libusbd_handoff_send(pClient->setup_fd, &buf);
+        }
+        free(buf.data);
+        if (ret) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int libusbd_client_finalize(libusbd_client_t* pClient, uint8_t* pIfaceNumOut)
+{
+    libusbd_handoff_buf_t reply;
+    uint32_t tag = 0;
+    int32_t status = 0;
+    uint8_t bNumEndpoints = 0;
+    int ret;
+
+    if ((ret = libusbd_client_put_op(pClient, LIBUSBD_DAEMON_OP_END))) {
+        return ret;
+    }
+
+    ret = libusbd_handoff_send(pClient->sock_fd, &pClient->setup);
+    libusbd_handoff_buf_free(&pClient->setup);
+    pClient->finalized = 1;
+    if (ret) {
+        return ret;
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    ret = libusbd_handoff_recv(pClient->sock_fd, &reply);
+    if (ret) {
+        libusbd_handoff_buf_free(&reply);
+        return ret;
+    }
+
+    LIBUSBD_HANDOFF_GET(&reply, tag);
+    LIBUSBD_HANDOFF_GET(&reply, status);
+    if (reply.error || tag != LIBUSBD_DAEMON_TAG_REPLY) {
+        libusbd_handoff_buf_free(&reply);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (status) {
+        LIBUSBD_LOG_ERROR("libusbd client: Daemon rejected interface (%d)", status);
+        libusbd_handoff_buf_free(&reply);
+        return status;
+    }
+
+    LIBUSBD_HANDOFF_GET(&reply, pClient->iface_num);
+    LIBUSBD_HANDOFF_GET(&reply, bNumEndpoints);
+    int shm_fd = libusbd_handoff_get_fd(&reply);
+    for (int i = 0; i < pClient->bNumEndpoints && i < bNumEndpoints; i++)
+    {
+        pClient->aEndpoints[i].data_fd = libusbd_handoff_get_fd(&reply);
+        pClient->aEndpoints[i].space_fd = libusbd_handoff_get_fd(&reply);
+    }
+    pClient->setup_fd = libusbd_handoff_get_fd(&reply);
+
+    ret = reply.error;
+    if (!ret && pClient->setup_callback && pClient->setup_fd < 0) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
+    if (!ret && bNumEndpoints != pClient->bNumEndpoints) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (!ret && bNumEndpoints) {
+        pClient->shm_size = bNumEndpoints * LIBUSBD_RING_SIZE;
+        pClient->pShm = mmap(NULL, pClient->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (pClient->pShm == MAP_FAILED) {
+            LIBUSBD_LOG_ERROR("libusbd client: Failed to map rings (%s)", strerror(errno));
+            pClient->pShm = NULL;
+            ret = LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+    }
+
+    if (shm_fd >= 0) close(shm_fd);
+    libusbd_handoff_buf_free(&reply);
+
+    if (ret) {
+        return ret;
+    }
+
+    for (int i = 0; i < pClient->bNumEndpoints; i++)
+    {
+        pClient->aEndpoints[i].pRing = (libusbd_ring_t*)((uint8_t*)pClient->pShm + i * LIBUSBD_RING_SIZE);
+    }
+
+    if (pClient->setup_callback) {
+        if (pthread_create(&pClient->setup_thread, NULL, libusbd_client_setup_thread, pClient)) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+        pClient->setup_thread_started = 1;
+    }
+
+    if (pIfaceNumOut) {
+        *pIfaceNumOut = pClient->iface_num;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static libusbd_client_ep_t* libusbd_client_get_ep(libusbd_client_t* pClient, uint64_t ep, uint8_t direction)
+{
+    if (!pClient || !pClient->pShm || ep >= pClient->bNumEndpoints) {
+        return NULL;
+    }
+
+    libusbd_client_ep_t* pEp = &pClient->aEndpoints[ep];
+    if (pEp->direction != direction) {
+        return NULL;
+    }
+
+    return pEp;
+}
+
+int libusbd_client_ep_read(libusbd_client_t* pClient, uint64_t ep, void* data, uint32_t len, uint64_t timeout_ms)
+{
+    libusbd_client_ep_t* pEp = libusbd_client_get_ep(pClient, ep, USB_EP_DIR_OUT);
+    int ret;
+
+    if (!pEp || (!data && len)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The daemon hanging up shows as the socket going readable
+    if ((ret = libusbd_ring_wait_data(pEp->pRing, pEp->data_fd, pClient->sock_fd, timeout_ms))) {
+        return ret;
+    }
+
+    libusbd_ring_slot_t* pSlot = libusbd_ring_pop_begin(pEp->pRing);
+    uint32_t slot_len = __atomic_load_n(&pSlot->len, __ATOMIC_RELAXED);
+    if (slot_len > LIBUSBD_RING_SLOT_SIZE) {
+        slot_len = LIBUSBD_RING_SLOT_SIZE;
+    }
+    if (len > slot_len) {
+        len = slot_len;
+    }
+
+    memcpy(data, pSlot->data, len);
+    libusbd_ring_pop_end(pEp->pRing, pEp->space_fd);
+
+    return len;
+}
+
+int libusbd_client_ep_write(libusbd_client_t* pClient, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
+{
+    libusbd_client_ep_t* pEp = libusbd_client_get_ep(pClient, ep, USB_EP_DIR_IN);
+    int ret;
+
+    if (!pEp || (!data && len) || len > LIBUSBD_RING_SLOT_SIZE) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_ring_wait_space(pEp->pRing, pEp->space_fd, pClient->sock_fd, timeout_ms))) {
+        return ret;
+    }
+
+    libusbd_ring_slot_t* pSlot = libusbd_ring_push_begin(pEp->pRing);
+    memcpy(pSlot->data, data, len);
+    __atomic_store_n(&pSlot->len, len, __ATOMIC_RELAXED);
+    libusbd_ring_push_end(pEp->pRing, pEp->data_fd);
+
+    return len;
+}
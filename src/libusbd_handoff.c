@@ -0,0 +1,476 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_arena.h"
+#include "libusbd_backend.h"
+#include "libusbd_handoff.h"
+#include "libusbd_log.h"
+#include "libusbd_pool.h"
+#include "libusbd_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define LIBUSBD_HANDOFF_MAGIC   (0x4f484c55) // 'ULHO'
+#define LIBUSBD_HANDOFF_VERSION (4)
+
+// Max payload, anything larger is not something we sent
+#define LIBUSBD_HANDOFF_MAX_SIZE (0x100000)
+
+typedef struct libusbd_handoff_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t numFds;
+} libusbd_handoff_header_t;
+
+//
+// Serialization
+//
+
+void libusbd_handoff_put(libusbd_handoff_buf_t* pBuf, const void* data, uint32_t len)
+{
+    if (pBuf->error) return;
+
+    if (pBuf->size + len > pBuf->alloc) {
+        uint32_t alloc = pBuf->alloc ? pBuf->alloc : 0x1000;
+        while (alloc < pBuf->size + len) {
+            alloc *= 2;
+        }
+
+        uint8_t* pNew = realloc(pBuf->data, alloc);
+        if (!pNew || alloc > LIBUSBD_HANDOFF_MAX_SIZE) {
+            if (pNew) pBuf->data = pNew;
+            pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+            return;
+        }
+        pBuf->data = pNew;
+        pBuf->alloc = alloc;
+    }
+
+    memcpy(pBuf->data + pBuf->size, data, len);
+    pBuf->size += len;
+}
+
+void libusbd_handoff_put_str(libusbd_handoff_buf_t* pBuf, const char* str)
+{
+    uint32_t len = str ? strlen(str) : 0xFFFFFFFF;
+
+    LIBUSBD_HANDOFF_PUT(pBuf, len);
+    if (str) {
+        libusbd_handoff_put(pBuf, str, len);
+    }
+}
+
+void libusbd_handoff_put_fd(libusbd_handoff_buf_t* pBuf, int fd)
+{
+    int32_t idx = -1;
+
+    if (fd >= 0) {
+        if (pBuf->numFds >= LIBUSBD_HANDOFF_MAX_FDS) {
+            pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+            return;
+        }
+
+        idx = pBuf->numFds;
+        pBuf->aFds[pBuf->numFds++] = fd;
+    }
+
+    LIBUSBD_HANDOFF_PUT(pBuf, idx);
+}
+
+void libusbd_handoff_get(libusbd_handoff_buf_t* pBuf, void* out, uint32_t len)
+{
+    if (pBuf->error || pBuf->pos + len > pBuf->size) {
+        pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+        memset(out, 0, len);
+        return;
+    }
+
+    memcpy(out, pBuf->data + pBuf->pos, len);
+    pBuf->pos += len;
+}
+
+char* libusbd_handoff_get_str(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    uint32_t len = 0;
+
+    LIBUSBD_HANDOFF_GET(pBuf, len);
+    if (pBuf->error || len == 0xFFFFFFFF) {
+        return NULL;
+    }
+
+    if (pBuf->pos + len > pBuf->size) {
+        pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+        return NULL;
+    }
+
+    char* str = pCtx ? libusbd_arena_alloc(pCtx, len + 1) : malloc(len + 1);
+    if (!str) {
+        pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+        return NULL;
+    }
+
+    libusbd_handoff_get(pBuf, str, len);
+    str[len] = 0;
+
+    return str;
+}
+
+int libusbd_handoff_get_fd(libusbd_handoff_buf_t* pBuf)
+{
+    int32_t idx = -1;
+
+    LIBUSBD_HANDOFF_GET(pBuf, idx);
+    if (pBuf->error || idx < 0) {
+        return -1;
+    }
+
+    if (idx >= pBuf->numFds || pBuf->aFds[idx] < 0) {
+        pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+        return -1;
+    }
+
+    int fd = pBuf->aFds[idx];
+    pBuf->aFds[idx] = -1;
+
+    return fd;
+}
+
+void libusbd_handoff_buf_free(libusbd_handoff_buf_t* pBuf)
+{
+    for (int i = 0; i < pBuf->numFds; i++)
+    {
+        if (pBuf->aFds[i] >= 0) close(pBuf->aFds[i]);
+    }
+    free(pBuf->data);
+
+    memset(pBuf, 0, sizeof(*pBuf));
+}
+
+//
+// Transport
+//
+
+static int libusbd_handoff_write_all(int sock_fd, const uint8_t* data, uint32_t len)
+{
+    while (len)
+    {
+        ssize_t ret = write(sock_fd, data, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_handoff_read_all(int sock_fd, uint8_t* data, uint32_t len)
+{
+    while (len)
+    {
+        ssize_t ret = read(sock_fd, data, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+// The fds ride along with the header, the payload follows as plain stream data
+int libusbd_handoff_send(int sock_fd, libusbd_handoff_buf_t* pBuf)
+{
+    libusbd_handoff_header_t hdr = {LIBUSBD_HANDOFF_MAGIC, LIBUSBD_HANDOFF_VERSION, pBuf->size, pBuf->numFds};
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * LIBUSBD_HANDOFF_MAX_FDS)];
+    } cmsg_buf;
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (pBuf->numFds) {
+        memset(&cmsg_buf, 0, sizeof(cmsg_buf));
+        msg.msg_control = cmsg_buf.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * pBuf->numFds);
+
+        struct cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg);
+        pCmsg->cmsg_level = SOL_SOCKET;
+        pCmsg->cmsg_type = SCM_RIGHTS;
+        pCmsg->cmsg_len = CMSG_LEN(sizeof(int) * pBuf->numFds);
+        memcpy(CMSG_DATA(pCmsg), pBuf->aFds, sizeof(int) * pBuf->numFds);
+    }
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock_fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0) {
+        LIBUSBD_LOG_ERROR("libusbd: Handoff sendmsg failed (%s)", strerror(errno));
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    // The fds went with the first byte, the rest can trickle
+    if (ret < sizeof(hdr)) {
+        if (libusbd_handoff_write_all(sock_fd, (uint8_t*)&hdr + ret, sizeof(hdr) - ret)) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+    }
+
+    return libusbd_handoff_write_all(sock_fd, pBuf->data, pBuf->size);
+}
+
+int libusbd_handoff_recv(int sock_fd, libusbd_handoff_buf_t* pBuf)
+{
+    libusbd_handoff_header_t hdr;
+    union {
+        struct cmsghdr align;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * LIBUSBD_HANDOFF_MAX_FDS)];
+    } cmsg_buf;
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf.buf;
+    msg.msg_controllen = sizeof(cmsg_buf.buf);
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock_fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0) {
+        LIBUSBD_LOG_ERROR("libusbd: Handoff recvmsg failed (%s)", ret < 0 ? strerror(errno) : "closed");
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    for (struct cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg); pCmsg; pCmsg = CMSG_NXTHDR(&msg, pCmsg))
+    {
+        if (pCmsg->cmsg_level != SOL_SOCKET || pCmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        uint32_t num = (pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (num > LIBUSBD_HANDOFF_MAX_FDS - pBuf->numFds) {
+            num = LIBUSBD_HANDOFF_MAX_FDS - pBuf->numFds;
+        }
+        memcpy(&pBuf->aFds[pBuf->numFds], CMSG_DATA(pCmsg), sizeof(int) * num);
+        pBuf->numFds += num;
+    }
+
+    if (ret < sizeof(hdr)) {
+        if (libusbd_handoff_read_all(sock_fd, (uint8_t*)&hdr + ret, sizeof(hdr) - ret)) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+    }
+
+    if (hdr.magic != LIBUSBD_HANDOFF_MAGIC || hdr.version != LIBUSBD_HANDOFF_VERSION
+        || hdr.size > LIBUSBD_HANDOFF_MAX_SIZE || hdr.numFds != pBuf->numFds
+        || (msg.msg_flags & MSG_CTRUNC)) {
+        LIBUSBD_LOG_ERROR("libusbd: Bad handoff header (magic %x, version %u, %u fds)", hdr.magic, hdr.version, pBuf->numFds);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pBuf->data = malloc(hdr.size ? hdr.size : 1);
+    if (!pBuf->data) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pBuf->size = hdr.size;
+    pBuf->alloc = hdr.size;
+
+    return libusbd_handoff_read_all(sock_fd, pBuf->data, pBuf->size);
+}
+
+//
+// API
+//
+
+int libusbd_handoff_export(libusbd_ctx_t* pCtx, int sock_fd)
+{
+    libusbd_handoff_buf_t buf;
+
+    if (!pCtx || sock_fd < 0) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Only a gadget that's fully up can be carried over
+    if (!pCtx->finalized) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        if (!pCtx->aInterfaces[i].finalized) {
+            return LIBUSBD_INVALID_ARGUMENT;
+        }
+    }
+
+    memset(&buf, 0, sizeof(buf));
+
+    // The successor has to drive the same backend the fds came from
+    libusbd_handoff_put_str(&buf, pCtx->pOps->name);
+
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->vid);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->pid);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->did);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->bClass);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->bSubclass);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->bProtocol);
+    libusbd_handoff_put_str(&buf, pCtx->pManufacturerStr);
+    libusbd_handoff_put_str(&buf, pCtx->pProductStr);
+    libusbd_handoff_put_str(&buf, pCtx->pSerialStr);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->buffer_retention);
+
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->bNumInterfaces);
+    LIBUSBD_HANDOFF_PUT(&buf, pCtx->bNumEndpoints);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_iface_t* pIface = &pCtx->aInterfaces[i];
+
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->bClass);
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->bSubclass);
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->bProtocol);
+
+        // Captures and transfer bookkeeping look endpoints up by these
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->aEpAddress);
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->aEpType);
+        LIBUSBD_HANDOFF_PUT(&buf, pIface->aEpInterval);
+    }
+
+    // Quiesces the backend, from here on it's the successor's device
+    int ret = pCtx->pOps->handoff_export(pCtx, &buf);
+    if (!ret) {
+        ret = buf.error;
+    }
+
+    if (!ret) {
+        ret = libusbd_handoff_send(sock_fd, &buf);
+    }
+
+    if (ret) {
+        LIBUSBD_LOG_ERROR("libusbd: Handoff export failed (%d)", ret);
+    }
+
+    free(buf.data);
+
+    return ret;
+}
+
+int libusbd_handoff_adopt(libusbd_ctx_t** pCtxOut, int sock_fd)
+{
+    libusbd_handoff_buf_t buf;
+    int ret;
+
+    if (!pCtxOut || sock_fd < 0) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+
+    libusbd_ctx_t* pCtx = malloc(sizeof(libusbd_ctx_t));
+    if (!pCtx) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pCtx, 0, sizeof(*pCtx));
+
+    ret = libusbd_handoff_recv(sock_fd, &buf);
+    if (ret) {
+        goto fail;
+    }
+
+    char* pBackend = libusbd_handoff_get_str(NULL, &buf);
+    pCtx->pOps = libusbd_backend_find(pBackend ? pBackend : "");
+    if (!pCtx->pOps) {
+        LIBUSBD_LOG_ERROR("libusbd: Handoff is from backend %s, which isn't built in", pBackend ? pBackend : "?");
+        free(pBackend);
+        ret = LIBUSBD_NOT_IMPLEMENTED;
+        goto fail;
+    }
+    free(pBackend);
+
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->vid);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->pid);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->did);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->bClass);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->bSubclass);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->bProtocol);
+    pCtx->pManufacturerStr = libusbd_handoff_get_str(pCtx, &buf);
+    pCtx->pProductStr = libusbd_handoff_get_str(pCtx, &buf);
+    pCtx->pSerialStr = libusbd_handoff_get_str(pCtx, &buf);
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->buffer_retention);
+    if (pCtx->buffer_retention != LIBUSBD_RETAIN_ALWAYS && pCtx->buffer_retention != LIBUSBD_RETAIN_WHILE_ENABLED) {
+        buf.error = LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    uint8_t bNumInterfaces = 0;
+    LIBUSBD_HANDOFF_GET(&buf, bNumInterfaces);
+    if (bNumInterfaces > LIBUSBD_MAX_IFACES) {
+        buf.error = LIBUSBD_INVALID_ARGUMENT;
+    }
+    LIBUSBD_HANDOFF_GET(&buf, pCtx->bNumEndpoints);
+
+    for (int i = 0; i < bNumInterfaces && !buf.error; i++)
+    {
+        libusbd_iface_t* pIface = &pCtx->aInterfaces[i];
+
+        LIBUSBD_HANDOFF_GET(&buf, pIface->bClass);
+        LIBUSBD_HANDOFF_GET(&buf, pIface->bSubclass);
+        LIBUSBD_HANDOFF_GET(&buf, pIface->bProtocol);
+        LIBUSBD_HANDOFF_GET(&buf, pIface->aEpAddress);
+        LIBUSBD_HANDOFF_GET(&buf, pIface->aEpType);
+        LIBUSBD_HANDOFF_GET(&buf, pIface->aEpInterval);
+        pIface->finalized = true;
+
+        if ((ret = libusbd_stats_iface_alloc(pCtx, i))) {
+            goto fail;
+        }
+        pCtx->bNumInterfaces++;
+    }
+
+    if (buf.error) {
+        ret = buf.error;
+        goto fail;
+    }
+
+    pCtx->finalized = true;
+
+    ret = pCtx->pOps->handoff_adopt(pCtx, &buf);
+    if (ret) {
+        goto fail;
+    }
+
+    libusbd_handoff_buf_free(&buf);
+
+    *pCtxOut = pCtx;
+
+    return LIBUSBD_SUCCESS;
+
+fail:
+    LIBUSBD_LOG_ERROR("libusbd: Handoff adopt failed (%d)", ret);
+
+    libusbd_handoff_buf_free(&buf);
+
+    libusbd_stats_free(pCtx);
+    libusbd_pool_destroy(pCtx);
+    libusbd_arena_free(pCtx);
+    free(pCtx);
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef _LIBUSBD_HANDOFF_H
+#define _LIBUSBD_HANDOFF_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SCM_RIGHTS allows at most 253 fds per message
+#define LIBUSBD_HANDOFF_MAX_FDS (253)
+
+// Serialized context state for libusbd_handoff_export/adopt. Errors are
+// sticky, so callers can put/get a whole struct and check `error` once.
+typedef struct libusbd_handoff_buf_t
+{
+    uint8_t* data;
+    uint32_t size;
+    uint32_t alloc;
+    uint32_t pos;
+    int error;
+
+    int aFds[LIBUSBD_HANDOFF_MAX_FDS];
+    uint32_t numFds;
+} libusbd_handoff_buf_t;
+
+void libusbd_handoff_put(libusbd_handoff_buf_t* pBuf, const void* data, uint32_t len);
+void libusbd_handoff_put_str(libusbd_handoff_buf_t* pBuf, const char* str);
+// Stores the fd's index into the message's fd list, -1 is passed as-is
+void libusbd_handoff_put_fd(libusbd_handoff_buf_t* pBuf, int fd);
+
+void libusbd_handoff_get(libusbd_handoff_buf_t* pBuf, void* out, uint32_t len);
+// In pCtx's arena, or from malloc with a NULL pCtx
+char* libusbd_handoff_get_str(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf);
+// The fd now belongs to the caller, -1 if none was sent
+int libusbd_handoff_get_fd(libusbd_handoff_buf_t* pBuf);
+
+// Closes any fds nobody claimed
+void libusbd_handoff_buf_free(libusbd_handoff_buf_t* pBuf);
+
+// One message per call over a connected AF_UNIX stream socket. Also used by
+// the daemon protocol (libusbd_daemon.c).
+int libusbd_handoff_send(int sock_fd, libusbd_handoff_buf_t* pBuf);
+int libusbd_handoff_recv(int sock_fd, libusbd_handoff_buf_t* pBuf);
+
+#define LIBUSBD_HANDOFF_PUT(pBuf, val) libusbd_handoff_put((pBuf), &(val), sizeof(val))
+#define LIBUSBD_HANDOFF_GET(pBuf, val) libusbd_handoff_get((pBuf), &(val), sizeof(val))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_HANDOFF_H
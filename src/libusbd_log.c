@@ -0,0 +1,50 @@
+#include "libusbd.h"
+
+#include "libusbd_log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+int libusbd_log_level = LIBUSBD_LOG_LEVEL_INFO;
+
+static libusbd_log_callback_t libusbd_log_cb = NULL;
+static void* libusbd_log_cb_user = NULL;
+
+void libusbd_log_write(int level, const char* fmt, ...)
+{
+    char msg[512];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+
+    libusbd_log_callback_t cb = __atomic_load_n(&libusbd_log_cb, __ATOMIC_ACQUIRE);
+    if (cb) {
+        cb(level, msg, libusbd_log_cb_user);
+        return;
+    }
+
+    fprintf(stderr, "%s\n", msg);
+}
+
+int libusbd_set_log_level(int level)
+{
+    if (level < LIBUSBD_LOG_LEVEL_NONE || level > LIBUSBD_LOG_LEVEL_DEBUG) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    __atomic_store_n(&libusbd_log_level, level, __ATOMIC_RELAXED);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_set_log_callback(libusbd_log_callback_t cb, void* user)
+{
+    // Swapping sinks while another thread is mid-log isn't synchronized
+    // with the user pointer, so set this up before libusbd_init.
+    libusbd_log_cb_user = user;
+    __atomic_store_n(&libusbd_log_cb, cb, __ATOMIC_RELEASE);
+
+    return LIBUSBD_SUCCESS;
+}
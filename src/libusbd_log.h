@@ -0,0 +1,40 @@
+#ifndef _LIBUSBD_LOG_H
+#define _LIBUSBD_LOG_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Anything above LIBUSBD_LOG_MAX_LEVEL is compiled out entirely, so
+// debug logging on the setup/data paths costs nothing in release builds.
+#ifndef LIBUSBD_LOG_MAX_LEVEL
+#if defined(DEBUG) && DEBUG
+#define LIBUSBD_LOG_MAX_LEVEL LIBUSBD_LOG_LEVEL_DEBUG
+#else
+#define LIBUSBD_LOG_MAX_LEVEL LIBUSBD_LOG_LEVEL_INFO
+#endif
+#endif
+
+extern int libusbd_log_level;
+
+void libusbd_log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LIBUSBD_LOG(level, ...) do { \
+    if ((level) <= LIBUSBD_LOG_MAX_LEVEL && (level) <= __atomic_load_n(&libusbd_log_level, __ATOMIC_RELAXED)) \
+        libusbd_log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define LIBUSBD_LOG_ERROR(...) LIBUSBD_LOG(LIBUSBD_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LIBUSBD_LOG_WARN(...)  LIBUSBD_LOG(LIBUSBD_LOG_LEVEL_WARN, __VA_ARGS__)
+#define LIBUSBD_LOG_INFO(...)  LIBUSBD_LOG(LIBUSBD_LOG_LEVEL_INFO, __VA_ARGS__)
+#define LIBUSBD_LOG_DEBUG(...) LIBUSBD_LOG(LIBUSBD_LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_LOG_H
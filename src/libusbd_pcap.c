@@ -0,0 +1,594 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// pcapng with LINKTYPE_USB_LINUX_MMAPPED, the same thing Wireshark reads
+// from usbmon. Everything is in host byte order, the section header magic
+// tells readers which one that is.
+#define PCAPNG_BLOCK_SHB (0x0A0D0D0A)
+#define PCAPNG_BLOCK_IDB (0x00000001)
+#define PCAPNG_BLOCK_ISB (0x00000005)
+#define PCAPNG_BLOCK_EPB (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+
+#define PCAPNG_OPT_IF_TSRESOL (9)
+#define PCAPNG_OPT_ISB_IFDROP (5)
+
+#define LINKTYPE_USB_LINUX_MMAPPED (220)
+
+#define USBMON_XFER_ISO  (0)
+#define USBMON_XFER_INTR (1)
+#define USBMON_XFER_CTRL (2)
+#define USBMON_XFER_BULK (3)
+
+// URB statuses are Linux errnos regardless of where we run
+#define USBMON_ENOENT      (-2)
+#define USBMON_EPIPE       (-32)
+#define USBMON_EPROTO      (-71)
+#define USBMON_ETIMEDOUT   (-110)
+#define USBMON_EINPROGRESS (-115)
+
+#define LIBUSBD_PCAP_BUSNUM (1)
+#define LIBUSBD_PCAP_DEVNUM (1)
+
+#define LIBUSBD_PCAP_DEFAULT_SNAPLEN (512)
+#define LIBUSBD_PCAP_MAX_SNAPLEN     (0x10000)
+#define LIBUSBD_PCAP_RING_BYTES      (8 << 20)
+#define LIBUSBD_PCAP_MIN_SLOTS       (64)
+#define LIBUSBD_PCAP_IDLE_NS         (1000000)
+#define LIBUSBD_PCAP_WRITE_BATCH     (64)
+
+typedef struct __attribute__((packed)) usbmon_hdr_t
+{
+    uint64_t id;
+    uint8_t event_type;
+    uint8_t transfer_type;
+    uint8_t endpoint_number;
+    uint8_t device_address;
+    uint16_t bus_id;
+    char setup_flag; // 0 if setup is valid
+    char data_flag;  // 0 if data follows
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t urb_len;
+    uint32_t data_len;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+} usbmon_hdr_t;
+
+// Producers lay out a complete enhanced packet block, so the writer can hand
+// slots straight to writev without touching them.
+typedef struct libusbd_pcap_slot_t
+{
+    // Bounded MPSC queue: pos + 1 once published, pos + num_slots once consumed
+    uint64_t seq;
+
+    uint32_t block_type;
+    uint32_t block_len;
+    uint32_t iface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t cap_len;
+    uint32_t orig_len;
+    usbmon_hdr_t hdr;
+    uint8_t data[]; // padded to 4, then block_len again
+} libusbd_pcap_slot_t;
+
+typedef struct libusbd_pcap_t
+{
+    uint64_t head;
+    uint8_t pad0[64 - sizeof(uint64_t)];
+    uint64_t tail;
+    uint8_t pad1[64 - sizeof(uint64_t)];
+
+    int enabled;
+    int stopping;
+    uint32_t producers; // in libusbd_pcap_push past the enabled check
+    uint64_t drops;
+    uint64_t realtime_offset_ns;
+
+    uint32_t snaplen;
+    uint32_t slot_size;
+    uint32_t mask;
+
+    pthread_mutex_t mutex; // start/stop only
+    pthread_t writer;
+    int fd;
+    int write_failed;
+
+    uint8_t* pSlots;
+} libusbd_pcap_t;
+
+static libusbd_pcap_slot_t* libusbd_pcap_slot(libusbd_pcap_t* pPcap, uint64_t pos)
+{
+    return (libusbd_pcap_slot_t*)(pPcap->pSlots + (pos & pPcap->mask) * pPcap->slot_size);
+}
+
+static uint8_t libusbd_pcap_xfer_type(uint8_t type)
+{
+    switch (type)
+    {
+        case USB_EPATTR_TTYPE_ISOC:
+            return USBMON_XFER_ISO;
+        case USB_EPATTR_TTYPE_INTR:
+            return USBMON_XFER_INTR;
+        default:
+            return USBMON_XFER_BULK;
+    }
+}
+
+static int32_t libusbd_pcap_status(int32_t status)
+{
+    if (status >= 0) return 0;
+
+    switch (status)
+    {
+        case LIBUSBD_STALLED:
+            return USBMON_EPIPE;
+        case LIBUSBD_CANCELLED:
+        case LIBUSBD_NOT_ENUMERATED:
+            return USBMON_ENOENT;
+        case LIBUSBD_TIMEOUT:
+            return USBMON_ETIMEDOUT;
+        default:
+            return USBMON_EPROTO;
+    }
+}
+
+static void libusbd_pcap_push(libusbd_ctx_t* pCtx, const usbmon_hdr_t* pHdr, const void* data, uint32_t len)
+{
+    // Like the trace ring, never freed while the context is alive
+    libusbd_pcap_t* pPcap = __atomic_load_n(&pCtx->pPcap, __ATOMIC_ACQUIRE);
+    if (!pPcap || !__atomic_load_n(&pPcap->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // Counted before enabled is looked at again, so libusbd_pcap_stop either
+    // sees us here or we see it cleared. Both are seq_cst for that.
+    __atomic_fetch_add(&pPcap->producers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&pPcap->enabled, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_sub(&pPcap->producers, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    uint64_t pos = __atomic_load_n(&pPcap->head, __ATOMIC_RELAXED);
+    libusbd_pcap_slot_t* pSlot;
+
+    while (1)
+    {
+        pSlot = libusbd_pcap_slot(pPcap, pos);
+        int64_t dif = (int64_t)(__atomic_load_n(&pSlot->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pPcap->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            // Writer hasn't caught up, don't stall the data path for it
+            __atomic_fetch_add(&pPcap->drops, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&pPcap->producers, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&pPcap->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (!data) len = 0;
+    if (len > pPcap->snaplen) len = pPcap->snaplen;
+
+    uint64_t ts_ns = libusbd_stats_now_ns() + pPcap->realtime_offset_ns;
+    uint32_t padded = (len + 3) & ~3;
+    uint32_t block_len = offsetof(libusbd_pcap_slot_t, data) - offsetof(libusbd_pcap_slot_t, block_type) + padded + 4;
+
+    pSlot->block_type = PCAPNG_BLOCK_EPB;
+    pSlot->block_len = block_len;
+    pSlot->iface_id = 0;
+    pSlot->ts_high = ts_ns >> 32;
+    pSlot->ts_low = ts_ns & 0xFFFFFFFF;
+    pSlot->cap_len = sizeof(usbmon_hdr_t) + len;
+    pSlot->orig_len = pSlot->cap_len;
+
+    memcpy(&pSlot->hdr, pHdr, sizeof(*pHdr));
+    pSlot->hdr.ts_sec = ts_ns / 1000000000ull;
+    pSlot->hdr.ts_usec = (ts_ns % 1000000000ull) / 1000;
+    pSlot->hdr.data_len = len;
+    if (len) {
+        pSlot->hdr.data_flag = 0;
+        memcpy(pSlot->data, data, len);
+    }
+    memset(pSlot->data + len, 0, padded - len);
+    memcpy(pSlot->data + padded, &block_len, sizeof(block_len));
+
+    __atomic_store_n(&pSlot->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&pPcap->producers, 1, __ATOMIC_RELEASE);
+}
+
+void libusbd_pcap_ep_submit(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
+{
+    if (!pCtx->pPcap || iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) return;
+
+    libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
+    uint8_t addr = pIface->aEpAddress[ep];
+    usbmon_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.id = ((uint64_t)iface_num << 8) | ep;
+    hdr.event_type = LIBUSBD_PCAP_SUBMIT;
+    hdr.transfer_type = libusbd_pcap_xfer_type(pIface->aEpType[ep]);
+    hdr.endpoint_number = addr;
+    hdr.device_address = LIBUSBD_PCAP_DEVNUM;
+    hdr.bus_id = LIBUSBD_PCAP_BUSNUM;
+    hdr.setup_flag = '-';
+    hdr.data_flag = (addr & 0x80) ? '<' : '=';
+    hdr.status = USBMON_EINPROGRESS;
+    hdr.urb_len = len;
+    hdr.interval = pIface->aEpInterval[ep];
+
+    libusbd_pcap_push(pCtx, &hdr, NULL, 0);
+}
+
+void libusbd_pcap_ep_complete(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, int32_t status)
+{
+    if (!pCtx->pPcap || iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) return;
+
+    libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
+    uint8_t addr = pIface->aEpAddress[ep];
+    uint32_t actual = status > 0 ? status : 0;
+    usbmon_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.id = ((uint64_t)iface_num << 8) | ep;
+    hdr.event_type = LIBUSBD_PCAP_COMPLETE;
+    hdr.transfer_type = libusbd_pcap_xfer_type(pIface->aEpType[ep]);
+    hdr.endpoint_number = addr;
+    hdr.device_address = LIBUSBD_PCAP_DEVNUM;
+    hdr.bus_id = LIBUSBD_PCAP_BUSNUM;
+    hdr.setup_flag = '-';
+    hdr.data_flag = '=';
+    hdr.status = libusbd_pcap_status(status);
+    hdr.urb_len = actual;
+    hdr.interval = pIface->aEpInterval[ep];
+
+    libusbd_pcap_push(pCtx, &hdr, data, actual);
+}
+
+void libusbd_pcap_control(libusbd_ctx_t* pCtx, char type, const uint8_t* setup, const void* data, int32_t status)
+{
+    if (!pCtx->pPcap) return;
+
+    int is_in = !!(setup[0] & LIBUSBD_DEV2HOST_DIR);
+    uint16_t wLength = setup[6] | (setup[7] << 8);
+    usbmon_hdr_t hdr;
+    uint32_t len;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.id = 0xFFFF;
+    hdr.event_type = type;
+    hdr.transfer_type = USBMON_XFER_CTRL;
+    hdr.endpoint_number = is_in ? 0x80 : 0x00;
+    hdr.device_address = LIBUSBD_PCAP_DEVNUM;
+    hdr.bus_id = LIBUSBD_PCAP_BUSNUM;
+
+    if (type == LIBUSBD_PCAP_SUBMIT) {
+        hdr.setup_flag = 0;
+        memcpy(hdr.setup, setup, sizeof(hdr.setup));
+        hdr.data_flag = is_in ? '<' : '=';
+        hdr.status = USBMON_EINPROGRESS;
+        hdr.urb_len = wLength;
+        len = is_in ? 0 : wLength;
+    }
+    else {
+        hdr.setup_flag = '-';
+        hdr.data_flag = is_in ? '=' : '>';
+        hdr.status = libusbd_pcap_status(status);
+        hdr.urb_len = status > 0 ? status : 0;
+        len = is_in ? hdr.urb_len : 0;
+    }
+
+    libusbd_pcap_push(pCtx, &hdr, data, len);
+}
+
+//
+// Writer
+//
+
+static void libusbd_pcap_write(libusbd_pcap_t* pPcap, struct iovec* pIov, int num_iov)
+{
+    while (num_iov && !pPcap->write_failed)
+    {
+        ssize_t ret = writev(pPcap->fd, pIov, num_iov);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+
+            LIBUSBD_LOG_ERROR("libusbd: Capture write failed (%s)", strerror(errno));
+            pPcap->write_failed = 1;
+            return;
+        }
+
+        // Short write, skip what made it out
+        while (num_iov && (size_t)ret >= pIov->iov_len)
+        {
+            ret -= pIov->iov_len;
+            pIov++;
+            num_iov--;
+        }
+        if (num_iov) {
+            pIov->iov_base = (uint8_t*)pIov->iov_base + ret;
+            pIov->iov_len -= ret;
+        }
+    }
+}
+
+static void libusbd_pcap_write_block(libusbd_pcap_t* pPcap, uint32_t type, const void* body, uint32_t body_len)
+{
+    uint32_t total = 12 + body_len;
+    struct iovec iov[4] = {
+        {&type, 4},
+        {&total, 4},
+        {(void*)body, body_len},
+        {&total, 4},
+    };
+
+    libusbd_pcap_write(pPcap, iov, 4);
+}
+
+static void libusbd_pcap_write_headers(libusbd_pcap_t* pPcap)
+{
+    struct {
+        uint32_t magic;
+        uint16_t major;
+        uint16_t minor;
+        int64_t section_len;
+    } shb = {PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1};
+
+    struct {
+        uint16_t linktype;
+        uint16_t reserved;
+        uint32_t snaplen;
+        uint16_t opt_code;
+        uint16_t opt_len;
+        uint8_t tsresol[4];
+        uint32_t opt_end;
+    } idb = {LINKTYPE_USB_LINUX_MMAPPED, 0, sizeof(usbmon_hdr_t) + pPcap->snaplen, PCAPNG_OPT_IF_TSRESOL, 1, {9, 0, 0, 0}, 0};
+
+    libusbd_pcap_write_block(pPcap, PCAPNG_BLOCK_SHB, &shb, sizeof(shb));
+    libusbd_pcap_write_block(pPcap, PCAPNG_BLOCK_IDB, &idb, sizeof(idb));
+}
+
+static void libusbd_pcap_write_stats(libusbd_pcap_t* pPcap)
+{
+    uint64_t ts_ns = libusbd_stats_now_ns() + pPcap->realtime_offset_ns;
+
+    struct __attribute__((packed)) {
+        uint32_t iface_id;
+        uint32_t ts_high;
+        uint32_t ts_low;
+        uint16_t opt_code;
+        uint16_t opt_len;
+        uint64_t ifdrop;
+        uint32_t opt_end;
+    } isb = {0, ts_ns >> 32, ts_ns & 0xFFFFFFFF, PCAPNG_OPT_ISB_IFDROP, 8, __atomic_load_n(&pPcap->drops, __ATOMIC_RELAXED), 0};
+
+    libusbd_pcap_write_block(pPcap, PCAPNG_BLOCK_ISB, &isb, sizeof(isb));
+}
+
+static void* libusbd_pcap_writer(void* arg)
+{
+    libusbd_pcap_t* pPcap = (libusbd_pcap_t*)arg;
+    struct timespec idle = {0, LIBUSBD_PCAP_IDLE_NS};
+    struct iovec aIov[LIBUSBD_PCAP_WRITE_BATCH];
+
+    while (1)
+    {
+        uint64_t pos = pPcap->tail;
+        int num = 0;
+
+        // Gather whatever is published, in order, and write it in one go
+        while (num < LIBUSBD_PCAP_WRITE_BATCH)
+        {
+            libusbd_pcap_slot_t* pSlot = libusbd_pcap_slot(pPcap, pos + num);
+            if (__atomic_load_n(&pSlot->seq, __ATOMIC_ACQUIRE) != pos + num + 1) break;
+
+            aIov[num].iov_base = &pSlot->block_type;
+            aIov[num].iov_len = pSlot->block_len;
+            num++;
+        }
+
+        if (num) {
+            libusbd_pcap_write(pPcap, aIov, num);
+
+            for (int i = 0; i < num; i++)
+            {
+                __atomic_store_n(&libusbd_pcap_slot(pPcap, pos + i)->seq, pos + i + pPcap->mask + 1, __ATOMIC_RELEASE);
+            }
+            pPcap->tail = pos + num;
+            continue;
+        }
+
+        // Stopping is only set once every producer that got past the
+        // enabled check has published, so once the ring is empty nothing
+        // else can show up.
+        if (__atomic_load_n(&pPcap->stopping, __ATOMIC_ACQUIRE) && __atomic_load_n(&pPcap->head, __ATOMIC_ACQUIRE) == pos) {
+            break;
+        }
+
+        // Polling keeps producers from ever having to wake us
+        nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+//
+// API
+//
+
+void libusbd_pcap_free(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx->pPcap) return;
+
+    libusbd_pcap_stop(pCtx);
+    pthread_mutex_destroy(&pCtx->pPcap->mutex);
+    free(pCtx->pPcap->pSlots);
+    free(pCtx->pPcap);
+    pCtx->pPcap = NULL;
+}
+
+int libusbd_pcap_start(libusbd_ctx_t* pCtx, const char* path, uint32_t snaplen)
+{
+    struct timespec mono, real;
+
+    if (!pCtx || !path || snaplen > LIBUSBD_PCAP_MAX_SNAPLEN) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (!snaplen) {
+        snaplen = LIBUSBD_PCAP_DEFAULT_SNAPLEN;
+    }
+
+    // The ring is sized once and kept until the context is freed, so the
+    // data path never has to take a lock to use it.
+    if (!pCtx->pPcap) {
+        libusbd_pcap_t* pPcap = calloc(1, sizeof(libusbd_pcap_t));
+        if (!pPcap) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+
+        pPcap->snaplen = snaplen;
+        pPcap->slot_size = (sizeof(libusbd_pcap_slot_t) + snaplen + 4 + 4 + 63) & ~63;
+
+        uint32_t num_slots = LIBUSBD_PCAP_MIN_SLOTS;
+        while (num_slots * 2 * (uint64_t)pPcap->slot_size <= LIBUSBD_PCAP_RING_BYTES) {
+            num_slots *= 2;
+        }
+        pPcap->mask = num_slots - 1;
+
+        pPcap->pSlots = malloc((size_t)num_slots * pPcap->slot_size);
+        if (!pPcap->pSlots) {
+            free(pPcap);
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+
+        for (uint32_t i = 0; i < num_slots; i++)
+        {
+            libusbd_pcap_slot(pPcap, i)->seq = i;
+        }
+
+        pPcap->fd = -1;
+        pthread_mutex_init(&pPcap->mutex, NULL);
+
+        __atomic_store_n(&pCtx->pPcap, pPcap, __ATOMIC_RELEASE);
+    }
+
+    libusbd_pcap_t* pPcap = pCtx->pPcap;
+
+    pthread_mutex_lock(&pPcap->mutex);
+
+    if (pPcap->fd >= 0) {
+        pthread_mutex_unlock(&pPcap->mutex);
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    pPcap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pPcap->fd < 0) {
+        LIBUSBD_LOG_ERROR("libusbd: Failed to open capture %s (%s)", path, strerror(errno));
+        pthread_mutex_unlock(&pPcap->mutex);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    pPcap->write_failed = 0;
+
+    if (snaplen != pPcap->snaplen) {
+        LIBUSBD_LOG_WARN("libusbd: Capture snaplen stays at %u", pPcap->snaplen);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    pPcap->realtime_offset_ns = ((uint64_t)real.tv_sec * 1000000000ull + real.tv_nsec)
+                              - ((uint64_t)mono.tv_sec * 1000000000ull + mono.tv_nsec);
+
+    libusbd_pcap_write_headers(pPcap);
+
+    pPcap->stopping = 0;
+    __atomic_store_n(&pPcap->drops, 0, __ATOMIC_RELAXED);
+
+    if (pthread_create(&pPcap->writer, NULL, libusbd_pcap_writer, pPcap)) {
+        close(pPcap->fd);
+        pPcap->fd = -1;
+        pthread_mutex_unlock(&pPcap->mutex);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    __atomic_store_n(&pPcap->enabled, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&pPcap->mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_pcap_stop(libusbd_ctx_t* pCtx)
+{
+    int ret = LIBUSBD_SUCCESS;
+
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_pcap_t* pPcap = pCtx->pPcap;
+    if (!pPcap) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pthread_mutex_lock(&pPcap->mutex);
+
+    if (pPcap->fd < 0) {
+        pthread_mutex_unlock(&pPcap->mutex);
+        return LIBUSBD_SUCCESS;
+    }
+
+    // Anything already claiming a slot gets to publish it into this file,
+    // rather than leaving it in the ring for the next one
+    struct timespec idle = {0, LIBUSBD_PCAP_IDLE_NS};
+    __atomic_store_n(&pPcap->enabled, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pPcap->producers, __ATOMIC_SEQ_CST))
+    {
+        nanosleep(&idle, NULL);
+    }
+
+    __atomic_store_n(&pPcap->stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(pPcap->writer, NULL);
+
+    libusbd_pcap_write_stats(pPcap);
+
+    uint64_t drops = __atomic_load_n(&pPcap->drops, __ATOMIC_RELAXED);
+    if (drops) {
+        LIBUSBD_LOG_WARN("libusbd: Capture dropped %llu events", (unsigned long long)drops);
+    }
+
+    if (close(pPcap->fd) || pPcap->write_failed) {
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    pPcap->fd = -1;
+
+    pthread_mutex_unlock(&pPcap->mutex);
+
+    return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef _LIBUSBD_PCAP_H
+#define _LIBUSBD_PCAP_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// usbmon event types
+#define LIBUSBD_PCAP_SUBMIT   ('S')
+#define LIBUSBD_PCAP_COMPLETE ('C')
+
+void libusbd_pcap_free(libusbd_ctx_t* pCtx);
+
+// Lock-free, safe to call from any thread. All of these return immediately
+// unless a capture is running, and drop the event if the writer has fallen
+// behind. data may be NULL when there's no data stage to show.
+//
+// The device only knows what an OUT transfer carried once it completes, so
+// endpoint data is attached to completions in both directions.
+void libusbd_pcap_ep_submit(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len);
+void libusbd_pcap_ep_complete(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, int32_t status);
+
+// setup is the raw 8-byte packet. For completions status is bytes in the
+// data stage or a LIBUSBD_* error.
+void libusbd_pcap_control(libusbd_ctx_t* pCtx, char type, const uint8_t* setup, const void* data, int32_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_PCAP_H
@@ -0,0 +1,241 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+#include "libusbd_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define LIBUSBD_POOL_WORDS (LIBUSBD_POOL_CHUNKS / 64)
+
+typedef struct libusbd_pool_t
+{
+    pthread_mutex_t mutex;
+    uint32_t flags;
+
+    // NULL if mapping it failed, everything goes to malloc then
+    uint8_t* pRegion;
+
+    // Set bits are chunks in use, aRun holds the length of each allocation
+    // at its first chunk
+    uint64_t aUsed[LIBUSBD_POOL_WORDS];
+    uint16_t aRun[LIBUSBD_POOL_CHUNKS];
+
+    bool mlock_warned;
+} libusbd_pool_t;
+
+static uint8_t* libusbd_pool_map(uint32_t flags)
+{
+    void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (flags & LIBUSBD_POOL_HUGETLB) {
+        p = mmap(NULL, LIBUSBD_POOL_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            LIBUSBD_LOG_INFO("libusbd: No huge pages for the buffer pool (%s), using regular pages", strerror(errno));
+        }
+    }
+#endif
+
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, LIBUSBD_POOL_SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            LIBUSBD_LOG_ERROR("libusbd: Failed to map the buffer pool (%s)", strerror(errno));
+            return NULL;
+        }
+
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages are the next best thing
+        if (flags & LIBUSBD_POOL_HUGETLB) {
+            madvise(p, LIBUSBD_POOL_SZ, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    return p;
+}
+
+static libusbd_pool_t* libusbd_pool_get(libusbd_ctx_t* pCtx)
+{
+    libusbd_pool_t* pPool = __atomic_load_n(&pCtx->pPool, __ATOMIC_ACQUIRE);
+    if (pPool) {
+        return pPool;
+    }
+
+    pPool = calloc(1, sizeof(libusbd_pool_t));
+    if (!pPool) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&pPool->mutex, NULL);
+    pPool->flags = pCtx->pool_flags;
+    pPool->pRegion = libusbd_pool_map(pPool->flags);
+
+    libusbd_pool_t* pExpected = NULL;
+    if (!__atomic_compare_exchange_n(&pCtx->pPool, &pExpected, pPool, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (pPool->pRegion) {
+            munmap(pPool->pRegion, LIBUSBD_POOL_SZ);
+        }
+        pthread_mutex_destroy(&pPool->mutex);
+        free(pPool);
+        return pExpected;
+    }
+
+    return pPool;
+}
+
+static bool libusbd_pool_chunk_used(libusbd_pool_t* pPool, uint32_t idx)
+{
+    return (pPool->aUsed[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void libusbd_pool_mark(libusbd_pool_t* pPool, uint32_t start, uint32_t count, bool used)
+{
+    for (uint32_t i = start; i < start + count; i++)
+    {
+        if (used) {
+            pPool->aUsed[i / 64] |= 1ull << (i % 64);
+        }
+        else {
+            pPool->aUsed[i / 64] &= ~(1ull << (i % 64));
+        }
+    }
+}
+
+// First fit, returns LIBUSBD_POOL_CHUNKS if there's no run long enough.
+// Must be called with the pool's mutex held.
+static uint32_t libusbd_pool_find_locked(libusbd_pool_t* pPool, uint32_t count)
+{
+    uint32_t run = 0;
+
+    for (uint32_t i = 0; i < LIBUSBD_POOL_CHUNKS; i++)
+    {
+        // Skip over full words
+        if (!run && !(i % 64) && pPool->aUsed[i / 64] == UINT64_MAX) {
+            i += 63;
+            continue;
+        }
+
+        if (libusbd_pool_chunk_used(pPool, i)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == count) {
+            return i + 1 - count;
+        }
+    }
+
+    return LIBUSBD_POOL_CHUNKS;
+}
+
+// Gets the chunks resident before anything runs on them
+static void libusbd_pool_fault_in(libusbd_pool_t* pPool, uint8_t* p, uint64_t size)
+{
+    if (pPool->flags & LIBUSBD_POOL_MLOCK) {
+        if (!mlock(p, size)) {
+            return;
+        }
+
+        if (!pPool->mlock_warned) {
+            LIBUSBD_LOG_WARN("libusbd: Failed to lock pool buffers (%s), check RLIMIT_MEMLOCK", strerror(errno));
+            pPool->mlock_warned = true;
+        }
+    }
+
+    if (pPool->flags & LIBUSBD_POOL_PREFAULT) {
+        // Written, not read, so it isn't left on the shared zero page
+        for (uint64_t off = 0; off < size; off += LIBUSBD_POOL_CHUNK_SZ)
+        {
+            volatile uint8_t* pTouch = p + off;
+            *pTouch = *pTouch;
+        }
+    }
+}
+
+void* libusbd_pool_alloc(libusbd_ctx_t* pCtx, uint64_t size)
+{
+    libusbd_pool_t* pPool = libusbd_pool_get(pCtx);
+    uint64_t count = size ? (size + LIBUSBD_POOL_CHUNK_SZ - 1) / LIBUSBD_POOL_CHUNK_SZ : 1;
+
+    if (!pPool || !pPool->pRegion || count > LIBUSBD_POOL_CHUNKS) {
+        return malloc(size ? size : 1);
+    }
+
+    pthread_mutex_lock(&pPool->mutex);
+
+    uint32_t start = libusbd_pool_find_locked(pPool, count);
+    if (start >= LIBUSBD_POOL_CHUNKS) {
+        pthread_mutex_unlock(&pPool->mutex);
+        LIBUSBD_LOG_DEBUG("libusbd: Buffer pool full, 0x%llx bytes from malloc", (unsigned long long)size);
+        return malloc(size ? size : 1);
+    }
+
+    libusbd_pool_mark(pPool, start, count, true);
+    pPool->aRun[start] = count;
+
+    uint8_t* p = pPool->pRegion + (uint64_t)start * LIBUSBD_POOL_CHUNK_SZ;
+    libusbd_pool_fault_in(pPool, p, count * LIBUSBD_POOL_CHUNK_SZ);
+
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return p;
+}
+
+void libusbd_pool_free(libusbd_ctx_t* pCtx, void* p)
+{
+    libusbd_pool_t* pPool = __atomic_load_n(&pCtx->pPool, __ATOMIC_ACQUIRE);
+    uint8_t* pBuf = p;
+
+    if (!p) return;
+
+    if (!pPool || !pPool->pRegion || pBuf < pPool->pRegion || pBuf >= pPool->pRegion + LIBUSBD_POOL_SZ) {
+        free(p);
+        return;
+    }
+
+    uint32_t start = (pBuf - pPool->pRegion) / LIBUSBD_POOL_CHUNK_SZ;
+
+    // Chunks stay locked and faulted in for whoever gets them next
+    pthread_mutex_lock(&pPool->mutex);
+    libusbd_pool_mark(pPool, start, pPool->aRun[start], false);
+    pPool->aRun[start] = 0;
+    pthread_mutex_unlock(&pPool->mutex);
+}
+
+void libusbd_pool_destroy(libusbd_ctx_t* pCtx)
+{
+    libusbd_pool_t* pPool = pCtx->pPool;
+    if (!pPool) return;
+
+    if (pPool->pRegion) {
+        munmap(pPool->pRegion, LIBUSBD_POOL_SZ);
+    }
+    pthread_mutex_destroy(&pPool->mutex);
+    free(pPool);
+    pCtx->pPool = NULL;
+}
+
+int libusbd_set_buffer_pool(libusbd_ctx_t* pCtx, uint32_t flags)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (flags & ~(LIBUSBD_POOL_HUGETLB | LIBUSBD_POOL_MLOCK | LIBUSBD_POOL_PREFAULT)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Already mapped with the old flags
+    if (__atomic_load_n(&pCtx->pPool, __ATOMIC_ACQUIRE)) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    pCtx->pool_flags = flags;
+    return LIBUSBD_SUCCESS;
+}
@@ -0,0 +1,34 @@
+#ifndef _LIBUSBD_POOL_H
+#define _LIBUSBD_POOL_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-context buffer pool. Endpoint, setup and transfer buffers are carved out
+// of one mmap'd region in page-sized, page-aligned chunks, so they share as few
+// TLB entries as possible. The region is mapped on the first allocation, with
+// whatever `libusbd_set_buffer_pool` asked for by then. Anything that doesn't
+// fit comes from malloc instead, so callers never see the pool run dry.
+#define LIBUSBD_POOL_CHUNK_SZ (0x1000)
+#define LIBUSBD_POOL_CHUNKS   (1024)
+#define LIBUSBD_POOL_SZ       (LIBUSBD_POOL_CHUNK_SZ * LIBUSBD_POOL_CHUNKS)
+
+// Safe to call from any thread. size 0 still hands back a chunk.
+void* libusbd_pool_alloc(libusbd_ctx_t* pCtx, uint64_t size);
+
+// Takes anything libusbd_pool_alloc returned, or NULL
+void libusbd_pool_free(libusbd_ctx_t* pCtx, void* p);
+
+// Unmaps the region, every buffer has to have been given back already
+void libusbd_pool_destroy(libusbd_ctx_t* pCtx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_POOL_H
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "libusbd.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,12 +15,45 @@ extern "C" {
 
 typedef struct libusbd_macos_ctx_t libusbd_macos_ctx_t;
 typedef struct libusbd_linux_ctx_t libusbd_linux_ctx_t;
+typedef struct libusbd_loopback_ctx_t libusbd_loopback_ctx_t;
+typedef struct libusbd_rawgadget_ctx_t libusbd_rawgadget_ctx_t;
+typedef struct libusbd_trace_ring_t libusbd_trace_ring_t;
+typedef struct libusbd_record_t libusbd_record_t;
+typedef struct libusbd_pcap_t libusbd_pcap_t;
+typedef struct libusbd_xfer_timer_t libusbd_xfer_timer_t;
+typedef struct libusbd_xfer_cq_t libusbd_xfer_cq_t;
+typedef struct libusbd_pool_t libusbd_pool_t;
+typedef struct libusbd_arena_t libusbd_arena_t;
+typedef struct libusbd_backend_ops_t libusbd_backend_ops_t;
+
+// See `libusbd_ep_set_watermarks`. above flips with the crossings, so each
+// one is reported once.
+typedef struct libusbd_ep_watermark_t {
+    libusbd_ep_watermark_callback_t cb;
+    void* user;
+    uint32_t low;
+    uint32_t high;
+    int above;
+} libusbd_ep_watermark_t;
 
 typedef struct libusbd_iface_t {
     uint8_t bClass;
     uint8_t bSubclass;
     uint8_t bProtocol;
 
+    libusbd_ep_stats_t* pEpStats;
+    libusbd_ep_watermark_t* pEpWatermarks;
+
+    // As the host sees them, for captures. Addresses are handed out from 1
+    // in the order endpoints were added, like every backend does.
+    uint8_t aEpAddress[LIBUSBD_MAX_IFACE_EPS];
+    uint8_t aEpType[LIBUSBD_MAX_IFACE_EPS]; // USB_EPATTR_TTYPE_*
+    uint8_t aEpInterval[LIBUSBD_MAX_IFACE_EPS];
+
+    // Async transfers started while capturing, reported on the first
+    // libusbd_ep_transfer_done that sees them complete
+    uint16_t async_captured;
+
     bool finalized;
 } libusbd_iface_t;
 
@@ -29,19 +64,43 @@ typedef struct libusbd_ctx_t
         void* pPlatCtx;
         libusbd_macos_ctx_t* pMacosCtx;
         libusbd_linux_ctx_t* pLinuxCtx;
+        libusbd_loopback_ctx_t* pLoopbackCtx;
+        libusbd_rawgadget_ctx_t* pRawGadgetCtx;
     };
+    const libusbd_backend_ops_t* pOps;
     uint8_t bNumInterfaces;
+    uint8_t bNumEndpoints;
     uint16_t vid;
     uint16_t pid;
     uint16_t did;
     uint8_t bClass;
     uint8_t bSubclass;
     uint8_t bProtocol;
+    // In pArena, along with the backend's configuration state
     char* pManufacturerStr;
     char* pProductStr;
     char* pSerialStr;
     libusbd_iface_t aInterfaces[16];
 
+    libusbd_trace_ring_t* pTraceRing;
+    libusbd_record_t* pRecord;
+    libusbd_pcap_t* pPcap;
+    libusbd_xfer_timer_t* pXferTimer;
+    libusbd_xfer_cq_t* pXferCq;
+
+    // Mapped on first use, with pool_flags as they were then
+    libusbd_pool_t* pPool;
+    uint32_t pool_flags;
+
+    // LIBUSBD_RETAIN_*, endpoint buffers are the backend's to release
+    uint8_t buffer_retention;
+
+    libusbd_arena_t* pArena;
+
+    // Set by backends that call libusbd_xfer_timer_poll from their own
+    // completion loop
+    bool xfer_timer_polled;
+
     bool finalized;
 } libusbd_ctx_t;
 
@@ -0,0 +1,186 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Big enough that a busy endpoint goes a while between write(2)s
+#define LIBUSBD_RECORD_BUFFER_SIZE (1 << 20)
+
+typedef struct libusbd_record_t
+{
+    pthread_mutex_t mutex;
+    int enabled;
+
+    FILE* pFile;
+    uint64_t start_ns;
+    uint64_t num_entries;
+} libusbd_record_t;
+
+void libusbd_record_free(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx->pRecord) return;
+
+    libusbd_record_stop(pCtx);
+    pthread_mutex_destroy(&pCtx->pRecord->mutex);
+    free(pCtx->pRecord);
+    pCtx->pRecord = NULL;
+}
+
+// Must be called with the record mutex held
+static void libusbd_record_write_locked(libusbd_record_t* pRecord, libusbd_record_entry_t* pEntry, const void* setup, const void* data)
+{
+    if (!pRecord->pFile) return;
+
+    pEntry->ts_ns = libusbd_stats_now_ns() - pRecord->start_ns;
+
+    fwrite(pEntry, sizeof(*pEntry), 1, pRecord->pFile);
+    if (setup) {
+        fwrite(setup, 8, 1, pRecord->pFile);
+    }
+    if (pEntry->status > 0) {
+        fwrite(data, pEntry->status, 1, pRecord->pFile);
+    }
+    pRecord->num_entries++;
+}
+
+static libusbd_record_t* libusbd_record_get(libusbd_ctx_t* pCtx)
+{
+    // Like the trace ring, never freed while the context is alive
+    libusbd_record_t* pRecord = __atomic_load_n(&pCtx->pRecord, __ATOMIC_ACQUIRE);
+    if (!pRecord || !__atomic_load_n(&pRecord->enabled, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return pRecord;
+}
+
+void libusbd_record_setup(libusbd_ctx_t* pCtx, uint8_t iface_num, const libusbd_setup_callback_info_t* pInfo, const void* data, int32_t status)
+{
+    libusbd_record_t* pRecord = libusbd_record_get(pCtx);
+    if (!pRecord) return;
+
+    libusbd_record_entry_t entry;
+    uint8_t setup[8] = {pInfo->bmRequestType, pInfo->bRequest,
+                        pInfo->wValue & 0xFF, pInfo->wValue >> 8,
+                        pInfo->wIndex & 0xFF, pInfo->wIndex >> 8,
+                        pInfo->wLength & 0xFF, pInfo->wLength >> 8};
+
+    entry.type = LIBUSBD_RECORD_SETUP;
+    entry.iface_num = iface_num;
+    entry.ep = LIBUSBD_RECORD_EP_CONTROL;
+    entry.direction = (pInfo->bmRequestType & LIBUSBD_DEV2HOST_DIR) ? USB_EP_DIR_IN : USB_EP_DIR_OUT;
+    entry.status = (status > 0 && !data) ? 0 : status;
+
+    pthread_mutex_lock(&pRecord->mutex);
+    libusbd_record_write_locked(pRecord, &entry, setup, data);
+    pthread_mutex_unlock(&pRecord->mutex);
+}
+
+void libusbd_record_transfer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t direction, const void* data, int32_t status)
+{
+    libusbd_record_t* pRecord = libusbd_record_get(pCtx);
+    if (!pRecord) return;
+
+    libusbd_record_entry_t entry;
+
+    entry.type = LIBUSBD_RECORD_TRANSFER;
+    entry.iface_num = iface_num;
+    entry.ep = ep;
+    entry.direction = direction;
+    entry.status = (status > 0 && !data) ? 0 : status;
+
+    pthread_mutex_lock(&pRecord->mutex);
+    libusbd_record_write_locked(pRecord, &entry, NULL, data);
+    pthread_mutex_unlock(&pRecord->mutex);
+}
+
+int libusbd_record_start(libusbd_ctx_t* pCtx, const char* path)
+{
+    libusbd_record_file_hdr_t hdr;
+    struct timespec ts;
+
+    if (!pCtx || !path) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (!pCtx->pRecord) {
+        libusbd_record_t* pRecord = calloc(1, sizeof(libusbd_record_t));
+        if (!pRecord) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+        pthread_mutex_init(&pRecord->mutex, NULL);
+
+        __atomic_store_n(&pCtx->pRecord, pRecord, __ATOMIC_RELEASE);
+    }
+
+    libusbd_record_t* pRecord = pCtx->pRecord;
+
+    pthread_mutex_lock(&pRecord->mutex);
+
+    if (pRecord->pFile) {
+        pthread_mutex_unlock(&pRecord->mutex);
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    pRecord->pFile = fopen(path, "wb");
+    if (!pRecord->pFile) {
+        LIBUSBD_LOG_ERROR("libusbd: Failed to open capture %s (%s)", path, strerror(errno));
+        pthread_mutex_unlock(&pRecord->mutex);
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    setvbuf(pRecord->pFile, NULL, _IOFBF, LIBUSBD_RECORD_BUFFER_SIZE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.magic = LIBUSBD_RECORD_MAGIC;
+    hdr.version = LIBUSBD_RECORD_VERSION;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    fwrite(&hdr, sizeof(hdr), 1, pRecord->pFile);
+
+    pRecord->start_ns = libusbd_stats_now_ns();
+    pRecord->num_entries = 0;
+    __atomic_store_n(&pRecord->enabled, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&pRecord->mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_record_stop(libusbd_ctx_t* pCtx)
+{
+    int ret = LIBUSBD_SUCCESS;
+
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_record_t* pRecord = pCtx->pRecord;
+    if (!pRecord) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pthread_mutex_lock(&pRecord->mutex);
+    __atomic_store_n(&pRecord->enabled, 0, __ATOMIC_RELAXED);
+
+    if (pRecord->pFile) {
+        if (fclose(pRecord->pFile)) {
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+        }
+        pRecord->pFile = NULL;
+
+        LIBUSBD_LOG_INFO("libusbd: Capture stopped, %llu entries", (unsigned long long)pRecord->num_entries);
+    }
+
+    pthread_mutex_unlock(&pRecord->mutex);
+
+    return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef _LIBUSBD_RECORD_H
+#define _LIBUSBD_RECORD_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Capture file, written by libusbd_record_start and read back by
+// libusbd_loopback_host_replay. Host byte order, captures are meant to be
+// replayed on the same kind of machine they came from.
+//
+//   libusbd_record_file_hdr_t
+//   { libusbd_record_entry_t, [setup packet (8)], payload (status bytes) }*
+
+#define LIBUSBD_RECORD_MAGIC   (0x43524c55) // 'ULRC'
+#define LIBUSBD_RECORD_VERSION (1)
+
+// libusbd_record_entry_t.type
+#define LIBUSBD_RECORD_SETUP    (1)
+#define LIBUSBD_RECORD_TRANSFER (2)
+
+// libusbd_record_entry_t.ep for setups
+#define LIBUSBD_RECORD_EP_CONTROL (0xFF)
+
+typedef struct libusbd_record_file_hdr_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t hdr_size;
+    uint64_t start_realtime_ns; // CLOCK_REALTIME, for reference only
+} libusbd_record_file_hdr_t;
+
+typedef struct __attribute__((packed)) libusbd_record_entry_t
+{
+    uint64_t ts_ns; // since libusbd_record_start
+    uint8_t type;
+    uint8_t iface_num;
+    uint8_t ep;        // index within the interface
+    uint8_t direction; // USB_EP_DIR_*
+    int32_t status;    // payload bytes that follow, or a LIBUSBD_* error
+} libusbd_record_entry_t;
+
+void libusbd_record_free(libusbd_ctx_t* pCtx);
+
+// Both return immediately unless a capture is running. data is the data
+// stage for setups (received for OUT, replied for IN).
+void libusbd_record_setup(libusbd_ctx_t* pCtx, uint8_t iface_num, const libusbd_setup_callback_info_t* pInfo, const void* data, int32_t status);
+void libusbd_record_transfer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t direction, const void* data, int32_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_RECORD_H
@@ -0,0 +1,190 @@
+#ifndef _LIBUSBD_RING_H
+#define _LIBUSBD_RING_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Single-producer single-consumer ring of fixed-size slots, laid out in
+// memory shared between the daemon and one client. Each side only writes its
+// own index. Doorbells are eventfds, and only get rung when the other side
+// has said it's about to sleep, so a busy ring moves data without syscalls.
+//
+// The geometry is fixed rather than stored in the ring, so a client scribbling
+// over its shared memory can't steer the daemon outside of it.
+
+#define LIBUSBD_RING_NUM_SLOTS (16) // power of two
+#define LIBUSBD_RING_SLOT_SIZE (0x1000)
+#define LIBUSBD_RING_SLOT_HDR  (8)
+
+typedef struct libusbd_ring_slot_t
+{
+    uint32_t len;
+    uint32_t pad;
+    uint8_t data[];
+} libusbd_ring_slot_t;
+
+typedef struct libusbd_ring_t
+{
+    // Producer's cache line
+    uint32_t head;
+    uint32_t producer_waiting;
+    uint8_t pad0[56];
+
+    // Consumer's cache line
+    uint32_t tail;
+    uint32_t consumer_waiting;
+    uint8_t pad1[56];
+
+    uint32_t closed;
+    uint8_t pad2[60];
+
+    uint8_t slots[];
+} libusbd_ring_t;
+
+#define LIBUSBD_RING_SIZE (sizeof(libusbd_ring_t) + LIBUSBD_RING_NUM_SLOTS * (LIBUSBD_RING_SLOT_HDR + LIBUSBD_RING_SLOT_SIZE))
+
+static inline void libusbd_ring_init(libusbd_ring_t* pRing)
+{
+    pRing->head = 0;
+    pRing->tail = 0;
+    pRing->producer_waiting = 0;
+    pRing->consumer_waiting = 0;
+    pRing->closed = 0;
+}
+
+static inline libusbd_ring_slot_t* libusbd_ring_slot(libusbd_ring_t* pRing, uint32_t idx)
+{
+    return (libusbd_ring_slot_t*)(pRing->slots + (idx & (LIBUSBD_RING_NUM_SLOTS - 1)) * (LIBUSBD_RING_SLOT_HDR + LIBUSBD_RING_SLOT_SIZE));
+}
+
+static inline void libusbd_ring_kick(int fd)
+{
+    uint64_t val = 1;
+    write(fd, &val, sizeof(val));
+}
+
+// Producer side. The slot returned by push_begin belongs to the producer
+// until push_end publishes it. NULL if the ring is full.
+static inline libusbd_ring_slot_t* libusbd_ring_push_begin(libusbd_ring_t* pRing)
+{
+    uint32_t head = pRing->head;
+    uint32_t tail = __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= LIBUSBD_RING_NUM_SLOTS) {
+        return NULL;
+    }
+
+    return libusbd_ring_slot(pRing, head);
+}
+
+static inline void libusbd_ring_push_end(libusbd_ring_t* pRing, int data_fd)
+{
+    __atomic_store_n(&pRing->head, pRing->head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pRing->consumer_waiting, __ATOMIC_RELAXED)) {
+        libusbd_ring_kick(data_fd);
+    }
+}
+
+// Consumer side, same deal. NULL if the ring is empty.
+static inline libusbd_ring_slot_t* libusbd_ring_pop_begin(libusbd_ring_t* pRing)
+{
+    uint32_t tail = pRing->tail;
+    uint32_t head = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    return libusbd_ring_slot(pRing, tail);
+}
+
+static inline void libusbd_ring_pop_end(libusbd_ring_t* pRing, int space_fd)
+{
+    __atomic_store_n(&pRing->tail, pRing->tail + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pRing->producer_waiting, __ATOMIC_RELAXED)) {
+        libusbd_ring_kick(space_fd);
+    }
+}
+
+static inline int libusbd_ring_has_data(libusbd_ring_t* pRing)
+{
+    return __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE) != pRing->tail;
+}
+
+static inline int libusbd_ring_has_space(libusbd_ring_t* pRing)
+{
+    return pRing->head - __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE) < LIBUSBD_RING_NUM_SLOTS;
+}
+
+// Sleeps on fd until ready(pRing) holds, the ring is closed or aux_fd
+// (-1 for none) becomes readable. timeout_ms of 0 waits forever.
+static inline int libusbd_ring_wait(libusbd_ring_t* pRing, uint32_t* pWaiting, int (*ready)(libusbd_ring_t*), int fd, int aux_fd, uint64_t timeout_ms)
+{
+    while (!ready(pRing))
+    {
+        if (__atomic_load_n(&pRing->closed, __ATOMIC_ACQUIRE)) {
+            return LIBUSBD_CANCELLED;
+        }
+
+        __atomic_store_n(pWaiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Re-check, the other side may have moved before it saw the flag
+        if (ready(pRing)) {
+            __atomic_store_n(pWaiting, 0, __ATOMIC_RELAXED);
+            break;
+        }
+
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {aux_fd, POLLIN, 0}};
+        int ret = poll(fds, aux_fd >= 0 ? 2 : 1, timeout_ms ? (int)timeout_ms : -1);
+        __atomic_store_n(pWaiting, 0, __ATOMIC_RELAXED);
+
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret == 0) {
+            return LIBUSBD_TIMEOUT;
+        }
+        if (ret < 0 || (aux_fd >= 0 && fds[1].revents)) {
+            return LIBUSBD_CANCELLED;
+        }
+
+        uint64_t val;
+        read(fd, &val, sizeof(val));
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static inline int libusbd_ring_wait_data(libusbd_ring_t* pRing, int data_fd, int aux_fd, uint64_t timeout_ms)
+{
+    return libusbd_ring_wait(pRing, &pRing->consumer_waiting, libusbd_ring_has_data, data_fd, aux_fd, timeout_ms);
+}
+
+static inline int libusbd_ring_wait_space(libusbd_ring_t* pRing, int space_fd, int aux_fd, uint64_t timeout_ms)
+{
+    return libusbd_ring_wait(pRing, &pRing->producer_waiting, libusbd_ring_has_space, space_fd, aux_fd, timeout_ms);
+}
+
+static inline void libusbd_ring_close(libusbd_ring_t* pRing, int data_fd, int space_fd)
+{
+    __atomic_store_n(&pRing->closed, 1, __ATOMIC_RELEASE);
+    libusbd_ring_kick(data_fd);
+    libusbd_ring_kick(space_fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_RING_H
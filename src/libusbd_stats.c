@@ -0,0 +1,283 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STAT_ADD(field, val) __atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+#define STAT_SUB(field, val) __atomic_fetch_sub(&(field), (val), __ATOMIC_RELAXED)
+#define STAT_LOAD(field)     __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_STORE(field, val) __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+
+uint64_t libusbd_stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static libusbd_ep_stats_t* libusbd_stats_get(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return NULL;
+    }
+
+    libusbd_ep_stats_t* pStats = pCtx->aInterfaces[iface_num].pEpStats;
+    if (!pStats) {
+        return NULL;
+    }
+
+    return &pStats[ep];
+}
+
+static uint32_t libusbd_stats_bucket(uint64_t latency_ns)
+{
+    uint64_t latency_us = latency_ns / 1000;
+    if (!latency_us) {
+        return 0;
+    }
+
+    uint32_t bucket = 63 - __builtin_clzll(latency_us);
+    if (bucket >= LIBUSBD_STATS_HIST_BUCKETS) {
+        bucket = LIBUSBD_STATS_HIST_BUCKETS - 1;
+    }
+
+    return bucket;
+}
+
+int libusbd_stats_iface_alloc(libusbd_ctx_t* pCtx, uint8_t iface_num)
+{
+    libusbd_iface_t* pIface = &pCtx->aInterfaces[iface_num];
+
+    if (pIface->pEpStats) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pIface->pEpStats = calloc(LIBUSBD_MAX_IFACE_EPS, sizeof(libusbd_ep_stats_t));
+    pIface->pEpWatermarks = calloc(LIBUSBD_MAX_IFACE_EPS, sizeof(libusbd_ep_watermark_t));
+    if (!pIface->pEpStats || !pIface->pEpWatermarks) {
+        free(pIface->pEpStats);
+        free(pIface->pEpWatermarks);
+        pIface->pEpStats = NULL;
+        pIface->pEpWatermarks = NULL;
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+void libusbd_stats_free(libusbd_ctx_t* pCtx)
+{
+    for (int i = 0; i < LIBUSBD_MAX_IFACES; i++)
+    {
+        free(pCtx->aInterfaces[i].pEpStats);
+        free(pCtx->aInterfaces[i].pEpWatermarks);
+        pCtx->aInterfaces[i].pEpStats = NULL;
+        pCtx->aInterfaces[i].pEpWatermarks = NULL;
+    }
+}
+
+// Reports the endpoint's queue depth crossing a watermark, once per crossing
+static void libusbd_stats_watermark(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t depth)
+{
+    libusbd_ep_watermark_t* pMark = &pCtx->aInterfaces[iface_num].pEpWatermarks[ep];
+
+    libusbd_ep_watermark_callback_t cb = __atomic_load_n(&pMark->cb, __ATOMIC_ACQUIRE);
+    if (!cb) return;
+
+    int above;
+    if (depth >= pMark->high) {
+        above = 1;
+    }
+    else if (depth <= pMark->low) {
+        above = 0;
+    }
+    else {
+        return;
+    }
+
+    if (__atomic_exchange_n(&pMark->above, above, __ATOMIC_ACQ_REL) == above) {
+        return;
+    }
+
+    cb(pCtx, iface_num, ep, above, pMark->user);
+}
+
+void libusbd_stats_submit(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    libusbd_ep_stats_t* pStats = libusbd_stats_get(pCtx, iface_num, ep);
+    if (!pStats) return;
+
+    uint32_t depth = STAT_ADD(pStats->queue_depth, 1) + 1;
+    uint32_t max = STAT_LOAD(pStats->max_queue_depth);
+    while (depth > max) {
+        if (__atomic_compare_exchange_n(&pStats->max_queue_depth, &max, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    libusbd_stats_watermark(pCtx, iface_num, ep, depth);
+}
+
+void libusbd_stats_complete(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int ret, uint64_t submit_ns)
+{
+    libusbd_ep_stats_t* pStats = libusbd_stats_get(pCtx, iface_num, ep);
+    if (!pStats) return;
+
+    // A completion with no matching submit isn't counted, the depth stays
+    // at 0 instead of wrapping
+    uint32_t depth = STAT_LOAD(pStats->queue_depth);
+    while (depth) {
+        if (__atomic_compare_exchange_n(&pStats->queue_depth, &depth, depth - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            libusbd_stats_watermark(pCtx, iface_num, ep, depth - 1);
+            break;
+        }
+    }
+
+    if (ret == LIBUSBD_CANCELLED) {
+        STAT_ADD(pStats->cancellations, 1);
+        return;
+    }
+    else if (ret < 0) {
+        STAT_ADD(pStats->errors, 1);
+        return;
+    }
+
+    STAT_ADD(pStats->transfers, 1);
+    STAT_ADD(pStats->bytes, (uint64_t)ret);
+
+    if (submit_ns) {
+        uint64_t now = libusbd_stats_now_ns();
+        uint64_t latency = now > submit_ns ? now - submit_ns : 0;
+        STAT_ADD(pStats->latency_hist[libusbd_stats_bucket(latency)], 1);
+    }
+}
+
+static void libusbd_stats_snapshot(libusbd_ep_stats_t* pOut, libusbd_ep_stats_t* pStats)
+{
+    pOut->bytes = STAT_LOAD(pStats->bytes);
+    pOut->transfers = STAT_LOAD(pStats->transfers);
+    pOut->errors = STAT_LOAD(pStats->errors);
+    pOut->cancellations = STAT_LOAD(pStats->cancellations);
+    pOut->queue_depth = STAT_LOAD(pStats->queue_depth);
+    pOut->max_queue_depth = STAT_LOAD(pStats->max_queue_depth);
+
+    for (int i = 0; i < LIBUSBD_STATS_HIST_BUCKETS; i++)
+    {
+        pOut->latency_hist[i] = STAT_LOAD(pStats->latency_hist[i]);
+    }
+}
+
+int libusbd_ep_get_stats(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, libusbd_ep_stats_t* pOut)
+{
+    if (!pCtx || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_ep_stats_t* pStats = libusbd_stats_get(pCtx, iface_num, ep);
+    if (!pStats) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_stats_snapshot(pOut, pStats);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_ep_set_watermarks(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t low, uint32_t high, libusbd_ep_watermark_callback_t cb, void* user)
+{
+    if (!pCtx || (cb && low >= high)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (!libusbd_stats_get(pCtx, iface_num, ep)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_ep_watermark_t* pMark = &pCtx->aInterfaces[iface_num].pEpWatermarks[ep];
+
+    // Off while the rest changes, completions only read it with cb set
+    __atomic_store_n(&pMark->cb, NULL, __ATOMIC_RELEASE);
+    if (!cb) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pMark->user = user;
+    pMark->low = low;
+    pMark->high = high;
+    __atomic_store_n(&pMark->above, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pMark->cb, cb, __ATOMIC_RELEASE);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_get_stats(libusbd_ctx_t* pCtx, libusbd_ep_stats_t* pOut)
+{
+    if (!pCtx || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    memset(pOut, 0, sizeof(*pOut));
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_ep_stats_t* pStats = pCtx->aInterfaces[i].pEpStats;
+        if (!pStats) continue;
+
+        for (int j = 0; j < LIBUSBD_MAX_IFACE_EPS; j++)
+        {
+            libusbd_ep_stats_t snap;
+            libusbd_stats_snapshot(&snap, &pStats[j]);
+
+            pOut->bytes += snap.bytes;
+            pOut->transfers += snap.transfers;
+            pOut->errors += snap.errors;
+            pOut->cancellations += snap.cancellations;
+            pOut->queue_depth += snap.queue_depth;
+            if (snap.max_queue_depth > pOut->max_queue_depth) {
+                pOut->max_queue_depth = snap.max_queue_depth;
+            }
+
+            for (int k = 0; k < LIBUSBD_STATS_HIST_BUCKETS; k++)
+            {
+                pOut->latency_hist[k] += snap.latency_hist[k];
+            }
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_reset_stats(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_ep_stats_t* pStats = pCtx->aInterfaces[i].pEpStats;
+        if (!pStats) continue;
+
+        for (int j = 0; j < LIBUSBD_MAX_IFACE_EPS; j++)
+        {
+            // queue_depth tracks live state, so it isn't reset
+            STAT_STORE(pStats[j].bytes, 0);
+            STAT_STORE(pStats[j].transfers, 0);
+            STAT_STORE(pStats[j].errors, 0);
+            STAT_STORE(pStats[j].cancellations, 0);
+            STAT_STORE(pStats[j].max_queue_depth, STAT_LOAD(pStats[j].queue_depth));
+
+            for (int k = 0; k < LIBUSBD_STATS_HIST_BUCKETS; k++)
+            {
+                STAT_STORE(pStats[j].latency_hist[k], 0);
+            }
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#ifndef _LIBUSBD_STATS_H
+#define _LIBUSBD_STATS_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t libusbd_stats_now_ns(void);
+
+int libusbd_stats_iface_alloc(libusbd_ctx_t* pCtx, uint8_t iface_num);
+void libusbd_stats_free(libusbd_ctx_t* pCtx);
+
+// Called by the platform layer, these are lock-free and safe to call
+// from completion threads.
+void libusbd_stats_submit(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+void libusbd_stats_complete(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int ret, uint64_t submit_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_STATS_H
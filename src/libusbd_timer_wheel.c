@@ -0,0 +1,183 @@
+#include "libusbd_timer_wheel.h"
+
+#include <string.h>
+
+// How far past `now` the last level reaches
+#define LIBUSBD_TIMER_WHEEL_RANGE (1ull << (LIBUSBD_TIMER_WHEEL_BITS * LIBUSBD_TIMER_WHEEL_LEVELS))
+
+static void libusbd_timer_link(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer)
+{
+    uint64_t expires = pTimer->expires;
+    uint64_t delta;
+    int level = 0;
+
+    // Overdue timers go in the slot being expired right now
+    if (expires < pWheel->now) {
+        expires = pWheel->now;
+    }
+
+    delta = expires - pWheel->now;
+    if (delta >= LIBUSBD_TIMER_WHEEL_RANGE) {
+        expires = pWheel->now + LIBUSBD_TIMER_WHEEL_RANGE - 1;
+        delta = LIBUSBD_TIMER_WHEEL_RANGE - 1;
+    }
+
+    while (level < LIBUSBD_TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (LIBUSBD_TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    uint8_t slot = (expires >> (LIBUSBD_TIMER_WHEEL_BITS * level)) & LIBUSBD_TIMER_WHEEL_MASK;
+    libusbd_timer_t** ppHead = &pWheel->aSlots[level][slot];
+
+    pTimer->level = level + 1;
+    pTimer->slot = slot;
+    pTimer->pPrev = NULL;
+    pTimer->pNext = *ppHead;
+    if (*ppHead) {
+        (*ppHead)->pPrev = pTimer;
+    }
+    *ppHead = pTimer;
+
+    pWheel->aOccupied[level] |= 1ull << slot;
+}
+
+static void libusbd_timer_unlink(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer)
+{
+    int level = pTimer->level - 1;
+    libusbd_timer_t** ppHead = &pWheel->aSlots[level][pTimer->slot];
+
+    if (pTimer->pPrev) {
+        pTimer->pPrev->pNext = pTimer->pNext;
+    }
+    else {
+        *ppHead = pTimer->pNext;
+    }
+
+    if (pTimer->pNext) {
+        pTimer->pNext->pPrev = pTimer->pPrev;
+    }
+
+    if (!*ppHead) {
+        pWheel->aOccupied[level] &= ~(1ull << pTimer->slot);
+    }
+
+    pTimer->pPrev = NULL;
+    pTimer->pNext = NULL;
+    pTimer->level = 0;
+}
+
+// Spreads an upper level slot over the levels below it, now that the wheel
+// has reached the start of its span
+static void libusbd_timer_cascade(libusbd_timer_wheel_t* pWheel, int level, uint8_t slot)
+{
+    libusbd_timer_t* pIter = pWheel->aSlots[level][slot];
+
+    pWheel->aSlots[level][slot] = NULL;
+    pWheel->aOccupied[level] &= ~(1ull << slot);
+
+    while (pIter)
+    {
+        libusbd_timer_t* pNext = pIter->pNext;
+
+        libusbd_timer_link(pWheel, pIter);
+        pIter = pNext;
+    }
+}
+
+void libusbd_timer_wheel_init(libusbd_timer_wheel_t* pWheel, uint64_t now)
+{
+    memset(pWheel, 0, sizeof(*pWheel));
+    pWheel->now = now;
+}
+
+void libusbd_timer_arm(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer, uint64_t expires)
+{
+    if (libusbd_timer_armed(pTimer)) {
+        libusbd_timer_unlink(pWheel, pTimer);
+        pWheel->count--;
+    }
+
+    pTimer->expires = expires;
+    libusbd_timer_link(pWheel, pTimer);
+    pWheel->count++;
+}
+
+void libusbd_timer_disarm(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer)
+{
+    if (!libusbd_timer_armed(pTimer)) return;
+
+    libusbd_timer_unlink(pWheel, pTimer);
+    pWheel->count--;
+}
+
+libusbd_timer_t* libusbd_timer_wheel_expire(libusbd_timer_wheel_t* pWheel, uint64_t now)
+{
+    while (1)
+    {
+        libusbd_timer_t* pTimer = pWheel->aSlots[0][pWheel->now & LIBUSBD_TIMER_WHEEL_MASK];
+        if (pTimer) {
+            libusbd_timer_unlink(pWheel, pTimer);
+            pWheel->count--;
+            return pTimer;
+        }
+
+        if (pWheel->now >= now) {
+            return NULL;
+        }
+
+        if (!pWheel->count) {
+            pWheel->now = now;
+            return NULL;
+        }
+
+        // Nothing left in level 0, skip to where the next cascade happens
+        uint64_t next = pWheel->now + 1;
+        if (!pWheel->aOccupied[0]) {
+            next = (pWheel->now | LIBUSBD_TIMER_WHEEL_MASK) + 1;
+            if (next > now) {
+                pWheel->now = now;
+                return NULL;
+            }
+        }
+        pWheel->now = next;
+
+        for (int level = 1; level < LIBUSBD_TIMER_WHEEL_LEVELS; level++)
+        {
+            if ((next >> (LIBUSBD_TIMER_WHEEL_BITS * (level - 1))) & LIBUSBD_TIMER_WHEEL_MASK) break;
+
+            libusbd_timer_cascade(pWheel, level, (next >> (LIBUSBD_TIMER_WHEEL_BITS * level)) & LIBUSBD_TIMER_WHEEL_MASK);
+        }
+    }
+}
+
+uint64_t libusbd_timer_wheel_next(const libusbd_timer_wheel_t* pWheel)
+{
+    if (!pWheel->count) {
+        return UINT64_MAX;
+    }
+
+    // The next cascade might bring something down from the upper levels
+    uint64_t next = UINT64_MAX;
+    for (int level = 1; level < LIBUSBD_TIMER_WHEEL_LEVELS; level++)
+    {
+        if (pWheel->aOccupied[level]) {
+            next = (pWheel->now | LIBUSBD_TIMER_WHEEL_MASK) + 1;
+            break;
+        }
+    }
+
+    // Level 0 is exact, the first occupied slot from now on around
+    uint64_t occupied = pWheel->aOccupied[0];
+    if (occupied) {
+        int idx = pWheel->now & LIBUSBD_TIMER_WHEEL_MASK;
+        uint64_t rotated = (occupied >> idx) | (idx ? occupied << (LIBUSBD_TIMER_WHEEL_SLOTS - idx) : 0);
+        uint64_t first = pWheel->now + __builtin_ctzll(rotated);
+
+        if (first < next) {
+            next = first;
+        }
+    }
+
+    return next;
+}
@@ -0,0 +1,74 @@
+#ifndef _LIBUSBD_TIMER_WHEEL_H
+#define _LIBUSBD_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hierarchical timer wheel. Level n has 64 slots of 64^n ticks each, so four
+// levels reach 2^24 ticks (4.6 hours at 1ms). Arming and disarming are O(1),
+// and a timer further out than that sits in the last level and is cascaded
+// until it comes into range. Callers do their own locking.
+
+#define LIBUSBD_TIMER_WHEEL_BITS   (6)
+#define LIBUSBD_TIMER_WHEEL_SLOTS  (1 << LIBUSBD_TIMER_WHEEL_BITS)
+#define LIBUSBD_TIMER_WHEEL_MASK   (LIBUSBD_TIMER_WHEEL_SLOTS - 1)
+#define LIBUSBD_TIMER_WHEEL_LEVELS (4)
+
+#define libusbd_timer_container(pTimer, type, member) ((type*)((uint8_t*)(pTimer) - offsetof(type, member)))
+
+typedef struct libusbd_timer_t libusbd_timer_t;
+
+// Embedded in whatever needs timing out, zeroed means disarmed
+typedef struct libusbd_timer_t
+{
+    uint64_t expires;
+    libusbd_timer_t* pPrev;
+    libusbd_timer_t* pNext;
+
+    // Where it's linked, level is 0 while disarmed and 1 + the level otherwise
+    uint8_t level;
+    uint8_t slot;
+} libusbd_timer_t;
+
+typedef struct libusbd_timer_wheel_t
+{
+    // Timers up to and including this tick have expired
+    uint64_t now;
+    uint32_t count;
+
+    // Which slots have anything in them, level 0's is used to skip ahead
+    uint64_t aOccupied[LIBUSBD_TIMER_WHEEL_LEVELS];
+    libusbd_timer_t* aSlots[LIBUSBD_TIMER_WHEEL_LEVELS][LIBUSBD_TIMER_WHEEL_SLOTS];
+} libusbd_timer_wheel_t;
+
+void libusbd_timer_wheel_init(libusbd_timer_wheel_t* pWheel, uint64_t now);
+
+// Expires at tick `expires`, or on the next libusbd_timer_wheel_expire if
+// that's already passed. Rearming an armed timer moves it.
+void libusbd_timer_arm(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer, uint64_t expires);
+void libusbd_timer_disarm(libusbd_timer_wheel_t* pWheel, libusbd_timer_t* pTimer);
+
+static inline int libusbd_timer_armed(const libusbd_timer_t* pTimer)
+{
+    return pTimer->level != 0;
+}
+
+// Moves the wheel up to tick now and returns one timer that has expired, already
+// disarmed, or NULL once there are none left. Call it until it returns NULL,
+// the wheel may be changed in between.
+libusbd_timer_t* libusbd_timer_wheel_expire(libusbd_timer_wheel_t* pWheel, uint64_t now);
+
+// The earliest tick libusbd_timer_wheel_expire can return anything at,
+// UINT64_MAX with nothing armed. Can be early for timers in the upper levels,
+// never late.
+uint64_t libusbd_timer_wheel_next(const libusbd_timer_wheel_t* pWheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_TIMER_WHEEL_H
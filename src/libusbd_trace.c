@@ -0,0 +1,136 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LIBUSBD_TRACE_MAX_EVENTS (1 << 20)
+
+typedef struct libusbd_trace_slot_t
+{
+    // 0 while a writer owns the slot, otherwise (seq + 1) of the event in it
+    uint64_t stamp;
+    libusbd_trace_event_t event;
+} libusbd_trace_slot_t;
+
+typedef struct libusbd_trace_ring_t
+{
+    uint64_t head;
+    uint32_t mask;
+    int enabled;
+    libusbd_trace_slot_t aSlots[];
+} libusbd_trace_ring_t;
+
+void libusbd_trace_record(libusbd_ctx_t* pCtx, uint8_t type, uint8_t iface_num, uint8_t ep, uint32_t arg0, uint32_t arg1)
+{
+    libusbd_trace_ring_t* pRing = __atomic_load_n(&pCtx->pTraceRing, __ATOMIC_ACQUIRE);
+    if (!pRing || !__atomic_load_n(&pRing->enabled, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uint64_t seq = __atomic_fetch_add(&pRing->head, 1, __ATOMIC_RELAXED);
+    libusbd_trace_slot_t* pSlot = &pRing->aSlots[seq & pRing->mask];
+
+    // Seqlock-style: readers skip the slot until the stamp matches again
+    __atomic_store_n(&pSlot->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    pSlot->event.timestamp_ns = libusbd_stats_now_ns();
+    pSlot->event.seq = seq;
+    pSlot->event.type = type;
+    pSlot->event.iface_num = iface_num;
+    pSlot->event.ep = ep;
+    pSlot->event.arg0 = arg0;
+    pSlot->event.arg1 = arg1;
+
+    __atomic_store_n(&pSlot->stamp, seq + 1, __ATOMIC_RELEASE);
+}
+
+void libusbd_trace_free(libusbd_ctx_t* pCtx)
+{
+    free(pCtx->pTraceRing);
+    pCtx->pTraceRing = NULL;
+}
+
+int libusbd_trace_enable(libusbd_ctx_t* pCtx, uint32_t num_events)
+{
+    if (!pCtx || !num_events || num_events > LIBUSBD_TRACE_MAX_EVENTS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The ring is never resized or freed while the context is alive, so
+    // completion threads can hold on to it without any locking.
+    if (pCtx->pTraceRing) {
+        __atomic_store_n(&pCtx->pTraceRing->enabled, 1, __ATOMIC_RELAXED);
+        return LIBUSBD_SUCCESS;
+    }
+
+    uint32_t size = 1;
+    while (size < num_events) {
+        size <<= 1;
+    }
+
+    libusbd_trace_ring_t* pRing = calloc(1, sizeof(libusbd_trace_ring_t) + size * sizeof(libusbd_trace_slot_t));
+    if (!pRing) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pRing->mask = size - 1;
+    pRing->enabled = 1;
+
+    __atomic_store_n(&pCtx->pTraceRing, pRing, __ATOMIC_RELEASE);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_trace_disable(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->pTraceRing) {
+        __atomic_store_n(&pCtx->pTraceRing->enabled, 0, __ATOMIC_RELAXED);
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_trace_dump(libusbd_ctx_t* pCtx, libusbd_trace_event_t* pOut, uint32_t max_events)
+{
+    if (!pCtx || (!pOut && max_events)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_trace_ring_t* pRing = __atomic_load_n(&pCtx->pTraceRing, __ATOMIC_ACQUIRE);
+    if (!pRing) {
+        return 0;
+    }
+
+    uint64_t head = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+    uint64_t count = head < (uint64_t)pRing->mask + 1 ? head : (uint64_t)pRing->mask + 1;
+    if (count > max_events) {
+        count = max_events;
+    }
+
+    // Oldest first; entries overwritten or mid-write during the copy are dropped
+    uint32_t copied = 0;
+    for (uint64_t seq = head - count; seq < head; seq++)
+    {
+        libusbd_trace_slot_t* pSlot = &pRing->aSlots[seq & pRing->mask];
+
+        if (__atomic_load_n(&pSlot->stamp, __ATOMIC_ACQUIRE) != seq + 1) continue;
+
+        memcpy(&pOut[copied], &pSlot->event, sizeof(libusbd_trace_event_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pSlot->stamp, __ATOMIC_RELAXED) != seq + 1) continue;
+
+        copied++;
+    }
+
+    return copied;
+}
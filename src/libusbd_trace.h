@@ -0,0 +1,42 @@
+#ifndef _LIBUSBD_TRACE_H
+#define _LIBUSBD_TRACE_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Static tracepoints, built with `make USDT=1` when <sys/sdt.h> is
+// available. Without it these compile out entirely. Probes live under the
+// `libusbd` provider, ie `bpftrace -e 'usdt:./libusbd.so:libusbd:complete { ... }'`
+#if defined(LIBUSBD_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LIBUSBD_PROBE(name, a, b, c, d) DTRACE_PROBE4(libusbd, name, a, b, c, d)
+#endif
+#endif
+
+#ifndef LIBUSBD_PROBE
+#define LIBUSBD_PROBE(name, a, b, c, d) do {} while (0)
+#endif
+
+// Fires the USDT probe and records into the context's trace ring, if enabled.
+#define LIBUSBD_TRACE(pCtx, name, type, iface_num, ep, arg0, arg1) do { \
+    LIBUSBD_PROBE(name, (iface_num), (ep), (arg0), (arg1)); \
+    libusbd_trace_record((pCtx), (type), (iface_num), (ep), (uint32_t)(arg0), (uint32_t)(arg1)); \
+} while (0)
+
+void libusbd_trace_free(libusbd_ctx_t* pCtx);
+
+// Lock-free, safe to call from any thread. Returns immediately if the
+// ring isn't enabled.
+void libusbd_trace_record(libusbd_ctx_t* pCtx, uint8_t type, uint8_t iface_num, uint8_t ep, uint32_t arg0, uint32_t arg1);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_TRACE_H
@@ -0,0 +1,586 @@
+#include "libusbd.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_backend.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
+#include "libusbd_transfer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Transfers with a timeout, on a wheel of 1ms ticks. Expired by a thread of
+// its own, or by the backend's completion loop if it has set
+// xfer_timer_polled.
+typedef struct libusbd_xfer_timer_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+
+    libusbd_timer_wheel_t wheel;
+} libusbd_xfer_timer_t;
+
+// Completed transfers without a callback, waiting for
+// `libusbd_poll_completions`. Linked through the transfers themselves, so
+// it never fills up.
+typedef struct libusbd_xfer_cq_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    libusbd_xfer_t* pHead;
+    libusbd_xfer_t* pTail;
+} libusbd_xfer_cq_t;
+
+static uint64_t libusbd_xfer_timer_now(void)
+{
+    return libusbd_stats_now_ns() / 1000000;
+}
+
+// Accounts for a finished transfer and hands it back to its owner
+static void libusbd_xfer_finish(libusbd_xfer_t* pXfer, int ret)
+{
+    libusbd_transfer_t* pTransfer = &pXfer->pub;
+    libusbd_ctx_t* pCtx = pTransfer->pCtx;
+    uint8_t iface_num = pTransfer->iface_num;
+    uint64_t ep = pTransfer->ep;
+
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, ret >= 0 ? pXfer->submit_ns : 0);
+
+    if (pCtx->pRecord) {
+        uint8_t direction = (pCtx->aInterfaces[iface_num].aEpAddress[ep] & 0x80) ? USB_EP_DIR_IN : USB_EP_DIR_OUT;
+        libusbd_record_transfer(pCtx, iface_num, ep, direction, pTransfer->buffer, ret);
+    }
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_complete(pCtx, iface_num, ep, pTransfer->buffer, ret);
+    }
+
+    pTransfer->status = ret < 0 ? ret : LIBUSBD_SUCCESS;
+    pTransfer->actual_length = ret < 0 ? 0 : ret;
+
+    // Stays in flight until it's been polled, submit made sure the queue exists
+    if (!pTransfer->callback) {
+        libusbd_xfer_cq_t* pCq = pCtx->pXferCq;
+
+        pXfer->complete_ns = libusbd_stats_now_ns();
+
+        pthread_mutex_lock(&pCq->mutex);
+        pXfer->pCqNext = NULL;
+        if (pCq->pTail) {
+            pCq->pTail->pCqNext = pXfer;
+        }
+        else {
+            pCq->pHead = pXfer;
+        }
+        pCq->pTail = pXfer;
+        pthread_cond_signal(&pCq->cond);
+        pthread_mutex_unlock(&pCq->mutex);
+        return;
+    }
+
+    // The callback may resubmit or free it
+    __atomic_store_n(&pXfer->in_flight, 0, __ATOMIC_RELEASE);
+
+    pTransfer->callback(pTransfer);
+}
+
+// Cancels every transfer that's past its deadline, dropping the mutex around
+// each cancel.
+//
+// Must be called with the timer's mutex held
+static void libusbd_xfer_timer_expire_locked(libusbd_ctx_t* pCtx, libusbd_xfer_timer_t* pTimer)
+{
+    libusbd_timer_t* pIter;
+
+    while ((pIter = libusbd_timer_wheel_expire(&pTimer->wheel, libusbd_xfer_timer_now())))
+    {
+        libusbd_xfer_t* pExpired = libusbd_timer_container(pIter, libusbd_xfer_t, timer);
+
+        pExpired->timer_busy = 1;
+        pExpired->cancel_status = LIBUSBD_TIMEOUT;
+        pthread_mutex_unlock(&pTimer->mutex);
+
+        pCtx->pOps->xfer_cancel(pCtx, pExpired);
+
+        pthread_mutex_lock(&pTimer->mutex);
+        pExpired->timer_busy = 0;
+        if (pExpired->complete_pending) {
+            pExpired->complete_pending = 0;
+            pthread_mutex_unlock(&pTimer->mutex);
+
+            libusbd_xfer_finish(pExpired, pExpired->pending_ret);
+
+            pthread_mutex_lock(&pTimer->mutex);
+        }
+    }
+}
+
+static void* libusbd_xfer_timer_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = pCtx->pXferTimer;
+
+    pthread_mutex_lock(&pTimer->mutex);
+    while (pTimer->running)
+    {
+        libusbd_xfer_timer_expire_locked(pCtx, pTimer);
+
+        uint64_t next = libusbd_timer_wheel_next(&pTimer->wheel);
+        uint64_t now = libusbd_xfer_timer_now();
+
+        if (next == UINT64_MAX) {
+            pthread_cond_wait(&pTimer->cond, &pTimer->mutex);
+        }
+        else if (next > now) {
+            // Ticks are monotonic, the wait isn't
+            struct timespec ts;
+            uint64_t wait_ms = next - now;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += wait_ms / 1000;
+            ts.tv_nsec += (wait_ms % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&pTimer->cond, &pTimer->mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&pTimer->mutex);
+
+    return NULL;
+}
+
+static libusbd_xfer_timer_t* libusbd_xfer_timer_get(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = __atomic_load_n(&pCtx->pXferTimer, __ATOMIC_ACQUIRE);
+    if (pTimer) {
+        return pTimer;
+    }
+
+    pTimer = calloc(1, sizeof(libusbd_xfer_timer_t));
+    if (!pTimer) {
+        return NULL;
+    }
+
+    pthread_cond_init(&pTimer->cond, NULL);
+    pthread_mutex_init(&pTimer->mutex, NULL);
+    libusbd_timer_wheel_init(&pTimer->wheel, libusbd_xfer_timer_now());
+
+    // Someone else got there first
+    libusbd_xfer_timer_t* pExpected = NULL;
+    if (!__atomic_compare_exchange_n(&pCtx->pXferTimer, &pExpected, pTimer, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_cond_destroy(&pTimer->cond);
+        pthread_mutex_destroy(&pTimer->mutex);
+        free(pTimer);
+        return pExpected;
+    }
+
+    // The backend's completion loop takes care of it
+    if (pCtx->xfer_timer_polled) {
+        return pTimer;
+    }
+
+    pthread_mutex_lock(&pTimer->mutex);
+    pTimer->running = 1;
+    if (pthread_create(&pTimer->thread, NULL, (void* (*)(void*))&libusbd_xfer_timer_thread, pCtx)) {
+        LIBUSBD_LOG_ERROR("libusbd: Failed to start the transfer timeout thread");
+        pTimer->running = 0;
+    }
+    pthread_mutex_unlock(&pTimer->mutex);
+
+    return pTimer;
+}
+
+void libusbd_xfer_timer_stop(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = pCtx->pXferTimer;
+    if (!pTimer) return;
+
+    pthread_mutex_lock(&pTimer->mutex);
+    int running = pTimer->running;
+    pTimer->running = 0;
+    pthread_cond_signal(&pTimer->cond);
+    pthread_mutex_unlock(&pTimer->mutex);
+
+    if (running) {
+        pthread_join(pTimer->thread, NULL);
+    }
+}
+
+void libusbd_xfer_timer_free(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = pCtx->pXferTimer;
+    if (!pTimer) return;
+
+    pthread_cond_destroy(&pTimer->cond);
+    pthread_mutex_destroy(&pTimer->mutex);
+    free(pTimer);
+    pCtx->pXferTimer = NULL;
+}
+
+void libusbd_xfer_timer_poll(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = __atomic_load_n(&pCtx->pXferTimer, __ATOMIC_ACQUIRE);
+
+    // Called on every pass of the loop, keep the idle case off the mutex.
+    // Anything armed while this looks isn't due yet.
+    if (!pTimer || !__atomic_load_n(&pTimer->wheel.count, __ATOMIC_RELAXED)) return;
+
+    pthread_mutex_lock(&pTimer->mutex);
+    libusbd_xfer_timer_expire_locked(pCtx, pTimer);
+    pthread_mutex_unlock(&pTimer->mutex);
+}
+
+uint64_t libusbd_xfer_timer_next(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_timer_t* pTimer = __atomic_load_n(&pCtx->pXferTimer, __ATOMIC_ACQUIRE);
+
+    if (!pTimer || !__atomic_load_n(&pTimer->wheel.count, __ATOMIC_RELAXED)) return UINT64_MAX;
+
+    pthread_mutex_lock(&pTimer->mutex);
+    uint64_t next = libusbd_timer_wheel_next(&pTimer->wheel);
+    pthread_mutex_unlock(&pTimer->mutex);
+
+    return next;
+}
+
+static libusbd_xfer_cq_t* libusbd_xfer_cq_get(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_cq_t* pCq = __atomic_load_n(&pCtx->pXferCq, __ATOMIC_ACQUIRE);
+    if (pCq) {
+        return pCq;
+    }
+
+    pCq = calloc(1, sizeof(libusbd_xfer_cq_t));
+    if (!pCq) {
+        return NULL;
+    }
+
+    pthread_cond_init(&pCq->cond, NULL);
+    pthread_mutex_init(&pCq->mutex, NULL);
+
+    libusbd_xfer_cq_t* pExpected = NULL;
+    if (!__atomic_compare_exchange_n(&pCtx->pXferCq, &pExpected, pCq, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_cond_destroy(&pCq->cond);
+        pthread_mutex_destroy(&pCq->mutex);
+        free(pCq);
+        return pExpected;
+    }
+
+    return pCq;
+}
+
+void libusbd_xfer_cq_free(libusbd_ctx_t* pCtx)
+{
+    libusbd_xfer_cq_t* pCq = pCtx->pXferCq;
+    if (!pCq) return;
+
+    pthread_cond_destroy(&pCq->cond);
+    pthread_mutex_destroy(&pCq->mutex);
+    free(pCq);
+    pCtx->pXferCq = NULL;
+}
+
+void libusbd_xfer_complete(libusbd_xfer_t* pXfer, int ret)
+{
+    libusbd_ctx_t* pCtx = pXfer->pub.pCtx;
+
+    if (ret == LIBUSBD_CANCELLED) {
+        ret = pXfer->cancel_status;
+    }
+
+    if (pXfer->deadline_ns) {
+        libusbd_xfer_timer_t* pTimer = pCtx->pXferTimer;
+
+        pthread_mutex_lock(&pTimer->mutex);
+        if (pXfer->timer_busy) {
+            pXfer->pending_ret = ret;
+            pXfer->complete_pending = 1;
+            pthread_mutex_unlock(&pTimer->mutex);
+            return;
+        }
+
+        libusbd_timer_disarm(&pTimer->wheel, &pXfer->timer);
+        pthread_mutex_unlock(&pTimer->mutex);
+    }
+
+    libusbd_xfer_finish(pXfer, ret);
+}
+
+int libusbd_transfer_alloc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t buffer_size, libusbd_transfer_t** pOut)
+{
+    if (!pCtx || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES || ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_t* pXfer = calloc(1, sizeof(libusbd_xfer_t));
+    if (!pXfer) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pXfer->pub.pCtx = pCtx;
+    pXfer->pub.iface_num = iface_num;
+    pXfer->pub.ep = ep;
+    pXfer->pub.buffer_size = buffer_size;
+    pXfer->pub.length = buffer_size;
+
+    // The backend picks where the buffer lives
+    int ret = pCtx->pOps->xfer_alloc(pCtx, pXfer);
+    if (ret < 0) {
+        free(pXfer);
+        return ret;
+    }
+
+    *pOut = &pXfer->pub;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// What submit and resubmit share, the latter going to the backend's
+// xfer_resubmit instead
+static int libusbd_xfer_start(libusbd_xfer_t* pXfer, uint32_t length, int prepared)
+{
+    libusbd_transfer_t* pTransfer = &pXfer->pub;
+    libusbd_ctx_t* pCtx = pTransfer->pCtx;
+    uint8_t iface_num = pTransfer->iface_num;
+    uint64_t ep = pTransfer->ep;
+    libusbd_xfer_timer_t* pTimer = NULL;
+
+    if (length > pTransfer->buffer_size) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pTransfer->timeout_ms && !(pTimer = libusbd_xfer_timer_get(pCtx))) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    if (!pTransfer->callback && !libusbd_xfer_cq_get(pCtx)) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    if (__atomic_exchange_n(&pXfer->in_flight, 1, __ATOMIC_ACQ_REL)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pTransfer->length = length;
+    pTransfer->status = LIBUSBD_SUCCESS;
+    pTransfer->actual_length = 0;
+    pXfer->cancel_status = LIBUSBD_CANCELLED;
+    pXfer->deadline_ns = 0;
+
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, pTransfer->length, 0);
+    libusbd_stats_submit(pCtx, iface_num, ep);
+    pXfer->submit_ns = libusbd_stats_now_ns();
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_ep_submit(pCtx, iface_num, ep, pTransfer->length);
+    }
+
+    // Armed first, it can complete before xfer_submit even returns
+    if (pTimer) {
+        pthread_mutex_lock(&pTimer->mutex);
+        pXfer->deadline_ns = pXfer->submit_ns + pTransfer->timeout_ms * 1000000ull;
+        // Rounded up, never early
+        libusbd_timer_arm(&pTimer->wheel, &pXfer->timer, (pXfer->deadline_ns + 999999) / 1000000);
+        pthread_cond_signal(&pTimer->cond);
+        pthread_mutex_unlock(&pTimer->mutex);
+    }
+
+    int ret = prepared ? pCtx->pOps->xfer_resubmit(pCtx, pXfer) : pCtx->pOps->xfer_submit(pCtx, pXfer);
+    if (ret < 0) {
+        if (pTimer) {
+            // The timer may have it, wait for it to let go
+            pthread_mutex_lock(&pTimer->mutex);
+            while (pXfer->timer_busy)
+            {
+                pthread_mutex_unlock(&pTimer->mutex);
+                sched_yield();
+                pthread_mutex_lock(&pTimer->mutex);
+            }
+            libusbd_timer_disarm(&pTimer->wheel, &pXfer->timer);
+            pXfer->complete_pending = 0;
+            pthread_mutex_unlock(&pTimer->mutex);
+        }
+
+        LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+        libusbd_stats_complete(pCtx, iface_num, ep, ret, 0);
+        __atomic_store_n(&pXfer->in_flight, 0, __ATOMIC_RELEASE);
+        return ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_transfer_submit(libusbd_transfer_t* pTransfer)
+{
+    if (!pTransfer || !pTransfer->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_xfer_start((libusbd_xfer_t*)pTransfer, pTransfer->length, 0);
+}
+
+int libusbd_transfer_prepare(libusbd_transfer_t* pTransfer)
+{
+    if (!pTransfer || !pTransfer->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_t* pXfer = (libusbd_xfer_t*)pTransfer;
+    libusbd_ctx_t* pCtx = pTransfer->pCtx;
+
+    if (__atomic_load_n(&pXfer->in_flight, __ATOMIC_ACQUIRE)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = pCtx->pOps->xfer_prepare(pCtx, pXfer);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pXfer->prepared = 1;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_transfer_resubmit(libusbd_transfer_t* pTransfer, uint32_t length)
+{
+    if (!pTransfer || !pTransfer->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_t* pXfer = (libusbd_xfer_t*)pTransfer;
+
+    if (!pXfer->prepared) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_xfer_start(pXfer, length, 1);
+}
+
+int libusbd_transfer_cancel(libusbd_transfer_t* pTransfer)
+{
+    if (!pTransfer || !pTransfer->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_t* pXfer = (libusbd_xfer_t*)pTransfer;
+    libusbd_ctx_t* pCtx = pTransfer->pCtx;
+
+    if (!__atomic_load_n(&pXfer->in_flight, __ATOMIC_ACQUIRE)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, pTransfer->iface_num, pTransfer->ep, 0, 0);
+
+    return pCtx->pOps->xfer_cancel(pCtx, pXfer);
+}
+
+int libusbd_transfer_free(libusbd_transfer_t* pTransfer)
+{
+    if (!pTransfer || !pTransfer->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_t* pXfer = (libusbd_xfer_t*)pTransfer;
+    libusbd_ctx_t* pCtx = pTransfer->pCtx;
+
+    if (__atomic_load_n(&pXfer->in_flight, __ATOMIC_ACQUIRE)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pCtx->pOps->xfer_free(pCtx, pXfer);
+
+    memset(pXfer, 0, sizeof(*pXfer));
+    free(pXfer);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_poll_completions(libusbd_ctx_t* pCtx, libusbd_completion_t* pEvents, uint32_t max, uint64_t timeout_ms)
+{
+    if (!pCtx || !pEvents || !max) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_xfer_cq_t* pCq = libusbd_xfer_cq_get(pCtx);
+    if (!pCq) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    struct timespec ts;
+    if (timeout_ms && timeout_ms != LIBUSBD_WAIT_FOREVER) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&pCq->mutex);
+    while (!pCq->pHead && timeout_ms)
+    {
+        if (timeout_ms == LIBUSBD_WAIT_FOREVER) {
+            pthread_cond_wait(&pCq->cond, &pCq->mutex);
+        }
+        else if (pthread_cond_timedwait(&pCq->cond, &pCq->mutex, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    // Taken off in one go, the copying happens outside the lock
+    libusbd_xfer_t* pIter = pCq->pHead;
+    libusbd_xfer_t* pLast = NULL;
+    uint32_t count = 0;
+    for (libusbd_xfer_t* pWalk = pIter; pWalk && count < max; pWalk = pWalk->pCqNext)
+    {
+        pLast = pWalk;
+        count++;
+    }
+    if (pLast) {
+        pCq->pHead = pLast->pCqNext;
+        if (!pCq->pHead) {
+            pCq->pTail = NULL;
+        }
+        pLast->pCqNext = NULL;
+    }
+    pthread_mutex_unlock(&pCq->mutex);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        libusbd_xfer_t* pNext = pIter->pCqNext;
+        libusbd_transfer_t* pTransfer = &pIter->pub;
+        libusbd_completion_t* pEvent = &pEvents[i];
+
+        pEvent->transfer = pTransfer;
+        pEvent->iface_num = pTransfer->iface_num;
+        pEvent->ep = pTransfer->ep;
+        pEvent->user_data = pTransfer->user_data;
+        pEvent->status = pTransfer->status;
+        pEvent->actual_length = pTransfer->actual_length;
+        pEvent->timestamp_ns = pIter->complete_ns;
+
+        // Handed back, it can be resubmitted or freed from here on
+        pIter->pCqNext = NULL;
+        __atomic_store_n(&pIter->in_flight, 0, __ATOMIC_RELEASE);
+
+        pIter = pNext;
+    }
+
+    return count;
+}
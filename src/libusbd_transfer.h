@@ -0,0 +1,75 @@
+#ifndef _LIBUSBD_TRANSFER_H
+#define _LIBUSBD_TRANSFER_H
+
+#include <stdint.h>
+
+#include "libusbd.h"
+#include "libusbd_timer_wheel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct libusbd_xfer_t libusbd_xfer_t;
+
+// What `libusbd_transfer_alloc` hands out, the public part first
+typedef struct libusbd_xfer_t
+{
+    libusbd_transfer_t pub;
+
+    // The backend's, set up by its xfer_alloc and torn down by xfer_free
+    void* pPlat;
+
+    // Set by `libusbd_transfer_prepare`, after which the backend's xfer_resubmit
+    // can skip straight to submitting
+    int prepared;
+
+    // From submit until just before the callback runs, or until
+    // `libusbd_poll_completions` hands it out
+    int in_flight;
+    uint64_t submit_ns;
+    uint64_t complete_ns;
+
+    // Completion queue link, protected by the queue's mutex
+    libusbd_xfer_t* pCqNext;
+
+    // What a cancelled completion is reported as, LIBUSBD_TIMEOUT when the
+    // timer is the one that cancelled it
+    int cancel_status;
+
+    // Timeout state, protected by the timer's mutex. While timer_busy the
+    // timer is cancelling it, and a completion that races with that is left
+    // for the timer to report.
+    uint64_t deadline_ns;
+    libusbd_timer_t timer;
+    int timer_busy;
+    int complete_pending;
+    int pending_ret;
+} libusbd_xfer_t;
+
+// The timeout thread calls into the backend, so it's stopped before the
+// backend is freed. The rest goes after, a backend may still be polling it.
+void libusbd_xfer_timer_stop(libusbd_ctx_t* pCtx);
+void libusbd_xfer_timer_free(libusbd_ctx_t* pCtx);
+
+// Expires transfer timeouts that are due. For backends whose completion loop
+// wakes up often enough on its own, which set xfer_timer_polled in the context
+// so no timeout thread gets started. Must be called without backend locks held.
+void libusbd_xfer_timer_poll(libusbd_ctx_t* pCtx);
+// The tick (ms, on libusbd_stats_now_ns) the next libusbd_xfer_timer_poll has
+// anything to do at, UINT64_MAX if nothing's armed. For polling loops to
+// sleep until then. Their xfer_submit/resubmit have to wake them for a
+// transfer with a deadline_ns, it may be due before they would have woken up.
+uint64_t libusbd_xfer_timer_next(libusbd_ctx_t* pCtx);
+void libusbd_xfer_cq_free(libusbd_ctx_t* pCtx);
+
+// Called by the platform layer when a submitted transfer is done, ret being
+// the bytes transferred or an error. Runs the callback, so it must be called
+// without any backend locks held.
+void libusbd_xfer_complete(libusbd_xfer_t* pXfer, int ret);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBUSBD_TRANSFER_H
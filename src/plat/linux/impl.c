@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include "impl.h"
 
 #include "impl_priv.h"
+#include "libusbd_backend.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,10 +15,26 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/eventfd.h>
+#include <sys/mount.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <limits.h>
 
 #include <linux/usb/functionfs.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <linux/udmabuf.h>
 
 #include "libusbd_priv.h"
+#include "libusbd_arena.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_pool.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
+#include "libusbd_transfer.h"
+#include "libusbd_handoff.h"
 
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -60,19 +78,19 @@ static uint32_t stupid_random_u32() {
     return rng_prev*1664525U + 1013904223U; // assuming complement-2 integers and non-signaling overflow
 }
 
-static int msleep(long msec)
+static int _usleep(long usec)
 {
     struct timespec ts;
     int res;
 
-    if (msec < 0)
+    if (usec < 0)
     {
         errno = EINVAL;
         return -1;
     }
 
-    ts.tv_sec = msec / 1000;
-    ts.tv_nsec = (msec % 1000) * 1000000;
+    ts.tv_sec = usec / 1000;
+    ts.tv_nsec = (usec % 1000) * 1000;
 
     do {
         res = nanosleep(&ts, &ts);
@@ -83,58 +101,65 @@ static int msleep(long msec)
     return res;
 }
 
-static int _usleep(long usec)
+// Writes configfs attributes relative to the gadget directory, skipping any
+// that already hold the requested value. Numbers are compared by value since
+// configfs reads them back in its own format (`0x1d6b\n`, `0x00\n`, ...), and
+// a trailing newline on the value is ignored for the comparison. Entries with
+// a NULL value are left alone. configfs has no batched write, every attribute
+// is its own open/pwrite/close.
+static int libusbd_linux_configfs_write(libusbd_linux_ctx_t* pImplCtx, const libusbd_linux_attr_t* pAttrs, int num)
 {
-    struct timespec ts;
-    int res;
+    int failed = 0;
 
-    if (usec < 0)
+    for (int i = 0; i < num; i++)
     {
-        errno = EINVAL;
-        return -1;
-    }
+        const libusbd_linux_attr_t* pAttr = &pAttrs[i];
+        char cur[256];
 
-    ts.tv_sec = usec / 1000;
-    ts.tv_nsec = (usec % 1000) * 1000;
+        if (!pAttr->value) continue;
 
-    do {
-        res = nanosleep(&ts, &ts);
-    } while (res && errno == EINTR);
+        int fd = openat(pImplCtx->gadget_fd, pAttr->name, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Failed to open `%s` (%s)", pAttr->name, strerror(errno));
+            failed++;
+            continue;
+        }
 
-    //pthread_yield();
+        ssize_t len = pread(fd, cur, sizeof(cur) - 1, 0);
+        if (len >= 0) {
+            cur[len] = 0;
+            if (len && cur[len - 1] == '\n') {
+                cur[len - 1] = 0;
+            }
 
-    return res;
-}
+            char val[256];
+            snprintf(val, sizeof(val), "%s", pAttr->value);
+            size_t val_len = strlen(val);
+            if (val_len && val[val_len - 1] == '\n') {
+                val[val_len - 1] = 0;
+            }
 
-static void write_str_to_file(const char* fpath, const char* val)
-{
-    FILE* f = fopen(fpath, "wb+");
-    if (f)
-    {
-        fputs(val, f);
-        fflush(f);
-        fclose(f);
-    }
-    else
-    {
-        printf("Failed to open `%s`!\n", fpath);
-    }
-}
+            char* pCurEnd;
+            char* pValEnd;
+            unsigned long cur_num = strtoul(cur, &pCurEnd, 0);
+            unsigned long val_num = strtoul(val, &pValEnd, 0);
 
-static void write_hex16_to_file(const char* fpath, uint16_t val)
-{
-    char tmp[8];
-    snprintf(tmp, sizeof(tmp), "0x%x", val);
-    write_str_to_file(fpath, tmp);
-}
+            if (!strcmp(cur, val)
+                || (*cur && *val && !*pCurEnd && !*pValEnd && cur_num == val_num)) {
+                close(fd);
+                continue;
+            }
+        }
 
-static void write_decimal_to_file(const char* fpath, uint16_t val)
-{
-    char tmp[32];
-    snprintf(tmp, sizeof(tmp), "%i", val);
-    write_str_to_file(fpath, tmp);
-}
+        if (pwrite(fd, pAttr->value, strlen(pAttr->value), 0) < 0) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Failed to write `%s` (%s)", pAttr->name, strerror(errno));
+            failed++;
+        }
+        close(fd);
+    }
 
+    return failed ? LIBUSBD_NONDESCRIPT_ERROR : LIBUSBD_SUCCESS;
+}
 
 #if 0
 
@@ -197,22 +222,113 @@ kern_return_t IOUSBDeviceInterface_SetClassCommandCallbacks(libusbd_linux_ctx_t*
 }
 #endif
 
+// Class/vendor requests to an interface with a callback. OUT data stages
+// are read first, which also acks them, so those can't be stalled after the
+// fact. Reading from ep0 during an IN request stalls it.
+static void libusbd_linux_class_request(libusbd_ctx_t* pCtx, uint8_t iface_num, const uint8_t* setup, libusbd_setup_callback_info_t* pSetupInfo)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = pImplCtx->apInterfaces[iface_num];
+    libusbd_setup_callback_info_t* pInfo = &pIface->setup_callback_info;
+    int is_in = pSetupInfo->bmRequestType & LIBUSBD_DEV2HOST_DIR;
+    int ret;
+
+    *pInfo = *pSetupInfo;
+    pInfo->out_len = 0;
+    pInfo->out_data = pIface->setup_buffer.data;
+
+    if (pInfo->wLength > pIface->setup_buffer.size) {
+        ret = LIBUSBD_STALLED;
+    }
+    else if (!is_in && pInfo->wLength) {
+        ret = read(pImplCtx->ep0_fd, pIface->setup_buffer.data, pInfo->wLength);
+        if (ret < 0) {
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+        }
+        else if (pIface->setup_callback(pInfo) >= 0) {
+            ret = pInfo->wLength;
+        }
+    }
+    else if (pIface->setup_callback(pInfo) < 0) {
+        ret = LIBUSBD_STALLED;
+    }
+    else if (is_in) {
+        uint32_t len = pInfo->out_len > pInfo->wLength ? pInfo->wLength : pInfo->out_len;
+        ret = write(pImplCtx->ep0_fd, pInfo->out_data, len);
+        if (ret < 0) {
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+        }
+    }
+    else {
+        ret = read(pImplCtx->ep0_fd, pIface->setup_buffer.data, 0);
+        ret = ret < 0 ? LIBUSBD_NONDESCRIPT_ERROR : 0;
+    }
+
+    if (ret == LIBUSBD_STALLED) {
+        if (is_in) {
+            read(pImplCtx->ep0_fd, pIface->setup_buffer.data, 0);
+        }
+        else {
+            write(pImplCtx->ep0_fd, pIface->setup_buffer.data, 0);
+        }
+    }
+
+    const uint8_t* pData = ret > 0 ? (is_in ? pInfo->out_data : pIface->setup_buffer.data) : NULL;
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, pData, ret);
+    }
+    libusbd_record_setup(pCtx, iface_num, pSetupInfo, pData, ret);
+}
+
 static void libusbd_linux_handle_setup(libusbd_ctx_t* pCtx, struct usb_ctrlrequest* pSetup)
 {
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    printf("Setup: %x %x\n", pSetup->bRequestType, pSetup->bRequest);
+    LIBUSBD_TRACE(pCtx, setup, LIBUSBD_TRACE_SETUP, 0xFF, 0,
+                  (uint32_t)pSetup->bRequestType << 24 | pSetup->bRequest << 16 | pSetup->wValue,
+                  (uint32_t)pSetup->wIndex << 16 | pSetup->wLength);
+
+    LIBUSBD_LOG_DEBUG("libusbd linux: Setup: %x %x", pSetup->bRequestType, pSetup->bRequest);
+
+    // usb_ctrlrequest is the raw packet, wValue etc are little endian
+    const uint8_t* setup = (const uint8_t*)pSetup;
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_SUBMIT, setup, NULL, 0);
+    }
+
+    // For libusbd_record_setup. FunctionFS answers the standard requests itself.
+    libusbd_setup_callback_info_t info = {0};
+    info.bmRequestType = pSetup->bRequestType;
+    info.bRequest = pSetup->bRequest;
+    info.wValue = le16toh(pSetup->wValue);
+    info.wIndex = le16toh(pSetup->wIndex);
+    info.wLength = le16toh(pSetup->wLength);
+    uint8_t iface_num = ((pSetup->bRequestType & 0x1F) == 1) ? (info.wIndex & 0xFF) : 0;
+
+    // Without a callback these fall through to the blanket ACKs below
+    uint8_t type = pSetup->bRequestType & 0x60;
+    if ((pSetup->bRequestType & 0x1F) == 1 && (type == 0x20 || type == 0x40)
+        && iface_num < LIBUSBD_MAX_IFACES && pCtx->aInterfaces[iface_num].finalized
+        && pImplCtx->apInterfaces[iface_num]->setup_callback) {
+        libusbd_linux_class_request(pCtx, iface_num, setup, &info);
+        return;
+    }
 
     if (pSetup->bRequestType == LIBUSBD_DEV2HOST_INTERFACE)
     {
         if (pSetup->bRequest == LIBUSBD_GET_DESCRIPTOR)
         {
-            if (pSetup->wIndex >= LIBUSBD_MAX_IFACES) return;
-
-            libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[pSetup->wIndex];
-            if (!pCtx->aInterfaces[pSetup->wIndex].finalized) {
+            // Not allocated yet if it isn't finalized
+            if (pSetup->wIndex >= LIBUSBD_MAX_IFACES || !pCtx->aInterfaces[pSetup->wIndex].finalized) {
+                // Reading from ep0 during an IN request stalls it
+                read(pImplCtx->ep0_fd, pImplCtx->setup_buffer.data, 0);
+                if (pCtx->pPcap) {
+                    libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, NULL, LIBUSBD_STALLED);
+                }
+                libusbd_record_setup(pCtx, iface_num, &info, NULL, LIBUSBD_STALLED);
                 return;
             }
+            libusbd_linux_iface_t* pIface = pImplCtx->apInterfaces[pSetup->wIndex];
 
             libusbd_linux_descdata_t* pIter = pIface->pNonStandardDescs;
             while (pIter)
@@ -226,9 +342,10 @@ static void libusbd_linux_handle_setup(libusbd_ctx_t* pCtx, struct usb_ctrlreque
                     memcpy(pIface->setup_buffer.data, pIter->data, pIter->size);
 
                     int ret = write(pImplCtx->ep0_fd, pIface->setup_buffer.data, len_out);
-                    if (ret < 0) {
-                        return;
+                    if (pCtx->pPcap) {
+                        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, pIface->setup_buffer.data, ret < 0 ? LIBUSBD_NONDESCRIPT_ERROR : ret);
                     }
+                    libusbd_record_setup(pCtx, iface_num, &info, pIface->setup_buffer.data, ret < 0 ? LIBUSBD_NONDESCRIPT_ERROR : ret);
                     return;
                 }
                 
@@ -249,890 +366,2294 @@ static void libusbd_linux_handle_setup(libusbd_ctx_t* pCtx, struct usb_ctrlreque
         else
             read(pImplCtx->ep0_fd, pImplCtx->setup_buffer.data, 0);
     }
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, NULL, 0);
+    }
+    libusbd_record_setup(pCtx, iface_num, &info, NULL, 0);
 }
 
-static void* libusbd_linux_ep0_thread(libusbd_ctx_t* pCtx)
+static int libusbd_linux_is_disconnect_err(int res)
 {
-    printf("libusbd linux: Start ep0\n");
+    // FunctionFS kills queued requests with these when the host resets,
+    // reconfigures or the UDC goes away.
+    return res == -ESHUTDOWN || res == -ECONNRESET || res == -ECONNABORTED || res == -ENODEV;
+}
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    pImplCtx->ep0_running = 1;
+// Maps an AIO result, bytes or -errno, for sync transfers and transfer objects
+static int libusbd_linux_sync_ret(int res)
+{
+    if (res >= 0) {
+        return res;
+    }
 
-    // Start loop
-    while (pImplCtx->ep0_running)
+    switch (res)
     {
-        int ret = read(pImplCtx->ep0_fd, pImplCtx->setup_buffer.data, pImplCtx->setup_buffer.size);
-        if (ret < 0) {
-            //pthread_yield();
-            continue;
-        }
-
-        static const char *const names[] = {
-            [FUNCTIONFS_BIND] = "BIND",
-            [FUNCTIONFS_UNBIND] = "UNBIND",
-            [FUNCTIONFS_ENABLE] = "ENABLE",
-            [FUNCTIONFS_DISABLE] = "DISABLE",
-            [FUNCTIONFS_SETUP] = "SETUP",
-            [FUNCTIONFS_SUSPEND] = "SUSPEND",
-            [FUNCTIONFS_RESUME] = "RESUME",
-        };
-        
-        const struct usb_functionfs_event *event = pImplCtx->setup_buffer.data;
-        for (size_t n = ret / sizeof *event; n; --n, ++event) {
-            switch (event->type) {
-                case FUNCTIONFS_BIND:
-                case FUNCTIONFS_UNBIND:
-                case FUNCTIONFS_SUSPEND:
-                case FUNCTIONFS_RESUME:
-                case FUNCTIONFS_ENABLE:
-                case FUNCTIONFS_DISABLE:
-                    printf("Event %s\n", names[event->type]);
-                    break;
-                case FUNCTIONFS_SETUP:
-                    break;
-                default:
-                    printf("Event %03u (unknown)\n", event->type);
-                    break;
-            }
-
-            switch (event->type) {
-                case FUNCTIONFS_BIND:
-                case FUNCTIONFS_UNBIND:
-                case FUNCTIONFS_SUSPEND:
-                case FUNCTIONFS_RESUME:
-                    break;
-                case FUNCTIONFS_ENABLE:
-                    msleep(10);
-                    pImplCtx->has_enumerated = 1;
-                    break;
-                case FUNCTIONFS_DISABLE:
-                    pImplCtx->has_enumerated = 0;
-                    msleep(10);
-                    break;
-                case FUNCTIONFS_SETUP:
-                    libusbd_linux_handle_setup(pCtx, &event->u.setup);
-                    break;
-
-                default:
-                    break;
-            }
-        }
-        //pthread_yield();
+        case -ETIMEDOUT:
+            return LIBUSBD_TIMEOUT;
+        case -ECANCELED:
+        case -ECONNRESET:
+            return LIBUSBD_CANCELLED;
+        case -ESHUTDOWN:
+            // The host disabled the function under us
+            return LIBUSBD_NOT_ENUMERATED;
+        case -EBUSY:
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        default:
+            return LIBUSBD_NONDESCRIPT_ERROR;
     }
-
-    printf("libusbd linux: Stopped ep0\n");
-
-    //Not reached, CFRunLoopRun doesn't return in this case.
-    return NULL;
 }
 
-static void* libusbd_linux_async_thread(libusbd_ctx_t* pCtx)
+// Returns the submission timestamp to hand back to libusbd_linux_ep_completed
+static uint64_t libusbd_linux_ep_submitted(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
 {
-    printf("libusbd linux: Start async\n");
-
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    pImplCtx->async_running = 1;
-
-    // Start loop
-    while (pImplCtx->async_running)
-    {
-        struct io_event e[1];
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, len, 0);
+    libusbd_stats_submit(pCtx, iface_num, ep);
 
-        pthread_mutex_lock(&pImplCtx->io_mutex);
-	    int ret = io_getevents(pImplCtx->io_ctx, 0, 1, e, NULL);
-        pthread_mutex_unlock(&pImplCtx->io_mutex);
+    return libusbd_stats_now_ns();
+}
 
-	    /* if we got event */
-	    for (int idx = 0; idx < ret; ++idx) {
-	    
-	        // Close all the endpoints
-            uint8_t epNum = 1;
-            for (int i = 0; i < pCtx->bNumInterfaces; i++)
-            {
-                libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-                libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
-
-                for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-                {
-                    if (e[idx].obj->aio_fildes == pIfaceIter->aEndpoints[j].fd) {
-                        if ((int)e[idx].res >= 0) {
-			                pIfaceIter->aEndpoints[j].last_transferred = e[idx].res;
-			                //printf("no error? %d\n", e[idx].res);
-			            }
-			            else {
-			                pIfaceIter->aEndpoints[j].last_transferred = 0;
-			                //printf("error? %d\n", e[idx].res);
-			            }
-                        pIfaceIter->aEndpoints[j].ep_async_done = 1;
-                        pIfaceIter->aEndpoints[j].request_in_flight = 0;
-		            }
-                    
-                }
-            }
-	    }
-        //pthread_yield();
-    }
+static void libusbd_linux_ep_completed(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int ret, uint64_t submit_ns)
+{
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, submit_ns);
+}
 
-    printf("libusbd linux: Stopped async\n");
+// NULL if the interface hasn't been allocated
+static libusbd_linux_iface_t* libusbd_linux_iface(libusbd_linux_ctx_t* pImplCtx, uint8_t iface_num)
+{
+    if (iface_num >= LIBUSBD_MAX_IFACES) return NULL;
 
-    //Not reached, CFRunLoopRun doesn't return in this case.
-    return NULL;
+    return pImplCtx->apInterfaces[iface_num];
 }
 
-int libusbd_linux_launch_ep0_thread(libusbd_ctx_t* pCtx)
+// NULL if the endpoint hasn't been added
+static libusbd_linux_ep_t* libusbd_linux_ep(libusbd_linux_ctx_t* pImplCtx, uint8_t iface_num, uint64_t ep)
 {
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    if (!pIface || ep >= LIBUSBD_MAX_IFACE_EPS) return NULL;
 
-    if (pCtx->pLinuxCtx->ep0_running != 0)
-        return 0;
-
-    // Create the thread using POSIX routines.
-    pthread_attr_t  attr;
-    pthread_t       posixThreadID;
-    int             returnVal;
+    return pIface->apEndpoints[ep];
+}
 
-    returnVal = pthread_attr_init(&attr);
-    if (returnVal != 0)
-        return returnVal;
+// Queues a transfer straight from the endpoint's dma-buf. Returns a sync_file
+// that signals when the UDC is done with it, or -errno.
+static int libusbd_linux_dmabuf_submit(libusbd_linux_ep_t* pEp, uint32_t len)
+{
+    struct usb_ffs_dmabuf_transfer_req req;
+    struct dma_buf_export_sync_file fence;
+    struct dma_buf_sync sync;
 
-    returnVal = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (returnVal != 0)
-        return returnVal;
+    // CPU writes have to land before the UDC reads, and stale cache lines
+    // can't be written back over what it receives
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+    ioctl(pEp->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
 
-    int     threadError = pthread_create(&posixThreadID, &attr, &libusbd_linux_ep0_thread, pCtx);
+    memset(&req, 0, sizeof(req));
+    req.fd = pEp->dmabuf_fd;
+    req.length = len;
+    if (ioctl(pEp->fd, FUNCTIONFS_DMABUF_TRANSFER, &req) < 0) {
+        return -errno;
+    }
 
-    returnVal = pthread_attr_destroy(&attr);
-    if (returnVal != 0)
-        return returnVal;
+    // WRITE gets every fence on the buffer, FunctionFS adds a read or a
+    // write one depending on the endpoint's direction
+    memset(&fence, 0, sizeof(fence));
+    fence.flags = DMA_BUF_SYNC_WRITE;
+    fence.fd = -1;
+    if (ioctl(pEp->dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &fence) < 0) {
+        int err = errno;
 
-    if (threadError != 0)
-        return threadError;
+        // Nothing to wait on, take the transfer back
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_DETACH, &pEp->dmabuf_fd);
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_ATTACH, &pEp->dmabuf_fd);
+        return -err;
+    }
 
-    return 0;
+    return fence.fd;
 }
 
-void libusbd_linux_stop_ep0_thread(libusbd_ctx_t* pCtx)
+// Result of a dma-buf transfer whose fence has signalled, in the same form
+// as an AIO res. Fences don't carry a length, so it's the requested one.
+static int libusbd_linux_dmabuf_finish(libusbd_linux_ep_t* pEp, int fence_fd, uint32_t len)
 {
-    if (pCtx->pLinuxCtx->ep0_running != 0) {
-        pCtx->pLinuxCtx->ep0_running = 0;
+    struct sync_file_info info;
+    struct dma_buf_sync sync;
+    int res = len;
+
+    memset(&info, 0, sizeof(info));
+    if (ioctl(fence_fd, SYNC_IOC_FILE_INFO, &info) < 0) {
+        res = -errno;
+    }
+    else if (info.status < 0) {
+        res = info.status;
     }
+    close(fence_fd);
+
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+    ioctl(pEp->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    return res;
 }
 
-int libusbd_linux_launch_async_thread(libusbd_ctx_t* pCtx)
+// Page-backed dma-buf from udmabuf, mapped through the memfd behind it.
+// Without /dev/udmabuf it's just the memfd mapping and *pFdOut is -1.
+static int libusbd_linux_dmabuf_alloc(uint64_t size, int* pFdOut, void** pDataOut)
 {
+    struct udmabuf_create create;
 
-    if (pCtx->pLinuxCtx->async_running != 0)
-        return 0;
+    int memfd = memfd_create("libusbd-ep", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
 
-    // Create the thread using POSIX routines.
-    pthread_attr_t  attr;
-    pthread_t       posixThreadID;
-    int             returnVal;
+    // udmabuf won't take a memfd that could shrink under it
+    if (ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        close(memfd);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
 
-    returnVal = pthread_attr_init(&attr);
-    if (returnVal != 0)
-        return returnVal;
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (data == MAP_FAILED) {
+        close(memfd);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
 
-    returnVal = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    if (returnVal != 0)
-        return returnVal;
+    *pFdOut = -1;
+    int dev_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev_fd >= 0) {
+        memset(&create, 0, sizeof(create));
+        create.memfd = memfd;
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.offset = 0;
+        create.size = size;
 
-    int     threadError = pthread_create(&posixThreadID, &attr, &libusbd_linux_async_thread, pCtx);
+        *pFdOut = ioctl(dev_fd, UDMABUF_CREATE, &create);
+        close(dev_fd);
+    }
 
-    returnVal = pthread_attr_destroy(&attr);
-    if (returnVal != 0)
-        return returnVal;
+    // The mapping and the udmabuf both hold the pages
+    close(memfd);
 
-    if (threadError != 0)
-        return threadError;
+    *pDataOut = data;
 
-    return 0;
+    return LIBUSBD_SUCCESS;
 }
 
-void libusbd_linux_stop_async_thread(libusbd_ctx_t* pCtx)
+// Nothing may be in flight on the endpoint
+static void libusbd_linux_ep_release_dmabuf(libusbd_linux_ep_t* pEp)
 {
-    if (pCtx->pLinuxCtx->async_running != 0) {
-        pCtx->pLinuxCtx->async_running = 0;
+    if (!pEp->has_dmabuf) return;
+
+    if (pEp->dmabuf_attached) {
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_DETACH, &pEp->dmabuf_fd);
+    }
+    if (pEp->dmabuf_fd >= 0) {
+        close(pEp->dmabuf_fd);
     }
+    if (pEp->buffer.data) {
+        munmap(pEp->buffer.data, pEp->buffer.size);
+    }
+
+    pEp->buffer.data = NULL;
+    pEp->buffer.size = 0;
+    pEp->has_dmabuf = 0;
+    pEp->dmabuf_attached = 0;
+    pEp->dmabuf_fd = -1;
 }
 
-int libusbd_impl_init(libusbd_ctx_t* pCtx)
+// Must be called with io_mutex held
+static int libusbd_linux_ep_buffer_alloc_locked(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp)
 {
-    if (!pCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    // A dma-buf that couldn't be mapped is still attached
+    if (pEp->buffer.data || pEp->has_dmabuf) {
+        return LIBUSBD_SUCCESS;
     }
 
-    pCtx->pLinuxCtx = malloc(sizeof(libusbd_linux_ctx_t));
-    memset(pCtx->pLinuxCtx, 0, sizeof(*pCtx->pLinuxCtx));
+    pEp->buffer.data = libusbd_pool_alloc(pCtx, 0x1000);
+    if (!pEp->buffer.data) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pEp->buffer.size = 0x1000;
+
+    return LIBUSBD_SUCCESS;
+}
 
+// Gives the buffer back to the pool under LIBUSBD_RETAIN_WHILE_ENABLED, if the
+// host has disabled the device and nothing needs it anymore.
+//
+// Must be called with io_mutex held
+static void libusbd_linux_ep_buffer_release_locked(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp)
+{
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    
-    mkdir("/sys/kernel/config/usb_gadget/libusbd", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/functions", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/functions/ffs.usb0", 0777);
-    //mkdir("/sys/kernel/config/usb_gadget/libusbd/functions/ncm.usb0", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/strings", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/strings/0x0409", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/configs", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/configs/c.1", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/strings", 0777);
-    mkdir("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/strings/0x0409", 0777);
-    
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/idVendor", 0x1d6b);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/idProduct", 0x0052);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bcdDevice", 0x0100);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bcdUSB", 0x0200);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceClass", 0x0);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceSubClass", 0x0);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceProtocol", 0x0);
-    write_decimal_to_file("/sys/kernel/config/usb_gadget/libusbd/bMaxPacketSize0", 64);
-    write_decimal_to_file("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/MaxPower", 50);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/bmAttributes", 0xc0);
-    
-    write_str_to_file("/sys/kernel/config/usb_gadget/libusbd/UDC", "");
-    
-    symlink("/sys/kernel/config/usb_gadget/libusbd/functions/ffs.usb0", "/sys/kernel/config/usb_gadget/libusbd/configs/c.1/ffs.usb0");
-    
-    mkdir("/dev/ffs-usb0", 0777);
-    system("mount -t functionfs usb0 /dev/ffs-usb0");
 
-    pImplCtx->write_descs = malloc(0x10000); // TODO check
-    memset(pImplCtx->write_descs, 0, 0x10000);
+    if (pCtx->buffer_retention != LIBUSBD_RETAIN_WHILE_ENABLED || pImplCtx->has_enumerated) return;
 
-    pImplCtx->write_descs_next = pImplCtx->write_descs;
+    // Standing transfers resend from it after the next ENABLE
+    if (!pEp->buffer.data || pEp->has_dmabuf || pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE) return;
 
-    pImplCtx->write_header->header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
-    pImplCtx->write_header->header.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC);
-    //pImplCtx->write_header->header.length = cpu_to_le32(sizeof descriptors);
+    // The UDC or a sync caller is still on it
+    if (pEp->request_in_flight || pEp->sync_in_flight || pEp->buffer_pins) return;
 
-    pImplCtx->write_descs_sz += sizeof(libusbd_linux_writeheader_t);
-    pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-    
-    pImplCtx->ep0_fd = open("/dev/ffs-usb0/ep0", O_RDWR);
-    //fclose(f);
+    libusbd_pool_free(pCtx, pEp->buffer.data);
+    pEp->buffer.data = NULL;
+    pEp->buffer.size = 0;
+}
 
-    pImplCtx->setup_buffer.data = malloc(0x1000);
-    pImplCtx->setup_buffer.size = 0x1000;
-    
-    pthread_mutex_init(&pImplCtx->io_mutex, NULL);
-    
-    memset(&pImplCtx->io_ctx, 0, sizeof(pImplCtx->io_ctx));
-	/* setup aio context to handle up to 2 requests */
-	if (io_setup(2, &pImplCtx->io_ctx) < 0) {
-		perror("unable to setup aio");
-		return 1;
-	}
-    
-    pImplCtx->evfd = eventfd(0, 0);
-	if (pImplCtx->evfd < 0) {
-		printf("unable to open eventfd\n");
-		return LIBUSBD_NONDESCRIPT_ERROR;
-	}
+// Keeps the buffer around for a sync transfer, bringing it back if it was released
+static int libusbd_linux_ep_buffer_pin(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    libusbd_linux_launch_ep0_thread(pCtx);
-    libusbd_linux_launch_async_thread(pCtx);
-#if 0
-    // TODO: A lot more error checking
-    io_iterator_t       iter    = 0;
-    kern_return_t s_ret;
-    IOReturn ret;
-    kern_return_t open_ret;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ret = libusbd_linux_ep_buffer_alloc_locked(pCtx, pEp);
+    if (!ret) {
+        pEp->buffer_pins++;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    // Seed the RNG
-    rng_prev = ((intptr_t)(pImplCtx))>>16;
+    return ret;
+}
 
-    pImplCtx->iface_rand32 = stupid_random_u32();
+static void libusbd_linux_ep_buffer_unpin(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    LaunchRunLoopThread();
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->buffer_pins--;
+    libusbd_linux_ep_buffer_release_locked(pCtx, pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
 
-    
-    //IOUSBDeviceControllerSendCommand(controller, CFSTR("ShowDeviceDebug"), NULL); 
+// Every endpoint buffer that isn't there yet, on ENABLE or when the last
+// interface is finalized under LIBUSBD_RETAIN_ALWAYS
+static void libusbd_linux_buffers_alloc(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    for (int i = 0; i < 5; i++)
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
     {
-        CFMutableDictionaryRef match = IOServiceMatching("gay_bowser_usbgadget");
-        CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        //CFDictionarySetValue(dict, CFSTR("USBDeviceFunction"), CFSTR("MyUSBData"));
-        CFDictionarySetValue(match, CFSTR("IOPropertyMatch"), dict);
-
-        CFRetain(match);
-        ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
-        if (ret != KERN_SUCCESS || iter == 0) {
-            printf("libusbd linux: Error matching gay_bowser_usbgadget (%x)...\n", ret);
-            sleep(1);
-            continue;
-        }
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
 
-        // Get the third port
-        while (1)
+        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
         {
-            pImplCtx->service_usbgadget = IOIteratorNext(iter);
-            if (!pImplCtx->service_usbgadget) break;
-
-            io_string_t path;
-            if (IORegistryEntryGetPath(pImplCtx->service_usbgadget, kIOServicePlane, path) != KERN_SUCCESS) {
-                IOObjectRelease(pImplCtx->service_usbgadget);
-                continue;
+            if (libusbd_linux_ep_buffer_alloc_locked(pCtx, pIfaceIter->apEndpoints[j])) {
+                LIBUSBD_LOG_ERROR("libusbd linux: Failed to allocate a buffer for iface %u ep %u", i, j);
             }
+        }
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
 
-            if (strstr(path, "usb-drd2")) {
-                printf("libusbd linux: Connecting to: '%s'\n", path);
-                break;
-            }
+// On DISABLE. Buffers still in use go once they're done with.
+static void libusbd_linux_buffers_release(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-            IOObjectRelease(pImplCtx->service_usbgadget);
-        } 
+    if (pCtx->buffer_retention != LIBUSBD_RETAIN_WHILE_ENABLED) return;
 
-        CFRelease(match);
-        IOObjectRelease(iter);
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
 
-        if (pImplCtx->service_usbgadget) break;
+        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+        {
+            libusbd_linux_ep_buffer_release_locked(pCtx, pIfaceIter->apEndpoints[j]);
+        }
     }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
 
-    if (!pImplCtx->service_usbgadget) {
-        printf("libusbd linux: Failed to find gay_bowser_usbgadget, aborting...\n");
-        return LIBUSBD_NONDESCRIPT_ERROR;
+// Wakes the async thread, so it picks up a new fence or timeout. Completions
+// wake it on their own through IOCB_FLAG_RESFD.
+static void libusbd_linux_async_kick(libusbd_linux_ctx_t* pImplCtx)
+{
+    uint64_t one = 1;
+    if (write(pImplCtx->evfd, &one, sizeof(one)) < 0) {
+        LIBUSBD_LOG_WARN("libusbd linux: Failed to wake the async thread (%s)", strerror(errno));
     }
+}
 
-    alt_IOUSBDeviceControllerCreateFromService(kCFAllocatorDefault, pImplCtx->service_usbgadget, &pImplCtx->controller);
+// Must be called with io_mutex held
+static int libusbd_linux_ep_submit_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int op, uint32_t len)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = pImplCtx->apInterfaces[iface_num]->apEndpoints[ep];
+    struct iocb* p_fd_iocb = &pEp->fd_iocb;
+    int ret;
 
-    pImplCtx->desc = alt_IOUSBDeviceDescriptionCreate(kCFAllocatorDefault);//alt_IOUSBDeviceDescriptionCreateFromController(kCFAllocatorDefault, controller);
-    //alt_IOUSBDeviceDescriptionSetSerialString(pImplCtx->desc, serial);
+    // Released while the host had the device disabled
+    if ((ret = libusbd_linux_ep_buffer_alloc_locked(pCtx, pEp))) {
+        return ret;
+    }
 
-    alt_IOUSBDeviceDescriptionRemoveAllConfigurations(pImplCtx->desc);
+    pEp->last_op = op;
+    pEp->last_len = len;
+    pEp->last_transferred = 0;
+    pEp->ep_async_done = 0;
+    pEp->rearm_pending = 0;
+    ++pEp->submit_gen;
 
-    pImplCtx->configId = alt_IOUSBDeviceDescriptionAppendConfiguration(pImplCtx->desc, CFSTR("libusbd"), 0xA0, 255);
-    
-    // Setup pkt source
-    CFRunLoopSourceRef run_loop_source;
+    pEp->submit_ns = libusbd_linux_ep_submitted(pCtx, iface_num, ep, len);
 
-    // Create port to listen for kernel notifications on.
-    pImplCtx->notification_port = IONotificationPortCreate(kIOMainPortDefault);
-    if (!pImplCtx->notification_port) {
-        printf("libusbd linux: Error getting notification port.\n");
-        return LIBUSBD_NONDESCRIPT_ERROR;
+    if (pEp->dmabuf_attached) {
+        ret = libusbd_linux_dmabuf_submit(pEp, len);
+        if (ret >= 0) {
+            pEp->fence_fd = ret;
+            libusbd_linux_async_kick(pImplCtx);
+        }
     }
+    else {
+        if (op == LIBUSBD_LINUX_OP_READ) {
+            io_prep_pread(p_fd_iocb, pEp->fd, pEp->buffer.data, len, 0);
+        }
+        else {
+            io_prep_pwrite(p_fd_iocb, pEp->fd, pEp->buffer.data, len, 0);
+        }
 
-    // Get lower level mach port from notification port.
-    pImplCtx->mnotification_port = IONotificationPortGetMachPort(pImplCtx->notification_port);
-    if (!pImplCtx->mnotification_port) {
-        printf("libusbd linux: Error getting mach notification port.\n");
-        return LIBUSBD_NONDESCRIPT_ERROR;
+        /* enable eventfd notification */
+        p_fd_iocb->u.c.flags |= IOCB_FLAG_RESFD;
+        p_fd_iocb->u.c.resfd = pImplCtx->evfd;
+        p_fd_iocb->data = (void*)(uintptr_t)(pEp->submit_gen << 1 | LIBUSBD_LINUX_IOCB_EP);
+
+        /* submit table of requests */
+        ret = io_submit(pImplCtx->io_ctx, 1, &p_fd_iocb);
     }
 
-    // Create a run loop source from our notification port so we can add the port to our run loop.
-    run_loop_source = IONotificationPortGetRunLoopSource(pImplCtx->notification_port);
-    if (run_loop_source == NULL) {
-        printf("libusbd linux: Error getting run loop source.\n");
+    if (ret < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: unable to submit request (%d)", ret);
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, LIBUSBD_NONDESCRIPT_ERROR, 0);
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
-    // Add the notification port and timer to the run loop.
-    CFRunLoopAddSource(_runLoop, run_loop_source, kCFRunLoopDefaultMode);
-#endif
+    pEp->request_in_flight = 1;
+
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_free(libusbd_ctx_t* pCtx)
+// Drops the endpoint's async transfer, if any.
+//
+// Must be called with io_mutex held
+static void libusbd_linux_ep_cancel_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
-    //kern_return_t s_ret;
-
-    if (!pCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = pImplCtx->apInterfaces[iface_num]->apEndpoints[ep];
 
-    libusbd_linux_stop_async_thread(pCtx);
-    libusbd_linux_stop_ep0_thread(pCtx);
-
-#if 0
-    // setDesc
-    /*outputCount = 0;
-    output[0] = some_str;
-    args[0] = some_str; // idk
-    s_ret = IOConnectCallMethod(pIface->port, 2, NULL, 0, args, 1, NULL, NULL, NULL, NULL);
-    printf("setdesc s_ret %x %x (%x %x)\n", s_ret, outputCount, output[0], output[1]);*/
+    if (!pEp->request_in_flight) return;
 
-    for (int j = 0; j < pCtx->bNumInterfaces; j++)
-    {
-        libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[j];
+    LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, iface_num, ep, pEp->submit_gen, 0);
 
-        free(pIface->pName);
-        pIface->pName = NULL;
+    libusbd_timer_disarm(&pImplCtx->ep_timers, &pEp->timeout_timer);
 
-        if (pIface->is_builtin) {
-            continue;
+    if (pEp->dmabuf_attached) {
+        // Detaching dequeues whatever is pending on the dma-buf
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_DETACH, &pEp->dmabuf_fd);
+        if (ioctl(pEp->fd, FUNCTIONFS_DMABUF_ATTACH, &pEp->dmabuf_fd) < 0) {
+            LIBUSBD_LOG_WARN("libusbd linux: Failed to reattach dma-buf (%s), using AIO", strerror(errno));
+            pEp->dmabuf_attached = 0;
         }
 
-        for (int i = 0; i < pIface->bNumEndpoints; i++)
-        {
-            libusbd_linux_ep_t* pEp = &pIface->aEndpoints[i];
-            s_ret = IOUSBDeviceInterface_ReleaseBuffer(pImplCtx, j, &pEp->buffer); // TODO check
-            //printf("release s_ret %x\n", s_ret);
+        close(pEp->fence_fd);
+        pEp->fence_fd = -1;
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, LIBUSBD_CANCELLED, 0);
+    }
+    else {
+        struct io_event e[1];
 
-            IONotificationPortDestroy(pEp->notification_port);
+        // If the cancel doesn't complete synchronously, the async thread
+        // accounts for it when the stale completion shows up.
+        if (!io_cancel(pImplCtx->io_ctx, &pEp->fd_iocb, e)) {
+            libusbd_linux_ep_completed(pCtx, iface_num, ep, LIBUSBD_CANCELLED, 0);
         }
-        IONotificationPortDestroy(pIface->notification_port);
-
-        s_ret = IOUSBDeviceInterface_Close(pImplCtx, j); // TODO check
-        //printf("close s_ret %x\n", s_ret);
-
-        IOServiceClose(pIface->port);
     }
+    pEp->request_in_flight = 0;
+}
 
-    IONotificationPortDestroy(pImplCtx->notification_port);
-#endif
-
-    io_destroy(pImplCtx->io_ctx);
-    pthread_mutex_destroy(&pImplCtx->io_mutex);
+// Resubmits every standing transfer that was killed by the last DISABLE.
+static void libusbd_linux_rearm_standing(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    // Close all the endpoints
-    uint8_t epNum = 1;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
     for (int i = 0; i < pCtx->bNumInterfaces; i++)
     {
-        libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-        libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
 
-        libusbd_linux_descdata_t* pIter = pIfaceIter->pNonStandardDescs;
-        while (pIter)
+        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
         {
-            free(pIter->data);
-            pIter->data = NULL;
-            pIter->size = 0;
+            libusbd_linux_ep_t* pEp = pIfaceIter->apEndpoints[j];
+            if (!pEp->rearm_pending || pEp->request_in_flight) continue;
 
-            libusbd_linux_descdata_t* pIterNext = pIter->pNext;
-            free(pIter);
-
-            pIter = pIterNext;
+            libusbd_linux_ep_submit_locked(pCtx, i, j, pEp->last_op, pEp->last_len);
         }
-        pIfaceIter->pNonStandardDescs = NULL;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
 
-        pIter = pIfaceIter->pStandardDescs;
-        while (pIter)
-        {
-            free(pIter->data);
-            pIter->data = NULL;
-            pIter->size = 0;
+// Accounts for a finished async transfer, res being what AIO or the fence
+// reported and gen the submit_gen it went out under.
+static void libusbd_linux_ep_finish(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int res, uint64_t gen)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = pImplCtx->apInterfaces[iface_num]->apEndpoints[ep];
 
-            libusbd_linux_descdata_t* pIterNext = pIter->pNext;
-            free(pIter);
+    // Completion for a request that was cancelled and replaced
+    if (gen != pEp->submit_gen) {
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, LIBUSBD_CANCELLED, 0);
+        return;
+    }
 
-            pIter = pIterNext;
-        }
-        pIfaceIter->pStandardDescs = NULL;
+    // Only ever armed under io_mutex for the transfer that's in flight
+    if (libusbd_timer_armed(&pEp->timeout_timer)) {
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+        libusbd_timer_disarm(&pImplCtx->ep_timers, &pEp->timeout_timer);
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+    }
 
-        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-        {
-            if (pIfaceIter->aEndpoints[j].fd)
-                close(pIfaceIter->aEndpoints[j].fd);
+    // Standing transfers killed by a disconnect stay queued
+    // and get resubmitted on the next ENABLE.
+    if (pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE && libusbd_linux_is_disconnect_err(res)) {
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, LIBUSBD_CANCELLED, 0);
 
-            if (pIfaceIter->aEndpoints[j].buffer.data)
-                free(pIfaceIter->aEndpoints[j].buffer.data);
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+        pEp->request_in_flight = 0;
+        pEp->rearm_pending = 1;
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-            pIfaceIter->aEndpoints[j].buffer.data = NULL;
-            pIfaceIter->aEndpoints[j].buffer.size = 0;
+        // ENABLE may have already come and gone
+        if (pImplCtx->has_enumerated) {
+            libusbd_linux_rearm_standing(pCtx);
         }
+        return;
     }
 
-    free(pImplCtx->write_descs);
-    pImplCtx->write_descs = NULL;
-
-    free(pImplCtx);
-    pCtx->pLinuxCtx = NULL;
+    if (res >= 0) {
+        pEp->last_transferred = res;
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, res, pEp->submit_ns);
+        //printf("no error? %d\n", e[idx].res);
+    }
+    else {
+        pEp->last_transferred = 0;
+        libusbd_linux_ep_completed(pCtx, iface_num, ep, res == -ECANCELED || res == -ECONNRESET ? LIBUSBD_CANCELLED : LIBUSBD_NONDESCRIPT_ERROR, 0);
+        //printf("error? %d\n", e[idx].res);
+    }
+    pEp->ep_async_done = 1;
+    pEp->request_in_flight = 0;
 
-    return LIBUSBD_SUCCESS;
+    // Kept past the DISABLE while the UDC had it. Data that made it in is
+    // left for the caller until the next one.
+    if (res < 0 && pCtx->buffer_retention == LIBUSBD_RETAIN_WHILE_ENABLED && !pImplCtx->has_enumerated) {
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+        libusbd_linux_ep_buffer_release_locked(pCtx, pEp);
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+    }
 }
 
-int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
+// Must be called with io_mutex held
+static void libusbd_linux_xfer_unlink_locked(libusbd_linux_ctx_t* pImplCtx, libusbd_linux_xfer_t* pLinuxXfer)
 {
-    //IOReturn ret;
-    //kern_return_t s_ret;
-    //io_iterator_t iter = 0;
-    //kern_return_t open_ret;
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    
-    if (pCtx->vid)
-        write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/idVendor", pCtx->vid);
-    
-    if (pCtx->pid)
-        write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/idProduct", pCtx->pid);
-
-    if (pCtx->did)
-        write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bcdDevice", pCtx->did);
-
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bcdUSB", 0x0200);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceClass", pCtx->bClass);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceSubClass", pCtx->bSubclass);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/bDeviceProtocol", pCtx->bProtocol);
-    write_decimal_to_file("/sys/kernel/config/usb_gadget/libusbd/bMaxPacketSize0", 64);
-    write_decimal_to_file("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/MaxPower", 50);
-    write_hex16_to_file("/sys/kernel/config/usb_gadget/libusbd/configs/c.1/bmAttributes", 0xc0);
-    
-    if (pCtx->pManufacturerStr) {
-        write_str_to_file("/sys/kernel/config/usb_gadget/libusbd/strings/0x0409/manufacturer", pCtx->pManufacturerStr);
-    }
-    if (pCtx->pProductStr) {
-        write_str_to_file("/sys/kernel/config/usb_gadget/libusbd/strings/0x0409/product", pCtx->pProductStr);
+    if (pLinuxXfer->pPrev) {
+        pLinuxXfer->pPrev->pNext = pLinuxXfer->pNext;
     }
-    if (pCtx->pSerialStr) {
-        write_str_to_file("/sys/kernel/config/usb_gadget/libusbd/strings/0x0409/serialnumber", pCtx->pSerialStr);
+    else {
+        pImplCtx->pXferHead = pLinuxXfer->pNext;
     }
 
-#if 0
-    if (alt_IOUSBDeviceControllerSetDescription(pImplCtx->controller, pImplCtx->desc)) {
-        return LIBUSBD_NONDESCRIPT_ERROR;
+    if (pLinuxXfer->pNext) {
+        pLinuxXfer->pNext->pPrev = pLinuxXfer->pPrev;
     }
 
+    pLinuxXfer->pPrev = NULL;
+    pLinuxXfer->pNext = NULL;
+    pLinuxXfer->in_flight = 0;
+}
 
-    if (IORegistryEntrySetCFProperty(pImplCtx->service_usbgadget, CFSTR("Poke"), CFSTR("Poke"))) {
-        return LIBUSBD_NONDESCRIPT_ERROR;
+// Asks AIO to drop a transfer object. If that happens right away it's moved
+// to pXferDone for libusbd_linux_xfer_run_done, otherwise the async thread
+// gets its completion.
+//
+// Must be called with io_mutex held
+static void libusbd_linux_xfer_cancel_locked(libusbd_linux_ctx_t* pImplCtx, libusbd_linux_xfer_t* pLinuxXfer)
+{
+    struct io_event e[1];
+
+    if (io_cancel(pImplCtx->io_ctx, &pLinuxXfer->iocb, e)) {
+        return;
     }
 
-    IOObjectRelease(pImplCtx->service_usbgadget);
+    libusbd_linux_xfer_unlink_locked(pImplCtx, pLinuxXfer);
+    pLinuxXfer->pNext = pImplCtx->pXferDone;
+    pImplCtx->pXferDone = pLinuxXfer;
+}
 
-    alt_IOUSBDeviceControllerRelease(pImplCtx->controller);
-    CFAllocatorDeallocate(kCFAllocatorDefault, pImplCtx->controller);
-    pImplCtx->controller = NULL;
+// Reports transfer objects cancelled under io_mutex. Must be called without io_mutex held.
+static void libusbd_linux_xfer_run_done(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    alt_IOUSBDeviceDescriptionRelease(pImplCtx->desc);
-    CFAllocatorDeallocate(kCFAllocatorDefault, pImplCtx->desc);
-    pImplCtx->desc = NULL;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_linux_xfer_t* pIter = pImplCtx->pXferDone;
+    pImplCtx->pXferDone = NULL;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    for (int j = 0; j < pCtx->bNumInterfaces; j++)
+    while (pIter)
     {
-        libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[j];
+        libusbd_linux_xfer_t* pNext = pIter->pNext;
 
-        // Built-ins don't need us to connect, the kernel driver connects to it.
-        if (pIface->is_builtin) {
-            continue;
-        }
+        pIter->pNext = NULL;
+        libusbd_xfer_complete(pIter->pXfer, LIBUSBD_CANCELLED);
 
-        for (int i = 0; i < 10; i++)
-        {
-            CFStringRef name = CFStringCreateWithCString(NULL, pIface->pName, 0);
-            CFMutableDictionaryRef match = IOServiceMatching("IOUSBDeviceInterface");
-            CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-            CFDictionarySetValue(dict, CFSTR("USBDeviceFunction"), name);
-            CFDictionarySetValue(match, CFSTR("IOPropertyMatch"), dict);
+        pIter = pNext;
+    }
+}
 
-            CFRetain(match);
-            ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
-            if (ret != KERN_SUCCESS || iter == 0) {
-                printf("libusbd linux: Error matching IOUSBDeviceInterface (%x)...\n", ret);
-                sleep(1);
-                continue;
-            }
+static void libusbd_linux_xfer_finish(libusbd_ctx_t* pCtx, libusbd_linux_xfer_t* pLinuxXfer, int res)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-            // Get the third port
-            while (1)
-            {
-                pIface->service = IOIteratorNext(iter);
-                if (!pIface->service) break;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_linux_xfer_unlink_locked(pImplCtx, pLinuxXfer);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-                io_string_t path;
-                if (IORegistryEntryGetPath(pIface->service, kIOServicePlane, path) != KERN_SUCCESS) {
-                    IOObjectRelease(pIface->service);
-                    continue;
-                }
+    libusbd_xfer_complete(pLinuxXfer->pXfer, libusbd_linux_sync_ret(res));
+}
 
-                if (strstr(path, "usb-drd2")) {
-                    printf("libusbd linux: Connecting to: '%s'\n", path);
-                    break;
-                }
-                IOObjectRelease(pIface->service);
-            } 
+// Finishes dma-buf transfers whose fences have signalled
+static void libusbd_linux_dmabuf_reap(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-            CFRelease(match);
-            IOObjectRelease(iter);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
 
-            if (pIface->service) break;
-        }
+        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+        {
+            libusbd_linux_ep_t* pEp = pIfaceIter->apEndpoints[j];
+            struct pollfd pfd;
 
-        if (!pIface->service) {
-            printf("libusbd linux: Failed to find IOUSBDeviceInterface, aborting...\n");
-            return LIBUSBD_NONDESCRIPT_ERROR;
-        }
+            if (!pEp->has_dmabuf) continue;
 
-        open_ret = IOServiceOpen(pIface->service, mach_task_self(), 123, &pIface->port); // TODO check
-        //printf("open_ret %x %x\n", open_ret, pIface->port);
-        //IOServiceClose(pIface->service);
-        IOObjectRelease(pIface->service);
+            pthread_mutex_lock(&pImplCtx->io_mutex);
+            if (!pEp->request_in_flight || pEp->fence_fd < 0) {
+                pthread_mutex_unlock(&pImplCtx->io_mutex);
+                continue;
+            }
 
-        
-        // Open
-        s_ret = IOUSBDeviceInterface_Open(pImplCtx, j); // TODO check
-        //printf("open s_ret %x\n", s_ret);
+            pfd.fd = pEp->fence_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) <= 0) {
+                pthread_mutex_unlock(&pImplCtx->io_mutex);
+                continue;
+            }
+
+            int res = libusbd_linux_dmabuf_finish(pEp, pEp->fence_fd, pEp->last_len);
+            uint64_t gen = pEp->submit_gen;
+            pEp->fence_fd = -1;
+            pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+            libusbd_linux_ep_finish(pCtx, i, j, res, gen);
+        }
     }
-#endif
-    return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
+// Must be called with io_mutex held
+static void libusbd_linux_ep_arm_timeout_locked(libusbd_linux_ctx_t* pImplCtx, libusbd_linux_ep_t* pEp, uint64_t timeout_ms)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+    // Rounded up to the next tick, never early
+    libusbd_timer_arm(&pImplCtx->ep_timers, &pEp->timeout_timer, (libusbd_stats_now_ns() + timeout_ms * 1000000ull + 999999) / 1000000);
+    libusbd_linux_async_kick(pImplCtx);
+}
+
+// Cancels async endpoint transfers that ran past their timeout_ms.
+// libusbd_ep_transfer_done reports LIBUSBD_TIMEOUT for them from then on.
+static void libusbd_linux_ep_expire(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_timer_t* pTimer;
+
+    if (!pImplCtx->ep_timers.count) return;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    while ((pTimer = libusbd_timer_wheel_expire(&pImplCtx->ep_timers, libusbd_stats_now_ns() / 1000000)))
+    {
+        libusbd_linux_ep_t* pEp = libusbd_timer_container(pTimer, libusbd_linux_ep_t, timeout_timer);
+
+        LIBUSBD_LOG_DEBUG("libusbd linux: Transfer on iface %u ep %u timed out", pEp->iface_num, pEp->idx);
+        pEp->last_error = LIBUSBD_LINUX_ERR_TIMEOUT;
+        libusbd_linux_ep_cancel_locked(pCtx, pEp->iface_num, pEp->idx);
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
+
+// evfd, then the fence of every dma-buf transfer in flight. Returns how many.
+static int libusbd_linux_async_pollfds(libusbd_ctx_t* pCtx, struct pollfd* pFds)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    int nfds = 0;
+
+    pFds[nfds].fd = pImplCtx->evfd;
+    pFds[nfds].events = POLLIN;
+    pFds[nfds++].revents = 0;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+
+        for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+        {
+            libusbd_linux_ep_t* pEp = pIfaceIter->apEndpoints[j];
+
+            if (!pEp->has_dmabuf || !pEp->request_in_flight || pEp->fence_fd < 0) continue;
+
+            pFds[nfds].fd = pEp->fence_fd;
+            pFds[nfds].events = POLLIN;
+            pFds[nfds++].revents = 0;
+        }
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return nfds;
+}
+
+// Until the earlier of the endpoint and transfer object timeouts, in ms for
+// poll. -1 with neither armed.
+static int libusbd_linux_async_timeout(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    uint64_t next = libusbd_timer_wheel_next(&pImplCtx->ep_timers);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    uint64_t xfer_next = libusbd_xfer_timer_next(pCtx);
+    if (xfer_next < next) {
+        next = xfer_next;
+    }
+
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+
+    uint64_t now = libusbd_stats_now_ns() / 1000000;
+    if (next <= now) {
+        return 0;
+    }
+
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+static void* libusbd_linux_async_thread(libusbd_ctx_t* pCtx)
+{
+    LIBUSBD_LOG_INFO("libusbd linux: Start async");
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    // Start loop
+    while (pImplCtx->async_running)
+    {
+        struct io_event e[LIBUSBD_LINUX_AIO_BATCH];
+        struct pollfd fds[1 + LIBUSBD_MAX_IFACES * LIBUSBD_MAX_IFACE_EPS];
+
+        // Sleeps until a completion, a dma-buf fence or the next timeout,
+        // without io_mutex
+        int nfds = libusbd_linux_async_pollfds(pCtx, fds);
+        if (poll(fds, nfds, libusbd_linux_async_timeout(pCtx)) > 0 && (fds[0].revents & POLLIN)) {
+            uint64_t count;
+            read(pImplCtx->evfd, &count, sizeof(count));
+        }
+
+        int ret;
+        do {
+            struct timespec zero = {0, 0};
+
+            pthread_mutex_lock(&pImplCtx->io_mutex);
+            ret = io_getevents(pImplCtx->io_ctx, 0, LIBUSBD_LINUX_AIO_BATCH, e, &zero);
+            pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+            for (int idx = 0; idx < ret; ++idx) {
+                uintptr_t data = (uintptr_t)e[idx].data;
+
+                // Endpoint transfers use the endpoint's own iocb, anything else
+                // is a transfer object
+                if (data & LIBUSBD_LINUX_IOCB_EP) {
+                    libusbd_linux_ep_t* pEp = (libusbd_linux_ep_t*)((uint8_t*)e[idx].obj - offsetof(libusbd_linux_ep_t, fd_iocb));
+
+                    libusbd_linux_ep_finish(pCtx, pEp->iface_num, pEp->idx, (int)e[idx].res, data >> 1);
+                }
+                else {
+                    libusbd_linux_xfer_finish(pCtx, (libusbd_linux_xfer_t*)e[idx].obj, (int)e[idx].res);
+                }
+            }
+        } while (ret == LIBUSBD_LINUX_AIO_BATCH);
+
+        libusbd_linux_dmabuf_reap(pCtx);
+
+        // After the completions, so nothing that just made it gets timed out
+        libusbd_linux_ep_expire(pCtx);
+        libusbd_xfer_timer_poll(pCtx);
+        //pthread_yield();
+    }
+
+    LIBUSBD_LOG_INFO("libusbd linux: Stopped async");
+
+    //Not reached, CFRunLoopRun doesn't return in this case.
+    return NULL;
+}
+
+static void* libusbd_linux_ep0_thread(libusbd_ctx_t* pCtx)
+{
+    LIBUSBD_LOG_INFO("libusbd linux: Start ep0");
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    // Start loop
+    while (pImplCtx->ep0_running)
+    {
+        // ep0_wake_fd lets libusbd_linux_stop_ep0_thread get us out of a blocking read
+        struct pollfd fds[2] = {
+            {pImplCtx->ep0_fd, POLLIN, 0},
+            {pImplCtx->ep0_wake_fd, POLLIN, 0},
+        };
+        int nready = poll(fds, 2, -1);
+
+        // Reset it, or a thread started later on this context never blocks
+        if (nready > 0 && (fds[1].revents & POLLIN)) {
+            uint64_t val;
+            read(pImplCtx->ep0_wake_fd, &val, sizeof(val));
+        }
+
+        if (nready <= 0 || !pImplCtx->ep0_running || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        int ret = read(pImplCtx->ep0_fd, pImplCtx->setup_buffer.data, pImplCtx->setup_buffer.size);
+        if (ret < 0) {
+            //pthread_yield();
+            continue;
+        }
+
+        static const char *const names[] = {
+            [FUNCTIONFS_BIND] = "BIND",
+            [FUNCTIONFS_UNBIND] = "UNBIND",
+            [FUNCTIONFS_ENABLE] = "ENABLE",
+            [FUNCTIONFS_DISABLE] = "DISABLE",
+            [FUNCTIONFS_SETUP] = "SETUP",
+            [FUNCTIONFS_SUSPEND] = "SUSPEND",
+            [FUNCTIONFS_RESUME] = "RESUME",
+        };
+        
+        const struct usb_functionfs_event *event = pImplCtx->setup_buffer.data;
+        for (size_t n = ret / sizeof *event; n; --n, ++event) {
+            LIBUSBD_TRACE(pCtx, ep0_event, LIBUSBD_TRACE_EP0_EVENT, 0xFF, 0, event->type, 0);
+
+            switch (event->type) {
+                case FUNCTIONFS_BIND:
+                case FUNCTIONFS_UNBIND:
+                case FUNCTIONFS_SUSPEND:
+                case FUNCTIONFS_RESUME:
+                case FUNCTIONFS_ENABLE:
+                case FUNCTIONFS_DISABLE:
+                    LIBUSBD_LOG_DEBUG("libusbd linux: Event %s", names[event->type]);
+                    break;
+                case FUNCTIONFS_SETUP:
+                    break;
+                default:
+                    LIBUSBD_LOG_DEBUG("libusbd linux: Event %03u (unknown)", event->type);
+                    break;
+            }
+
+            switch (event->type) {
+                case FUNCTIONFS_BIND:
+                case FUNCTIONFS_SUSPEND:
+                case FUNCTIONFS_RESUME:
+                    break;
+                case FUNCTIONFS_ENABLE:
+                    // FunctionFS enables the endpoints before queuing this,
+                    // so they can take transfers right away
+                    libusbd_linux_buffers_alloc(pCtx);
+                    pImplCtx->has_enumerated = 1;
+                    libusbd_linux_rearm_standing(pCtx);
+                    break;
+                case FUNCTIONFS_DISABLE:
+                case FUNCTIONFS_UNBIND:
+                    pImplCtx->has_enumerated = 0;
+                    libusbd_linux_buffers_release(pCtx);
+                    break;
+                case FUNCTIONFS_SETUP:
+                    libusbd_linux_handle_setup(pCtx, &event->u.setup);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+        //pthread_yield();
+    }
+
+    LIBUSBD_LOG_INFO("libusbd linux: Stopped ep0");
+
+    //Not reached, CFRunLoopRun doesn't return in this case.
+    return NULL;
+}
+
+int libusbd_linux_launch_ep0_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    if (pImplCtx->ep0_running != 0)
+        return 0;
+
+    // Joinable, so a handoff can be sure nothing reads ep0 after it
+    pImplCtx->ep0_running = 1;
+    int threadError = pthread_create(&pImplCtx->ep0_thread, NULL, (void* (*)(void*))&libusbd_linux_ep0_thread, pCtx);
+    if (threadError != 0) {
+        pImplCtx->ep0_running = 0;
+        return threadError;
+    }
+
+    return 0;
+}
+
+void libusbd_linux_stop_ep0_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    if (pImplCtx->ep0_running != 0) {
+        uint64_t val = 1;
+
+        pImplCtx->ep0_running = 0;
+        write(pImplCtx->ep0_wake_fd, &val, sizeof(val));
+        pthread_join(pImplCtx->ep0_thread, NULL);
+    }
+}
+
+int libusbd_linux_launch_async_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    if (pImplCtx->async_running != 0)
+        return 0;
+
+    // Its loop expires transfer object timeouts too
+    pCtx->xfer_timer_polled = true;
+
+    pImplCtx->async_running = 1;
+    int threadError = pthread_create(&pImplCtx->async_thread, NULL, (void* (*)(void*))&libusbd_linux_async_thread, pCtx);
+    if (threadError != 0) {
+        pImplCtx->async_running = 0;
+        return threadError;
+    }
+
+    return 0;
+}
+
+void libusbd_linux_stop_async_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    if (pImplCtx->async_running != 0) {
+        pImplCtx->async_running = 0;
+        libusbd_linux_async_kick(pImplCtx);
+        pthread_join(pImplCtx->async_thread, NULL);
+    }
+}
+
+int libusbd_linux_init(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pCtx->pLinuxCtx = malloc(sizeof(libusbd_linux_ctx_t));
+    if (!pCtx->pLinuxCtx) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pCtx->pLinuxCtx, 0, sizeof(*pCtx->pLinuxCtx));
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    
+    // Reuse whatever a previous run (or a boot script) left behind, the
+    // attributes get rewritten in config_finalize if they don't match.
+    struct stat st;
+    if (lstat(LIBUSBD_LINUX_GADGET_PATH "/configs/c.1/ffs.usb0", &st)) {
+        mkdir(LIBUSBD_LINUX_GADGET_PATH, 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/functions", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/functions/ffs.usb0", 0777);
+        //mkdir(LIBUSBD_LINUX_GADGET_PATH "/functions/ncm.usb0", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/strings", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/strings/0x0409", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/configs", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/configs/c.1", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/configs/c.1/strings", 0777);
+        mkdir(LIBUSBD_LINUX_GADGET_PATH "/configs/c.1/strings/0x0409", 0777);
+
+        symlink(LIBUSBD_LINUX_GADGET_PATH "/functions/ffs.usb0", LIBUSBD_LINUX_GADGET_PATH "/configs/c.1/ffs.usb0");
+    }
+    else {
+        LIBUSBD_LOG_DEBUG("libusbd linux: Reusing existing gadget");
+    }
+
+    int ret = LIBUSBD_SUCCESS;
+    pImplCtx->ep0_fd = -1;
+    pImplCtx->evfd = -1;
+    pImplCtx->ep0_wake_fd = -1;
+
+    pImplCtx->gadget_fd = open(LIBUSBD_LINUX_GADGET_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pImplCtx->gadget_fd < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Failed to open `%s` (%s)", LIBUSBD_LINUX_GADGET_PATH, strerror(errno));
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
+        goto fail;
+    }
+
+    // Unbind, if something was still bound. configfs never sees an empty
+    // write, it has to be a newline like `echo "" > UDC` sends.
+    libusbd_linux_attr_t unbind = {"UDC", "\n"};
+    libusbd_linux_configfs_write(pImplCtx, &unbind, 1);
+
+    // Only mount if there isn't a functionfs instance there already
+    pImplCtx->ep0_fd = open("/dev/ffs-usb0/ep0", O_RDWR);
+    if (pImplCtx->ep0_fd < 0) {
+        mkdir("/dev/ffs-usb0", 0777);
+        if (mount("usb0", "/dev/ffs-usb0", "functionfs", 0, NULL) && errno != EBUSY) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Failed to mount functionfs (%s)", strerror(errno));
+        }
+        pImplCtx->ep0_fd = open("/dev/ffs-usb0/ep0", O_RDWR);
+    }
+
+    // ep0 is read from before the buffer pool can be configured, so this one
+    // stays on the heap
+    pImplCtx->setup_buffer.data = malloc(0x1000);
+    pImplCtx->setup_buffer.size = 0x1000;
+    if (!pImplCtx->setup_buffer.data) {
+        ret = LIBUSBD_RESOURCE_LIMIT_REACHED;
+        goto fail;
+    }
+    
+    memset(&pImplCtx->io_ctx, 0, sizeof(pImplCtx->io_ctx));
+	/* setup aio context, transfer objects can queue many requests */
+	if (io_setup(LIBUSBD_LINUX_AIO_EVENTS, &pImplCtx->io_ctx) < 0) {
+		LIBUSBD_LOG_ERROR("libusbd linux: unable to setup aio (%s)", strerror(errno));
+		ret = LIBUSBD_NONDESCRIPT_ERROR;
+		goto fail;
+	}
+
+    pImplCtx->evfd = eventfd(0, 0);
+    pImplCtx->ep0_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (pImplCtx->evfd < 0 || pImplCtx->ep0_wake_fd < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: unable to open eventfd");
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
+        goto fail;
+    }
+
+    pthread_mutex_init(&pImplCtx->io_mutex, NULL);
+    libusbd_timer_wheel_init(&pImplCtx->ep_timers, libusbd_stats_now_ns() / 1000000);
+
+    libusbd_linux_launch_ep0_thread(pCtx);
+    libusbd_linux_launch_async_thread(pCtx);
+#if 0
+    // TODO: A lot more error checking
+    io_iterator_t       iter    = 0;
+    kern_return_t s_ret;
+    IOReturn ret;
+    kern_return_t open_ret;
+
+    // Seed the RNG
+    rng_prev = ((intptr_t)(pImplCtx))>>16;
+
+    pImplCtx->iface_rand32 = stupid_random_u32();
+
+    LaunchRunLoopThread();
+
+    
+    //IOUSBDeviceControllerSendCommand(controller, CFSTR("ShowDeviceDebug"), NULL); 
+
+    for (int i = 0; i < 5; i++)
+    {
+        CFMutableDictionaryRef match = IOServiceMatching("gay_bowser_usbgadget");
+        CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        //CFDictionarySetValue(dict, CFSTR("USBDeviceFunction"), CFSTR("MyUSBData"));
+        CFDictionarySetValue(match, CFSTR("IOPropertyMatch"), dict);
+
+        CFRetain(match);
+        ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
+        if (ret != KERN_SUCCESS || iter == 0) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Error matching gay_bowser_usbgadget (%x)...", ret);
+            sleep(1);
+            continue;
+        }
+
+        // Get the third port
+        while (1)
+        {
+            pImplCtx->service_usbgadget = IOIteratorNext(iter);
+            if (!pImplCtx->service_usbgadget) break;
+
+            io_string_t path;
+            if (IORegistryEntryGetPath(pImplCtx->service_usbgadget, kIOServicePlane, path) != KERN_SUCCESS) {
+                IOObjectRelease(pImplCtx->service_usbgadget);
+                continue;
+            }
+
+            if (strstr(path, "usb-drd2")) {
+                LIBUSBD_LOG_INFO("libusbd linux: Connecting to: '%s'", path);
+                break;
+            }
+
+            IOObjectRelease(pImplCtx->service_usbgadget);
+        } 
+
+        CFRelease(match);
+        IOObjectRelease(iter);
+
+        if (pImplCtx->service_usbgadget) break;
+    }
+
+    if (!pImplCtx->service_usbgadget) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Failed to find gay_bowser_usbgadget, aborting...");
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    alt_IOUSBDeviceControllerCreateFromService(kCFAllocatorDefault, pImplCtx->service_usbgadget, &pImplCtx->controller);
+
+    pImplCtx->desc = alt_IOUSBDeviceDescriptionCreate(kCFAllocatorDefault);//alt_IOUSBDeviceDescriptionCreateFromController(kCFAllocatorDefault, controller);
+    //alt_IOUSBDeviceDescriptionSetSerialString(pImplCtx->desc, serial);
+
+    alt_IOUSBDeviceDescriptionRemoveAllConfigurations(pImplCtx->desc);
+
+    pImplCtx->configId = alt_IOUSBDeviceDescriptionAppendConfiguration(pImplCtx->desc, CFSTR("libusbd"), 0xA0, 255);
+    
+    // Setup pkt source
+    CFRunLoopSourceRef run_loop_source;
+
+    // Create port to listen for kernel notifications on.
+    pImplCtx->notification_port = IONotificationPortCreate(kIOMainPortDefault);
+    if (!pImplCtx->notification_port) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Error getting notification port.");
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    // Get lower level mach port from notification port.
+    pImplCtx->mnotification_port = IONotificationPortGetMachPort(pImplCtx->notification_port);
+    if (!pImplCtx->mnotification_port) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Error getting mach notification port.");
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    // Create a run loop source from our notification port so we can add the port to our run loop.
+    run_loop_source = IONotificationPortGetRunLoopSource(pImplCtx->notification_port);
+    if (run_loop_source == NULL) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Error getting run loop source.");
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    // Add the notification port and timer to the run loop.
+    CFRunLoopAddSource(_runLoop, run_loop_source, kCFRunLoopDefaultMode);
+#endif
+    return LIBUSBD_SUCCESS;
+
+fail:
+    // libusbd_init only frees the outer context, so everything here goes too
+    if (pImplCtx->gadget_fd >= 0)
+        close(pImplCtx->gadget_fd);
+    if (pImplCtx->ep0_fd >= 0)
+        close(pImplCtx->ep0_fd);
+    if (pImplCtx->evfd >= 0)
+        close(pImplCtx->evfd);
+    if (pImplCtx->ep0_wake_fd >= 0)
+        close(pImplCtx->ep0_wake_fd);
+    if (pImplCtx->io_ctx)
+        io_destroy(pImplCtx->io_ctx);
+
+    free(pImplCtx->setup_buffer.data);
+    free(pImplCtx);
+    pCtx->pLinuxCtx = NULL;
+
+    return ret;
+}
+
+// Closes and gives back everything the endpoint holds, then the record itself
+static void libusbd_linux_ep_free(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp)
+{
+    if (!pEp) return;
+
+    if (pEp->sync_ctx)
+        io_destroy(pEp->sync_ctx);
+
+    if (pEp->has_dmabuf) {
+        if (pEp->fence_fd >= 0)
+            close(pEp->fence_fd);
+
+        libusbd_linux_ep_release_dmabuf(pEp);
+    }
+
+    if (pEp->fd > 0)
+        close(pEp->fd);
+
+    libusbd_pool_free(pCtx, pEp->buffer.data);
+    free(pEp);
+}
+
+static void libusbd_linux_iface_free(libusbd_ctx_t* pCtx, libusbd_linux_iface_t* pIface)
+{
+    if (!pIface) return;
+
+    for (int j = 0; j < LIBUSBD_MAX_IFACE_EPS; j++)
+    {
+        libusbd_linux_ep_free(pCtx, pIface->apEndpoints[j]);
+    }
+
+    // The descriptor nodes and pName are in the context's arena
+    libusbd_pool_free(pCtx, pIface->setup_buffer.data);
+    free(pIface);
+}
+
+int libusbd_linux_free(libusbd_ctx_t* pCtx)
+{
+    //kern_return_t s_ret;
+
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    libusbd_linux_stop_async_thread(pCtx);
+    libusbd_linux_stop_ep0_thread(pCtx);
+
+#if 0
+    // setDesc
+    /*outputCount = 0;
+    output[0] = some_str;
+    args[0] = some_str; // idk
+    s_ret = IOConnectCallMethod(pIface->port, 2, NULL, 0, args, 1, NULL, NULL, NULL, NULL);
+    printf("setdesc s_ret %x %x (%x %x)\n", s_ret, outputCount, output[0], output[1]);*/
+
+    for (int j = 0; j < pCtx->bNumInterfaces; j++)
+    {
+        libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[j];
+
+        pIface->pName = NULL;
+
+        if (pIface->is_builtin) {
+            continue;
+        }
+
+        for (int i = 0; i < pIface->bNumEndpoints; i++)
+        {
+            libusbd_linux_ep_t* pEp = &pIface->aEndpoints[i];
+            s_ret = IOUSBDeviceInterface_ReleaseBuffer(pImplCtx, j, &pEp->buffer); // TODO check
+            //printf("release s_ret %x\n", s_ret);
+
+            IONotificationPortDestroy(pEp->notification_port);
+        }
+        IONotificationPortDestroy(pIface->notification_port);
+
+        s_ret = IOUSBDeviceInterface_Close(pImplCtx, j); // TODO check
+        //printf("close s_ret %x\n", s_ret);
+
+        IOServiceClose(pIface->port);
+    }
+
+    IONotificationPortDestroy(pImplCtx->notification_port);
+#endif
+
+    io_destroy(pImplCtx->io_ctx);
+    pthread_mutex_destroy(&pImplCtx->io_mutex);
+
+    // Close all the endpoints. A record past bNumInterfaces is one a failed
+    // libusbd_iface_alloc left behind.
+    for (int i = 0; i < LIBUSBD_MAX_IFACES; i++)
+    {
+        libusbd_linux_iface_free(pCtx, pImplCtx->apInterfaces[i]);
+        pImplCtx->apInterfaces[i] = NULL;
+    }
+
+    pImplCtx->write_descs = NULL;
+
+    if (pImplCtx->gadget_fd >= 0)
+        close(pImplCtx->gadget_fd);
+
+    if (pImplCtx->ep0_wake_fd > 0)
+        close(pImplCtx->ep0_wake_fd);
+
+    free(pImplCtx);
+    pCtx->pLinuxCtx = NULL;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_config_finalize(libusbd_ctx_t* pCtx)
+{
+    //IOReturn ret;
+    //kern_return_t s_ret;
+    //io_iterator_t iter = 0;
+    //kern_return_t open_ret;
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    
+    char vid[8], pid[8], did[8], bClass[8], bSubclass[8], bProtocol[8];
+    snprintf(vid, sizeof(vid), "0x%04x", pCtx->vid ? pCtx->vid : 0x1d6b);
+    snprintf(pid, sizeof(pid), "0x%04x", pCtx->pid ? pCtx->pid : 0x0052);
+    snprintf(did, sizeof(did), "0x%04x", pCtx->did ? pCtx->did : 0x0100);
+    snprintf(bClass, sizeof(bClass), "0x%02x", pCtx->bClass);
+    snprintf(bSubclass, sizeof(bSubclass), "0x%02x", pCtx->bSubclass);
+    snprintf(bProtocol, sizeof(bProtocol), "0x%02x", pCtx->bProtocol);
+
+    libusbd_linux_attr_t attrs[] = {
+        {"idVendor", vid},
+        {"idProduct", pid},
+        {"bcdDevice", did},
+        {"bcdUSB", "0x0200"},
+        {"bDeviceClass", bClass},
+        {"bDeviceSubClass", bSubclass},
+        {"bDeviceProtocol", bProtocol},
+        {"bMaxPacketSize0", "64"},
+        {"configs/c.1/MaxPower", "50"},
+        {"configs/c.1/bmAttributes", "0xc0"},
+        {"strings/0x0409/manufacturer", pCtx->pManufacturerStr},
+        {"strings/0x0409/product", pCtx->pProductStr},
+        {"strings/0x0409/serialnumber", pCtx->pSerialStr},
+    };
+    libusbd_linux_configfs_write(pImplCtx, attrs, sizeof(attrs) / sizeof(attrs[0]));
+
+#if 0
+    if (alt_IOUSBDeviceControllerSetDescription(pImplCtx->controller, pImplCtx->desc)) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+
+    if (IORegistryEntrySetCFProperty(pImplCtx->service_usbgadget, CFSTR("Poke"), CFSTR("Poke"))) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    IOObjectRelease(pImplCtx->service_usbgadget);
+
+    alt_IOUSBDeviceControllerRelease(pImplCtx->controller);
+    CFAllocatorDeallocate(kCFAllocatorDefault, pImplCtx->controller);
+    pImplCtx->controller = NULL;
+
+    alt_IOUSBDeviceDescriptionRelease(pImplCtx->desc);
+    CFAllocatorDeallocate(kCFAllocatorDefault, pImplCtx->desc);
+    pImplCtx->desc = NULL;
+
+    for (int j = 0; j < pCtx->bNumInterfaces; j++)
+    {
+        libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[j];
+
+        // Built-ins don't need us to connect, the kernel driver connects to it.
+        if (pIface->is_builtin) {
+            continue;
+        }
+
+        for (int i = 0; i < 10; i++)
+        {
+            CFStringRef name = CFStringCreateWithCString(NULL, pIface->pName, 0);
+            CFMutableDictionaryRef match = IOServiceMatching("IOUSBDeviceInterface");
+            CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+            CFDictionarySetValue(dict, CFSTR("USBDeviceFunction"), name);
+            CFDictionarySetValue(match, CFSTR("IOPropertyMatch"), dict);
+
+            CFRetain(match);
+            ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
+            if (ret != KERN_SUCCESS || iter == 0) {
+                LIBUSBD_LOG_ERROR("libusbd linux: Error matching IOUSBDeviceInterface (%x)...", ret);
+                sleep(1);
+                continue;
+            }
+
+            // Get the third port
+            while (1)
+            {
+                pIface->service = IOIteratorNext(iter);
+                if (!pIface->service) break;
+
+                io_string_t path;
+                if (IORegistryEntryGetPath(pIface->service, kIOServicePlane, path) != KERN_SUCCESS) {
+                    IOObjectRelease(pIface->service);
+                    continue;
+                }
+
+                if (strstr(path, "usb-drd2")) {
+                    LIBUSBD_LOG_INFO("libusbd linux: Connecting to: '%s'", path);
+                    break;
+                }
+                IOObjectRelease(pIface->service);
+            } 
+
+            CFRelease(match);
+            IOObjectRelease(iter);
+
+            if (pIface->service) break;
+        }
+
+        if (!pIface->service) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Failed to find IOUSBDeviceInterface, aborting...");
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        open_ret = IOServiceOpen(pIface->service, mach_task_self(), 123, &pIface->port); // TODO check
+        //printf("open_ret %x %x\n", open_ret, pIface->port);
+        //IOServiceClose(pIface->service);
+        IOObjectRelease(pIface->service);
+
+        
+        // Open
+        s_ret = IOUSBDeviceInterface_Open(pImplCtx, j); // TODO check
+        //printf("open s_ret %x\n", s_ret);
+    }
+#endif
+    return LIBUSBD_SUCCESS;
+}
+
+// Full and high speed each get the interface, its standard descriptors and
+// its endpoints, so the blob can be sized exactly before it's filled in
+static int libusbd_linux_descs_alloc(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    uint32_t speedSz = 0;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+
+        speedSz += sizeof(struct usb_interface_descriptor);
+        speedSz += sizeof(struct usb_endpoint_descriptor_no_audio) * pIfaceIter->bNumEndpoints;
+        for (libusbd_linux_descdata_t* pIter = pIfaceIter->pStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            speedSz += pIter->size;
+        }
+    }
+
+    uint32_t total = sizeof(libusbd_linux_writeheader_t) + (2 * speedSz);
+
+    // Anything from an earlier pass just stays in the arena
+    pImplCtx->write_descs = libusbd_arena_alloc(pCtx, total);
+    if (!pImplCtx->write_descs) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Failed to allocate 0x%x bytes of descriptors", total);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pImplCtx->write_header->header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    pImplCtx->write_header->header.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC);
+
+    pImplCtx->write_descs_cap = total;
+    pImplCtx->write_descs_sz = sizeof(libusbd_linux_writeheader_t);
+    pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
+
+    return LIBUSBD_SUCCESS;
+}
+
+static void libusbd_linux_descs_put(libusbd_linux_ctx_t* pImplCtx, const void* data, uint32_t size)
+{
+    if (size > pImplCtx->write_descs_cap - pImplCtx->write_descs_sz) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Descriptors don't fit, dropping 0x%x bytes", size);
+        return;
+    }
+
+    memcpy(pImplCtx->write_descs_next, data, size);
+    pImplCtx->write_descs_sz += size;
+    pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
+}
+
+int libusbd_linux_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+
+    if (!pIface || pIface->is_builtin) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    // TODO: is this even needed?
+    if (!pIface->setup_buffer.data) {
+        pIface->setup_buffer.data = libusbd_pool_alloc(pCtx, 0x1000);
+        if (!pIface->setup_buffer.data) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+        pIface->setup_buffer.size = 0x1000;
+    }
+
+#if 0
+    IOUSBDeviceInterface_CreateBuffer(pImplCtx, iface_num, 0x1000, &pIface->setup_buffer); // TODO EP max size, error
+
+    for (int k = 0; k < pIface->bNumEndpoints; k++)
+    {
+        libusbd_linux_ep_t* pEp = &pIface->aEndpoints[k];
+        IOUSBDeviceInterface_CreateBuffer(pImplCtx, iface_num, 0x1000, &pEp->buffer); // TODO EP max size, error
+
+        CFRunLoopSourceRef run_loop_source;
+
+        // Create port to listen for kernel notifications on.
+        pEp->notification_port = IONotificationPortCreate(kIOMainPortDefault);
+        if (!pEp->notification_port) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Error getting notification port.");
+            return 0;
+        }
+
+        // Get lower level mach port from notification port.
+        pEp->mnotification_port = IONotificationPortGetMachPort(pEp->notification_port);
+        if (!pEp->mnotification_port) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Error getting mach notification port.");
+            return 0;
+        }
+
+        // Create a run loop source from our notification port so we can add the port to our run loop.
+        run_loop_source = IONotificationPortGetRunLoopSource(pEp->notification_port);
+        if (run_loop_source == NULL) {
+            LIBUSBD_LOG_ERROR("libusbd linux: Error getting run loop source.");
+            return 0;
+        }
+
+        // Add the notification port and timer to the run loop.
+        CFRunLoopAddSource(_runLoop, run_loop_source, kCFRunLoopDefaultMode);
+    }
+
+    kern_return_t ret = IOUSBDeviceInterface_CommitConfiguration(pImplCtx, iface_num); // TODO check
+
+    IOUSBDeviceInterface_SetClassCommandCallbacks(pImplCtx, iface_num, true, false, false); // second bool sets whether to report successful sends?
+#endif
+    pCtx->aInterfaces[iface_num].finalized = true;
+
+    
+
+    bool all_finalized = true;
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        if (!pCtx->aInterfaces[i].finalized)
+        {
+            all_finalized = false;
+        }
+    }
+
+    if (all_finalized)
+    {
+        int ret = libusbd_linux_descs_alloc(pCtx);
+        if (ret) {
+            return ret;
+        }
+
+        uint8_t epNum = 1;
+        uint16_t cnt = 0;
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+            
+            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+
+            pDescFFS->bLength = sizeof(*pDescFFS);
+            pDescFFS->bDescriptorType = USB_DT_INTERFACE;
+            pDescFFS->bInterfaceNumber = i;
+            pDescFFS->bNumEndpoints = pIfaceIter->bNumEndpoints;
+            pDescFFS->bInterfaceClass = pIfaceIterSuper->bClass;
+            pDescFFS->bInterfaceSubClass = pIfaceIterSuper->bSubclass;
+            pDescFFS->bInterfaceProtocol = pIfaceIterSuper->bProtocol;
+            pDescFFS->iInterface = 1;
+
+            libusbd_linux_descs_put(pImplCtx, pDescFFS, sizeof(*pDescFFS));
+            cnt++;
+
+            libusbd_linux_descdata_t* pIter = pIfaceIter->pStandardDescs;
+            while (pIter)
+            {
+                libusbd_linux_descs_put(pImplCtx, pIter->data, pIter->size);
+                cnt++;
+
+                pIter = pIter->pNext;
+            }
+
+            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+            {
+                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->apEndpoints[j]->descFFS;
+                pEpFFS->bLength = sizeof(*pEpFFS);
+                pEpFFS->bDescriptorType = USB_DT_ENDPOINT;
+                pEpFFS->bEndpointAddress |= epNum; // epNum // TODO
+                //pEpFFS->bmAttributes = USB_ENDPOINT_XFER_BULK; // TODO
+                pEpFFS->wMaxPacketSize = 0;//pIfaceIter->apEndpoints[j]->maxPktSize & 0xFFFF;
+                //pEpFFS->bInterval = 1;
+
+                epNum += 1;
+
+                libusbd_linux_descs_put(pImplCtx, pEpFFS, sizeof(*pEpFFS));
+                cnt++;
+            }
+        }
+        
+
+        pImplCtx->write_header->fs_count = cpu_to_le32(cnt);
+
+        cnt = 0;
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+            
+            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+
+            libusbd_linux_descs_put(pImplCtx, pDescFFS, sizeof(*pDescFFS));
+            cnt++;
+
+            libusbd_linux_descdata_t* pIter = pIfaceIter->pStandardDescs;
+            while (pIter)
+            {
+                libusbd_linux_descs_put(pImplCtx, pIter->data, pIter->size);
+                cnt++;
+
+                pIter = pIter->pNext;
+            }
+
+            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+            {
+                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->apEndpoints[j]->descFFS;
+
+                pEpFFS->wMaxPacketSize = cpu_to_le16(pIfaceIter->apEndpoints[j]->maxPktSize & 0xFFFF);
+
+                libusbd_linux_descs_put(pImplCtx, pEpFFS, sizeof(*pEpFFS));
+                cnt++;
+            }
+        }
+
+        pImplCtx->write_header->hs_count = cpu_to_le32(cnt);
+        
+        cnt = 0;
+#if 0
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+            
+            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+
+            memcpy(pImplCtx->write_descs_next, pDescFFS, sizeof(*pDescFFS));
+            pImplCtx->write_descs_sz += sizeof(*pDescFFS);
+            pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
+            cnt++;
+
+            // TODO extra descriptors
+
+            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+            {
+                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->aEndpointsFFS[j];
+
+                pEpFFS->wMaxPacketSize = cpu_to_le16(512);
+
+                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
+                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
+                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
+                cnt++;
+
+                struct usb_ss_ep_comp_descriptor sink_comp = {
+                    .bLength = USB_DT_SS_EP_COMP_SIZE,
+                    .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+                    .bMaxBurst = 0,
+                    .bmAttributes = 0,
+                    .wBytesPerInterval = 0,
+                };
+
+                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
+                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
+                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
+                cnt++;
+            }
+        }
+#endif
+        pImplCtx->write_header->ss_count = cpu_to_le32(cnt);
+
+        pImplCtx->write_header->header.length = cpu_to_le32(pImplCtx->write_descs_sz);
+        write(pImplCtx->ep0_fd, pImplCtx->write_descs, pImplCtx->write_descs_sz);
+        //write(pImplCtx->ep0_fd, &descriptors, sizeof(descriptors));
+        write(pImplCtx->ep0_fd, &strings, sizeof(strings));
+
+
+        // Bind the configuration
+        DIR* d;
+        struct dirent *dir;
+        d = opendir("/sys/class/udc");
+        if (d) {
+            while ((dir = readdir(d)) != NULL) {
+                if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, "..")) continue;
+
+                libusbd_linux_attr_t bind = {"UDC", dir->d_name};
+                libusbd_linux_configfs_write(pImplCtx, &bind, 1);
+                LIBUSBD_LOG_INFO("libusbd linux: Binding to port: %s", dir->d_name);
+                break;
+            }
+            closedir(d);
+        }
+
+        // Open all the endpoints
+        epNum = 1;
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            libusbd_linux_iface_t* pIfaceIter = pImplCtx->apInterfaces[i];
+            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+
+            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
+            {
+                libusbd_linux_ep_t* pEp = pIfaceIter->apEndpoints[j];
+
+                char tmp[64];
+                snprintf(tmp, 64, "/dev/ffs-usb0/ep%u", epNum);
+                pEp->fd = open(tmp, O_RDWR);
+
+                epNum += 1;
+            }
+        }
+
+        // Otherwise they come with the first ENABLE
+        if (pCtx->buffer_retention == LIBUSBD_RETAIN_ALWAYS) {
+            libusbd_linux_buffers_alloc(pCtx);
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+// The record for interface bNumInterfaces. That isn't bumped when
+// libusbd_iface_alloc fails further up, so one may be left over to reuse.
+static libusbd_linux_iface_t* libusbd_linux_iface_next(libusbd_ctx_t* pCtx)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = pImplCtx->apInterfaces[pCtx->bNumInterfaces];
+
+    if (pIface) {
+        memset(pIface, 0, sizeof(*pIface));
+        return pIface;
+    }
+
+    pIface = calloc(1, sizeof(libusbd_linux_iface_t));
+    pImplCtx->apInterfaces[pCtx->bNumInterfaces] = pIface;
+
+    return pIface;
+}
+
+// Zeroed, on cache lines of its own
+static libusbd_linux_ep_t* libusbd_linux_ep_alloc(uint8_t iface_num, uint8_t idx)
+{
+    libusbd_linux_ep_t* pEp = aligned_alloc(LIBUSBD_LINUX_CACHELINE, sizeof(libusbd_linux_ep_t));
+    if (!pEp) return NULL;
+
+    memset(pEp, 0, sizeof(*pEp));
+    pEp->iface_num = iface_num;
+    pEp->idx = idx;
+
+    return pEp;
+}
+
+// The node and a copy of the descriptor in one go, pDesc NULL leaves it zeroed
+static libusbd_linux_descdata_t* libusbd_linux_desc_alloc(libusbd_ctx_t* pCtx, const uint8_t* pDesc, uint64_t descSz)
+{
+    libusbd_linux_descdata_t* pNewDesc = libusbd_arena_alloc(pCtx, sizeof(libusbd_linux_descdata_t) + descSz);
+    if (!pNewDesc) return NULL;
+
+    pNewDesc->data = pNewDesc + 1;
+    pNewDesc->size = descSz;
+    if (pDesc) {
+        memcpy(pNewDesc->data, pDesc, descSz);
+    }
+
+    return pNewDesc;
+}
+
+int libusbd_linux_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    if (!pIface) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_descdata_t* pNewDesc = libusbd_linux_desc_alloc(pCtx, pDesc, descSz);
+    if (!pNewDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pNewDesc->pNext = pIface->pStandardDescs;
+
+    pIface->pStandardDescs = pNewDesc;
+
+    //IOUSBDeviceInterface_AppendStandardClassOrVendorDescriptor(pImplCtx, iface_num, descType, unk, pDesc, descSz); // TODO error check
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    if (!pIface) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_descdata_t* pNewDesc = libusbd_linux_desc_alloc(pCtx, pDesc, descSz);
+    if (!pNewDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pNewDesc->pNext = pIface->pNonStandardDescs;
+    pNewDesc->idx = descType;
+
+    pIface->pNonStandardDescs = pNewDesc;
+
+    //IOUSBDeviceInterface_AppendNonstandardClassOrVendorDescriptor(pImplCtx, iface_num, descType, unk, pDesc, descSz); // TODO error check
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    if (!pIface) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+    if (pIface->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    // Set up before it's counted, the threads walk bNumEndpoints
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep_alloc(iface_num, pIface->bNumEndpoints);
+    if (!pEp) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pEp->maxPktSize = maxPktSize;
+    pIface->apEndpoints[pIface->bNumEndpoints] = pEp;
+
+    struct usb_endpoint_descriptor_no_audio* pEpFFS = &pEp->descFFS;
+    pEpFFS->bmAttributes = type;
+    pEpFFS->bInterval = interval;
+    pEpFFS->bEndpointAddress = (direction == USB_EP_DIR_IN ? USB_DIR_IN : USB_DIR_OUT); // number gets added later
+
+    *pEpOut = pIface->bNumEndpoints++;
+
+    //kern_return_t ret = IOUSBDeviceInterface_CreatePipe(pImplCtx, iface_num, type, direction, maxPktSize, interval, unk, pEpOut);
+
+    //printf("create %x %x\n", ret, *pEpOut);
+    //IOUSBDeviceInterface_SetPipeProperty(pImplCtx, iface_num, *pEpOut, 0);
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_linux_iface_alloc_builtin_internal(libusbd_ctx_t* pCtx, const char* name)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface_next(pCtx);
+    if (!pIface) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pIface->pName = libusbd_arena_strdup(pCtx, name);
+    if (!pIface->pName) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    //CFStringRef nameRef = CFStringCreateWithCString(NULL, pIface->pName, 0);
+
+    pIface->is_builtin = 1;
+    pCtx->aInterfaces[pCtx->bNumInterfaces].finalized = 1;
+
+    //alt_IOUSBDeviceDescriptionAppendInterfaceToConfiguration(pImplCtx->desc, pImplCtx->configId, nameRef);
+
+    pCtx->bNumInterfaces += 1;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
+{
+    if (!pCtx || !pCtx->pLinuxCtx || !name) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = 0;
+
+    if (!strcmp(name, "libusbd_std_ncm")) {
+        //if (ret = libusbd_linux_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControl")) return ret;
+    }
+    else
+    {
+        if (ret = libusbd_linux_iface_alloc_builtin_internal(pCtx, name)) return ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_alloc(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface_next(pCtx);
+    if (!pIface) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    // We have to include a random element, otherwise we might connect to a port which is about to
+    // be replaced.
+    char name[32];
+    snprintf(name, sizeof(name), "iface-%08x-%u", pImplCtx->iface_rand32, pCtx->bNumInterfaces);
+    pIface->pName = libusbd_arena_strdup(pCtx, name);
+    if (!pIface->pName) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    //CFStringRef name = CFStringCreateWithCString(NULL, pIface->pName, 0);
+
+    //alt_IOUSBDeviceDescriptionAppendInterfaceToConfiguration(pImplCtx->desc, pImplCtx->configId, name);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
     if (iface_num >= LIBUSBD_MAX_IFACES) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    /*kern_return_t ret = IOUSBDeviceInterface_SetDescription(pImplCtx, iface_num, desc);
+
+    if (ret) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }*/
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    if (pIface->is_builtin) {
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
     if (pCtx->aInterfaces[iface_num].finalized) {
         return LIBUSBD_ALREADY_FINALIZED;
     }
 
-    // TODO: is this even needed?
-    pIface->setup_buffer.data = malloc(0x1000);
-    pIface->setup_buffer.size = 0x1000;
+    /*kern_return_t ret = IOUSBDeviceInterface_SetClass(pImplCtx, iface_num, val);
 
-#if 0
-    IOUSBDeviceInterface_CreateBuffer(pImplCtx, iface_num, 0x1000, &pIface->setup_buffer); // TODO EP max size, error
+    if (ret) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }*/
 
-    for (int k = 0; k < pIface->bNumEndpoints; k++)
-    {
-        libusbd_linux_ep_t* pEp = &pIface->aEndpoints[k];
-        IOUSBDeviceInterface_CreateBuffer(pImplCtx, iface_num, 0x1000, &pEp->buffer); // TODO EP max size, error
+    return LIBUSBD_SUCCESS;
+}
 
-        CFRunLoopSourceRef run_loop_source;
+int libusbd_linux_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-        // Create port to listen for kernel notifications on.
-        pEp->notification_port = IONotificationPortCreate(kIOMainPortDefault);
-        if (!pEp->notification_port) {
-            printf("libusbd linux: Error getting notification port.\n");
-            return 0;
-        }
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-        // Get lower level mach port from notification port.
-        pEp->mnotification_port = IONotificationPortGetMachPort(pEp->notification_port);
-        if (!pEp->mnotification_port) {
-            printf("libusbd linux: Error getting mach notification port.\n");
-            return 0;
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    /*kern_return_t ret = IOUSBDeviceInterface_SetSubClass(pImplCtx, iface_num, val);
+
+    if (ret) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }*/
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    /*kern_return_t ret = IOUSBDeviceInterface_SetProtocol(pImplCtx, iface_num, val);
+
+    if (ret) {
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }*/
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    if (!pIface) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // TODO check finalized?
+
+    pIface->setup_callback = func;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Sync transfer through the endpoint's attached dma-buf, waits on the fence
+// instead of blocking in read()/write(). Returns bytes or -errno.
+static int libusbd_linux_dmabuf_io(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp, uint32_t len, uint64_t timeoutMs)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    struct pollfd pfd;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (pEp->sync_in_flight) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return -EBUSY;
+    }
+
+    int fence_fd = libusbd_linux_dmabuf_submit(pEp, len);
+    if (fence_fd >= 0) {
+        pEp->sync_in_flight = 1;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (fence_fd < 0) {
+        return fence_fd;
+    }
+
+    pfd.fd = fence_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int timed_out = poll(&pfd, 1, !timeoutMs ? -1 : (timeoutMs > INT_MAX ? INT_MAX : (int)timeoutMs)) == 0;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (timed_out) {
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_DETACH, &pEp->dmabuf_fd);
+        ioctl(pEp->fd, FUNCTIONFS_DMABUF_ATTACH, &pEp->dmabuf_fd);
+    }
+    pEp->sync_in_flight = 0;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (timed_out) {
+        close(fence_fd);
+        return -ETIMEDOUT;
+    }
+
+    return libusbd_linux_dmabuf_finish(pEp, fence_fd, len);
+}
+
+// Sync transfer through AIO on the endpoint's own context, so it can time
+// out and libusbd_ep_abort can cancel it. Returns bytes or -errno.
+static int libusbd_linux_ep_sync_io(libusbd_ctx_t* pCtx, libusbd_linux_ep_t* pEp, int op, uint32_t len, uint64_t timeoutMs)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    struct iocb* p_iocb = &pEp->sync_iocb;
+    struct io_event e[1];
+    struct timespec ts;
+    int ret;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    // A timed out transfer the UDC hadn't given back yet
+    if (pEp->sync_in_flight == 2) {
+        struct timespec zero = {0, 0};
+        if (io_getevents(pEp->sync_ctx, 1, 1, e, &zero) == 1) {
+            pEp->sync_in_flight = 0;
         }
+    }
+    if (pEp->sync_in_flight) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return -EBUSY;
+    }
 
-        // Create a run loop source from our notification port so we can add the port to our run loop.
-        run_loop_source = IONotificationPortGetRunLoopSource(pEp->notification_port);
-        if (run_loop_source == NULL) {
-            printf("libusbd linux: Error getting run loop source.\n");
-            return 0;
+    if (!pEp->sync_ctx) {
+        ret = io_setup(1, &pEp->sync_ctx);
+        if (ret < 0) {
+            pEp->sync_ctx = 0;
+            pthread_mutex_unlock(&pImplCtx->io_mutex);
+            return ret;
         }
+    }
 
-        // Add the notification port and timer to the run loop.
-        CFRunLoopAddSource(_runLoop, run_loop_source, kCFRunLoopDefaultMode);
+    if (op == LIBUSBD_LINUX_OP_READ) {
+        io_prep_pread(p_iocb, pEp->fd, pEp->buffer.data, len, 0);
+    }
+    else {
+        io_prep_pwrite(p_iocb, pEp->fd, pEp->buffer.data, len, 0);
     }
 
-    kern_return_t ret = IOUSBDeviceInterface_CommitConfiguration(pImplCtx, iface_num); // TODO check
+    ret = io_submit(pEp->sync_ctx, 1, &p_iocb);
+    if (ret < 0) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return ret;
+    }
+    pEp->sync_in_flight = 1;
 
-    IOUSBDeviceInterface_SetClassCommandCallbacks(pImplCtx, iface_num, true, false, false); // second bool sets whether to report successful sends?
-#endif
-    pCtx->aInterfaces[iface_num].finalized = true;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+    do {
+        ret = io_getevents(pEp->sync_ctx, 1, 1, e, timeoutMs ? &ts : NULL);
+    } while (ret == -EINTR);
 
-    bool all_finalized = true;
-    for (int i = 0; i < pCtx->bNumInterfaces; i++)
-    {
-        if (!pCtx->aInterfaces[i].finalized)
-        {
-            all_finalized = false;
-        }
+    int res;
+    if (ret == 1) {
+        res = (int)e[0].res;
     }
+    else {
+        // Take it back, the cancelled request still completes
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+        io_cancel(pEp->sync_ctx, p_iocb, e);
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    if (all_finalized)
-    {
-        uint8_t epNum = 1;
-        uint16_t cnt = 0;
-        for (int i = 0; i < pCtx->bNumInterfaces; i++)
-        {
-            libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
-            
-            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+        ts.tv_sec = 1;
+        ts.tv_nsec = 0;
+        ret = io_getevents(pEp->sync_ctx, 1, 1, e, &ts);
 
-            pDescFFS->bLength = sizeof(*pDescFFS);
-            pDescFFS->bDescriptorType = USB_DT_INTERFACE;
-            pDescFFS->bInterfaceNumber = i;
-            pDescFFS->bNumEndpoints = pIfaceIter->bNumEndpoints;
-            pDescFFS->bInterfaceClass = pIfaceIterSuper->bClass;
-            pDescFFS->bInterfaceSubClass = pIfaceIterSuper->bSubclass;
-            pDescFFS->bInterfaceProtocol = pIfaceIterSuper->bProtocol;
-            pDescFFS->iInterface = 1;
+        // It may have finished just as we gave up on it
+        res = (ret == 1 && (int)e[0].res >= 0) ? (int)e[0].res : -ETIMEDOUT;
+    }
 
-            memcpy(pImplCtx->write_descs_next, pDescFFS, sizeof(*pDescFFS));
-            pImplCtx->write_descs_sz += sizeof(*pDescFFS);
-            pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-            cnt++;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->sync_in_flight = (ret == 1) ? 0 : 2;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-            libusbd_linux_descdata_t* pIter = pIfaceIter->pStandardDescs;
-            while (pIter)
-            {
-                memcpy(pImplCtx->write_descs_next, pIter->data, pIter->size);
-                pImplCtx->write_descs_sz += pIter->size;
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
+    return res;
+}
 
-                pIter = pIter->pNext;
-            }
+int libusbd_linux_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-            {
-                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->aEndpointsFFS[j];
-                pEpFFS->bLength = sizeof(*pEpFFS);
-                pEpFFS->bDescriptorType = USB_DT_ENDPOINT;
-                pEpFFS->bEndpointAddress |= epNum; // epNum // TODO
-                //pEpFFS->bmAttributes = USB_ENDPOINT_XFER_BULK; // TODO
-                pEpFFS->wMaxPacketSize = 0;//pIfaceIter->aEndpoints[j].maxPktSize & 0xFFFF;
-                //pEpFFS->bInterval = 1;
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-                epNum += 1;
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
-                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
-            }
-        }
-        
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-        pImplCtx->write_header->fs_count = cpu_to_le32(cnt);
+    if (!pImplCtx->has_enumerated) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
 
-        cnt = 0;
-        for (int i = 0; i < pCtx->bNumInterfaces; i++)
-        {
-            libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
-            
-            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
 
-            memcpy(pImplCtx->write_descs_next, pDescFFS, sizeof(*pDescFFS));
-            pImplCtx->write_descs_sz += sizeof(*pDescFFS);
-            pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-            cnt++;
+    int ret = libusbd_linux_ep_buffer_pin(pCtx, pEp);
+    if (ret) {
+        return ret;
+    }
+
+    if (len > pBuffer->size) {
+        libusbd_linux_ep_buffer_unpin(pCtx, pEp);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    uint64_t submit_ns = libusbd_linux_ep_submitted(pCtx, iface_num, ep, len);
+
+    if (pEp->dmabuf_attached) {
+        ret = libusbd_linux_sync_ret(libusbd_linux_dmabuf_io(pCtx, pEp, len, timeoutMs));
+    }
+    else {
+        ret = libusbd_linux_sync_ret(libusbd_linux_ep_sync_io(pCtx, pEp, LIBUSBD_LINUX_OP_READ, len, timeoutMs));
+    }
 
-            libusbd_linux_descdata_t* pIter = pIfaceIter->pStandardDescs;
-            while (pIter)
-            {
-                memcpy(pImplCtx->write_descs_next, pIter->data, pIter->size);
-                pImplCtx->write_descs_sz += pIter->size;
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
+    libusbd_linux_ep_completed(pCtx, iface_num, ep, ret, ret >= 0 ? submit_ns : 0);
 
-                pIter = pIter->pNext;
-            }
+    if (ret > 0 && data && pBuffer->data && data != pBuffer->data) {
+        memcpy(data, pBuffer->data, ret);
+    }
 
-            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-            {
-                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->aEndpointsFFS[j];
+    libusbd_linux_ep_buffer_unpin(pCtx, pEp);
 
-                pEpFFS->wMaxPacketSize = cpu_to_le16(pIfaceIter->aEndpoints[j].maxPktSize & 0xFFFF);
+    return ret;
+}
 
-                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
-                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
-            }
-        }
 
-        pImplCtx->write_header->hs_count = cpu_to_le32(cnt);
-        
-        cnt = 0;
-#if 0
-        for (int i = 0; i < pCtx->bNumInterfaces; i++)
-        {
-            libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
-            
-            struct usb_interface_descriptor* pDescFFS = &pIfaceIter->descFFS;
+int libusbd_linux_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-            memcpy(pImplCtx->write_descs_next, pDescFFS, sizeof(*pDescFFS));
-            pImplCtx->write_descs_sz += sizeof(*pDescFFS);
-            pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-            cnt++;
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-            // TODO extra descriptors
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-            {
-                struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIfaceIter->aEndpointsFFS[j];
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-                pEpFFS->wMaxPacketSize = cpu_to_le16(512);
+    if (!pImplCtx->has_enumerated) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
 
-                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
-                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
 
-                struct usb_ss_ep_comp_descriptor sink_comp = {
-                    .bLength = USB_DT_SS_EP_COMP_SIZE,
-                    .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
-                    .bMaxBurst = 0,
-                    .bmAttributes = 0,
-                    .wBytesPerInterval = 0,
-                };
+    int ret = libusbd_linux_ep_buffer_pin(pCtx, pEp);
+    if (ret) {
+        return ret;
+    }
 
-                memcpy(pImplCtx->write_descs_next, pEpFFS, sizeof(*pEpFFS));
-                pImplCtx->write_descs_sz += sizeof(*pEpFFS);
-                pImplCtx->write_descs_next = pImplCtx->write_descs + pImplCtx->write_descs_sz;
-                cnt++;
-            }
-        }
-#endif
-        pImplCtx->write_header->ss_count = cpu_to_le32(cnt);
+    if (len > pBuffer->size) {
+        libusbd_linux_ep_buffer_unpin(pCtx, pEp);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-        pImplCtx->write_header->header.length = cpu_to_le32(pImplCtx->write_descs_sz);
-        write(pImplCtx->ep0_fd, pImplCtx->write_descs, pImplCtx->write_descs_sz);
-        //write(pImplCtx->ep0_fd, &descriptors, sizeof(descriptors));
-        write(pImplCtx->ep0_fd, &strings, sizeof(strings));
+    if (data && pBuffer->data && data != pBuffer->data && len) {
+        memcpy(pBuffer->data, data, len);
+    }
 
+    uint64_t submit_ns = libusbd_linux_ep_submitted(pCtx, iface_num, ep, len);
 
-        // Bind the configuration
-        DIR* d;
-        struct dirent *dir;
-        d = opendir("/sys/class/udc");
-        if (d) {
-            while ((dir = readdir(d)) != NULL) {
-                if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, "..")) continue;
+    if (pEp->dmabuf_attached) {
+        ret = libusbd_linux_sync_ret(libusbd_linux_dmabuf_io(pCtx, pEp, len, timeoutMs));
+    }
+    else {
+        ret = libusbd_linux_sync_ret(libusbd_linux_ep_sync_io(pCtx, pEp, LIBUSBD_LINUX_OP_WRITE, len, timeoutMs));
+    }
 
-                write_str_to_file("/sys/kernel/config/usb_gadget/libusbd/UDC", dir->d_name);
-                printf("Binding to port: %s\n", dir->d_name);
-                break;
-            }
-            closedir(d);
-        }
+    libusbd_linux_ep_completed(pCtx, iface_num, ep, ret, ret >= 0 ? submit_ns : 0);
 
-        // Open all the endpoints
-        epNum = 1;
-        for (int i = 0; i < pCtx->bNumInterfaces; i++)
-        {
-            libusbd_linux_iface_t* pIfaceIter = &pImplCtx->aInterfaces[i];
-            libusbd_iface_t* pIfaceIterSuper = &pCtx->aInterfaces[i];
+    libusbd_linux_ep_buffer_unpin(pCtx, pEp);
 
-            for (int j = 0; j < pIfaceIter->bNumEndpoints; j++)
-            {
+    return ret;
+}
 
-                char tmp[64];
-                snprintf(tmp, 64, "/dev/ffs-usb0/ep%u", epNum);
-                pIfaceIter->aEndpoints[j].fd = open(tmp, O_RDWR);
+static int libusbd_linux_ep_is_in(libusbd_linux_ep_t* pEp)
+{
+    return !!(pEp->descFFS.bEndpointAddress & USB_DIR_IN);
+}
 
-                pIfaceIter->aEndpoints[j].buffer.data = malloc(0x1000);
-                pIfaceIter->aEndpoints[j].buffer.size = 0x1000;
+// Cancels everything queued on the endpoint, async, sync and transfer
+// objects. Follow up with libusbd_linux_xfer_run_done.
+//
+// Must be called with io_mutex held
+static void libusbd_linux_ep_cancel_all_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = pImplCtx->apInterfaces[iface_num]->apEndpoints[ep];
 
-                epNum += 1;
-            }
+    libusbd_linux_ep_cancel_locked(pCtx, iface_num, ep);
+    pEp->rearm_pending = 0;
+
+    libusbd_linux_xfer_t* pIter = pImplCtx->pXferHead;
+    while (pIter)
+    {
+        libusbd_linux_xfer_t* pNext = pIter->pNext;
+
+        if (pIter->pXfer->pub.iface_num == iface_num && pIter->pXfer->pub.ep == ep) {
+            libusbd_linux_xfer_cancel_locked(pImplCtx, pIter);
         }
+
+        pIter = pNext;
     }
 
-    return LIBUSBD_SUCCESS;
+    // The waiter sees its request come back cancelled
+    if (pEp->sync_in_flight == 1) {
+        if (pEp->dmabuf_attached) {
+            ioctl(pEp->fd, FUNCTIONFS_DMABUF_DETACH, &pEp->dmabuf_fd);
+            ioctl(pEp->fd, FUNCTIONFS_DMABUF_ATTACH, &pEp->dmabuf_fd);
+        }
+        else {
+            struct io_event e[1];
+            io_cancel(pEp->sync_ctx, &pEp->sync_iocb, e);
+        }
+    }
 }
 
-
-int libusbd_impl_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+int libusbd_linux_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1142,26 +2663,46 @@ int libusbd_impl_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uin
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    // FunctionFS blocks until the endpoint is enabled
+    if (!pImplCtx->has_enumerated || pEp->fd <= 0) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
 
-    libusbd_linux_descdata_t* pNewDesc = malloc(sizeof(libusbd_linux_descdata_t));
-    pNewDesc->pNext = pIface->pStandardDescs;
-    pNewDesc->data = malloc(descSz);
-    memcpy(pNewDesc->data, pDesc, descSz);
-    pNewDesc->size = descSz;
+    // Most UDCs won't halt an endpoint with requests queued
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_linux_ep_cancel_all_locked(pCtx, iface_num, ep);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    libusbd_linux_xfer_run_done(pCtx);
 
-    pIface->pStandardDescs = pNewDesc;
+    // FunctionFS halts an endpoint that's asked to transfer the wrong way,
+    // and says so with EBADMSG. It stays halted until the host clears it.
+    int ret;
+    if (libusbd_linux_ep_is_in(pEp)) {
+        ret = read(pEp->fd, pEp->buffer.data, 0);
+    }
+    else {
+        ret = write(pEp->fd, pEp->buffer.data, 0);
+    }
 
-    //IOUSBDeviceInterface_AppendStandardClassOrVendorDescriptor(pImplCtx, iface_num, descType, unk, pDesc, descSz); // TODO error check
-    return LIBUSBD_SUCCESS;
+    if (ret < 0 && errno == EBADMSG) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    LIBUSBD_LOG_ERROR("libusbd linux: Failed to halt iface %u ep %u (%s)", iface_num, (uint32_t)ep, ret < 0 ? strerror(errno) : "no error");
+    return ret < 0 && errno == ESHUTDOWN ? LIBUSBD_NOT_ENUMERATED : LIBUSBD_NONDESCRIPT_ERROR;
 }
 
-int libusbd_impl_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+int libusbd_linux_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1171,27 +2712,30 @@ int libusbd_impl_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num,
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    libusbd_linux_descdata_t* pNewDesc = malloc(sizeof(libusbd_linux_descdata_t));
-    pNewDesc->pNext = pIface->pNonStandardDescs;
-    pNewDesc->data = malloc(descSz);
-    memcpy(pNewDesc->data, pDesc, descSz);
-    pNewDesc->size = descSz;
-    pNewDesc->idx = descType;
+    if (!pImplCtx->has_enumerated || pEp->fd <= 0) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
 
-    pIface->pNonStandardDescs = pNewDesc;
+    // Also resets the data toggle
+    if (ioctl(pEp->fd, FUNCTIONFS_CLEAR_HALT) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Failed to clear halt on iface %u ep %u (%s)", iface_num, (uint32_t)ep, strerror(errno));
+        return errno == ESHUTDOWN ? LIBUSBD_NOT_ENUMERATED : LIBUSBD_NONDESCRIPT_ERROR;
+    }
 
-    //IOUSBDeviceInterface_AppendNonstandardClassOrVendorDescriptor(pImplCtx, iface_num, descType, unk, pDesc, descSz); // TODO error check
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
+int libusbd_linux_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1201,99 +2745,197 @@ int libusbd_impl_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_linux_ep_cancel_all_locked(pCtx, iface_num, ep);
+
+    // Whatever an aborted IN transfer left in the FIFO would still go out.
+    // OUT FIFOs hold data the host already sent, that's kept for the next read.
+    if (pImplCtx->has_enumerated && pEp->fd > 0 && libusbd_linux_ep_is_in(pEp)) {
+        ioctl(pEp->fd, FUNCTIONFS_FIFO_FLUSH);
     }
-    if (pIface->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    libusbd_linux_xfer_run_done(pCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
+{
+    if (!pCtx || !pCtx->pLinuxCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[pIface->bNumEndpoints];
-    pEp->maxPktSize = maxPktSize;
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    struct usb_endpoint_descriptor_no_audio* pEpFFS = &pIface->aEndpointsFFS[pIface->bNumEndpoints];
-    pEpFFS->bmAttributes = type;
-    pEpFFS->bInterval = interval;
-    pEpFFS->bEndpointAddress = (direction == USB_EP_DIR_IN ? USB_DIR_IN : USB_DIR_OUT); // number gets added later
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    *pEpOut = pIface->bNumEndpoints++;
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    //kern_return_t ret = IOUSBDeviceInterface_CreatePipe(pImplCtx, iface_num, type, direction, maxPktSize, interval, unk, pEpOut);
+    // Brought back if it was released, until the next DISABLE
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ret = libusbd_linux_ep_buffer_alloc_locked(pCtx, pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    if (ret) {
+        return ret;
+    }
 
-    //printf("create %x %x\n", ret, *pEpOut);
-    //IOUSBDeviceInterface_SetPipeProperty(pImplCtx, iface_num, *pEpOut, 0);
+    *pOut = pEp->buffer.data;
 
-    return LIBUSBD_SUCCESS;
+    return (pEp->buffer.size & 0x7FFFFFFF);
 }
 
-static int libusbd_impl_iface_alloc_builtin_internal(libusbd_ctx_t* pCtx, const char* name)
+int libusbd_linux_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    // TODO oob
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[pCtx->bNumInterfaces];
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    pIface->pName = malloc(0x80);
-    strncpy(pIface->pName, name, 0x80);
-    //CFStringRef nameRef = CFStringCreateWithCString(NULL, pIface->pName, 0);
+    // Endpoint files only exist once every interface is finalized
+    if (pEp->fd <= 0) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    pIface->is_builtin = 1;
-    pCtx->aInterfaces[pCtx->bNumInterfaces].finalized = 1;
+    int dmabuf_fd = -1;
+    void* data = NULL;
 
-    //alt_IOUSBDeviceDescriptionAppendInterfaceToConfiguration(pImplCtx->desc, pImplCtx->configId, nameRef);
+    if (fd < 0) {
+        long page = sysconf(_SC_PAGESIZE);
 
-    pCtx->bNumInterfaces += 1;
+        if (!size || size > UINT32_MAX) {
+            return LIBUSBD_INVALID_ARGUMENT;
+        }
+        size = (size + page - 1) & ~(uint64_t)(page - 1);
 
-    return LIBUSBD_SUCCESS;
-}
+        int ret = libusbd_linux_dmabuf_alloc(size, &dmabuf_fd, &data);
+        if (ret) {
+            return ret;
+        }
+    }
+    else {
+        // Imported ones are as big as they are
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end <= 0) {
+            return LIBUSBD_INVALID_ARGUMENT;
+        }
+        size = end;
 
-int libusbd_impl_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
-{
-    if (!pCtx || !pCtx->pLinuxCtx || !name) {
-        return LIBUSBD_INVALID_ARGUMENT;
+        dmabuf_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dmabuf_fd < 0) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+
+        // Not every exporter lets the CPU in, that's fine if FunctionFS
+        // takes it below
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dmabuf_fd, 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+        }
     }
 
-    int ret = 0;
+    int attached = 0;
+    if (dmabuf_fd >= 0) {
+        if (!ioctl(pEp->fd, FUNCTIONFS_DMABUF_ATTACH, &dmabuf_fd)) {
+            attached = 1;
+        }
+        else {
+            LIBUSBD_LOG_INFO("libusbd linux: FunctionFS didn't take the dma-buf (%s), using AIO", strerror(errno));
+        }
+    }
 
-    if (!strcmp(name, "libusbd_std_ncm")) {
-        //if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControl")) return ret;
+    if (!attached && !data) {
+        if (dmabuf_fd >= 0) {
+            close(dmabuf_fd);
+        }
+        return LIBUSBD_NOT_IMPLEMENTED;
     }
-    else
-    {
-        if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, name)) return ret;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    libusbd_linux_ep_cancel_locked(pCtx, iface_num, ep);
+
+    if (pEp->has_dmabuf) {
+        libusbd_linux_ep_release_dmabuf(pEp);
+    }
+    else {
+        libusbd_pool_free(pCtx, pEp->buffer.data);
+    }
+
+    pEp->buffer.data = data;
+    pEp->buffer.size = size;
+    pEp->has_dmabuf = 1;
+    pEp->dmabuf_fd = dmabuf_fd;
+    pEp->dmabuf_attached = attached;
+    pEp->fence_fd = -1;
+
+    if (pEp->rearm_pending && pEp->last_len > size) {
+        pEp->rearm_pending = 0;
     }
 
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_alloc(libusbd_ctx_t* pCtx)
+int libusbd_linux_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    // TODO oob
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[pCtx->bNumInterfaces];
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    // We have to include a random element, otherwise we might connect to a port which is about to
-    // be replaced.
-    pIface->pName = malloc(0x80);
-    snprintf(pIface->pName, 0x80, "iface-%08x-%u", pImplCtx->iface_rand32, pCtx->bNumInterfaces);
-    //CFStringRef name = CFStringCreateWithCString(NULL, pIface->pName, 0);
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    //alt_IOUSBDeviceDescriptionAppendInterfaceToConfiguration(pImplCtx->desc, pImplCtx->configId, name);
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    return LIBUSBD_SUCCESS;
+    if (!pEp->has_dmabuf || pEp->dmabuf_fd < 0) {
+        return LIBUSBD_NOT_IMPLEMENTED;
+    }
+
+    return pEp->dmabuf_fd;
 }
 
-int libusbd_impl_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
+int libusbd_linux_ep_get_fifo_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1303,21 +2945,33 @@ int libusbd_impl_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, c
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    /*kern_return_t ret = IOUSBDeviceInterface_SetDescription(pImplCtx, iface_num, desc);
+    // FunctionFS waits for the endpoint to be enabled before answering
+    if (!pImplCtx->has_enumerated || pEp->fd <= 0) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
 
-    if (ret) {
-        return LIBUSBD_NONDESCRIPT_ERROR;
-    }*/
+    int ret = ioctl(pEp->fd, FUNCTIONFS_FIFO_STATUS);
+    if (ret < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY) {
+            return LIBUSBD_NOT_IMPLEMENTED;
+        }
+        return errno == ESHUTDOWN || errno == ENODEV ? LIBUSBD_NOT_ENUMERATED : LIBUSBD_NONDESCRIPT_ERROR;
+    }
 
-    return LIBUSBD_SUCCESS;
+    return ret;
 }
 
-int libusbd_impl_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_linux_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1327,21 +2981,73 @@ int libusbd_impl_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    
+    libusbd_linux_ep_cancel_locked(pCtx, iface_num, ep);
+    pEp->last_error = 0;
+
+    // Not enumerated yet, leave it standing until the next ENABLE
+    if (!pImplCtx->has_enumerated && pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE) {
+        pEp->last_op = LIBUSBD_LINUX_OP_READ;
+        pEp->last_len = len;
+        pEp->last_transferred = 0;
+        pEp->ep_async_done = 0;
+        pEp->rearm_pending = 1;
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_SUCCESS;
+    }
+    
+    //printf("Start read %x\n", len);
+    int ret = libusbd_linux_ep_submit_locked(pCtx, iface_num, ep, LIBUSBD_LINUX_OP_READ, len);
+    if (!ret && timeout_ms) {
+        libusbd_linux_ep_arm_timeout_locked(pImplCtx, pEp, timeout_ms);
     }
+    
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    /*kern_return_t ret = IOUSBDeviceInterface_SetClass(pImplCtx, iface_num, val);
+    if (ret < 0) {
+        return ret;
+    }
+	
+	//printf("Done read: %d\n", ret);
 
-    if (ret) {
+    //pthread_yield();
+
+    /*kern_return_t ret = IOUSBDeviceInterface_ReadPipeStart(pImplCtx, iface_num, ep, len, timeout_ms);
+    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
+    {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
+    {
+        return LIBUSBD_TIMEOUT;
+    }
+    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
+    {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    else if (ret & 0xFFF00000)
+    {
+        LIBUSBD_LOG_ERROR("libusbd linux: Unknown error from IOUSBDeviceInterface_ReadPipeStart: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
-    }*/
+    }
 
+    return ret;*/
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_linux_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1351,21 +3057,92 @@ int libusbd_impl_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
+    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
 
-    /*kern_return_t ret = IOUSBDeviceInterface_SetSubClass(pImplCtx, iface_num, val);
+    if (!pImplCtx->has_enumerated && pEp->rearm_policy != LIBUSBD_REARM_ON_ENABLE) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
 
+    // Sized under the lock, a DISABLE could release it in between
+    int ret = libusbd_linux_ep_buffer_alloc_locked(pCtx, pEp);
+    if (!ret && data && pBuffer->data && data != pBuffer->data && len > pBuffer->size) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
     if (ret) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return ret;
+    }
+    
+    libusbd_linux_ep_cancel_locked(pCtx, iface_num, ep);
+    pEp->last_error = 0;
+
+    if (data && pBuffer->data && data != pBuffer->data && len) {
+        memcpy(pBuffer->data, data, len);
+    }
+
+    // Not enumerated yet, leave it standing until the next ENABLE
+    if (!pImplCtx->has_enumerated) {
+        pEp->last_op = LIBUSBD_LINUX_OP_WRITE;
+        pEp->last_len = len;
+        pEp->last_transferred = 0;
+        pEp->ep_async_done = 0;
+        pEp->rearm_pending = 1;
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_SUCCESS;
+    }
+    
+    //printf("Start write %x\n", len);
+    ret = libusbd_linux_ep_submit_locked(pCtx, iface_num, ep, LIBUSBD_LINUX_OP_WRITE, len);
+    if (!ret && timeout_ms) {
+        libusbd_linux_ep_arm_timeout_locked(pImplCtx, pEp, timeout_ms);
+    }
+    
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (ret < 0) {
+        return ret;
+    }
+	
+	//printf("Done write: %d\n", ret);
+
+    //pthread_yield();
+
+    /*kern_return_t ret = IOUSBDeviceInterface_WritePipeStart(pImplCtx, iface_num, ep, data, len, timeout_ms);
+    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
+    {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
+    {
+        return LIBUSBD_TIMEOUT;
+    }
+    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
+    {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    else if (ret & 0xFFF00000)
+    {
+        LIBUSBD_LOG_ERROR("libusbd linux: Unknown error from IOUSBDeviceInterface_WritePipeStart: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
-    }*/
+    }
 
+    return ret;*/
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_linux_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1375,21 +3152,31 @@ int libusbd_impl_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    if (pCtx->aInterfaces[iface_num].finalized) {
-        return LIBUSBD_ALREADY_FINALIZED;
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    /*kern_return_t ret = IOUSBDeviceInterface_SetProtocol(pImplCtx, iface_num, val);
+    if (policy != LIBUSBD_REARM_NONE && policy != LIBUSBD_REARM_ON_ENABLE) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    if (ret) {
-        return LIBUSBD_NONDESCRIPT_ERROR;
-    }*/
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->rearm_policy = policy;
+    if (policy == LIBUSBD_REARM_NONE) {
+        pEp->rearm_pending = 0;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
+int libusbd_linux_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1399,17 +3186,25 @@ int libusbd_impl_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    // TODO check finalized?
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    pIface->setup_callback = func;
+    if (pEp->last_error == LIBUSBD_LINUX_ERR_TIMEOUT)
+    {
+        return LIBUSBD_TIMEOUT;
+    }
 
-    return LIBUSBD_SUCCESS;
+    return pEp->ep_async_done;
 }
 
-int libusbd_impl_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
+int libusbd_linux_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pLinuxCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1424,384 +3219,544 @@ int libusbd_impl_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, vo
     }
 
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_ep_t* pEp = libusbd_linux_ep(pImplCtx, iface_num, ep);
+    if (!pEp) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
 
-    if (!pImplCtx->has_enumerated) {
-        return LIBUSBD_NOT_ENUMERATED;
+    if (pEp->last_error == LIBUSBD_LINUX_ERR_TIMEOUT)
+    {
+        return LIBUSBD_TIMEOUT;
     }
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
-    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
+    return pEp->last_transferred;
+}
 
-    int ret = read(pEp->fd, pBuffer->data, len);
+#define LIBUSBD_LINUX_HANDOFF_TAG (0x31584e4c) // 'LNX1'
 
-    if (data && pBuffer->data && data != pBuffer->data && len) {
-        memcpy(data, pBuffer->data, len);
+int libusbd_linux_xfer_alloc(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    /*kern_return_t ret = IOUSBDeviceInterface_ReadPipe(pImplCtx, iface_num, ep, data, len, timeoutMs);
-    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
-    {
-        return LIBUSBD_NOT_ENUMERATED;
+    libusbd_linux_xfer_t* pLinuxXfer = calloc(1, sizeof(libusbd_linux_xfer_t));
+    if (!pLinuxXfer) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
-    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
+
+    pXfer->pub.buffer = libusbd_pool_alloc(pCtx, pXfer->pub.buffer_size);
+    if (!pXfer->pub.buffer) {
+        free(pLinuxXfer);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
-    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
-    {
+
+    pLinuxXfer->pXfer = pXfer;
+    pXfer->pPlat = pLinuxXfer;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_xfer_free(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
-    else if (ret & 0xFFF00000)
-    {
-        printf("libusbd linux: Unknown error from IOUSBDeviceInterface_ReadPipe: %08x\n", ret);
-        return LIBUSBD_NONDESCRIPT_ERROR;
-    }
 
-    return ret;*/
+    libusbd_pool_free(pCtx, pXfer->pub.buffer);
+    free(pXfer->pPlat);
+    pXfer->pub.buffer = NULL;
+    pXfer->pPlat = NULL;
+
     return LIBUSBD_SUCCESS;
 }
 
-
-int libusbd_impl_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+// Hands a transfer object's ready iocb to AIO.
+//
+// Must be called with io_mutex held, drops it
+static int libusbd_linux_xfer_io_submit_locked(libusbd_linux_ctx_t* pImplCtx, libusbd_linux_xfer_t* pLinuxXfer)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    struct iocb* p_iocb = &pLinuxXfer->iocb;
+
+    // Linked first, the async thread can reap it before io_submit returns
+    pLinuxXfer->in_flight = 1;
+    pLinuxXfer->pPrev = NULL;
+    pLinuxXfer->pNext = pImplCtx->pXferHead;
+    if (pImplCtx->pXferHead) {
+        pImplCtx->pXferHead->pPrev = pLinuxXfer;
     }
+    pImplCtx->pXferHead = pLinuxXfer;
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    int ret = io_submit(pImplCtx->io_ctx, 1, &p_iocb);
+    if (ret < 0) {
+        libusbd_linux_xfer_unlink_locked(pImplCtx, pLinuxXfer);
+    }
+    else if (pLinuxXfer->pXfer->deadline_ns) {
+        // Its timeout may be due before the async thread would wake up
+        libusbd_linux_async_kick(pImplCtx);
     }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+    if (ret < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: unable to submit transfer (%d)", ret);
+        return ret == -EAGAIN ? LIBUSBD_RESOURCE_LIMIT_REACHED : libusbd_linux_sync_ret(ret);
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_linux_xfer_submit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
+
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    libusbd_linux_xfer_t* pLinuxXfer = pXfer->pPlat;
+    struct iocb* p_iocb = &pLinuxXfer->iocb;
 
-    if (!pImplCtx->has_enumerated) {
+    if (iface_num >= pCtx->bNumInterfaces || ep >= pIface->bNumEndpoints || pIface->is_builtin) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_linux_ep_t* pEp = pIface->apEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    // FunctionFS would block in io_submit until the endpoint is enabled
+    if (!pImplCtx->has_enumerated || pEp->fd <= 0) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
         return LIBUSBD_NOT_ENUMERATED;
     }
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
-    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
+    if (libusbd_linux_ep_is_in(pEp)) {
+        io_prep_pwrite(p_iocb, pEp->fd, pXfer->pub.buffer, pXfer->pub.length, 0);
+    }
+    else {
+        io_prep_pread(p_iocb, pEp->fd, pXfer->pub.buffer, pXfer->pub.length, 0);
+    }
 
-    if (data && pBuffer->data && data != pBuffer->data && len) {
-        if (len > pBuffer->size) return LIBUSBD_LINUX_FAKERET_BADARGS;
+    p_iocb->u.c.flags |= IOCB_FLAG_RESFD;
+    p_iocb->u.c.resfd = pImplCtx->evfd;
+    p_iocb->data = pLinuxXfer;
 
-        memcpy(pBuffer->data, data, len);
+    return libusbd_linux_xfer_io_submit_locked(pImplCtx, pLinuxXfer);
+}
+
+int libusbd_linux_xfer_prepare(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    int ret = write(pEp->fd, pBuffer->data, len);
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
 
-    /*kern_return_t ret = IOUSBDeviceInterface_WritePipe(pImplCtx, iface_num, ep, data, len, timeoutMs);
-    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
-    {
-        return LIBUSBD_NOT_ENUMERATED;
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_iface_t* pIface = libusbd_linux_iface(pImplCtx, iface_num);
+    libusbd_linux_xfer_t* pLinuxXfer = pXfer->pPlat;
+    struct iocb* p_iocb = &pLinuxXfer->iocb;
+
+    if (iface_num >= pCtx->bNumInterfaces || ep >= pIface->bNumEndpoints || pIface->is_builtin) {
+        return LIBUSBD_INVALID_ARGUMENT;
     }
-    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
+
+    libusbd_linux_ep_t* pEp = pIface->apEndpoints[ep];
+
+    // The endpoint files are there from finalize on, no need to wait for
+    // the host
+    if (pEp->fd <= 0) {
+        return LIBUSBD_NOT_ENUMERATED;
     }
-    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
-    {
-        return LIBUSBD_INVALID_ARGUMENT;
+
+    // Full buffer for now, resubmit sets nbytes
+    if (libusbd_linux_ep_is_in(pEp)) {
+        io_prep_pwrite(p_iocb, pEp->fd, pXfer->pub.buffer, pXfer->pub.buffer_size, 0);
     }
-    else if (ret & 0xFFF00000)
-    {
-        printf("libusbd linux: Unknown error from IOUSBDeviceInterface_WritePipe: %08x\n", ret);
-        return LIBUSBD_NONDESCRIPT_ERROR;
+    else {
+        io_prep_pread(p_iocb, pEp->fd, pXfer->pub.buffer, pXfer->pub.buffer_size, 0);
     }
 
-    return ret;*/
+    p_iocb->u.c.flags |= IOCB_FLAG_RESFD;
+    p_iocb->u.c.resfd = pImplCtx->evfd;
+    p_iocb->data = pLinuxXfer;
+
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_linux_xfer_resubmit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_xfer_t* pLinuxXfer = pXfer->pPlat;
 
-    //IOUSBDeviceInterface_StallPipe(pImplCtx, iface_num, ep);
+    pthread_mutex_lock(&pImplCtx->io_mutex);
 
-    return LIBUSBD_SUCCESS;
+    if (!pImplCtx->has_enumerated) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    // Everything else is as xfer_prepare left it
+    pLinuxXfer->iocb.u.c.nbytes = pXfer->pub.length;
+
+    return libusbd_linux_xfer_io_submit_locked(pImplCtx, pLinuxXfer);
 }
 
-int libusbd_impl_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_linux_xfer_cancel(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
+    if (!pCtx || !pCtx->pLinuxCtx || !pXfer) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_xfer_t* pLinuxXfer = pXfer->pPlat;
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (!pLinuxXfer->in_flight) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    libusbd_linux_xfer_cancel_locked(pImplCtx, pLinuxXfer);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
 
-    //IOUSBDeviceInterface_AbortPipe(pImplCtx, iface_num, ep);
+    libusbd_linux_xfer_run_done(pCtx);
 
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
+int libusbd_linux_handoff_export(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
+    if (!pCtx || !pCtx->pLinuxCtx || !pBuf) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+    uint32_t tag = LIBUSBD_LINUX_HANDOFF_TAG;
+
+    // dma-bufs belong to this process, the successor would have to redo
+    // libusbd_ep_set_dmabuf anyway
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        for (int j = 0; j < pImplCtx->apInterfaces[i]->bNumEndpoints; j++)
+        {
+            if (pImplCtx->apInterfaces[i]->apEndpoints[j]->has_dmabuf) {
+                LIBUSBD_LOG_ERROR("libusbd linux: Can't hand off dma-buf backed endpoints");
+                return LIBUSBD_NOT_IMPLEMENTED;
+            }
+        }
     }
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    // Their callbacks would have nowhere to run
+    if (pImplCtx->pXferHead) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Can't hand off with transfer objects in flight");
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep]; // TODO oob
+    // Nothing in this process may touch ep0 or the endpoints past this point,
+    // any events that show up in between wait in the kernel for the successor.
+    libusbd_linux_stop_async_thread(pCtx);
+    libusbd_linux_stop_ep0_thread(pCtx);
 
-    *pOut = pEp->buffer.data;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
 
-    return (pEp->buffer.size & 0x7FFFFFFF);
-}
+    LIBUSBD_HANDOFF_PUT(pBuf, tag);
+    LIBUSBD_HANDOFF_PUT(pBuf, pImplCtx->has_enumerated);
+    libusbd_handoff_put_fd(pBuf, pImplCtx->ep0_fd);
 
-int libusbd_impl_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
-{
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_linux_iface_t* pIface = pImplCtx->apInterfaces[i];
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+        LIBUSBD_HANDOFF_PUT(pBuf, pIface->is_builtin);
+        libusbd_handoff_put_str(pBuf, pIface->pName);
+        LIBUSBD_HANDOFF_PUT(pBuf, pIface->bNumEndpoints);
+        LIBUSBD_HANDOFF_PUT(pBuf, pIface->descFFS);
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            LIBUSBD_HANDOFF_PUT(pBuf, pIface->apEndpoints[j]->descFFS);
+        }
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+        // Still served from ep0, unlike the standard ones
+        uint32_t numDescs = 0;
+        for (libusbd_linux_descdata_t* pIter = pIface->pNonStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            numDescs++;
+        }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
+        LIBUSBD_HANDOFF_PUT(pBuf, numDescs);
+        for (libusbd_linux_descdata_t* pIter = pIface->pNonStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            uint32_t size = pIter->size;
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
-    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
+            LIBUSBD_HANDOFF_PUT(pBuf, pIter->idx);
+            LIBUSBD_HANDOFF_PUT(pBuf, size);
+            libusbd_handoff_put(pBuf, pIter->data, size);
+        }
 
-#if 0
-    int ret = read(pEp->fd, pBuffer->data, len);
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_linux_ep_t* pEp = pIface->apEndpoints[j];
+            struct io_event e[1];
 
-    if (ret >= 0) {
-        pEp->last_transferred = ret;
-        pEp->ep_async_done = 1;
-    }
-#endif
-    
-    pthread_mutex_lock(&pImplCtx->io_mutex);
-    
-    if (pEp->request_in_flight) {
-        struct io_event e[1];
-        io_cancel(pImplCtx->io_ctx, &pEp->fd_iocb, e); // check
-        pEp->request_in_flight = 0;
-    }
-    
-    pEp->last_transferred = 0;
-    pEp->ep_async_done = 0;
-    
-    //printf("Start read %x\n", len);
-    struct iocb* p_fd_iocb = &pEp->fd_iocb;
-    
-    io_prep_pread(p_fd_iocb, pEp->fd, pBuffer->data, len, 0);
-	/* enable eventfd notification */
-	pEp->fd_iocb.u.c.flags |= IOCB_FLAG_RESFD;
-	pEp->fd_iocb.u.c.resfd = pImplCtx->evfd;
-	/* submit table of requests */
-	int ret = io_submit(pImplCtx->io_ctx, 1, &p_fd_iocb);
-	if (ret >= 0) { /* if ret > 0 request is queued */
-
-	} else {
-		perror("unable to submit request");
-		return LIBUSBD_NONDESCRIPT_ERROR;
-    }
-    
-    pEp->request_in_flight = 1;
-    
-    pthread_mutex_unlock(&pImplCtx->io_mutex);
-	
-	//printf("Done read: %d\n", ret);
+            if (pEp->request_in_flight) {
+                LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, i, j, pEp->submit_gen, 0);
+                io_cancel(pImplCtx->io_ctx, &pEp->fd_iocb, e);
+                libusbd_linux_ep_completed(pCtx, i, j, LIBUSBD_CANCELLED, 0);
 
-    //pthread_yield();
+                pEp->request_in_flight = 0;
+                if (pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE) {
+                    pEp->rearm_pending = 1;
+                }
+            }
 
-    /*kern_return_t ret = IOUSBDeviceInterface_ReadPipeStart(pImplCtx, iface_num, ep, len, timeout_ms);
-    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
-    {
-        return LIBUSBD_NOT_ENUMERATED;
-    }
-    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
-    }
-    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
-    {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-    else if (ret & 0xFFF00000)
-    {
-        printf("libusbd linux: Unknown error from IOUSBDeviceInterface_ReadPipeStart: %08x\n", ret);
-        return LIBUSBD_NONDESCRIPT_ERROR;
+            LIBUSBD_HANDOFF_PUT(pBuf, pEp->maxPktSize);
+            LIBUSBD_HANDOFF_PUT(pBuf, pEp->rearm_policy);
+            LIBUSBD_HANDOFF_PUT(pBuf, pEp->rearm_pending);
+            LIBUSBD_HANDOFF_PUT(pBuf, pEp->last_op);
+            LIBUSBD_HANDOFF_PUT(pBuf, pEp->last_len);
+
+            // Standing writes resend what's already in the buffer
+            if (pEp->rearm_pending && pEp->last_op == LIBUSBD_LINUX_OP_WRITE) {
+                libusbd_handoff_put(pBuf, pEp->buffer.data, pEp->last_len);
+            }
+
+            libusbd_handoff_put_fd(pBuf, pEp->fd > 0 ? pEp->fd : -1);
+        }
     }
 
-    return ret;*/
+    // The exported context is done, ep_* calls shouldn't start anything new
+    pImplCtx->has_enumerated = 0;
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
+int libusbd_linux_handoff_adopt(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
 {
-    if (!pCtx || !pCtx->pLinuxCtx) {
+    if (!pCtx || !pBuf) {
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
+    uint32_t tag = 0;
+    LIBUSBD_HANDOFF_GET(pBuf, tag);
+    if (tag != LIBUSBD_LINUX_HANDOFF_TAG) {
+        LIBUSBD_LOG_ERROR("libusbd linux: Handoff is from a different backend (%x)", tag);
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    pCtx->pLinuxCtx = malloc(sizeof(libusbd_linux_ctx_t));
+    if (!pCtx->pLinuxCtx) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
     }
+    memset(pCtx->pLinuxCtx, 0, sizeof(*pCtx->pLinuxCtx));
 
     libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
 
-    if (!pImplCtx->has_enumerated) {
-        return LIBUSBD_NOT_ENUMERATED;
-    }
+    LIBUSBD_HANDOFF_GET(pBuf, pImplCtx->has_enumerated);
+    pImplCtx->ep0_fd = libusbd_handoff_get_fd(pBuf);
+    pImplCtx->gadget_fd = -1;
 
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
-    libusbd_linux_buffer_t* pBuffer = &pEp->buffer;
-    
-    pthread_mutex_lock(&pImplCtx->io_mutex);
-    
-    if (pEp->request_in_flight) {
-        struct io_event e[1];
-        io_cancel(pImplCtx->io_ctx, &pEp->fd_iocb, e); // check
-        pEp->request_in_flight = 0;
-    }
+    for (int i = 0; i < pCtx->bNumInterfaces && !pBuf->error; i++)
+    {
+        libusbd_linux_iface_t* pIface = calloc(1, sizeof(libusbd_linux_iface_t));
+        if (!pIface) {
+            pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+            break;
+        }
+        pImplCtx->apInterfaces[i] = pIface;
+
+        LIBUSBD_HANDOFF_GET(pBuf, pIface->is_builtin);
+        pIface->pName = libusbd_handoff_get_str(pCtx, pBuf);
+        LIBUSBD_HANDOFF_GET(pBuf, pIface->bNumEndpoints);
+        if (pIface->bNumEndpoints > LIBUSBD_MAX_IFACE_EPS) {
+            pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+            break;
+        }
+        LIBUSBD_HANDOFF_GET(pBuf, pIface->descFFS);
+        for (int j = 0; j < pIface->bNumEndpoints && !pBuf->error; j++)
+        {
+            libusbd_linux_ep_t* pEp = libusbd_linux_ep_alloc(i, j);
+            if (!pEp) {
+                pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+                break;
+            }
+            pIface->apEndpoints[j] = pEp;
 
-    if (data && pBuffer->data && data != pBuffer->data && len) {
-        if (len > pBuffer->size) return LIBUSBD_LINUX_FAKERET_BADARGS;
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->descFFS);
+        }
 
-        memcpy(pBuffer->data, data, len);
-    }
-    
-    pEp->last_transferred = 0;
-    pEp->ep_async_done = 0;
-    
-    //printf("Start write %x\n", len);
-    struct iocb* p_fd_iocb = &pEp->fd_iocb;
-    
-    io_prep_pwrite(p_fd_iocb, pEp->fd, pBuffer->data, len, 0);
-	/* enable eventfd notification */
-	pEp->fd_iocb.u.c.flags |= IOCB_FLAG_RESFD;
-	pEp->fd_iocb.u.c.resfd = pImplCtx->evfd;
-	/* submit table of requests */
-	int ret = io_submit(pImplCtx->io_ctx, 1, &p_fd_iocb);
-	if (ret >= 0) { /* if ret > 0 request is queued */
-
-	} else {
-		perror("unable to submit request");
-		return LIBUSBD_NONDESCRIPT_ERROR;
-    }
-    
-    pEp->request_in_flight = 1;
-    
-    pthread_mutex_unlock(&pImplCtx->io_mutex);
-	
-	//printf("Done write: %d\n", ret);
+        uint32_t numDescs = 0;
+        LIBUSBD_HANDOFF_GET(pBuf, numDescs);
 
-    //pthread_yield();
+        libusbd_linux_descdata_t** ppNext = &pIface->pNonStandardDescs;
+        for (uint32_t k = 0; k < numDescs && !pBuf->error; k++)
+        {
+            uint8_t idx = 0;
+            uint32_t size = 0;
 
-    /*kern_return_t ret = IOUSBDeviceInterface_WritePipeStart(pImplCtx, iface_num, ep, data, len, timeout_ms);
-    if (ret == LIBUSBD_LINUX_ERR_NOTACTIVATED)
-    {
-        return LIBUSBD_NOT_ENUMERATED;
-    }
-    else if (ret == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
-    }
-    else if (ret == LIBUSBD_LINUX_FAKERET_BADARGS)
-    {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-    else if (ret & 0xFFF00000)
-    {
-        printf("libusbd linux: Unknown error from IOUSBDeviceInterface_WritePipeStart: %08x\n", ret);
-        return LIBUSBD_NONDESCRIPT_ERROR;
+            LIBUSBD_HANDOFF_GET(pBuf, idx);
+            LIBUSBD_HANDOFF_GET(pBuf, size);
+            if (pBuf->error || size > pBuf->size - pBuf->pos) {
+                pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+                break;
+            }
+
+            libusbd_linux_descdata_t* pDesc = libusbd_linux_desc_alloc(pCtx, NULL, size);
+            if (!pDesc) {
+                pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+                break;
+            }
+            pDesc->idx = idx;
+            libusbd_handoff_get(pBuf, pDesc->data, size);
+
+            *ppNext = pDesc;
+            ppNext = &pDesc->pNext;
+        }
+
+        if (!pIface->is_builtin && !pBuf->error) {
+            pIface->setup_buffer.data = libusbd_pool_alloc(pCtx, 0x1000);
+            if (!pIface->setup_buffer.data) {
+                pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+                break;
+            }
+            pIface->setup_buffer.size = 0x1000;
+        }
+
+        for (int j = 0; j < pIface->bNumEndpoints && !pBuf->error; j++)
+        {
+            libusbd_linux_ep_t* pEp = pIface->apEndpoints[j];
+
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->maxPktSize);
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->rearm_policy);
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->rearm_pending);
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->last_op);
+            LIBUSBD_HANDOFF_GET(pBuf, pEp->last_len);
+            if (pEp->last_len > 0x1000) {
+                pBuf->error = LIBUSBD_INVALID_ARGUMENT;
+                break;
+            }
+
+            // Standing writes need their data back regardless of the
+            // retention policy, the rest follow it below. Nothing else is
+            // running yet, so no io_mutex.
+            if (pEp->rearm_pending && pEp->last_op == LIBUSBD_LINUX_OP_WRITE) {
+                if (libusbd_linux_ep_buffer_alloc_locked(pCtx, pEp)) {
+                    pBuf->error = LIBUSBD_RESOURCE_LIMIT_REACHED;
+                    break;
+                }
+                libusbd_handoff_get(pBuf, pEp->buffer.data, pEp->last_len);
+            }
+
+            int fd = libusbd_handoff_get_fd(pBuf);
+            pEp->fd = fd < 0 ? 0 : fd;
+        }
     }
 
-    return ret;*/
-    return LIBUSBD_SUCCESS;
-}
+    pImplCtx->setup_buffer.data = malloc(0x1000);
+    pImplCtx->setup_buffer.size = 0x1000;
 
-int libusbd_impl_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
-{
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    pthread_mutex_init(&pImplCtx->io_mutex, NULL);
+    libusbd_timer_wheel_init(&pImplCtx->ep_timers, libusbd_stats_now_ns() / 1000000);
+
+    int ret = pBuf->error;
+    if (!ret && pImplCtx->ep0_fd < 0) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
     }
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    if (!ret && io_setup(LIBUSBD_LINUX_AIO_EVENTS, &pImplCtx->io_ctx) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd linux: unable to setup aio (%s)", strerror(errno));
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
     }
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    if (!ret) {
+        pImplCtx->evfd = eventfd(0, 0);
+        pImplCtx->ep0_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (pImplCtx->evfd < 0 || pImplCtx->ep0_wake_fd < 0) {
+            LIBUSBD_LOG_ERROR("libusbd linux: unable to open eventfd");
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+        }
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
+    if (ret) {
+        if (pImplCtx->ep0_fd >= 0)
+            close(pImplCtx->ep0_fd);
+        if (pImplCtx->evfd > 0)
+            close(pImplCtx->evfd);
+        if (pImplCtx->io_ctx)
+            io_destroy(pImplCtx->io_ctx);
+
+        // Everything else is what libusbd_linux_free would release anyway
+        pImplCtx->io_ctx = 0;
+        pthread_mutex_destroy(&pImplCtx->io_mutex);
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            libusbd_linux_iface_free(pCtx, pImplCtx->apInterfaces[i]);
+        }
+        if (pImplCtx->ep0_wake_fd > 0)
+            close(pImplCtx->ep0_wake_fd);
+        free(pImplCtx->setup_buffer.data);
+        free(pImplCtx);
+        pCtx->pLinuxCtx = NULL;
 
-    if (pEp->last_error == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
+        return ret;
     }
 
-    return pEp->ep_async_done;
-}
+    // Only used for attribute writes, which are all done by now
+    pImplCtx->gadget_fd = open(LIBUSBD_LINUX_GADGET_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-int libusbd_impl_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
-{
-    if (!pCtx || !pCtx->pLinuxCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    // Otherwise they come with the next ENABLE
+    if (pImplCtx->has_enumerated || pCtx->buffer_retention == LIBUSBD_RETAIN_ALWAYS) {
+        libusbd_linux_buffers_alloc(pCtx);
     }
 
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
+    libusbd_linux_launch_ep0_thread(pCtx);
+    libusbd_linux_launch_async_thread(pCtx);
 
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
+    // Anything still DISABLEd gets picked up by the ep0 thread's next ENABLE
+    if (pImplCtx->has_enumerated) {
+        libusbd_linux_rearm_standing(pCtx);
     }
 
-    libusbd_linux_ctx_t* pImplCtx = pCtx->pLinuxCtx;
-    libusbd_linux_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
-    libusbd_linux_ep_t* pEp = &pIface->aEndpoints[ep];
+    LIBUSBD_LOG_INFO("libusbd linux: Adopted gadget with %u interfaces", pCtx->bNumInterfaces);
 
-    if (pEp->last_error == LIBUSBD_LINUX_ERR_TIMEOUT)
-    {
-        return LIBUSBD_TIMEOUT;
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_linux_probe(void)
+{
+    // Needs configfs with libcomposite, and a UDC to bind to
+    if (access("/sys/kernel/config/usb_gadget", F_OK)) {
+        return LIBUSBD_NOT_IMPLEMENTED;
+    }
+
+    int ret = LIBUSBD_NOT_IMPLEMENTED;
+    DIR* d = opendir("/sys/class/udc");
+    if (d) {
+        struct dirent* dir;
+        while ((dir = readdir(d)) != NULL) {
+            if (strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
+                ret = LIBUSBD_SUCCESS;
+                break;
+            }
+        }
+        closedir(d);
     }
 
-    return pEp->last_transferred;
+    return ret;
 }
+
+const libusbd_backend_ops_t libusbd_backend_linux = {
+    .name = "functionfs",
+    .probe = libusbd_linux_probe,
+    LIBUSBD_BACKEND_OPS(linux),
+};
@@ -5,9 +5,40 @@
 #include <libaio.h>
 #include <pthread.h>
 
+#include "libusbd_priv.h"
+#include "libusbd_timer_wheel.h"
+
 #define IOCB_FLAG_RESFD (1<<0)
 
+// FunctionFS dma-buf transfers (Linux 6.9), missing from older headers
+#ifndef FUNCTIONFS_DMABUF_ATTACH
+struct usb_ffs_dmabuf_transfer_req {
+    int fd;
+    __u32 flags;
+    __u64 length;
+} __attribute__((packed));
+
+#define FUNCTIONFS_DMABUF_ATTACH   _IOW('g', 131, int)
+#define FUNCTIONFS_DMABUF_DETACH   _IOW('g', 132, int)
+#define FUNCTIONFS_DMABUF_TRANSFER _IOW('g', 133, struct usb_ffs_dmabuf_transfer_req)
+#endif
+
+// libusbd_linux_ep_t.last_op
+#define LIBUSBD_LINUX_OP_NONE  (0)
+#define LIBUSBD_LINUX_OP_READ  (1)
+#define LIBUSBD_LINUX_OP_WRITE (2)
+
+// Low bit of iocb.data. Endpoint iocbs carry their submit_gen above it,
+// transfer objects a pointer to themselves with it clear.
+#define LIBUSBD_LINUX_IOCB_EP (1)
+
+// Shared AIO context, sized for plenty of queued transfer objects
+#define LIBUSBD_LINUX_AIO_EVENTS (256)
+#define LIBUSBD_LINUX_AIO_BATCH  (16)
+
 typedef struct libusbd_linux_descdata_t libusbd_linux_descdata_t;
+typedef struct libusbd_linux_xfer_t libusbd_linux_xfer_t;
+typedef struct libusbd_xfer_t libusbd_xfer_t;
 
 typedef struct libusbd_linux_descdata_t
 {
@@ -33,19 +64,66 @@ typedef struct libusbd_linux_buffer_t
     uint64_t size;
 } libusbd_linux_buffer_t;
 
+// Endpoint records are allocated on their own and start on a cache line, so
+// the state the completion path touches doesn't share one with a neighbour's
+#define LIBUSBD_LINUX_CACHELINE (64)
+
 typedef struct libusbd_linux_ep_t
 {
+    // Hot, written on every submit and completion. Kept together up front.
+    //
+    // submit_gen is tagged into fd_iocb.data so completions for a cancelled
+    // iocb aren't mistaken for the one that replaced it.
+    uint64_t submit_gen;
+    uint64_t submit_ns;
     uint64_t last_transferred;
     uint64_t ep_async_done;
     int32_t last_error;
-    uint64_t maxPktSize;
-
-    int fd;
-    struct iocb fd_iocb;
     int request_in_flight;
+    int fd;
+
+    // Where the record sits, so completions can go straight from the iocb
+    // to the endpoint
+    uint8_t iface_num;
+    uint8_t idx;
+
+    // Standing transfer, kept so it can be re-armed after the host
+    // disables/re-enables the function (LIBUSBD_REARM_ON_ENABLE).
+    uint8_t rearm_policy;
+    int rearm_pending;
+    int last_op;
+    uint32_t last_len;
 
     libusbd_linux_buffer_t buffer;
-} libusbd_linux_ep_t;
+
+    // timeout_ms of the async transfer, on the context's ep_timers
+    libusbd_timer_t timeout_timer;
+
+    // Set by libusbd_ep_set_dmabuf, buffer is then the dma-buf's mapping.
+    // While FunctionFS has it attached, transfers skip AIO and finish when
+    // fence_fd (a sync_file for the transfer's fence) signals.
+    int has_dmabuf;
+    int dmabuf_attached;
+    int fence_fd;
+    int dmabuf_fd;
+
+    struct iocb fd_iocb;
+
+    // Cold from here on
+
+    uint64_t maxPktSize;
+    struct usb_endpoint_descriptor_no_audio descFFS;
+
+    // Sync transfers get a context of their own, so the async thread never
+    // reaps them and they can wait with a timeout. sync_in_flight is 1
+    // while someone waits on it, 2 if it timed out and hasn't come back.
+    io_context_t sync_ctx;
+    struct iocb sync_iocb;
+    int sync_in_flight;
+
+    // Sync transfers using the buffer, it isn't released under them
+    int buffer_pins;
+} __attribute__((aligned(LIBUSBD_LINUX_CACHELINE))) libusbd_linux_ep_t;
 
 typedef struct libusbd_linux_iface_t
 {
@@ -59,17 +137,38 @@ typedef struct libusbd_linux_iface_t
 
     int is_builtin;
 
+    // Allocated by add_endpoint, the first bNumEndpoints are set
     uint8_t bNumEndpoints;
-    libusbd_linux_ep_t aEndpoints[16];
+    libusbd_linux_ep_t* apEndpoints[LIBUSBD_MAX_IFACE_EPS];
 
     struct usb_interface_descriptor descFFS;
-    struct usb_endpoint_descriptor_no_audio aEndpointsFFS[16];
 
     libusbd_linux_descdata_t* pStandardDescs;
     libusbd_linux_descdata_t* pNonStandardDescs;
 
 } libusbd_linux_iface_t;
 
+#define LIBUSBD_LINUX_GADGET_PATH "/sys/kernel/config/usb_gadget/libusbd"
+
+// A configfs attribute, name is relative to LIBUSBD_LINUX_GADGET_PATH
+typedef struct libusbd_linux_attr_t
+{
+    const char* name;
+    const char* value;
+} libusbd_linux_attr_t;
+
+// A transfer object's AIO request. iocb comes first, so completions can
+// be mapped straight back from io_event.obj.
+typedef struct libusbd_linux_xfer_t
+{
+    struct iocb iocb;
+    libusbd_xfer_t* pXfer;
+
+    int in_flight;
+    libusbd_linux_xfer_t* pPrev;
+    libusbd_linux_xfer_t* pNext;
+} libusbd_linux_xfer_t;
+
 typedef struct libusbd_linux_ctx_t
 {
     int configId;
@@ -77,14 +176,30 @@ typedef struct libusbd_linux_ctx_t
 
     int ep0_running;
     int async_running;
+    pthread_t ep0_thread;
+    pthread_t async_thread;
+    int ep0_wake_fd;
     int has_enumerated;
     int evfd;
     io_context_t io_ctx;
     pthread_mutex_t io_mutex;
 
+    // Transfer objects queued with AIO, and the ones cancelled under
+    // io_mutex whose callbacks haven't run yet
+    libusbd_linux_xfer_t* pXferHead;
+    libusbd_linux_xfer_t* pXferDone;
+
+    // Async endpoint transfer timeouts in 1ms ticks, expired by the async
+    // thread. Protected by io_mutex.
+    libusbd_timer_wheel_t ep_timers;
+
     libusbd_linux_buffer_t setup_buffer;
-    libusbd_linux_iface_t aInterfaces[16];
 
+    // Allocated by iface_alloc, the first bNumInterfaces are set
+    libusbd_linux_iface_t* apInterfaces[LIBUSBD_MAX_IFACES];
+
+    // The FunctionFS descriptor blob, in the context's arena and sized to fit
+    // once every interface is finalized
     union
     {
         void* write_descs;
@@ -93,8 +208,10 @@ typedef struct libusbd_linux_ctx_t
 
     void* write_descs_next;
     uint32_t write_descs_sz;
+    uint32_t write_descs_cap;
 
     int ep0_fd;
+    int gadget_fd;
     
 } libusbd_linux_ctx_t;
 
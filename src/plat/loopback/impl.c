@@ -0,0 +1,1959 @@
+#include "impl.h"
+
+#include "impl_priv.h"
+#include "libusbd_backend.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_pool.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
+#include "libusbd_transfer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "libusbd_priv.h"
+#include "libusbd_arena.h"
+
+#define LIBUSBD_LOOPBACK_EP_BUFFER_SZ (0x1000)
+
+#define LIBUSBD_LOOPBACK_EPADDR_IDX(addr) (((addr) & 0xF) | (((addr) & 0x80) ? 0x10 : 0))
+
+//
+// Transfer queues
+//
+
+static void libusbd_loopback_xfer_enqueue(libusbd_loopback_xfer_t** ppHead, libusbd_loopback_xfer_t** ppTail, libusbd_loopback_xfer_t* pXfer)
+{
+    pXfer->pNext = NULL;
+    if (*ppTail) {
+        (*ppTail)->pNext = pXfer;
+    }
+    else {
+        *ppHead = pXfer;
+    }
+    *ppTail = pXfer;
+}
+
+static libusbd_loopback_xfer_t* libusbd_loopback_xfer_pop(libusbd_loopback_xfer_t** ppHead, libusbd_loopback_xfer_t** ppTail)
+{
+    libusbd_loopback_xfer_t* pXfer = *ppHead;
+    if (!pXfer) return NULL;
+
+    *ppHead = pXfer->pNext;
+    if (!*ppHead) {
+        *ppTail = NULL;
+    }
+    pXfer->pNext = NULL;
+
+    return pXfer;
+}
+
+static int libusbd_loopback_xfer_unlink(libusbd_loopback_xfer_t** ppHead, libusbd_loopback_xfer_t** ppTail, libusbd_loopback_xfer_t* pXfer)
+{
+    libusbd_loopback_xfer_t* pPrev = NULL;
+    libusbd_loopback_xfer_t* pIter = *ppHead;
+    while (pIter)
+    {
+        if (pIter == pXfer) {
+            if (pPrev) {
+                pPrev->pNext = pIter->pNext;
+            }
+            else {
+                *ppHead = pIter->pNext;
+            }
+
+            if (*ppTail == pIter) {
+                *ppTail = pPrev;
+            }
+            pIter->pNext = NULL;
+            return 1;
+        }
+
+        pPrev = pIter;
+        pIter = pIter->pNext;
+    }
+
+    return 0;
+}
+
+// Must be called with io_mutex held. timeout_ms of 0 waits forever.
+static int libusbd_loopback_wait_locked(libusbd_loopback_ctx_t* pImplCtx, int* pDone, uint64_t timeout_ms)
+{
+    struct timespec ts;
+
+    if (timeout_ms) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    while (!*pDone)
+    {
+        if (!timeout_ms) {
+            pthread_cond_wait(&pImplCtx->io_cond, &pImplCtx->io_mutex);
+        }
+        else if (pthread_cond_timedwait(&pImplCtx->io_cond, &pImplCtx->io_mutex, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    return *pDone;
+}
+
+//
+// Completion
+//
+
+static uint64_t libusbd_loopback_ep_submitted(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
+{
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, len, 0);
+    libusbd_stats_submit(pCtx, iface_num, ep);
+
+    return libusbd_stats_now_ns();
+}
+
+static void libusbd_loopback_ep_completed(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int ret, uint64_t submit_ns)
+{
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, submit_ns);
+}
+
+// Must be called with io_mutex held, pXfer already off the queue
+static void libusbd_loopback_dev_complete_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t ep, libusbd_loopback_xfer_t* pXfer, int status)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pXfer->status = status < 0 ? status : (int)pXfer->actual;
+    pXfer->done = 1;
+
+    // Sync transfers are accounted for by the waiter
+    if (pXfer == &pEp->async_xfer) {
+        pEp->async_queued = 0;
+        pEp->last_transferred = status < 0 ? 0 : pXfer->actual;
+        pEp->ep_async_done = 1;
+        libusbd_loopback_ep_completed(pCtx, iface_num, ep, pXfer->status, status < 0 ? 0 : pEp->submit_ns);
+    }
+    else if (pXfer->pOwner) {
+        libusbd_loopback_xfer_enqueue(&pImplCtx->pDoneHead, &pImplCtx->pDoneTail, pXfer);
+    }
+
+    pthread_cond_broadcast(&pImplCtx->io_cond);
+}
+
+// Must be called with io_mutex held, pXfer already off the queue
+static void libusbd_loopback_host_complete_locked(libusbd_loopback_ctx_t* pImplCtx, libusbd_loopback_xfer_t* pXfer, int status)
+{
+    pXfer->status = status < 0 ? status : (int)pXfer->actual;
+    pXfer->done = 1;
+
+    if (pXfer->cb) {
+        libusbd_loopback_xfer_enqueue(&pImplCtx->pDoneHead, &pImplCtx->pDoneTail, pXfer);
+    }
+
+    pthread_cond_broadcast(&pImplCtx->io_cond);
+}
+
+// Runs host callbacks and finishes device transfer objects queued by
+// *_complete_locked. Must be called without io_mutex held.
+static void libusbd_loopback_run_callbacks(libusbd_loopback_ctx_t* pImplCtx)
+{
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_loopback_xfer_t* pIter = pImplCtx->pDoneHead;
+    pImplCtx->pDoneHead = NULL;
+    pImplCtx->pDoneTail = NULL;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    while (pIter)
+    {
+        libusbd_loopback_xfer_t* pNext = pIter->pNext;
+
+        if (pIter->pOwner) {
+            // Can be resubmitted from in here, pNext is already saved
+            libusbd_xfer_complete(pIter->pOwner, pIter->status);
+        }
+        else {
+            pIter->cb(pIter->user, pIter->status);
+            free(pIter);
+        }
+
+        pIter = pNext;
+    }
+}
+
+// Pairs up device and host requests on an endpoint, oldest first. A writer's
+// transfer ending also ends the reader's, like a short packet would.
+//
+// Must be called with io_mutex held
+static void libusbd_loopback_pump_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t ep)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    int is_in = (pEp->direction == USB_EP_DIR_IN);
+
+    if (!pImplCtx->has_enumerated || pEp->halted) {
+        return;
+    }
+
+    while (pEp->pDevHead && pEp->pHostHead)
+    {
+        libusbd_loopback_xfer_t* pDev = pEp->pDevHead;
+        libusbd_loopback_xfer_t* pHost = pEp->pHostHead;
+        libusbd_loopback_xfer_t* pWriter = is_in ? pDev : pHost;
+        libusbd_loopback_xfer_t* pReader = is_in ? pHost : pDev;
+
+        uint32_t n = pWriter->len - pWriter->actual;
+        if (n > pReader->len - pReader->actual) {
+            n = pReader->len - pReader->actual;
+        }
+
+        if (n) {
+            memcpy(pReader->data + pReader->actual, pWriter->data + pWriter->actual, n);
+            pWriter->actual += n;
+            pReader->actual += n;
+        }
+
+        int writer_done = (pWriter->actual == pWriter->len);
+        int reader_done = (pReader->actual == pReader->len) || writer_done;
+
+        if (is_in ? writer_done : reader_done) {
+            libusbd_loopback_xfer_pop(&pEp->pDevHead, &pEp->pDevTail);
+            libusbd_loopback_dev_complete_locked(pCtx, iface_num, ep, pDev, LIBUSBD_SUCCESS);
+        }
+
+        if (is_in ? reader_done : writer_done) {
+            libusbd_loopback_xfer_pop(&pEp->pHostHead, &pEp->pHostTail);
+            libusbd_loopback_host_complete_locked(pImplCtx, pHost, LIBUSBD_SUCCESS);
+        }
+    }
+}
+
+static void libusbd_loopback_pump_all_locked(libusbd_ctx_t* pCtx)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        for (int j = 0; j < pImplCtx->aInterfaces[i].bNumEndpoints; j++)
+        {
+            libusbd_loopback_pump_locked(pCtx, i, j);
+        }
+    }
+}
+
+static void libusbd_loopback_cancel_host_locked(libusbd_loopback_ctx_t* pImplCtx, libusbd_loopback_ep_t* pEp, int status)
+{
+    libusbd_loopback_xfer_t* pXfer;
+    while ((pXfer = libusbd_loopback_xfer_pop(&pEp->pHostHead, &pEp->pHostTail)))
+    {
+        libusbd_loopback_host_complete_locked(pImplCtx, pXfer, status);
+    }
+}
+
+// Must be called with io_mutex held
+static int libusbd_loopback_ep_buffer_alloc_locked(libusbd_ctx_t* pCtx, libusbd_loopback_ep_t* pEp)
+{
+    if (pEp->buffer.data) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    pEp->buffer.data = libusbd_pool_alloc(pCtx, LIBUSBD_LOOPBACK_EP_BUFFER_SZ);
+    if (!pEp->buffer.data) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pEp->buffer.size = LIBUSBD_LOOPBACK_EP_BUFFER_SZ;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Gives the buffer back to the pool under LIBUSBD_RETAIN_WHILE_ENABLED, if the
+// host has unconfigured the device and nothing needs it anymore.
+//
+// Must be called with io_mutex held
+static void libusbd_loopback_ep_buffer_release_locked(libusbd_ctx_t* pCtx, libusbd_loopback_ep_t* pEp)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    if (pCtx->buffer_retention != LIBUSBD_RETAIN_WHILE_ENABLED || pImplCtx->has_enumerated) return;
+
+    // Standing transfers resend from it after the next SET_CONFIGURATION
+    if (!pEp->buffer.data || pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE) return;
+
+    if (pEp->async_queued || pEp->buffer_pins) return;
+
+    libusbd_pool_free(pCtx, pEp->buffer.data);
+    pEp->buffer.data = NULL;
+    pEp->buffer.size = 0;
+}
+
+// Keeps the buffer around for a sync transfer, bringing it back if it was
+// released. Fails if len doesn't fit.
+static int libusbd_loopback_ep_buffer_pin(libusbd_ctx_t* pCtx, libusbd_loopback_ep_t* pEp, uint32_t len)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ret = libusbd_loopback_ep_buffer_alloc_locked(pCtx, pEp);
+    if (!ret && len > pEp->buffer.size) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
+    if (!ret) {
+        pEp->buffer_pins++;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return ret;
+}
+
+static void libusbd_loopback_ep_buffer_unpin(libusbd_ctx_t* pCtx, libusbd_loopback_ep_t* pEp)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->buffer_pins--;
+    libusbd_loopback_ep_buffer_release_locked(pCtx, pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+}
+
+// Must be called with io_mutex held
+static void libusbd_loopback_disconnect_locked(libusbd_ctx_t* pCtx, int keep_standing)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    pImplCtx->has_enumerated = 0;
+    pImplCtx->bConfigurationValue = 0;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[i];
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_loopback_ep_t* pEp = &pIface->aEndpoints[j];
+
+            pEp->halted = 0;
+            libusbd_loopback_cancel_host_locked(pImplCtx, pEp, LIBUSBD_CANCELLED);
+
+            libusbd_loopback_xfer_t* pIter = pEp->pDevHead;
+            while (pIter)
+            {
+                libusbd_loopback_xfer_t* pNext = pIter->pNext;
+
+                // Standing transfers get resubmitted from scratch on the next enable
+                if (keep_standing && pIter == &pEp->async_xfer && pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE) {
+                    pIter->actual = 0;
+                }
+                else {
+                    libusbd_loopback_xfer_unlink(&pEp->pDevHead, &pEp->pDevTail, pIter);
+                    libusbd_loopback_dev_complete_locked(pCtx, i, j, pIter, LIBUSBD_CANCELLED);
+                }
+
+                pIter = pNext;
+            }
+
+            libusbd_loopback_ep_buffer_release_locked(pCtx, pEp);
+        }
+    }
+
+    pthread_cond_broadcast(&pImplCtx->io_cond);
+}
+
+//
+// Descriptors
+//
+
+// The node and its data are one allocation in the context's arena
+static libusbd_loopback_descdata_t* libusbd_loopback_desc_append(libusbd_ctx_t* pCtx, libusbd_loopback_descdata_t** ppHead, const uint8_t* pDesc, uint64_t descSz)
+{
+    libusbd_loopback_descdata_t* pNewDesc = libusbd_arena_alloc(pCtx, sizeof(libusbd_loopback_descdata_t) + descSz);
+    if (!pNewDesc) return NULL;
+
+    pNewDesc->pNext = NULL;
+    pNewDesc->data = pNewDesc + 1;
+    memcpy(pNewDesc->data, pDesc, descSz);
+    pNewDesc->size = descSz;
+    pNewDesc->idx = 0;
+
+    // Keep the order they were added in, it's the order the host sees
+    while (*ppHead) {
+        ppHead = &(*ppHead)->pNext;
+    }
+    *ppHead = pNewDesc;
+
+    return pNewDesc;
+}
+
+static int libusbd_loopback_build_config_desc(libusbd_ctx_t* pCtx)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    uint32_t total = 9;
+    uint8_t bNumInterfaces = 0;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[i];
+        if (pIface->is_builtin) continue;
+
+        total += 9 + (7 * pIface->bNumEndpoints);
+        for (libusbd_loopback_descdata_t* pIter = pIface->pStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            total += pIter->size;
+        }
+        bNumInterfaces++;
+    }
+
+    if (total > 0xFFFF) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    uint8_t* pDesc = libusbd_arena_alloc(pCtx, total);
+    if (!pDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    uint8_t* pNext = pDesc;
+    uint8_t config[9] = {9, 0x02, total & 0xFF, total >> 8, bNumInterfaces, 1, 0, 0xC0, 50};
+    memcpy(pNext, config, sizeof(config));
+    pNext += sizeof(config);
+
+    uint8_t epNum = 1;
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[i];
+        libusbd_iface_t* pIfaceSuper = &pCtx->aInterfaces[i];
+        if (pIface->is_builtin) continue;
+
+        uint8_t iface[9] = {9, 0x04, i, 0, pIface->bNumEndpoints, pIfaceSuper->bClass, pIfaceSuper->bSubclass, pIfaceSuper->bProtocol, 0};
+        memcpy(pNext, iface, sizeof(iface));
+        pNext += sizeof(iface);
+
+        for (libusbd_loopback_descdata_t* pIter = pIface->pStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            memcpy(pNext, pIter->data, pIter->size);
+            pNext += pIter->size;
+        }
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_loopback_ep_t* pEp = &pIface->aEndpoints[j];
+
+            pEp->address = epNum++ | (pEp->direction == USB_EP_DIR_IN ? 0x80 : 0x00);
+            pImplCtx->aEpAddrIface[LIBUSBD_LOOPBACK_EPADDR_IDX(pEp->address)] = i;
+            pImplCtx->aEpAddrIdx[LIBUSBD_LOOPBACK_EPADDR_IDX(pEp->address)] = j;
+
+            uint8_t epDesc[7] = {7, 0x05, pEp->address, pEp->type, pEp->maxPktSize & 0xFF, (pEp->maxPktSize >> 8) & 0xFF, pEp->interval};
+            memcpy(pNext, epDesc, sizeof(epDesc));
+            pNext += sizeof(epDesc);
+        }
+    }
+
+    // A rebuild leaves the old one in the arena
+    pImplCtx->pConfigDesc = pDesc;
+    pImplCtx->configDescSz = total;
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_loopback_string_desc(libusbd_ctx_t* pCtx, uint8_t idx, uint8_t* pOut)
+{
+    const char* pStr = NULL;
+
+    if (idx == 0) {
+        uint8_t langs[4] = {4, 0x03, 0x09, 0x04};
+        memcpy(pOut, langs, sizeof(langs));
+        return sizeof(langs);
+    }
+
+    if (idx == 1) pStr = pCtx->pManufacturerStr;
+    else if (idx == 2) pStr = pCtx->pProductStr;
+    else if (idx == 3) pStr = pCtx->pSerialStr;
+
+    if (!pStr) {
+        return LIBUSBD_STALLED;
+    }
+
+    // ASCII -> UTF-16LE, truncated to what fits in bLength
+    int len = 0;
+    for (; pStr[len] && len < 126; len++)
+    {
+        pOut[2 + (len * 2)] = pStr[len];
+        pOut[3 + (len * 2)] = 0;
+    }
+    pOut[0] = 2 + (len * 2);
+    pOut[1] = 0x03;
+
+    return pOut[0];
+}
+
+//
+// Init/config
+//
+
+int libusbd_loopback_init(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pCtx->pLoopbackCtx = malloc(sizeof(libusbd_loopback_ctx_t));
+    if (!pCtx->pLoopbackCtx) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pCtx->pLoopbackCtx, 0, sizeof(*pCtx->pLoopbackCtx));
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    pthread_mutex_init(&pImplCtx->io_mutex, NULL);
+    pthread_cond_init(&pImplCtx->io_cond, NULL);
+
+    memset(pImplCtx->aEpAddrIface, 0xFF, sizeof(pImplCtx->aEpAddrIface));
+    memset(pImplCtx->aEpAddrIdx, 0xFF, sizeof(pImplCtx->aEpAddrIdx));
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_free(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_loopback_disconnect_locked(pCtx, 0);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    if (pImplCtx->pHost) {
+        LIBUSBD_LOG_WARN("libusbd loopback: Freeing context with the host still open");
+        pImplCtx->pHost->pCtx = NULL;
+        pImplCtx->pHost = NULL;
+    }
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        libusbd_pool_free(pCtx, pIface->setup_buffer.data);
+        pIface->setup_buffer.data = NULL;
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_pool_free(pCtx, pIface->aEndpoints[j].buffer.data);
+            pIface->aEndpoints[j].buffer.data = NULL;
+            pIface->aEndpoints[j].buffer.size = 0;
+        }
+    }
+
+    pImplCtx->pConfigDesc = NULL;
+
+    pthread_cond_destroy(&pImplCtx->io_cond);
+    pthread_mutex_destroy(&pImplCtx->io_mutex);
+
+    free(pImplCtx);
+    pCtx->pLoopbackCtx = NULL;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_config_finalize(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+
+    if (pIface->is_builtin) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    pIface->setup_buffer.data = libusbd_pool_alloc(pCtx, LIBUSBD_LOOPBACK_EP_BUFFER_SZ);
+    pIface->setup_buffer.size = LIBUSBD_LOOPBACK_EP_BUFFER_SZ;
+
+    // Otherwise they come with SET_CONFIGURATION
+    if (pCtx->buffer_retention == LIBUSBD_RETAIN_ALWAYS) {
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            pIface->aEndpoints[j].buffer.data = libusbd_pool_alloc(pCtx, LIBUSBD_LOOPBACK_EP_BUFFER_SZ);
+            pIface->aEndpoints[j].buffer.size = LIBUSBD_LOOPBACK_EP_BUFFER_SZ;
+        }
+    }
+
+    pCtx->aInterfaces[iface_num].finalized = true;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        if (!pCtx->aInterfaces[i].finalized) {
+            return LIBUSBD_SUCCESS;
+        }
+    }
+
+    // Everything's in, the device can be "plugged in"
+    int ret = libusbd_loopback_build_config_desc(pCtx);
+    if (ret) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pImplCtx->all_finalized = 1;
+    pthread_cond_broadcast(&pImplCtx->io_cond);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pDesc) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (!libusbd_loopback_desc_append(pCtx, &pIface->pStandardDescs, pDesc, descSz)) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pDesc) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    libusbd_loopback_descdata_t* pNewDesc = libusbd_loopback_desc_append(pCtx, &pIface->pNonStandardDescs, pDesc, descSz);
+    if (!pNewDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pNewDesc->idx = descType;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pEpOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+    if (pIface->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    libusbd_loopback_ep_t* pEp = &pIface->aEndpoints[pIface->bNumEndpoints];
+    pEp->maxPktSize = maxPktSize;
+    pEp->type = USB_EPATTR_TTYPE(type);
+    pEp->direction = direction;
+    pEp->interval = interval;
+
+    *pEpOut = pIface->bNumEndpoints++;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !name) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // No kernel-side functions to alias to
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_loopback_iface_alloc(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+
+    pIface->setup_callback = func;
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Device-side endpoints
+//
+
+static int libusbd_loopback_ep_sync(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeoutMs)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    libusbd_loopback_xfer_t xfer;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.len = len;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    xfer.data = pEp->buffer.data;
+
+    if (!pImplCtx->has_enumerated) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    uint64_t submit_ns = libusbd_loopback_ep_submitted(pCtx, iface_num, ep, len);
+
+    libusbd_loopback_xfer_enqueue(&pEp->pDevHead, &pEp->pDevTail, &xfer);
+    libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+
+    int ret;
+    if (libusbd_loopback_wait_locked(pImplCtx, &xfer.done, timeoutMs)) {
+        ret = xfer.status;
+    }
+    else {
+        libusbd_loopback_xfer_unlink(&pEp->pDevHead, &pEp->pDevTail, &xfer);
+        ret = LIBUSBD_TIMEOUT;
+    }
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+    libusbd_loopback_ep_completed(pCtx, iface_num, ep, ret, ret >= 0 ? submit_ns : 0);
+
+    return ret;
+}
+
+int libusbd_loopback_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    libusbd_loopback_buffer_t* pBuffer = &pEp->buffer;
+
+    int ret = libusbd_loopback_ep_buffer_pin(pCtx, pEp, len);
+    if (ret) {
+        return ret;
+    }
+
+    ret = libusbd_loopback_ep_sync(pCtx, iface_num, ep, len, timeoutMs);
+
+    if (ret > 0 && data && data != pBuffer->data) {
+        memcpy(data, pBuffer->data, ret);
+    }
+
+    libusbd_loopback_ep_buffer_unpin(pCtx, pEp);
+
+    return ret;
+}
+
+int libusbd_loopback_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    libusbd_loopback_buffer_t* pBuffer = &pEp->buffer;
+
+    int ret = libusbd_loopback_ep_buffer_pin(pCtx, pEp, len);
+    if (ret) {
+        return ret;
+    }
+
+    if (data && data != pBuffer->data && len) {
+        memcpy(pBuffer->data, data, len);
+    }
+
+    ret = libusbd_loopback_ep_sync(pCtx, iface_num, ep, len, timeoutMs);
+
+    libusbd_loopback_ep_buffer_unpin(pCtx, pEp);
+
+    return ret;
+}
+
+int libusbd_loopback_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    // Halted until the host sends CLEAR_FEATURE(ENDPOINT_HALT)
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->halted = 1;
+    libusbd_loopback_cancel_host_locked(pImplCtx, pEp, LIBUSBD_STALLED);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->halted = 0;
+    libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_loopback_xfer_t* pXfer;
+    while ((pXfer = libusbd_loopback_xfer_pop(&pEp->pDevHead, &pEp->pDevTail)))
+    {
+        LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, iface_num, ep, 0, 0);
+        libusbd_loopback_dev_complete_locked(pCtx, iface_num, ep, pXfer, LIBUSBD_CANCELLED);
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    // Brought back if it was released, until the next unconfigure
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ret = libusbd_loopback_ep_buffer_alloc_locked(pCtx, pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    if (ret) {
+        return ret;
+    }
+
+    *pOut = pEp->buffer.data;
+
+    return (pEp->buffer.size & 0x7FFFFFFF);
+}
+
+// Must be called with io_mutex held
+static void libusbd_loopback_ep_start_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pEp->async_xfer.data = pEp->buffer.data;
+    pEp->async_xfer.len = len;
+    pEp->async_xfer.actual = 0;
+    pEp->async_xfer.done = 0;
+    pEp->async_xfer.status = 0;
+
+    pEp->last_transferred = 0;
+    pEp->ep_async_done = 0;
+
+    pEp->submit_ns = libusbd_loopback_ep_submitted(pCtx, iface_num, ep, len);
+
+    libusbd_loopback_xfer_enqueue(&pEp->pDevHead, &pEp->pDevTail, &pEp->async_xfer);
+    pEp->async_queued = 1;
+
+    libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+}
+
+// Must be called with io_mutex held
+static void libusbd_loopback_ep_cancel_async_locked(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    if (!pEp->async_queued) return;
+
+    LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, iface_num, ep, 0, 0);
+    libusbd_loopback_xfer_unlink(&pEp->pDevHead, &pEp->pDevTail, &pEp->async_xfer);
+    libusbd_loopback_dev_complete_locked(pCtx, iface_num, ep, &pEp->async_xfer, LIBUSBD_CANCELLED);
+}
+
+int libusbd_loopback_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    int ret = libusbd_loopback_ep_buffer_alloc_locked(pCtx, pEp);
+    if (!ret && len > pEp->buffer.size) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
+    if (ret) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return ret;
+    }
+
+    libusbd_loopback_ep_cancel_async_locked(pCtx, iface_num, ep);
+    libusbd_loopback_ep_start_locked(pCtx, iface_num, ep, len);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    if (!pImplCtx->has_enumerated && pEp->rearm_policy != LIBUSBD_REARM_ON_ENABLE) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    int ret = libusbd_loopback_ep_buffer_alloc_locked(pCtx, pEp);
+    if (!ret && len > pEp->buffer.size) {
+        ret = LIBUSBD_INVALID_ARGUMENT;
+    }
+    if (ret) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return ret;
+    }
+
+    libusbd_loopback_ep_cancel_async_locked(pCtx, iface_num, ep);
+
+    if (data && data != pEp->buffer.data && len) {
+        memcpy(pEp->buffer.data, data, len);
+    }
+
+    libusbd_loopback_ep_start_locked(pCtx, iface_num, ep, len);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (policy != LIBUSBD_REARM_NONE && policy != LIBUSBD_REARM_ON_ENABLE) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->rearm_policy = policy;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The simulated host copies out of ordinary buffers
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_loopback_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_loopback_ep_get_fifo_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    int ret = 0;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (!pImplCtx->has_enumerated) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    // Whatever the writing side has queued that the reader hasn't taken yet
+    libusbd_loopback_xfer_t* pIter = (pEp->direction == USB_EP_DIR_IN) ? pEp->pDevHead : pEp->pHostHead;
+    for (; pIter; pIter = pIter->pNext)
+    {
+        ret += pIter->len - pIter->actual;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return ret;
+}
+
+int libusbd_loopback_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    return __atomic_load_n(&pEp->ep_async_done, __ATOMIC_ACQUIRE);
+}
+
+int libusbd_loopback_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    return pEp->last_transferred;
+}
+
+//
+// Host side
+//
+
+int libusbd_loopback_host_open(libusbd_ctx_t* pCtx, libusbd_loopback_host_t** pOut)
+{
+    // pPlatCtx belongs to whichever backend the ctx was created with
+    if (!pCtx || pCtx->pOps != &libusbd_backend_loopback || !pCtx->pLoopbackCtx || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    if (pImplCtx->pHost) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    libusbd_loopback_host_t* pHost = malloc(sizeof(libusbd_loopback_host_t));
+    if (!pHost) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pHost->pCtx = pCtx;
+    pImplCtx->pHost = pHost;
+
+    *pOut = pHost;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_host_close(libusbd_loopback_host_t* pHost)
+{
+    if (!pHost) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pHost->pCtx) {
+        libusbd_loopback_host_disconnect(pHost);
+        pHost->pCtx->pLoopbackCtx->pHost = NULL;
+    }
+
+    free(pHost);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_host_disconnect(libusbd_loopback_host_t* pHost)
+{
+    if (!pHost || !pHost->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_ctx_t* pCtx = pHost->pCtx;
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+
+    LIBUSBD_LOG_DEBUG("libusbd loopback: Host disconnect");
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_loopback_disconnect_locked(pCtx, 1);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_host_enumerate(libusbd_loopback_host_t* pHost, uint64_t timeout_ms)
+{
+    if (!pHost || !pHost->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pHost->pCtx->pLoopbackCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ready = libusbd_loopback_wait_locked(pImplCtx, &pImplCtx->all_finalized, timeout_ms);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (!ready) {
+        return LIBUSBD_TIMEOUT;
+    }
+
+    // Same order a real host goes through
+    uint8_t desc[18];
+    int ret = libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0100, 0, desc, sizeof(desc), timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = libusbd_loopback_host_control(pHost, LIBUSBD_HOST2DEV_DEVICE, LIBUSBD_SET_ADDRESS, 1, 0, NULL, 0, timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0200, 0, desc, 9, timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = libusbd_loopback_host_control(pHost, LIBUSBD_HOST2DEV_DEVICE, LIBUSBD_SET_CONFIGURATION, 1, 0, NULL, 0, timeout_ms);
+    if (ret < 0) {
+        return ret;
+    }
+
+    LIBUSBD_LOG_DEBUG("libusbd loopback: Host enumerated device");
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Standard requests, handled by the "controller" like the kernel would.
+// Returns the reply length, or LIBUSBD_STALLED.
+//
+// Must be called with io_mutex held
+static int libusbd_loopback_standard_request_locked(libusbd_ctx_t* pCtx, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t* pReply, uint16_t wLength)
+{
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    uint8_t recipient = bmRequestType & 0x1F;
+
+    if (bmRequestType == LIBUSBD_DEV2HOST_DEVICE && bRequest == LIBUSBD_GET_DESCRIPTOR)
+    {
+        uint8_t descType = wValue >> 8;
+        uint8_t descIdx = wValue & 0xFF;
+
+        if (descType == 0x01) {
+            uint16_t vid = pCtx->vid ? pCtx->vid : 0x1d6b;
+            uint16_t pid = pCtx->pid ? pCtx->pid : 0x0052;
+            uint16_t did = pCtx->did ? pCtx->did : 0x0100;
+            uint8_t dev[18] = {18, 0x01, 0x00, 0x02, pCtx->bClass, pCtx->bSubclass, pCtx->bProtocol, 64,
+                               vid & 0xFF, vid >> 8, pid & 0xFF, pid >> 8, did & 0xFF, did >> 8,
+                               pCtx->pManufacturerStr ? 1 : 0, pCtx->pProductStr ? 2 : 0, pCtx->pSerialStr ? 3 : 0, 1};
+            memcpy(pReply, dev, sizeof(dev));
+            return sizeof(dev);
+        }
+        else if (descType == 0x02 && descIdx == 0) {
+            memcpy(pReply, pImplCtx->pConfigDesc, pImplCtx->configDescSz);
+            return pImplCtx->configDescSz;
+        }
+        else if (descType == 0x03) {
+            return libusbd_loopback_string_desc(pCtx, descIdx, pReply);
+        }
+
+        return LIBUSBD_STALLED;
+    }
+    else if (bmRequestType == LIBUSBD_DEV2HOST_INTERFACE && bRequest == LIBUSBD_GET_DESCRIPTOR)
+    {
+        if (wIndex >= pCtx->bNumInterfaces) return LIBUSBD_STALLED;
+
+        libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[wIndex];
+        for (libusbd_loopback_descdata_t* pIter = pIface->pNonStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            if (pIter->idx == (wValue >> 8)) {
+                memcpy(pReply, pIter->data, pIter->size);
+                return pIter->size;
+            }
+        }
+
+        return LIBUSBD_STALLED;
+    }
+    else if (bRequest == LIBUSBD_SET_CONFIGURATION && bmRequestType == LIBUSBD_HOST2DEV_DEVICE)
+    {
+        if (wValue == 0) {
+            libusbd_loopback_disconnect_locked(pCtx, 1);
+            return 0;
+        }
+        else if (wValue != 1) {
+            return LIBUSBD_STALLED;
+        }
+
+        // Before has_enumerated, so nothing can be pumped into a missing buffer
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            for (int j = 0; j < pImplCtx->aInterfaces[i].bNumEndpoints; j++)
+            {
+                if (libusbd_loopback_ep_buffer_alloc_locked(pCtx, &pImplCtx->aInterfaces[i].aEndpoints[j])) {
+                    return LIBUSBD_STALLED;
+                }
+            }
+        }
+
+        pImplCtx->bConfigurationValue = wValue;
+        pImplCtx->has_enumerated = 1;
+        libusbd_loopback_pump_all_locked(pCtx);
+
+        pthread_cond_broadcast(&pImplCtx->io_cond);
+        return 0;
+    }
+    else if (bRequest == LIBUSBD_GET_CONFIGURATION && bmRequestType == LIBUSBD_DEV2HOST_DEVICE)
+    {
+        pReply[0] = pImplCtx->bConfigurationValue;
+        return 1;
+    }
+    else if (bRequest == LIBUSBD_GET_STATUS && (bmRequestType & LIBUSBD_DEV2HOST_DIR))
+    {
+        pReply[0] = (recipient == 0) ? 0x01 : 0x00; // self-powered
+        pReply[1] = 0;
+
+        if (recipient == 2) {
+            uint8_t idx = LIBUSBD_LOOPBACK_EPADDR_IDX(wIndex);
+            if (pImplCtx->aEpAddrIface[idx] == 0xFF) return LIBUSBD_STALLED;
+
+            pReply[0] = pImplCtx->aInterfaces[pImplCtx->aEpAddrIface[idx]].aEndpoints[pImplCtx->aEpAddrIdx[idx]].halted;
+        }
+        return 2;
+    }
+    else if ((bRequest == LIBUSBD_CLEAR_FEATURE || bRequest == LIBUSBD_SET_FEATURE) && bmRequestType == LIBUSBD_HOST2DEV_ENDPOINT)
+    {
+        uint8_t idx = LIBUSBD_LOOPBACK_EPADDR_IDX(wIndex);
+        if (wValue != 0 || pImplCtx->aEpAddrIface[idx] == 0xFF) return LIBUSBD_STALLED;
+
+        uint8_t iface_num = pImplCtx->aEpAddrIface[idx];
+        uint8_t ep = pImplCtx->aEpAddrIdx[idx];
+        libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+        // ENDPOINT_HALT
+        if (bRequest == LIBUSBD_SET_FEATURE) {
+            pEp->halted = 1;
+            libusbd_loopback_cancel_host_locked(pImplCtx, pEp, LIBUSBD_STALLED);
+        }
+        else {
+            pEp->halted = 0;
+            libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+        }
+        return 0;
+    }
+    else if (bRequest == LIBUSBD_GET_INTERFACE && bmRequestType == LIBUSBD_DEV2HOST_INTERFACE)
+    {
+        pReply[0] = 0;
+        return 1;
+    }
+    else if ((bRequest == LIBUSBD_SET_ADDRESS || bRequest == LIBUSBD_SET_FEATURE || bRequest == LIBUSBD_CLEAR_FEATURE) && !(bmRequestType & LIBUSBD_DEV2HOST_DIR))
+    {
+        return 0;
+    }
+    else if (bRequest == 11 && bmRequestType == LIBUSBD_HOST2DEV_INTERFACE) // SET_INTERFACE
+    {
+        return 0;
+    }
+
+    return LIBUSBD_STALLED;
+}
+
+static int libusbd_loopback_host_do_control(libusbd_loopback_host_t* pHost, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void* data, uint16_t wLength, uint64_t timeout_ms)
+{
+    libusbd_ctx_t* pCtx = pHost->pCtx;
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    int is_in = bmRequestType & LIBUSBD_DEV2HOST_DIR;
+    int ret;
+
+    LIBUSBD_TRACE(pCtx, setup, LIBUSBD_TRACE_SETUP, 0xFF, 0,
+                  (uint32_t)bmRequestType << 24 | bRequest << 16 | wValue,
+                  (uint32_t)wIndex << 16 | wLength);
+
+    LIBUSBD_LOG_DEBUG("libusbd loopback: Setup: %x %x", bmRequestType, bRequest);
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    if (!pImplCtx->all_finalized) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    // Standard requests
+    if (((bmRequestType >> 5) & 0x3) == 0) {
+        ret = libusbd_loopback_standard_request_locked(pCtx, bmRequestType, bRequest, wValue, wIndex, pImplCtx->aEp0Reply, wLength);
+
+        if (ret >= 0 && is_in) {
+            if (ret > wLength) ret = wLength;
+            memcpy(data, pImplCtx->aEp0Reply, ret);
+        }
+        else if (ret >= 0) {
+            ret = 0;
+        }
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+        libusbd_loopback_run_callbacks(pImplCtx);
+
+        return ret;
+    }
+
+    // Class/vendor requests go to the interface's callback
+    uint8_t iface_num = 0;
+    if ((bmRequestType & 0x1F) == 1) {
+        iface_num = wIndex & 0xFF;
+    }
+    else if ((bmRequestType & 0x1F) == 2) {
+        iface_num = pImplCtx->aEpAddrIface[LIBUSBD_LOOPBACK_EPADDR_IDX(wIndex)];
+    }
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (iface_num >= pCtx->bNumInterfaces) {
+        return LIBUSBD_STALLED;
+    }
+
+    libusbd_loopback_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    libusbd_setup_callback_info_t* pInfo = &pIface->setup_callback_info;
+
+    if (!pIface->setup_callback) {
+        // Nobody to ask, ACK it like FunctionFS would
+        return is_in ? 0 : wLength;
+    }
+
+    if (wLength > pIface->setup_buffer.size) {
+        return LIBUSBD_STALLED;
+    }
+
+    pInfo->bmRequestType = bmRequestType;
+    pInfo->bRequest = bRequest;
+    pInfo->wValue = wValue;
+    pInfo->wIndex = wIndex;
+    pInfo->wLength = wLength;
+    pInfo->out_len = 0;
+    pInfo->out_data = pIface->setup_buffer.data;
+
+    if (!is_in && wLength) {
+        memcpy(pIface->setup_buffer.data, data, wLength);
+    }
+
+    ret = pIface->setup_callback(pInfo);
+    if (ret < 0) {
+        libusbd_record_setup(pCtx, iface_num, pInfo, NULL, LIBUSBD_STALLED);
+        return LIBUSBD_STALLED;
+    }
+
+    if (!is_in) {
+        libusbd_record_setup(pCtx, iface_num, pInfo, pIface->setup_buffer.data, wLength);
+        return wLength;
+    }
+
+    ret = pInfo->out_len > wLength ? wLength : pInfo->out_len;
+    memcpy(data, pInfo->out_data, ret);
+    libusbd_record_setup(pCtx, iface_num, pInfo, data, ret);
+
+    return ret;
+}
+
+int libusbd_loopback_host_control(libusbd_loopback_host_t* pHost, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void* data, uint16_t wLength, uint64_t timeout_ms)
+{
+    if (!pHost || !pHost->pCtx || (wLength && !data)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_ctx_t* pCtx = pHost->pCtx;
+    uint8_t setup[8] = {bmRequestType, bRequest, wValue & 0xFF, wValue >> 8, wIndex & 0xFF, wIndex >> 8, wLength & 0xFF, wLength >> 8};
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_SUBMIT, setup, data, 0);
+    }
+
+    int ret = libusbd_loopback_host_do_control(pHost, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout_ms);
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, data, ret);
+    }
+
+    return ret;
+}
+
+// Must be called with io_mutex held
+static int libusbd_loopback_host_queue_locked(libusbd_loopback_host_t* pHost, uint8_t ep_addr, libusbd_loopback_xfer_t* pXfer, libusbd_loopback_ep_t** ppEp)
+{
+    libusbd_ctx_t* pCtx = pHost->pCtx;
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    uint8_t idx = LIBUSBD_LOOPBACK_EPADDR_IDX(ep_addr);
+
+    if (pImplCtx->aEpAddrIface[idx] == 0xFF) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (!pImplCtx->has_enumerated) {
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    uint8_t iface_num = pImplCtx->aEpAddrIface[idx];
+    uint8_t ep = pImplCtx->aEpAddrIdx[idx];
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    if (pEp->halted) {
+        return LIBUSBD_STALLED;
+    }
+
+    libusbd_loopback_xfer_enqueue(&pEp->pHostHead, &pEp->pHostTail, pXfer);
+    libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+
+    *ppEp = pEp;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_host_transfer(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* data, uint32_t len, uint64_t timeout_ms)
+{
+    if (!pHost || !pHost->pCtx || (len && !data)) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pHost->pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = NULL;
+    libusbd_loopback_xfer_t xfer;
+
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.data = data;
+    xfer.len = len;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    int ret = libusbd_loopback_host_queue_locked(pHost, ep_addr, &xfer, &pEp);
+    if (ret == LIBUSBD_SUCCESS) {
+        if (libusbd_loopback_wait_locked(pImplCtx, &xfer.done, timeout_ms)) {
+            ret = xfer.status;
+        }
+        else {
+            libusbd_loopback_xfer_unlink(&pEp->pHostHead, &pEp->pHostTail, &xfer);
+            ret = LIBUSBD_TIMEOUT;
+        }
+    }
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return ret;
+}
+
+int libusbd_loopback_host_submit(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* data, uint32_t len, libusbd_loopback_host_cb_t cb, void* user)
+{
+    if (!pHost || !pHost->pCtx || (len && !data) || !cb) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_ctx_t* pImplCtx = pHost->pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = NULL;
+
+    libusbd_loopback_xfer_t* pXfer = malloc(sizeof(libusbd_loopback_xfer_t));
+    if (!pXfer) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    memset(pXfer, 0, sizeof(*pXfer));
+    pXfer->data = data;
+    pXfer->len = len;
+    pXfer->cb = cb;
+    pXfer->user = user;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    int ret = libusbd_loopback_host_queue_locked(pHost, ep_addr, pXfer, &pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    if (ret < 0) {
+        free(pXfer);
+        return ret;
+    }
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_host_cancel(libusbd_loopback_host_t* pHost, uint8_t ep_addr, void* user)
+{
+    if (!pHost || !pHost->pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_ctx_t* pCtx = pHost->pCtx;
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    uint8_t idx = LIBUSBD_LOOPBACK_EPADDR_IDX(ep_addr);
+    int ret = LIBUSBD_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    if (pImplCtx->aEpAddrIface[idx] != 0xFF) {
+        libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[pImplCtx->aEpAddrIface[idx]].aEndpoints[pImplCtx->aEpAddrIdx[idx]];
+
+        for (libusbd_loopback_xfer_t* pIter = pEp->pHostHead; pIter; pIter = pIter->pNext)
+        {
+            if (!pIter->cb || pIter->user != user) continue;
+
+            libusbd_loopback_xfer_unlink(&pEp->pHostHead, &pEp->pHostTail, pIter);
+            libusbd_loopback_host_complete_locked(pImplCtx, pIter, LIBUSBD_CANCELLED);
+            ret = LIBUSBD_SUCCESS;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return ret;
+}
+
+int libusbd_loopback_xfer_alloc(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_xfer_t* pLoopXfer = calloc(1, sizeof(libusbd_loopback_xfer_t));
+    if (!pLoopXfer) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pLoopXfer->data = libusbd_pool_alloc(pCtx, pXfer->pub.buffer_size);
+    if (!pLoopXfer->data) {
+        free(pLoopXfer);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pLoopXfer->pOwner = pXfer;
+
+    pXfer->pPlat = pLoopXfer;
+    pXfer->pub.buffer = pLoopXfer->data;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_xfer_free(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_loopback_xfer_t* pLoopXfer = pXfer->pPlat;
+
+    libusbd_pool_free(pCtx, pLoopXfer->data);
+    free(pLoopXfer);
+    pXfer->pPlat = NULL;
+    pXfer->pub.buffer = NULL;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Checks a transfer object's endpoint exists, for submit and prepare
+static int libusbd_loopback_xfer_check(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
+
+    if (iface_num >= pCtx->bNumInterfaces || ep >= pCtx->pLoopbackCtx->aInterfaces[iface_num].bNumEndpoints) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_loopback_xfer_queue(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    libusbd_loopback_xfer_t* pLoopXfer = pXfer->pPlat;
+
+    pLoopXfer->len = pXfer->pub.length;
+    pLoopXfer->actual = 0;
+    pLoopXfer->done = 0;
+    pLoopXfer->status = 0;
+
+    // Queued behind whatever else the device has on the endpoint, and held
+    // there until the host enumerates
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_loopback_xfer_enqueue(&pEp->pDevHead, &pEp->pDevTail, pLoopXfer);
+    libusbd_loopback_pump_locked(pCtx, iface_num, ep);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_xfer_submit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = libusbd_loopback_xfer_check(pCtx, pXfer);
+    if (ret) {
+        return ret;
+    }
+
+    return libusbd_loopback_xfer_queue(pCtx, pXfer);
+}
+
+int libusbd_loopback_xfer_cancel(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
+
+    libusbd_loopback_ctx_t* pImplCtx = pCtx->pLoopbackCtx;
+    libusbd_loopback_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    libusbd_loopback_xfer_t* pLoopXfer = pXfer->pPlat;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (!libusbd_loopback_xfer_unlink(&pEp->pDevHead, &pEp->pDevTail, pLoopXfer)) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Whatever part of it was already copied stays with the host
+    libusbd_loopback_dev_complete_locked(pCtx, iface_num, ep, pLoopXfer, LIBUSBD_CANCELLED);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_loopback_run_callbacks(pImplCtx);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_loopback_xfer_prepare(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Nothing to build ahead of time, queueing is all there is to it
+    return libusbd_loopback_xfer_check(pCtx, pXfer);
+}
+
+int libusbd_loopback_xfer_resubmit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_loopback_xfer_queue(pCtx, pXfer);
+}
+
+int libusbd_loopback_handoff_export(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    if (!pCtx || !pCtx->pLoopbackCtx || !pBuf) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The simulated host lives in this process, there's nothing to hand over
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_loopback_handoff_adopt(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+const libusbd_backend_ops_t libusbd_backend_loopback = {
+    .name = "loopback",
+    // Nothing ever leaves the process, don't let it stand in for real hardware
+    // unless it's the only thing built in
+    .flags = LIBUSBD_BACKEND_FLAG_EXPLICIT,
+    LIBUSBD_BACKEND_OPS(loopback),
+};
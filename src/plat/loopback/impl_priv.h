@@ -0,0 +1,130 @@
+#ifndef _LIBUSBD_PLAT_LOOPBACK_IMPL_PRIV_H
+#define _LIBUSBD_PLAT_LOOPBACK_IMPL_PRIV_H
+
+#include <pthread.h>
+
+#include "libusbd_loopback.h"
+
+typedef struct libusbd_loopback_descdata_t libusbd_loopback_descdata_t;
+typedef struct libusbd_loopback_xfer_t libusbd_loopback_xfer_t;
+typedef struct libusbd_xfer_t libusbd_xfer_t;
+
+typedef struct libusbd_loopback_descdata_t
+{
+    void* data;
+    uint64_t size;
+
+    uint8_t idx;
+
+    libusbd_loopback_descdata_t* pNext;
+} libusbd_loopback_descdata_t;
+
+typedef struct libusbd_loopback_buffer_t
+{
+    void* data;
+    uint64_t size;
+} libusbd_loopback_buffer_t;
+
+// One side of a transfer, either a device request (`libusbd_ep_*`) or a
+// host request (`libusbd_loopback_host_*`). Each endpoint pairs its device
+// and host queues head-to-head and copies between them.
+typedef struct libusbd_loopback_xfer_t
+{
+    uint8_t* data;
+    uint32_t len;
+    uint32_t actual;
+
+    int status;
+    int done;
+
+    // Host async only, freed after the callback runs
+    libusbd_loopback_host_cb_t cb;
+    void* user;
+
+    // Device transfer objects, the libusbd_transfer_t this belongs to
+    libusbd_xfer_t* pOwner;
+
+    libusbd_loopback_xfer_t* pNext;
+} libusbd_loopback_xfer_t;
+
+typedef struct libusbd_loopback_ep_t
+{
+    uint64_t last_transferred;
+    uint64_t ep_async_done;
+    uint64_t maxPktSize;
+
+    uint8_t type;
+    uint8_t direction;
+    uint8_t interval;
+    uint8_t address;
+
+    int halted;
+    uint8_t rearm_policy;
+
+    // The single `libusbd_ep_*_start` transfer the API allows per endpoint
+    libusbd_loopback_xfer_t async_xfer;
+    int async_queued;
+    uint64_t submit_ns;
+
+    libusbd_loopback_xfer_t* pDevHead;
+    libusbd_loopback_xfer_t* pDevTail;
+    libusbd_loopback_xfer_t* pHostHead;
+    libusbd_loopback_xfer_t* pHostTail;
+
+    libusbd_loopback_buffer_t buffer;
+
+    // Sync transfers using the buffer, it isn't released under them
+    int buffer_pins;
+} libusbd_loopback_ep_t;
+
+typedef struct libusbd_loopback_iface_t
+{
+    libusbd_loopback_buffer_t setup_buffer;
+
+    libusbd_setup_callback_t setup_callback;
+    libusbd_setup_callback_info_t setup_callback_info;
+
+    int is_builtin;
+
+    uint8_t bNumEndpoints;
+    libusbd_loopback_ep_t aEndpoints[16];
+
+    libusbd_loopback_descdata_t* pStandardDescs;
+    libusbd_loopback_descdata_t* pNonStandardDescs;
+} libusbd_loopback_iface_t;
+
+typedef struct libusbd_loopback_host_t
+{
+    libusbd_ctx_t* pCtx;
+} libusbd_loopback_host_t;
+
+typedef struct libusbd_loopback_ctx_t
+{
+    pthread_mutex_t io_mutex;
+    pthread_cond_t io_cond;
+
+    int all_finalized;
+    int has_enumerated;
+    uint8_t bConfigurationValue;
+
+    libusbd_loopback_host_t* pHost;
+
+    // Host async transfers which finished, waiting for their callbacks
+    libusbd_loopback_xfer_t* pDoneHead;
+    libusbd_loopback_xfer_t* pDoneTail;
+
+    // bEndpointAddress -> (interface, endpoint), 0xFF if unused
+    uint8_t aEpAddrIface[32];
+    uint8_t aEpAddrIdx[32];
+
+    libusbd_loopback_iface_t aInterfaces[16];
+
+    void* pConfigDesc;
+    uint16_t configDescSz;
+
+    // Standard request replies are built here before being cut to wLength,
+    // must be used with io_mutex held
+    uint8_t aEp0Reply[0x10000];
+} libusbd_loopback_ctx_t;
+
+#endif // _LIBUSBD_PLAT_LOOPBACK_IMPL_PRIV_H
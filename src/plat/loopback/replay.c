@@ -0,0 +1,245 @@
+#include "libusbd.h"
+#include "libusbd_loopback.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LIBUSBD_REPLAY_TIMEOUT_MS (1000)
+
+typedef struct libusbd_replay_t
+{
+    libusbd_loopback_host_t* pHost;
+    uint32_t flags;
+
+    // bEndpointAddress for each (iface_num, ep), 0 if not present
+    uint8_t aEpAddr[LIBUSBD_MAX_IFACES][LIBUSBD_MAX_IFACE_EPS];
+
+    uint8_t* pPayload;
+    uint8_t* pScratch;
+    uint32_t bufSize;
+} libusbd_replay_t;
+
+// Endpoint indices are handed out per interface in the order they were added,
+// which is also the order they show up in the configuration descriptor.
+static int libusbd_replay_map_endpoints(libusbd_replay_t* pReplay)
+{
+    uint8_t config[0x1000];
+    uint8_t aNumEps[LIBUSBD_MAX_IFACES] = {0};
+    int cur_iface = -1;
+
+    int len = libusbd_loopback_host_control(pReplay->pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0200, 0, config, sizeof(config), LIBUSBD_REPLAY_TIMEOUT_MS);
+    if (len < 0) {
+        return len;
+    }
+
+    for (int i = 0; i + 2 <= len && config[i] >= 2; i += config[i])
+    {
+        uint8_t bLength = config[i];
+        uint8_t bDescriptorType = config[i+1];
+
+        if (i + bLength > len) break;
+
+        // Interface, alt setting 0 only
+        if (bDescriptorType == 4 && bLength >= 9) {
+            cur_iface = config[i+3] == 0 ? config[i+2] : -1;
+        }
+        else if (bDescriptorType == 5 && bLength >= 7 && cur_iface >= 0 && cur_iface < LIBUSBD_MAX_IFACES) {
+            if (aNumEps[cur_iface] < LIBUSBD_MAX_IFACE_EPS) {
+                pReplay->aEpAddr[cur_iface][aNumEps[cur_iface]++] = config[i+2];
+            }
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_replay_grow(libusbd_replay_t* pReplay, uint32_t size)
+{
+    if (size <= pReplay->bufSize) {
+        return LIBUSBD_SUCCESS;
+    }
+
+    uint8_t* pPayload = realloc(pReplay->pPayload, size);
+    if (!pPayload) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pReplay->pPayload = pPayload;
+
+    uint8_t* pScratch = realloc(pReplay->pScratch, size);
+    if (!pScratch) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    pReplay->pScratch = pScratch;
+
+    pReplay->bufSize = size;
+
+    return LIBUSBD_SUCCESS;
+}
+
+static void libusbd_replay_wait(uint64_t target_ns, libusbd_loopback_replay_result_t* pOut)
+{
+    struct timespec ts;
+
+    ts.tv_sec = target_ns / 1000000000ull;
+    ts.tv_nsec = target_ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    uint64_t now = libusbd_stats_now_ns();
+    if (now > target_ns && now - target_ns > pOut->max_lag_ns) {
+        pOut->max_lag_ns = now - target_ns;
+    }
+}
+
+static void libusbd_replay_setup(libusbd_replay_t* pReplay, const libusbd_record_entry_t* pEntry, const uint8_t* setup, libusbd_loopback_replay_result_t* pOut)
+{
+    uint8_t bmRequestType = setup[0];
+    uint8_t bRequest = setup[1];
+    uint16_t wValue = setup[2] | (setup[3] << 8);
+    uint16_t wIndex = setup[4] | (setup[5] << 8);
+    uint16_t wLength = setup[6] | (setup[7] << 8);
+    int is_in = !!(bmRequestType & LIBUSBD_DEV2HOST_DIR);
+    int32_t expected = pEntry->status;
+    void* data = is_in ? pReplay->pScratch : pReplay->pPayload;
+
+    pOut->setups++;
+
+    int ret = libusbd_loopback_host_control(pReplay->pHost, bmRequestType, bRequest, wValue, wIndex, data, wLength, LIBUSBD_REPLAY_TIMEOUT_MS);
+    if (ret < 0 && ret != LIBUSBD_STALLED) {
+        pOut->errors++;
+        return;
+    }
+
+    if (ret >= 0) {
+        pOut->bytes += ret;
+    }
+
+    if (ret != expected || (is_in && ret > 0 && memcmp(pReplay->pScratch, pReplay->pPayload, ret))) {
+        pOut->mismatches++;
+    }
+}
+
+static void libusbd_replay_transfer(libusbd_replay_t* pReplay, const libusbd_record_entry_t* pEntry, libusbd_loopback_replay_result_t* pOut)
+{
+    uint8_t ep_addr = 0;
+
+    if (pEntry->iface_num < LIBUSBD_MAX_IFACES && pEntry->ep < LIBUSBD_MAX_IFACE_EPS) {
+        ep_addr = pReplay->aEpAddr[pEntry->iface_num][pEntry->ep];
+    }
+
+    if (!ep_addr) {
+        pOut->errors++;
+        return;
+    }
+
+    pOut->transfers++;
+
+    int is_in = pEntry->direction == USB_EP_DIR_IN;
+    void* data = is_in ? pReplay->pScratch : pReplay->pPayload;
+
+    // The device picks the size of IN transfers, give it all the room it had
+    uint32_t len = is_in ? pReplay->bufSize : pEntry->status;
+
+    int ret = libusbd_loopback_host_transfer(pReplay->pHost, ep_addr, data, len, LIBUSBD_REPLAY_TIMEOUT_MS);
+    if (ret < 0) {
+        pOut->errors++;
+        return;
+    }
+
+    pOut->bytes += ret;
+
+    if (ret != pEntry->status || (is_in && ret > 0 && memcmp(pReplay->pScratch, pReplay->pPayload, ret))) {
+        pOut->mismatches++;
+    }
+}
+
+int libusbd_loopback_host_replay(libusbd_loopback_host_t* pHost, const char* path, uint32_t flags, libusbd_loopback_replay_result_t* pOut)
+{
+    libusbd_replay_t replay;
+    libusbd_record_file_hdr_t hdr;
+    libusbd_record_entry_t entry;
+    uint8_t setup[8];
+    int ret = LIBUSBD_SUCCESS;
+
+    if (!pHost || !path || !pOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    memset(pOut, 0, sizeof(*pOut));
+    memset(&replay, 0, sizeof(replay));
+    replay.pHost = pHost;
+    replay.flags = flags;
+
+    FILE* pFile = fopen(path, "rb");
+    if (!pFile) {
+        LIBUSBD_LOG_ERROR("libusbd replay: Failed to open %s (%s)", path, strerror(errno));
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, pFile) != 1 || hdr.magic != LIBUSBD_RECORD_MAGIC || hdr.version != LIBUSBD_RECORD_VERSION || hdr.hdr_size < sizeof(hdr)) {
+        LIBUSBD_LOG_ERROR("libusbd replay: %s is not a capture", path);
+        fclose(pFile);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    fseek(pFile, hdr.hdr_size, SEEK_SET);
+
+    ret = libusbd_replay_map_endpoints(&replay);
+    if (ret < 0) {
+        LIBUSBD_LOG_ERROR("libusbd replay: Couldn't read configuration descriptor (%d), enumerate first", ret);
+        fclose(pFile);
+        return ret;
+    }
+
+    ret = libusbd_replay_grow(&replay, 0x10000);
+    if (ret < 0) goto done;
+
+    uint64_t start_ns = libusbd_stats_now_ns();
+
+    while (fread(&entry, sizeof(entry), 1, pFile) == 1)
+    {
+        if (entry.type == LIBUSBD_RECORD_SETUP && fread(setup, sizeof(setup), 1, pFile) != 1) {
+            break;
+        }
+
+        if (entry.status > 0) {
+            ret = libusbd_replay_grow(&replay, entry.status);
+            if (ret < 0) goto done;
+
+            if (fread(replay.pPayload, entry.status, 1, pFile) != 1) {
+                break;
+            }
+        }
+
+        if (flags & LIBUSBD_REPLAY_REALTIME) {
+            libusbd_replay_wait(start_ns + entry.ts_ns, pOut);
+        }
+
+        if (entry.type == LIBUSBD_RECORD_SETUP) {
+            libusbd_replay_setup(&replay, &entry, setup, pOut);
+        }
+        else if (entry.type == LIBUSBD_RECORD_TRANSFER && entry.status >= 0) {
+            // Failed transfers (timeouts, cancels) were never seen by a host
+            libusbd_replay_transfer(&replay, &entry, pOut);
+        }
+    }
+
+    pOut->elapsed_ns = libusbd_stats_now_ns() - start_ns;
+
+    if (!feof(pFile)) {
+        LIBUSBD_LOG_WARN("libusbd replay: %s is truncated", path);
+    }
+
+done:
+    fclose(pFile);
+    free(replay.pPayload);
+    free(replay.pScratch);
+
+    return ret;
+}
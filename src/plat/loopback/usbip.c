@@ -0,0 +1,874 @@
+#include "libusbd.h"
+#include "libusbd_loopback.h"
+#include "libusbd_usbip.h"
+
+#include "libusbd_priv.h"
+#include "libusbd_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// USB/IP 1.1.1, everything on the wire is big endian
+#define USBIP_VERSION (0x0111)
+
+#define USBIP_OP_REQ_DEVLIST (0x8005)
+#define USBIP_OP_REP_DEVLIST (0x0005)
+#define USBIP_OP_REQ_IMPORT  (0x8003)
+#define USBIP_OP_REP_IMPORT  (0x0003)
+
+#define USBIP_CMD_SUBMIT (1)
+#define USBIP_CMD_UNLINK (2)
+#define USBIP_RET_SUBMIT (3)
+#define USBIP_RET_UNLINK (4)
+
+#define USBIP_DIR_OUT (0)
+#define USBIP_DIR_IN  (1)
+
+#define USBIP_SPEED_HIGH (3)
+
+// URB statuses are Linux errnos regardless of where we run
+#define USBIP_ENOENT     (2)
+#define USBIP_EINVAL     (22)
+#define USBIP_EPIPE      (32)
+#define USBIP_EPROTO     (71)
+#define USBIP_ECONNRESET (104)
+#define USBIP_ESHUTDOWN  (108)
+#define USBIP_ETIMEDOUT  (110)
+
+// We only ever export the one device
+#define LIBUSBD_USBIP_PATH  "/sys/devices/platform/libusbd/usb1/1-1"
+#define LIBUSBD_USBIP_BUSID "1-1"
+#define LIBUSBD_USBIP_BUSNUM (1)
+#define LIBUSBD_USBIP_DEVNUM (2)
+
+#define LIBUSBD_USBIP_MAX_XFER     (0x100000)
+#define LIBUSBD_USBIP_MAX_ISO_PKTS (1024)
+#define LIBUSBD_USBIP_CTRL_TIMEOUT_MS (5000)
+
+// Completions picked up by one writev
+#define LIBUSBD_USBIP_TX_BATCH (64)
+
+typedef struct __attribute__((packed)) usbip_op_header_t
+{
+    uint16_t version;
+    uint16_t code;
+    uint32_t status;
+} usbip_op_header_t;
+
+typedef struct __attribute__((packed)) usbip_usb_device_t
+{
+    char path[256];
+    char busid[32];
+    uint32_t busnum;
+    uint32_t devnum;
+    uint32_t speed;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bConfigurationValue;
+    uint8_t bNumConfigurations;
+    uint8_t bNumInterfaces;
+} usbip_usb_device_t;
+
+typedef struct __attribute__((packed)) usbip_usb_interface_t
+{
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t padding;
+} usbip_usb_interface_t;
+
+typedef struct __attribute__((packed)) usbip_header_t
+{
+    uint32_t command;
+    uint32_t seqnum;
+    uint32_t devid;
+    uint32_t direction;
+    uint32_t ep;
+
+    union
+    {
+        struct __attribute__((packed))
+        {
+            uint32_t transfer_flags;
+            int32_t transfer_buffer_length;
+            int32_t start_frame;
+            int32_t number_of_packets;
+            int32_t interval;
+            uint8_t setup[8];
+        } cmd_submit;
+
+        struct __attribute__((packed))
+        {
+            int32_t status;
+            int32_t actual_length;
+            int32_t start_frame;
+            int32_t number_of_packets;
+            int32_t error_count;
+            uint8_t padding[8];
+        } ret_submit;
+
+        struct __attribute__((packed))
+        {
+            uint32_t seqnum;
+            uint8_t padding[24];
+        } cmd_unlink;
+
+        struct __attribute__((packed))
+        {
+            int32_t status;
+            uint8_t padding[24];
+        } ret_unlink;
+    };
+} usbip_header_t;
+
+typedef struct __attribute__((packed)) usbip_iso_packet_t
+{
+    uint32_t offset;
+    uint32_t length;
+    uint32_t actual_length;
+    uint32_t status;
+} usbip_iso_packet_t;
+
+typedef struct libusbd_usbip_session_t libusbd_usbip_session_t;
+typedef struct libusbd_usbip_urb_t libusbd_usbip_urb_t;
+typedef struct libusbd_usbip_msg_t libusbd_usbip_msg_t;
+
+// A bulk/interrupt/iso URB handed to the loopback host
+typedef struct libusbd_usbip_urb_t
+{
+    libusbd_usbip_session_t* pSess;
+
+    uint32_t seqnum;
+    uint8_t ep_addr;
+
+    // Set by CMD_UNLINK, the completion answers that instead
+    int unlinked;
+    uint32_t unlink_seqnum;
+
+    int32_t number_of_packets;
+    usbip_iso_packet_t* aIso;
+
+    uint8_t* data;
+    uint32_t len;
+
+    libusbd_usbip_urb_t* pNext;
+} libusbd_usbip_urb_t;
+
+// A reply waiting for the writer thread
+typedef struct libusbd_usbip_msg_t
+{
+    uint32_t len;
+    libusbd_usbip_msg_t* pNext;
+
+    uint8_t data[];
+} libusbd_usbip_msg_t;
+
+typedef struct libusbd_usbip_session_t
+{
+    libusbd_loopback_host_t* pHost;
+    int fd;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    libusbd_usbip_urb_t* pUrbs;
+    uint32_t num_urbs;
+
+    pthread_t tx_thread;
+    int tx_stop;
+    libusbd_usbip_msg_t* pTxHead;
+    libusbd_usbip_msg_t* pTxTail;
+
+    // Commands are small and pipelined, so read them in bulk
+    uint8_t aRxBuf[0x10000];
+    uint32_t rx_pos;
+    uint32_t rx_len;
+} libusbd_usbip_session_t;
+
+static int32_t libusbd_usbip_status(int ret)
+{
+    if (ret >= 0) return 0;
+
+    switch (ret)
+    {
+        case LIBUSBD_STALLED:
+            return -USBIP_EPIPE;
+        case LIBUSBD_CANCELLED:
+            return -USBIP_ECONNRESET;
+        case LIBUSBD_NOT_ENUMERATED:
+            return -USBIP_ESHUTDOWN;
+        case LIBUSBD_TIMEOUT:
+            return -USBIP_ETIMEDOUT;
+        case LIBUSBD_INVALID_ARGUMENT:
+            return -USBIP_EINVAL;
+        default:
+            return -USBIP_EPROTO;
+    }
+}
+
+static int libusbd_usbip_write_all(int fd, const void* data, uint32_t len)
+{
+    const uint8_t* pIter = (const uint8_t*)data;
+
+    while (len)
+    {
+        ssize_t ret = send(fd, pIter, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        pIter += ret;
+        len -= ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_usbip_read_all(int fd, void* data, uint32_t len)
+{
+    uint8_t* pIter = (uint8_t*)data;
+
+    while (len)
+    {
+        ssize_t ret = read(fd, pIter, len);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        pIter += ret;
+        len -= ret;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Device info
+//
+
+// Builds the device record from the same descriptors the host would read.
+// Returns the number of interfaces written to aIfaces, or an error if the
+// device isn't finalized yet.
+static int libusbd_usbip_device_info(libusbd_loopback_host_t* pHost, usbip_usb_device_t* pDev, usbip_usb_interface_t* aIfaces)
+{
+    uint8_t dev[18];
+    uint8_t config[0x1000];
+    uint8_t cur_config = 0;
+    int ret;
+
+    ret = libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0100, 0, dev, sizeof(dev), LIBUSBD_USBIP_CTRL_TIMEOUT_MS);
+    if (ret < (int)sizeof(dev)) {
+        return ret < 0 ? ret : LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    int config_len = libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_DESCRIPTOR, 0x0200, 0, config, sizeof(config), LIBUSBD_USBIP_CTRL_TIMEOUT_MS);
+    if (config_len < 9) {
+        return config_len < 0 ? config_len : LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    libusbd_loopback_host_control(pHost, LIBUSBD_DEV2HOST_DEVICE, LIBUSBD_GET_CONFIGURATION, 0, 0, &cur_config, 1, LIBUSBD_USBIP_CTRL_TIMEOUT_MS);
+
+    memset(pDev, 0, sizeof(*pDev));
+    strcpy(pDev->path, LIBUSBD_USBIP_PATH);
+    strcpy(pDev->busid, LIBUSBD_USBIP_BUSID);
+    pDev->busnum = htonl(LIBUSBD_USBIP_BUSNUM);
+    pDev->devnum = htonl(LIBUSBD_USBIP_DEVNUM);
+    pDev->speed = htonl(USBIP_SPEED_HIGH);
+    pDev->idVendor = htons(dev[8] | dev[9] << 8);
+    pDev->idProduct = htons(dev[10] | dev[11] << 8);
+    pDev->bcdDevice = htons(dev[12] | dev[13] << 8);
+    pDev->bDeviceClass = dev[4];
+    pDev->bDeviceSubClass = dev[5];
+    pDev->bDeviceProtocol = dev[6];
+    pDev->bConfigurationValue = cur_config;
+    pDev->bNumConfigurations = dev[17];
+    pDev->bNumInterfaces = config[4];
+
+    // Alternate setting 0 of each interface
+    int num_ifaces = 0;
+    for (int i = 0; i + 1 < config_len && config[i] >= 2; i += config[i])
+    {
+        if (config[i+1] != 0x04 || i + 9 > config_len || config[i+3] != 0) continue;
+        if (num_ifaces >= LIBUSBD_MAX_IFACES) break;
+
+        aIfaces[num_ifaces].bInterfaceClass = config[i+5];
+        aIfaces[num_ifaces].bInterfaceSubClass = config[i+6];
+        aIfaces[num_ifaces].bInterfaceProtocol = config[i+7];
+        aIfaces[num_ifaces].padding = 0;
+        num_ifaces++;
+    }
+
+    return num_ifaces;
+}
+
+//
+// Replies
+//
+
+static libusbd_usbip_msg_t* libusbd_usbip_msg_alloc(uint32_t len)
+{
+    libusbd_usbip_msg_t* pMsg = malloc(sizeof(libusbd_usbip_msg_t) + len);
+    if (!pMsg) return NULL;
+
+    pMsg->len = len;
+    pMsg->pNext = NULL;
+    memset(pMsg->data, 0, sizeof(usbip_header_t));
+
+    return pMsg;
+}
+
+// Must be called with the session mutex held
+static void libusbd_usbip_queue_locked(libusbd_usbip_session_t* pSess, libusbd_usbip_msg_t* pMsg)
+{
+    if (!pMsg) {
+        LIBUSBD_LOG_ERROR("libusbd usbip: Out of memory for a reply, client will see a stuck URB");
+        return;
+    }
+
+    if (pSess->pTxTail) {
+        pSess->pTxTail->pNext = pMsg;
+    }
+    else {
+        pSess->pTxHead = pMsg;
+    }
+    pSess->pTxTail = pMsg;
+
+    pthread_cond_broadcast(&pSess->cond);
+}
+
+static libusbd_usbip_msg_t* libusbd_usbip_ret_submit(uint32_t seqnum, int32_t status, const uint8_t* data, uint32_t actual, int32_t number_of_packets, const usbip_iso_packet_t* aIso)
+{
+    uint32_t iso_len = number_of_packets > 0 ? number_of_packets * sizeof(usbip_iso_packet_t) : 0;
+
+    libusbd_usbip_msg_t* pMsg = libusbd_usbip_msg_alloc(sizeof(usbip_header_t) + actual + iso_len);
+    if (!pMsg) return NULL;
+
+    usbip_header_t* pHdr = (usbip_header_t*)pMsg->data;
+    pHdr->command = htonl(USBIP_RET_SUBMIT);
+    pHdr->seqnum = htonl(seqnum);
+    pHdr->ret_submit.status = htonl(status);
+    pHdr->ret_submit.actual_length = htonl(actual);
+    pHdr->ret_submit.number_of_packets = htonl(number_of_packets > 0 ? number_of_packets : 0);
+
+    if (actual) {
+        memcpy(pMsg->data + sizeof(usbip_header_t), data, actual);
+    }
+    if (iso_len) {
+        memcpy(pMsg->data + sizeof(usbip_header_t) + actual, aIso, iso_len);
+    }
+
+    return pMsg;
+}
+
+static libusbd_usbip_msg_t* libusbd_usbip_ret_unlink(uint32_t seqnum, int32_t status)
+{
+    libusbd_usbip_msg_t* pMsg = libusbd_usbip_msg_alloc(sizeof(usbip_header_t));
+    if (!pMsg) return NULL;
+
+    usbip_header_t* pHdr = (usbip_header_t*)pMsg->data;
+    pHdr->command = htonl(USBIP_RET_UNLINK);
+    pHdr->seqnum = htonl(seqnum);
+    pHdr->ret_unlink.status = htonl(status);
+
+    return pMsg;
+}
+
+// Sends everything queued so far in one go, so a burst of small completions
+// costs one syscall rather than one each
+static void* libusbd_usbip_tx_thread(void* arg)
+{
+    libusbd_usbip_session_t* pSess = (libusbd_usbip_session_t*)arg;
+    struct iovec aIov[LIBUSBD_USBIP_TX_BATCH];
+    libusbd_usbip_msg_t* aMsgs[LIBUSBD_USBIP_TX_BATCH];
+    int failed = 0;
+
+    pthread_mutex_lock(&pSess->mutex);
+    while (1)
+    {
+        while (!pSess->pTxHead && !pSess->tx_stop)
+        {
+            pthread_cond_wait(&pSess->cond, &pSess->mutex);
+        }
+
+        if (!pSess->pTxHead) break;
+
+        int num = 0;
+        while (pSess->pTxHead && num < LIBUSBD_USBIP_TX_BATCH)
+        {
+            libusbd_usbip_msg_t* pMsg = pSess->pTxHead;
+            pSess->pTxHead = pMsg->pNext;
+
+            aMsgs[num] = pMsg;
+            aIov[num].iov_base = pMsg->data;
+            aIov[num].iov_len = pMsg->len;
+            num++;
+        }
+        if (!pSess->pTxHead) {
+            pSess->pTxTail = NULL;
+        }
+        pthread_mutex_unlock(&pSess->mutex);
+
+        struct iovec* pIov = aIov;
+        int left = num;
+        while (left && !failed)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = pIov;
+            msg.msg_iovlen = left;
+
+            ssize_t ret = sendmsg(pSess->fd, &msg, MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret <= 0) {
+                // The reader sees the hangup too and tears the session down
+                failed = 1;
+                break;
+            }
+
+            while (left && ret >= (ssize_t)pIov->iov_len)
+            {
+                ret -= pIov->iov_len;
+                pIov++;
+                left--;
+            }
+            if (left) {
+                pIov->iov_base = (uint8_t*)pIov->iov_base + ret;
+                pIov->iov_len -= ret;
+            }
+        }
+
+        for (int i = 0; i < num; i++)
+        {
+            free(aMsgs[i]);
+        }
+
+        pthread_mutex_lock(&pSess->mutex);
+    }
+    pthread_mutex_unlock(&pSess->mutex);
+
+    return NULL;
+}
+
+//
+// URBs
+//
+
+static void libusbd_usbip_urb_free(libusbd_usbip_urb_t* pUrb)
+{
+    free(pUrb->aIso);
+    free(pUrb->data);
+    free(pUrb);
+}
+
+// Must be called with the session mutex held
+static int libusbd_usbip_urb_unlink_locked(libusbd_usbip_session_t* pSess, libusbd_usbip_urb_t* pUrb)
+{
+    for (libusbd_usbip_urb_t** ppIter = &pSess->pUrbs; *ppIter; ppIter = &(*ppIter)->pNext)
+    {
+        if (*ppIter == pUrb) {
+            *ppIter = pUrb->pNext;
+            pSess->num_urbs--;
+            pthread_cond_broadcast(&pSess->cond);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Loopback host completion, from whichever thread finished the transfer
+static void libusbd_usbip_urb_done(void* user, int status)
+{
+    libusbd_usbip_urb_t* pUrb = (libusbd_usbip_urb_t*)user;
+    libusbd_usbip_session_t* pSess = pUrb->pSess;
+    libusbd_usbip_msg_t* pMsg;
+
+    uint32_t actual = status > 0 ? status : 0;
+
+    // Iso packets get filled front to back, same as the data
+    if (pUrb->number_of_packets > 0) {
+        uint32_t left = actual;
+        for (int i = 0; i < pUrb->number_of_packets; i++)
+        {
+            uint32_t length = ntohl(pUrb->aIso[i].length);
+            uint32_t pkt_actual = left < length ? left : length;
+
+            pUrb->aIso[i].actual_length = htonl(pkt_actual);
+            pUrb->aIso[i].status = 0;
+            left -= pkt_actual;
+        }
+    }
+
+    pthread_mutex_lock(&pSess->mutex);
+    libusbd_usbip_urb_unlink_locked(pSess, pUrb);
+
+    if (pUrb->unlinked) {
+        pMsg = libusbd_usbip_ret_unlink(pUrb->unlink_seqnum, -USBIP_ECONNRESET);
+    }
+    else {
+        int is_in = pUrb->ep_addr & 0x80;
+        pMsg = libusbd_usbip_ret_submit(pUrb->seqnum, libusbd_usbip_status(status), pUrb->data, is_in ? actual : 0, pUrb->number_of_packets, pUrb->aIso);
+        if (pMsg && !is_in) {
+            ((usbip_header_t*)pMsg->data)->ret_submit.actual_length = htonl(actual);
+        }
+    }
+    libusbd_usbip_queue_locked(pSess, pMsg);
+    pthread_mutex_unlock(&pSess->mutex);
+
+    libusbd_usbip_urb_free(pUrb);
+}
+
+static int libusbd_usbip_recv(libusbd_usbip_session_t* pSess, void* out, uint32_t len)
+{
+    uint8_t* pOut = (uint8_t*)out;
+
+    uint32_t avail = pSess->rx_len - pSess->rx_pos;
+    uint32_t n = avail < len ? avail : len;
+    memcpy(pOut, pSess->aRxBuf + pSess->rx_pos, n);
+    pSess->rx_pos += n;
+    pOut += n;
+    len -= n;
+
+    // Big payloads skip the buffer
+    if (len >= sizeof(pSess->aRxBuf)) {
+        return libusbd_usbip_read_all(pSess->fd, pOut, len);
+    }
+
+    while (len)
+    {
+        ssize_t ret = read(pSess->fd, pSess->aRxBuf, sizeof(pSess->aRxBuf));
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) {
+            return LIBUSBD_NONDESCRIPT_ERROR;
+        }
+
+        pSess->rx_len = ret;
+        n = (uint32_t)ret < len ? (uint32_t)ret : len;
+        memcpy(pOut, pSess->aRxBuf, n);
+        pSess->rx_pos = n;
+        pOut += n;
+        len -= n;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Control transfers are answered inline, the loopback host handles them synchronously
+static int libusbd_usbip_control(libusbd_usbip_session_t* pSess, usbip_header_t* pHdr, uint8_t* data, uint32_t len)
+{
+    uint8_t* setup = pHdr->cmd_submit.setup;
+    uint16_t wLength = setup[6] | setup[7] << 8;
+    uint8_t is_in = setup[0] & LIBUSBD_DEV2HOST_DIR;
+    libusbd_usbip_msg_t* pMsg;
+
+    if (wLength > len) {
+        wLength = len;
+    }
+
+    int ret = libusbd_loopback_host_control(pSess->pHost, setup[0], setup[1], setup[2] | setup[3] << 8, setup[4] | setup[5] << 8,
+                                            data, wLength, LIBUSBD_USBIP_CTRL_TIMEOUT_MS);
+
+    uint32_t actual = ret > 0 ? ret : 0;
+    pMsg = libusbd_usbip_ret_submit(ntohl(pHdr->seqnum), libusbd_usbip_status(ret), data, is_in ? actual : 0, 0, NULL);
+    if (pMsg && !is_in) {
+        ((usbip_header_t*)pMsg->data)->ret_submit.actual_length = htonl(actual);
+    }
+
+    pthread_mutex_lock(&pSess->mutex);
+    libusbd_usbip_queue_locked(pSess, pMsg);
+    pthread_mutex_unlock(&pSess->mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_usbip_submit(libusbd_usbip_session_t* pSess, usbip_header_t* pHdr)
+{
+    uint32_t direction = ntohl(pHdr->direction);
+    uint32_t ep = ntohl(pHdr->ep);
+    int32_t len = ntohl(pHdr->cmd_submit.transfer_buffer_length);
+    int32_t number_of_packets = ntohl(pHdr->cmd_submit.number_of_packets);
+    int ret;
+
+    if (len < 0 || len > LIBUSBD_USBIP_MAX_XFER || ep > 15 || number_of_packets > LIBUSBD_USBIP_MAX_ISO_PKTS) {
+        LIBUSBD_LOG_ERROR("libusbd usbip: Bad CMD_SUBMIT (ep %u, len %d, %d packets)", ep, len, number_of_packets);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_usbip_urb_t* pUrb = malloc(sizeof(libusbd_usbip_urb_t));
+    if (!pUrb) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pUrb, 0, sizeof(*pUrb));
+
+    pUrb->pSess = pSess;
+    pUrb->seqnum = ntohl(pHdr->seqnum);
+    pUrb->ep_addr = ep | (direction == USBIP_DIR_IN ? 0x80 : 0);
+    pUrb->len = len;
+    pUrb->number_of_packets = number_of_packets;
+
+    pUrb->data = malloc(len ? len : 1);
+    if (number_of_packets > 0) {
+        pUrb->aIso = malloc(number_of_packets * sizeof(usbip_iso_packet_t));
+    }
+    if (!pUrb->data || (number_of_packets > 0 && !pUrb->aIso)) {
+        libusbd_usbip_urb_free(pUrb);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    // OUT data, then the iso packet table
+    if (direction == USBIP_DIR_OUT && len) {
+        if ((ret = libusbd_usbip_recv(pSess, pUrb->data, len))) {
+            libusbd_usbip_urb_free(pUrb);
+            return ret;
+        }
+    }
+    if (number_of_packets > 0) {
+        if ((ret = libusbd_usbip_recv(pSess, pUrb->aIso, number_of_packets * sizeof(usbip_iso_packet_t)))) {
+            libusbd_usbip_urb_free(pUrb);
+            return ret;
+        }
+    }
+
+    if (ep == 0) {
+        ret = libusbd_usbip_control(pSess, pHdr, pUrb->data, len);
+        libusbd_usbip_urb_free(pUrb);
+        return ret;
+    }
+
+    // Tracked before submitting, the completion can beat us back
+    pthread_mutex_lock(&pSess->mutex);
+    pUrb->pNext = pSess->pUrbs;
+    pSess->pUrbs = pUrb;
+    pSess->num_urbs++;
+    pthread_mutex_unlock(&pSess->mutex);
+
+    ret = libusbd_loopback_host_submit(pSess->pHost, pUrb->ep_addr, pUrb->data, len, libusbd_usbip_urb_done, pUrb);
+    if (ret < 0) {
+        pthread_mutex_lock(&pSess->mutex);
+        libusbd_usbip_urb_unlink_locked(pSess, pUrb);
+        libusbd_usbip_queue_locked(pSess, libusbd_usbip_ret_submit(pUrb->seqnum, libusbd_usbip_status(ret), NULL, 0, 0, NULL));
+        pthread_mutex_unlock(&pSess->mutex);
+
+        libusbd_usbip_urb_free(pUrb);
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_usbip_unlink(libusbd_usbip_session_t* pSess, usbip_header_t* pHdr)
+{
+    uint32_t seqnum = ntohl(pHdr->seqnum);
+    uint32_t target = ntohl(pHdr->cmd_unlink.seqnum);
+    libusbd_usbip_urb_t* pUrb;
+
+    pthread_mutex_lock(&pSess->mutex);
+    for (pUrb = pSess->pUrbs; pUrb; pUrb = pUrb->pNext)
+    {
+        if (pUrb->seqnum == target) break;
+    }
+
+    if (!pUrb) {
+        // Already completed, its RET_SUBMIT is out or on the way
+        libusbd_usbip_queue_locked(pSess, libusbd_usbip_ret_unlink(seqnum, 0));
+        pthread_mutex_unlock(&pSess->mutex);
+        return LIBUSBD_SUCCESS;
+    }
+
+    pUrb->unlinked = 1;
+    pUrb->unlink_seqnum = seqnum;
+    uint8_t ep_addr = pUrb->ep_addr;
+    pthread_mutex_unlock(&pSess->mutex);
+
+    // Either this cancels it or it's completing right now, both paths
+    // answer with RET_UNLINK. Only this thread allocates URBs, so the
+    // pointer can't have been reused in between.
+    libusbd_loopback_host_cancel(pSess->pHost, ep_addr, pUrb);
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_usbip_session(libusbd_usbip_session_t* pSess)
+{
+    usbip_header_t hdr;
+    int ret;
+
+    LIBUSBD_LOG_INFO("libusbd usbip: Client attached");
+
+    if (pthread_create(&pSess->tx_thread, NULL, libusbd_usbip_tx_thread, pSess)) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    while (1)
+    {
+        if ((ret = libusbd_usbip_recv(pSess, &hdr, sizeof(hdr)))) {
+            // Hangup is how clients detach
+            ret = LIBUSBD_SUCCESS;
+            break;
+        }
+
+        uint32_t command = ntohl(hdr.command);
+        if (command == USBIP_CMD_SUBMIT) {
+            ret = libusbd_usbip_submit(pSess, &hdr);
+        }
+        else if (command == USBIP_CMD_UNLINK) {
+            ret = libusbd_usbip_unlink(pSess, &hdr);
+        }
+        else {
+            LIBUSBD_LOG_ERROR("libusbd usbip: Unknown command %x", command);
+            ret = LIBUSBD_INVALID_ARGUMENT;
+        }
+
+        if (ret) break;
+    }
+
+    LIBUSBD_LOG_INFO("libusbd usbip: Client detached");
+
+    // Like pulling the cable, outstanding URBs complete as cancelled
+    libusbd_loopback_host_disconnect(pSess->pHost);
+
+    pthread_mutex_lock(&pSess->mutex);
+    while (pSess->num_urbs)
+    {
+        pthread_cond_wait(&pSess->cond, &pSess->mutex);
+    }
+    pSess->tx_stop = 1;
+    pthread_cond_broadcast(&pSess->cond);
+    pthread_mutex_unlock(&pSess->mutex);
+
+    // Anything still queued goes out if the socket's alive, then the thread quits
+    pthread_join(pSess->tx_thread, NULL);
+
+    return ret;
+}
+
+//
+// API
+//
+
+int libusbd_usbip_serve(libusbd_ctx_t* pCtx, int listen_fd)
+{
+    libusbd_loopback_host_t* pHost;
+    usbip_usb_device_t dev;
+    usbip_usb_interface_t aIfaces[LIBUSBD_MAX_IFACES];
+    int ret;
+
+    if (!pCtx || listen_fd < 0) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if ((ret = libusbd_loopback_host_open(pCtx, &pHost))) {
+        return ret;
+    }
+
+    while (1)
+    {
+        usbip_op_header_t op;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            LIBUSBD_LOG_ERROR("libusbd usbip: accept failed (%s)", strerror(errno));
+            ret = LIBUSBD_NONDESCRIPT_ERROR;
+            break;
+        }
+
+        // Completions are batched by hand, Nagle would only add latency.
+        // Fails harmlessly on AF_UNIX.
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (libusbd_usbip_read_all(fd, &op, sizeof(op))) {
+            close(fd);
+            continue;
+        }
+
+        int num_ifaces = libusbd_usbip_device_info(pHost, &dev, aIfaces);
+
+        if (ntohs(op.code) == USBIP_OP_REQ_DEVLIST) {
+            usbip_op_header_t rep = {htons(USBIP_VERSION), htons(USBIP_OP_REP_DEVLIST), 0};
+            uint32_t num_devs = htonl(num_ifaces >= 0 ? 1 : 0);
+
+            if (!libusbd_usbip_write_all(fd, &rep, sizeof(rep)) && !libusbd_usbip_write_all(fd, &num_devs, sizeof(num_devs)) && num_ifaces >= 0) {
+                if (!libusbd_usbip_write_all(fd, &dev, sizeof(dev))) {
+                    libusbd_usbip_write_all(fd, aIfaces, num_ifaces * sizeof(usbip_usb_interface_t));
+                }
+            }
+            close(fd);
+            continue;
+        }
+        else if (ntohs(op.code) != USBIP_OP_REQ_IMPORT) {
+            LIBUSBD_LOG_WARN("libusbd usbip: Unknown op %x", ntohs(op.code));
+            close(fd);
+            continue;
+        }
+
+        char busid[32];
+        if (libusbd_usbip_read_all(fd, busid, sizeof(busid))) {
+            close(fd);
+            continue;
+        }
+        busid[sizeof(busid)-1] = 0;
+
+        int ok = (num_ifaces >= 0 && !strcmp(busid, LIBUSBD_USBIP_BUSID));
+        usbip_op_header_t rep = {htons(USBIP_VERSION), htons(USBIP_OP_REP_IMPORT), htonl(ok ? 0 : 1)};
+
+        if (!ok) {
+            LIBUSBD_LOG_WARN("libusbd usbip: Refused import of %s", busid);
+            libusbd_usbip_write_all(fd, &rep, sizeof(rep));
+            close(fd);
+            continue;
+        }
+
+        if (libusbd_usbip_write_all(fd, &rep, sizeof(rep)) || libusbd_usbip_write_all(fd, &dev, sizeof(dev))) {
+            close(fd);
+            continue;
+        }
+
+        libusbd_usbip_session_t* pSess = malloc(sizeof(libusbd_usbip_session_t));
+        if (!pSess) {
+            close(fd);
+            ret = LIBUSBD_RESOURCE_LIMIT_REACHED;
+            break;
+        }
+        memset(pSess, 0, sizeof(*pSess));
+
+        pSess->pHost = pHost;
+        pSess->fd = fd;
+        pthread_mutex_init(&pSess->mutex, NULL);
+        pthread_cond_init(&pSess->cond, NULL);
+
+        ret = libusbd_usbip_session(pSess);
+
+        libusbd_usbip_msg_t* pIter = pSess->pTxHead;
+        while (pIter)
+        {
+            libusbd_usbip_msg_t* pNext = pIter->pNext;
+            free(pIter);
+            pIter = pNext;
+        }
+        pthread_cond_destroy(&pSess->cond);
+        pthread_mutex_destroy(&pSess->mutex);
+        free(pSess);
+        close(fd);
+        break;
+    }
+
+    libusbd_loopback_host_close(pHost);
+
+    return ret;
+}
@@ -1,6 +1,10 @@
 #include "impl.h"
 
 #include "impl_priv.h"
+#include "libusbd_backend.h"
+#include "libusbd_log.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -72,7 +76,7 @@ static int _usleep(long usec)
 
 void* RunLoopThread(void* data)
 {
-    printf("libusbd macos: Start runloop\n");
+    LIBUSBD_LOG_INFO("libusbd macos: Start runloop");
 
     _runLoop = CFRunLoopGetCurrent();
 
@@ -84,7 +88,7 @@ void* RunLoopThread(void* data)
         //printf(".\n");
     }
 
-    printf("libusbd macos: Stopped runloop\n");
+    LIBUSBD_LOG_INFO("libusbd macos: Stopped runloop");
 
     //Not reached, CFRunLoopRun doesn't return in this case.
     return NULL;
@@ -382,7 +386,7 @@ kern_return_t IOUSBDeviceInterface_ReadPipe(libusbd_macos_ctx_t* pImplCtx, uint8
 
     if (ret) {
         if (ret != LIBUSBD_MACOS_ERR_NOTACTIVATED)
-            printf("libusbd macos: Unexpected error during IOUSBDeviceInterface_ReadPipe: %x (output %llx)\n", ret, output[0]);
+            LIBUSBD_LOG_ERROR("libusbd macos: Unexpected error during IOUSBDeviceInterface_ReadPipe: %x (output %llx)", ret, output[0]);
         return ret;
     }
 
@@ -554,7 +558,7 @@ kern_return_t IOUSBDeviceInterface_SetPipeProperty(libusbd_macos_ctx_t* pImplCtx
     return ret;
 }
 
-int libusbd_impl_init(libusbd_ctx_t* pCtx)
+int libusbd_macos_init(libusbd_ctx_t* pCtx)
 {
     if (!pCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -591,7 +595,7 @@ int libusbd_impl_init(libusbd_ctx_t* pCtx)
         CFRetain(match);
         ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
         if (ret != KERN_SUCCESS || iter == 0) {
-            printf("libusbd macos: Error matching gay_bowser_usbgadget (%x)...\n", ret);
+            LIBUSBD_LOG_ERROR("libusbd macos: Error matching gay_bowser_usbgadget (%x)...", ret);
             sleep(1);
             continue;
         }
@@ -609,7 +613,7 @@ int libusbd_impl_init(libusbd_ctx_t* pCtx)
             }
 
             if (strstr(path, "usb-drd2")) {
-                printf("libusbd macos: Connecting to: '%s'\n", path);
+                LIBUSBD_LOG_INFO("libusbd macos: Connecting to: '%s'", path);
                 break;
             }
 
@@ -623,7 +627,7 @@ int libusbd_impl_init(libusbd_ctx_t* pCtx)
     }
 
     if (!pImplCtx->service_usbgadget) {
-        printf("libusbd macos: Failed to find gay_bowser_usbgadget, aborting...\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Failed to find gay_bowser_usbgadget, aborting...");
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
@@ -642,21 +646,21 @@ int libusbd_impl_init(libusbd_ctx_t* pCtx)
     // Create port to listen for kernel notifications on.
     pImplCtx->notification_port = IONotificationPortCreate(kIOMainPortDefault);
     if (!pImplCtx->notification_port) {
-        printf("libusbd macos: Error getting notification port.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting notification port.");
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     // Get lower level mach port from notification port.
     pImplCtx->mnotification_port = IONotificationPortGetMachPort(pImplCtx->notification_port);
     if (!pImplCtx->mnotification_port) {
-        printf("libusbd macos: Error getting mach notification port.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting mach notification port.");
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     // Create a run loop source from our notification port so we can add the port to our run loop.
     run_loop_source = IONotificationPortGetRunLoopSource(pImplCtx->notification_port);
     if (run_loop_source == NULL) {
-        printf("libusbd macos: Error getting run loop source.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting run loop source.");
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
@@ -666,7 +670,7 @@ int libusbd_impl_init(libusbd_ctx_t* pCtx)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_free(libusbd_ctx_t* pCtx)
+int libusbd_macos_free(libusbd_ctx_t* pCtx)
 {
     kern_return_t s_ret;
 
@@ -720,7 +724,7 @@ int libusbd_impl_free(libusbd_ctx_t* pCtx)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
+int libusbd_macos_config_finalize(libusbd_ctx_t* pCtx)
 {
     IOReturn ret;
     kern_return_t s_ret;
@@ -790,7 +794,7 @@ int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
             CFRetain(match);
             ret = IOServiceGetMatchingServices(kIOMainPortDefault, match, &iter);
             if (ret != KERN_SUCCESS || iter == 0) {
-                printf("libusbd macos: Error matching IOUSBDeviceInterface (%x)...\n", ret);
+                LIBUSBD_LOG_ERROR("libusbd macos: Error matching IOUSBDeviceInterface (%x)...", ret);
                 sleep(1);
                 continue;
             }
@@ -808,7 +812,7 @@ int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
                 }
 
                 if (strstr(path, "usb-drd2")) {
-                    printf("libusbd macos: Connecting to: '%s'\n", path);
+                    LIBUSBD_LOG_INFO("libusbd macos: Connecting to: '%s'", path);
                     break;
                 }
                 IOObjectRelease(pIface->service);
@@ -821,7 +825,7 @@ int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
         }
 
         if (!pIface->service) {
-            printf("libusbd macos: Failed to find IOUSBDeviceInterface, aborting...\n");
+            LIBUSBD_LOG_ERROR("libusbd macos: Failed to find IOUSBDeviceInterface, aborting...");
             return LIBUSBD_NONDESCRIPT_ERROR;
         }
 
@@ -839,7 +843,7 @@ int libusbd_impl_config_finalize(libusbd_ctx_t* pCtx)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
+int libusbd_macos_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -872,21 +876,21 @@ int libusbd_impl_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
         // Create port to listen for kernel notifications on.
         pEp->notification_port = IONotificationPortCreate(kIOMainPortDefault);
         if (!pEp->notification_port) {
-            printf("libusbd macos: Error getting notification port.\n");
+            LIBUSBD_LOG_ERROR("libusbd macos: Error getting notification port.");
             return 0;
         }
 
         // Get lower level mach port from notification port.
         pEp->mnotification_port = IONotificationPortGetMachPort(pEp->notification_port);
         if (!pEp->mnotification_port) {
-            printf("libusbd macos: Error getting mach notification port.\n");
+            LIBUSBD_LOG_ERROR("libusbd macos: Error getting mach notification port.");
             return 0;
         }
 
         // Create a run loop source from our notification port so we can add the port to our run loop.
         run_loop_source = IONotificationPortGetRunLoopSource(pEp->notification_port);
         if (run_loop_source == NULL) {
-            printf("libusbd macos: Error getting run loop source.\n");
+            LIBUSBD_LOG_ERROR("libusbd macos: Error getting run loop source.");
             return 0;
         }
 
@@ -904,7 +908,7 @@ int libusbd_impl_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
 }
 
 
-int libusbd_impl_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+int libusbd_macos_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -923,7 +927,7 @@ int libusbd_impl_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uin
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+int libusbd_macos_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -942,7 +946,7 @@ int libusbd_impl_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num,
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
+int libusbd_macos_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -975,7 +979,7 @@ int libusbd_impl_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
     return LIBUSBD_SUCCESS;
 }
 
-static int libusbd_impl_iface_alloc_builtin_internal(libusbd_ctx_t* pCtx, const char* name)
+static int libusbd_macos_iface_alloc_builtin_internal(libusbd_ctx_t* pCtx, const char* name)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -999,7 +1003,7 @@ static int libusbd_impl_iface_alloc_builtin_internal(libusbd_ctx_t* pCtx, const
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
+int libusbd_macos_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
 {
     if (!pCtx || !pCtx->pMacosCtx || !name) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1012,20 +1016,20 @@ int libusbd_impl_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
             return LIBUSBD_RESOURCE_LIMIT_REACHED;
         }
 
-        if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControl")) return ret;
-        //if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControlAux")) return ret;
-        if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMData")) return ret;
-        //if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMDataAux")) return ret;
+        if (ret = libusbd_macos_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControl")) return ret;
+        //if (ret = libusbd_macos_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMControlAux")) return ret;
+        if (ret = libusbd_macos_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMData")) return ret;
+        //if (ret = libusbd_macos_iface_alloc_builtin_internal(pCtx, "AppleUSBNCMDataAux")) return ret;
     }
     else
     {
-        if (ret = libusbd_impl_iface_alloc_builtin_internal(pCtx, name)) return ret;
+        if (ret = libusbd_macos_iface_alloc_builtin_internal(pCtx, name)) return ret;
     }
 
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_alloc(libusbd_ctx_t* pCtx)
+int libusbd_macos_iface_alloc(libusbd_ctx_t* pCtx)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1040,21 +1044,21 @@ int libusbd_impl_iface_alloc(libusbd_ctx_t* pCtx)
     // Create port to listen for kernel notifications on.
     pIface->notification_port = IONotificationPortCreate(kIOMainPortDefault);
     if (!pIface->notification_port) {
-        printf("libusbd macos: Error getting notification port.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting notification port.");
         return 0;
     }
 
     // Get lower level mach port from notification port.
     pIface->mnotification_port = IONotificationPortGetMachPort(pIface->notification_port);
     if (!pIface->mnotification_port) {
-        printf("libusbd macos: Error getting mach notification port.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting mach notification port.");
         return 0;
     }
 
     // Create a run loop source from our notification port so we can add the port to our run loop.
     run_loop_source = IONotificationPortGetRunLoopSource(pIface->notification_port);
     if (run_loop_source == NULL) {
-        printf("libusbd macos: Error getting run loop source.\n");
+        LIBUSBD_LOG_ERROR("libusbd macos: Error getting run loop source.");
         return 0;
     }
 
@@ -1072,7 +1076,7 @@ int libusbd_impl_iface_alloc(libusbd_ctx_t* pCtx)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
+int libusbd_macos_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1096,7 +1100,7 @@ int libusbd_impl_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, c
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_macos_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1120,7 +1124,7 @@ int libusbd_impl_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_macos_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1144,7 +1148,7 @@ int libusbd_impl_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+int libusbd_macos_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1168,7 +1172,7 @@ int libusbd_impl_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
+int libusbd_macos_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1188,22 +1192,8 @@ int libusbd_impl_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
+static int libusbd_macos_ep_read_sync(libusbd_macos_ctx_t* pImplCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
 {
-    if (!pCtx || !pCtx->pMacosCtx) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-
-    if (iface_num >= LIBUSBD_MAX_IFACES) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-
-    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
-        return LIBUSBD_INVALID_ARGUMENT;
-    }
-
-    libusbd_macos_ctx_t* pImplCtx = pCtx->pMacosCtx;
-
     kern_return_t ret = IOUSBDeviceInterface_ReadPipe(pImplCtx, iface_num, ep, data, len, timeoutMs);
     if (ret == LIBUSBD_MACOS_ERR_NOTACTIVATED)
     {
@@ -1219,15 +1209,14 @@ int libusbd_impl_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, vo
     }
     else if (ret & 0xFFF00000)
     {
-        printf("libusbd macos: Unknown error from IOUSBDeviceInterface_ReadPipe: %08x\n", ret);
+        LIBUSBD_LOG_ERROR("libusbd macos: Unknown error from IOUSBDeviceInterface_ReadPipe: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     return ret;
 }
 
-
-int libusbd_impl_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+int libusbd_macos_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1241,8 +1230,21 @@ int libusbd_impl_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, c
         return LIBUSBD_INVALID_ARGUMENT;
     }
 
-    libusbd_macos_ctx_t* pImplCtx = pCtx->pMacosCtx;
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, len, 0);
+    uint64_t submit_ns = libusbd_stats_now_ns();
+    libusbd_stats_submit(pCtx, iface_num, ep);
+
+    int ret = libusbd_macos_ep_read_sync(pCtx->pMacosCtx, iface_num, ep, data, len, timeoutMs);
+
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, submit_ns);
+
+    return ret;
+}
 
+
+static int libusbd_macos_ep_write_sync(libusbd_macos_ctx_t* pImplCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+{
     kern_return_t ret = IOUSBDeviceInterface_WritePipe(pImplCtx, iface_num, ep, data, len, timeoutMs);
     if (ret == LIBUSBD_MACOS_ERR_NOTACTIVATED)
     {
@@ -1258,14 +1260,40 @@ int libusbd_impl_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, c
     }
     else if (ret & 0xFFF00000)
     {
-        printf("libusbd macos: Unknown error from IOUSBDeviceInterface_WritePipe: %08x\n", ret);
+        LIBUSBD_LOG_ERROR("libusbd macos: Unknown error from IOUSBDeviceInterface_WritePipe: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     return ret;
 }
 
-int libusbd_impl_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_macos_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, len, 0);
+    uint64_t submit_ns = libusbd_stats_now_ns();
+    libusbd_stats_submit(pCtx, iface_num, ep);
+
+    int ret = libusbd_macos_ep_write_sync(pCtx->pMacosCtx, iface_num, ep, data, len, timeoutMs);
+
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, submit_ns);
+
+    return ret;
+}
+
+int libusbd_macos_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1282,7 +1310,25 @@ int libusbd_impl_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_macos_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // No known IOUSBDeviceInterface method for it, only the host can
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1303,7 +1349,7 @@ int libusbd_impl_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
     return LIBUSBD_SUCCESS;
 }
 
-int libusbd_impl_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
+int libusbd_macos_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1326,7 +1372,7 @@ int libusbd_impl_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t
     return (pEp->buffer.size & 0x7FFFFFFF);
 }
 
-int libusbd_impl_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
+int libusbd_macos_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1357,14 +1403,14 @@ int libusbd_impl_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t
     }
     else if (ret & 0xFFF00000)
     {
-        printf("libusbd macos: Unknown error from IOUSBDeviceInterface_ReadPipeStart: %08x\n", ret);
+        LIBUSBD_LOG_ERROR("libusbd macos: Unknown error from IOUSBDeviceInterface_ReadPipeStart: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     return ret;
 }
 
-int libusbd_impl_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
+int libusbd_macos_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1395,14 +1441,84 @@ int libusbd_impl_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t
     }
     else if (ret & 0xFFF00000)
     {
-        printf("libusbd macos: Unknown error from IOUSBDeviceInterface_WritePipeStart: %08x\n", ret);
+        LIBUSBD_LOG_ERROR("libusbd macos: Unknown error from IOUSBDeviceInterface_WritePipeStart: %08x", ret);
         return LIBUSBD_NONDESCRIPT_ERROR;
     }
 
     return ret;
 }
 
-int libusbd_impl_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_macos_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // IOUSBDeviceFamily doesn't tell us about resets, so there's nothing to re-arm from.
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // No dma-buf on macOS, IOUSBDeviceFamily hands out its own buffers
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_ep_get_fifo_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pMacosCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1428,7 +1544,7 @@ int libusbd_impl_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64
     return pEp->ep_async_done;
 }
 
-int libusbd_impl_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+int libusbd_macos_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
 {
     if (!pCtx || !pCtx->pMacosCtx) {
         return LIBUSBD_INVALID_ARGUMENT;
@@ -1452,4 +1568,78 @@ int libusbd_impl_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, ui
     }
 
     return pEp->last_transferred;
-}
\ No newline at end of file
+}
+
+int libusbd_macos_xfer_alloc(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_xfer_free(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_xfer_submit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_xfer_cancel(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_xfer_prepare(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_xfer_resubmit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_handoff_export(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    if (!pCtx || !pCtx->pMacosCtx || !pBuf) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // IOUSBDeviceFamily interfaces are mach connections owned by this task
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_macos_handoff_adopt(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+const libusbd_backend_ops_t libusbd_backend_macos = {
+    .name = "iousbdevice",
+    LIBUSBD_BACKEND_OPS(macos),
+};
@@ -0,0 +1,2111 @@
+#include "impl.h"
+
+#include "impl_priv.h"
+#include "libusbd_backend.h"
+#include "libusbd_log.h"
+#include "libusbd_pcap.h"
+#include "libusbd_pool.h"
+#include "libusbd_record.h"
+#include "libusbd_stats.h"
+#include "libusbd_trace.h"
+#include "libusbd_transfer.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <pthread.h>
+
+#include "libusbd_priv.h"
+#include "libusbd_arena.h"
+
+#define LIBUSBD_RAWGADGET_DEV "/dev/raw-gadget"
+
+#define LIBUSBD_RAWGADGET_EP_BUFFER_SZ  (0x1000)
+#define LIBUSBD_RAWGADGET_EP0_BUFFER_SZ (0x10000)
+
+#define LIBUSBD_RAWGADGET_EPADDR_IDX(addr) (((addr) & 0xF) | (((addr) & 0x80) ? 0x10 : 0))
+
+// Bus events from newer kernels, older ones only ever send CONNECT and CONTROL
+#define LIBUSBD_RAWGADGET_EVENT_SUSPEND    (3)
+#define LIBUSBD_RAWGADGET_EVENT_RESUME     (4)
+#define LIBUSBD_RAWGADGET_EVENT_RESET      (5)
+#define LIBUSBD_RAWGADGET_EVENT_DISCONNECT (6)
+
+// Raw Gadget's blocking ioctls only give up early when a signal interrupts
+// them, this one is used to get threads out of EVENT_FETCH and EP_READ/WRITE
+#ifndef LIBUSBD_RAWGADGET_WAKE_SIGNAL
+#define LIBUSBD_RAWGADGET_WAKE_SIGNAL (SIGRTMIN + 5)
+#endif
+
+//
+// Helpers
+//
+
+static void libusbd_rawgadget_wake_handler(int sig)
+{
+}
+
+static void libusbd_rawgadget_install_wake_handler(void)
+{
+    struct sigaction sa;
+    struct sigaction old;
+
+    if (sigaction(LIBUSBD_RAWGADGET_WAKE_SIGNAL, NULL, &old) == 0
+        && !(old.sa_flags & SA_SIGINFO) && old.sa_handler != SIG_DFL && old.sa_handler != libusbd_rawgadget_wake_handler) {
+        LIBUSBD_LOG_WARN("libusbd raw-gadget: Signal %d already has a handler, timeouts and aborts may not work", LIBUSBD_RAWGADGET_WAKE_SIGNAL);
+        return;
+    }
+
+    // No SA_RESTART, the ioctl has to come back with EINTR
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = libusbd_rawgadget_wake_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(LIBUSBD_RAWGADGET_WAKE_SIGNAL, &sa, NULL);
+}
+
+// ep0's buffer is set up by init, before the pool can be configured, so it
+// passes a NULL pCtx and comes from malloc
+static int libusbd_rawgadget_buffer_alloc(libusbd_ctx_t* pCtx, libusbd_rawgadget_buffer_t* pBuffer, uint64_t size)
+{
+    uint64_t total = sizeof(struct usb_raw_ep_io) + size;
+
+    pBuffer->pIo = pCtx ? libusbd_pool_alloc(pCtx, total) : malloc(total);
+    if (!pBuffer->pIo) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pBuffer->data = pBuffer->pIo->data;
+    pBuffer->size = size;
+
+    return LIBUSBD_SUCCESS;
+}
+
+static void libusbd_rawgadget_buffer_free(libusbd_ctx_t* pCtx, libusbd_rawgadget_buffer_t* pBuffer)
+{
+    if (pCtx) {
+        libusbd_pool_free(pCtx, pBuffer->pIo);
+    }
+    else {
+        free(pBuffer->pIo);
+    }
+    pBuffer->pIo = NULL;
+    pBuffer->data = NULL;
+    pBuffer->size = 0;
+}
+
+static int libusbd_rawgadget_errno_to_ret(int err)
+{
+    // EINTR is us interrupting it, the rest are the UDC killing the request
+    // on reset, disconnect or halt
+    if (err == EINTR || err == ESHUTDOWN || err == ECONNRESET || err == ECONNABORTED || err == ENODEV) {
+        return LIBUSBD_CANCELLED;
+    }
+    else if (err == EPIPE) {
+        return LIBUSBD_STALLED;
+    }
+
+    return LIBUSBD_NONDESCRIPT_ERROR;
+}
+
+// First UDC listed, or $LIBUSBD_RAW_GADGET_UDC. Raw Gadget also wants the
+// name of the driver bound to it, ie dummy_udc for dummy_udc.0.
+static int libusbd_rawgadget_find_udc(struct usb_raw_init* pInit)
+{
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+    const char* pDevice = getenv("LIBUSBD_RAW_GADGET_UDC");
+
+    if (!pDevice) {
+        DIR* d = opendir("/sys/class/udc");
+        if (!d) {
+            return LIBUSBD_NOT_IMPLEMENTED;
+        }
+
+        struct dirent* dir;
+        while ((dir = readdir(d)) != NULL) {
+            if (strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")) {
+                snprintf((char*)pInit->device_name, UDC_NAME_LENGTH_MAX, "%.*s", UDC_NAME_LENGTH_MAX - 1, dir->d_name);
+                break;
+            }
+        }
+        closedir(d);
+
+        if (!pInit->device_name[0]) {
+            return LIBUSBD_NOT_IMPLEMENTED;
+        }
+    }
+    else {
+        snprintf((char*)pInit->device_name, UDC_NAME_LENGTH_MAX, "%.*s", UDC_NAME_LENGTH_MAX - 1, pDevice);
+    }
+
+    snprintf(path, sizeof(path), "/sys/class/udc/%s/device/driver", pInit->device_name);
+    ssize_t len = readlink(path, link, sizeof(link) - 1);
+    if (len < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: No driver for UDC %s (%s)", pInit->device_name, strerror(errno));
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+    link[len] = 0;
+
+    const char* pDriver = strrchr(link, '/');
+    snprintf((char*)pInit->driver_name, UDC_NAME_LENGTH_MAX, "%.*s", UDC_NAME_LENGTH_MAX - 1, pDriver ? pDriver + 1 : link);
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Descriptors
+//
+
+// The node and its data are one allocation in the context's arena
+static libusbd_rawgadget_descdata_t* libusbd_rawgadget_desc_append(libusbd_ctx_t* pCtx, libusbd_rawgadget_descdata_t** ppHead, const uint8_t* pDesc, uint64_t descSz)
+{
+    libusbd_rawgadget_descdata_t* pNewDesc = libusbd_arena_alloc(pCtx, sizeof(libusbd_rawgadget_descdata_t) + descSz);
+    if (!pNewDesc) return NULL;
+
+    pNewDesc->pNext = NULL;
+    pNewDesc->data = pNewDesc + 1;
+    memcpy(pNewDesc->data, pDesc, descSz);
+    pNewDesc->size = descSz;
+    pNewDesc->idx = 0;
+
+    // Keep the order they were added in, it's the order the host sees
+    while (*ppHead) {
+        ppHead = &(*ppHead)->pNext;
+    }
+    *ppHead = pNewDesc;
+
+    return pNewDesc;
+}
+
+static int libusbd_rawgadget_ep_caps_match(const struct usb_raw_ep_info* pInfo, const libusbd_rawgadget_ep_t* pEp)
+{
+    if (pEp->direction == USB_EP_DIR_IN ? !pInfo->caps.dir_in : !pInfo->caps.dir_out) {
+        return 0;
+    }
+
+    if (pInfo->limits.maxpacket_limit && pInfo->limits.maxpacket_limit < pEp->maxPktSize) {
+        return 0;
+    }
+
+    switch (pEp->type)
+    {
+        case USB_EPATTR_TTYPE_ISOC:
+            return pInfo->caps.type_iso;
+        case USB_EPATTR_TTYPE_BULK:
+            return pInfo->caps.type_bulk;
+        case USB_EPATTR_TTYPE_INTR:
+            return pInfo->caps.type_int;
+        default:
+            return 0;
+    }
+}
+
+// Endpoint addresses have to be ones the UDC actually has, so they're
+// matched up against USB_RAW_IOCTL_EPS_INFO once it's bound, like
+// usb_ep_autoconfig does for in-kernel gadgets.
+static int libusbd_rawgadget_assign_endpoints(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    struct usb_raw_eps_info info;
+    uint8_t aUdcUsed[USB_RAW_EPS_NUM_MAX] = {0};
+    uint32_t addrUsed = 0;
+
+    memset(&info, 0, sizeof(info));
+    int num = ioctl(pImplCtx->fd, USB_RAW_IOCTL_EPS_INFO, &info);
+    if (num < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: EPS_INFO failed (%s)", strerror(errno));
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    memset(pImplCtx->aEpAddrIface, 0xFF, sizeof(pImplCtx->aEpAddrIface));
+    memset(pImplCtx->aEpAddrIdx, 0xFF, sizeof(pImplCtx->aEpAddrIdx));
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+            uint8_t dir = pEp->direction == USB_EP_DIR_IN ? 0x80 : 0x00;
+
+            pEp->address = 0;
+            for (int k = 0; k < num && !pEp->address; k++)
+            {
+                if (aUdcUsed[k] || !libusbd_rawgadget_ep_caps_match(&info.eps[k], pEp)) continue;
+
+                uint8_t addr = 0;
+                if (info.eps[k].addr != USB_RAW_EP_ADDR_ANY) {
+                    addr = (info.eps[k].addr & 0xF) | dir;
+                }
+                else {
+                    for (int n = 1; n < 16 && !addr; n++)
+                    {
+                        if (!(addrUsed & (1 << LIBUSBD_RAWGADGET_EPADDR_IDX(n | dir)))) {
+                            addr = n | dir;
+                        }
+                    }
+                }
+
+                if (!addr || (addrUsed & (1 << LIBUSBD_RAWGADGET_EPADDR_IDX(addr)))) continue;
+
+                aUdcUsed[k] = 1;
+                addrUsed |= 1 << LIBUSBD_RAWGADGET_EPADDR_IDX(addr);
+                pEp->address = addr;
+            }
+
+            if (!pEp->address) {
+                LIBUSBD_LOG_ERROR("libusbd raw-gadget: UDC has no endpoint left for interface %u endpoint %u", i, j);
+                return LIBUSBD_RESOURCE_LIMIT_REACHED;
+            }
+
+            pImplCtx->aEpAddrIface[LIBUSBD_RAWGADGET_EPADDR_IDX(pEp->address)] = i;
+            pImplCtx->aEpAddrIdx[LIBUSBD_RAWGADGET_EPADDR_IDX(pEp->address)] = j;
+
+            // Keep captures in line with what the host sees
+            pCtx->aInterfaces[i].aEpAddress[j] = pEp->address;
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_rawgadget_build_config_desc(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    uint32_t total = 9;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        total += 9 + (7 * pIface->bNumEndpoints);
+        for (libusbd_rawgadget_descdata_t* pIter = pIface->pStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            total += pIter->size;
+        }
+    }
+
+    if (total > 0xFFFF) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    uint8_t* pDesc = libusbd_arena_alloc(pCtx, total);
+    if (!pDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    uint8_t* pNext = pDesc;
+    uint8_t config[9] = {9, 0x02, total & 0xFF, total >> 8, pCtx->bNumInterfaces, 1, 0, 0xC0, 50};
+    memcpy(pNext, config, sizeof(config));
+    pNext += sizeof(config);
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+        libusbd_iface_t* pIfaceSuper = &pCtx->aInterfaces[i];
+
+        uint8_t iface[9] = {9, 0x04, i, 0, pIface->bNumEndpoints, pIfaceSuper->bClass, pIfaceSuper->bSubclass, pIfaceSuper->bProtocol, 0};
+        memcpy(pNext, iface, sizeof(iface));
+        pNext += sizeof(iface);
+
+        for (libusbd_rawgadget_descdata_t* pIter = pIface->pStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            memcpy(pNext, pIter->data, pIter->size);
+            pNext += pIter->size;
+        }
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+
+            uint8_t epDesc[7] = {7, 0x05, pEp->address, pEp->type, pEp->maxPktSize & 0xFF, (pEp->maxPktSize >> 8) & 0xFF, pEp->interval};
+            memcpy(pNext, epDesc, sizeof(epDesc));
+            pNext += sizeof(epDesc);
+        }
+    }
+
+    // A rebuild leaves the old one in the arena
+    pImplCtx->pConfigDesc = pDesc;
+    pImplCtx->configDescSz = total;
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_rawgadget_string_desc(libusbd_ctx_t* pCtx, uint8_t idx, uint8_t* pOut)
+{
+    const char* pStr = NULL;
+
+    if (idx == 0) {
+        uint8_t langs[4] = {4, 0x03, 0x09, 0x04};
+        memcpy(pOut, langs, sizeof(langs));
+        return sizeof(langs);
+    }
+
+    if (idx == 1) pStr = pCtx->pManufacturerStr;
+    else if (idx == 2) pStr = pCtx->pProductStr;
+    else if (idx == 3) pStr = pCtx->pSerialStr;
+
+    if (!pStr) {
+        return LIBUSBD_STALLED;
+    }
+
+    // ASCII -> UTF-16LE, truncated to what fits in bLength
+    int len = 0;
+    for (; pStr[len] && len < 126; len++)
+    {
+        pOut[2 + (len * 2)] = pStr[len];
+        pOut[3 + (len * 2)] = 0;
+    }
+    pOut[0] = 2 + (len * 2);
+    pOut[1] = 0x03;
+
+    return pOut[0];
+}
+
+//
+// Endpoint I/O
+//
+
+static uint64_t libusbd_rawgadget_ep_submitted(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len)
+{
+    LIBUSBD_TRACE(pCtx, submit, LIBUSBD_TRACE_SUBMIT, iface_num, ep, len, 0);
+    libusbd_stats_submit(pCtx, iface_num, ep);
+
+    return libusbd_stats_now_ns();
+}
+
+static void libusbd_rawgadget_ep_completed(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int ret, uint64_t submit_ns)
+{
+    LIBUSBD_TRACE(pCtx, complete, LIBUSBD_TRACE_COMPLETE, iface_num, ep, ret, 0);
+    libusbd_stats_complete(pCtx, iface_num, ep, ret, submit_ns);
+}
+
+// Runs the endpoint's current transfer out of pIo. io_mutex is dropped for
+// the ioctl.
+//
+// Must be called with io_mutex held
+static int libusbd_rawgadget_ep_io_locked(libusbd_rawgadget_ctx_t* pImplCtx, libusbd_rawgadget_ep_t* pEp, struct usb_raw_ep_io* pIo, int op, uint32_t len)
+{
+
+    pEp->in_io = 1;
+    pEp->io_thread = pthread_self();
+
+    if (pEp->cancel) {
+        pEp->in_io = 0;
+        return LIBUSBD_CANCELLED;
+    }
+
+    pIo->ep = pEp->handle;
+    pIo->flags = 0;
+    pIo->length = len;
+    unsigned long req = op == LIBUSBD_RAWGADGET_OP_READ ? USB_RAW_IOCTL_EP_READ : USB_RAW_IOCTL_EP_WRITE;
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    int ret = ioctl(pImplCtx->fd, req, pIo);
+    int err = errno;
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    pEp->in_io = 0;
+    pthread_cond_broadcast(&pEp->cond);
+
+    return ret < 0 ? libusbd_rawgadget_errno_to_ret(err) : ret;
+}
+
+// Gets whoever is in the endpoint's ioctl out of it.
+//
+// Must be called with io_mutex held
+static void libusbd_rawgadget_ep_interrupt_locked(libusbd_rawgadget_ctx_t* pImplCtx, libusbd_rawgadget_ep_t* pEp)
+{
+    // The signal can land just before the ioctl is entered, so keep at it
+    while (pEp->in_io)
+    {
+        struct timespec ts;
+
+        pthread_kill(pEp->io_thread, LIBUSBD_RAWGADGET_WAKE_SIGNAL);
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&pEp->cond, &pImplCtx->io_mutex, &ts);
+    }
+}
+
+// Must be called with io_mutex held
+static void libusbd_rawgadget_ep_complete_locked(libusbd_rawgadget_ep_t* pEp, int ret)
+{
+    pEp->status = ret;
+    pEp->done = 1;
+    pEp->op = LIBUSBD_RAWGADGET_OP_NONE;
+    pEp->busy = 0;
+    pEp->cancel = 0;
+    pEp->rearm_pending = 0;
+
+    // Sync transfers are accounted for by the waiter
+    if (pEp->is_async) {
+        pEp->last_transferred = ret < 0 ? 0 : ret;
+        libusbd_rawgadget_ep_completed(pEp->pCtx, pEp->iface_num, pEp->idx, ret, ret < 0 ? 0 : pEp->submit_ns);
+        __atomic_store_n(&pEp->ep_async_done, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_cond_broadcast(&pEp->cond);
+}
+
+// Ends whatever transfer owns the endpoint and waits for it to let go.
+//
+// Must be called with io_mutex held
+static void libusbd_rawgadget_ep_cancel_locked(libusbd_ctx_t* pCtx, libusbd_rawgadget_ep_t* pEp)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    if (!pEp->busy) return;
+
+    LIBUSBD_TRACE(pCtx, cancel, LIBUSBD_TRACE_CANCEL, pEp->iface_num, pEp->idx, 0, 0);
+
+    pEp->cancel = 1;
+    if (pEp->in_io) {
+        libusbd_rawgadget_ep_interrupt_locked(pImplCtx, pEp);
+    }
+    else if (pEp->is_async) {
+        // Queued for the worker or held for the next enable
+        libusbd_rawgadget_ep_complete_locked(pEp, LIBUSBD_CANCELLED);
+    }
+
+    while (pEp->busy)
+    {
+        pthread_cond_wait(&pEp->cond, &pImplCtx->io_mutex);
+    }
+}
+
+// Runs the transfer object at the head of the queue, the worker's fallback
+// when no legacy transfer is waiting. io_mutex is dropped for the ioctl and
+// the callback.
+//
+// Must be called with io_mutex held
+static void libusbd_rawgadget_xfer_run_locked(libusbd_rawgadget_ctx_t* pImplCtx, libusbd_rawgadget_ep_t* pEp)
+{
+    libusbd_rawgadget_xfer_t* pRgXfer = pEp->pXferHead;
+
+    pEp->pXferHead = pRgXfer->pNext;
+    if (!pEp->pXferHead) {
+        pEp->pXferTail = NULL;
+    }
+    pRgXfer->pNext = NULL;
+
+    pEp->pXferCur = pRgXfer;
+    pEp->busy = 1;
+    pEp->is_async = 0;
+    pEp->cancel = 0;
+
+    int op = pEp->direction == USB_EP_DIR_IN ? LIBUSBD_RAWGADGET_OP_WRITE : LIBUSBD_RAWGADGET_OP_READ;
+    int ret = libusbd_rawgadget_ep_io_locked(pImplCtx, pEp, pRgXfer->buffer.pIo, op, pRgXfer->pXfer->pub.length);
+
+    pEp->pXferCur = NULL;
+    pEp->busy = 0;
+    pEp->cancel = 0;
+    pthread_cond_broadcast(&pEp->cond);
+
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+    libusbd_xfer_complete(pRgXfer->pXfer, ret);
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+}
+
+// Pulls every queued transfer object off the endpoint, for the caller to
+// complete as cancelled once io_mutex is dropped.
+//
+// Must be called with io_mutex held
+static libusbd_rawgadget_xfer_t* libusbd_rawgadget_xfer_take_queued_locked(libusbd_rawgadget_ep_t* pEp)
+{
+    libusbd_rawgadget_xfer_t* pHead = pEp->pXferHead;
+
+    pEp->pXferHead = NULL;
+    pEp->pXferTail = NULL;
+
+    return pHead;
+}
+
+static void libusbd_rawgadget_xfer_cancel_list(libusbd_rawgadget_xfer_t* pIter)
+{
+    while (pIter)
+    {
+        libusbd_rawgadget_xfer_t* pNext = pIter->pNext;
+
+        pIter->pNext = NULL;
+        libusbd_xfer_complete(pIter->pXfer, LIBUSBD_CANCELLED);
+        pIter = pNext;
+    }
+}
+
+static void* libusbd_rawgadget_ep_worker(libusbd_rawgadget_ep_t* pEp)
+{
+    libusbd_ctx_t* pCtx = pEp->pCtx;
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    while (pEp->worker_running)
+    {
+        int has_xfer = pEp->pXferHead && !pEp->busy;
+
+        if ((pEp->op == LIBUSBD_RAWGADGET_OP_NONE && !has_xfer) || pEp->in_io || !pImplCtx->has_enumerated || pEp->handle < 0) {
+            pthread_cond_wait(&pEp->cond, &pImplCtx->io_mutex);
+            continue;
+        }
+
+        if (pEp->op == LIBUSBD_RAWGADGET_OP_NONE) {
+            libusbd_rawgadget_xfer_run_locked(pImplCtx, pEp);
+            continue;
+        }
+
+        if (pEp->rearm_pending) {
+            pEp->rearm_pending = 0;
+            pEp->submit_ns = libusbd_rawgadget_ep_submitted(pCtx, pEp->iface_num, pEp->idx, pEp->len);
+        }
+
+        int ret = libusbd_rawgadget_ep_io_locked(pImplCtx, pEp, pEp->buffer.pIo, pEp->op, pEp->len);
+
+        // Standing transfers killed by a reset or disconnect stay queued
+        // and go out again on the next SET_CONFIGURATION
+        if (ret < 0 && !pEp->cancel && pEp->is_async && pEp->rearm_policy == LIBUSBD_REARM_ON_ENABLE && !pImplCtx->has_enumerated) {
+            libusbd_rawgadget_ep_completed(pCtx, pEp->iface_num, pEp->idx, LIBUSBD_CANCELLED, 0);
+            pEp->rearm_pending = 1;
+            continue;
+        }
+
+        libusbd_rawgadget_ep_complete_locked(pEp, ret);
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return NULL;
+}
+
+// Must be called with io_mutex held
+static int libusbd_rawgadget_enable_endpoints_locked(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+            struct usb_endpoint_descriptor desc;
+
+            if (pEp->handle >= 0) continue;
+
+            memset(&desc, 0, sizeof(desc));
+            desc.bLength = USB_DT_ENDPOINT_SIZE;
+            desc.bDescriptorType = USB_DT_ENDPOINT;
+            desc.bEndpointAddress = pEp->address;
+            desc.bmAttributes = pEp->type;
+            desc.wMaxPacketSize = htole16(pEp->maxPktSize);
+            desc.bInterval = pEp->interval;
+
+            int handle = ioctl(pImplCtx->fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+            if (handle < 0) {
+                LIBUSBD_LOG_ERROR("libusbd raw-gadget: Failed to enable endpoint %02x (%s)", pEp->address, strerror(errno));
+                return LIBUSBD_NONDESCRIPT_ERROR;
+            }
+
+            pEp->handle = handle;
+            pEp->halted = 0;
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Must be called with io_mutex held
+static void libusbd_rawgadget_disable_endpoints_locked(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    pImplCtx->has_enumerated = 0;
+    pImplCtx->bConfigurationValue = 0;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+
+            if (pEp->handle < 0) continue;
+
+            // EP_DISABLE refuses while a request is queued
+            libusbd_rawgadget_ep_interrupt_locked(pImplCtx, pEp);
+
+            if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_EP_DISABLE, pEp->handle) < 0) {
+                LIBUSBD_LOG_WARN("libusbd raw-gadget: Failed to disable endpoint %02x (%s)", pEp->address, strerror(errno));
+            }
+            pEp->handle = -1;
+        }
+    }
+}
+
+static int libusbd_rawgadget_ep_start_workers(libusbd_ctx_t* pCtx, uint8_t iface_num)
+{
+    libusbd_rawgadget_iface_t* pIface = &pCtx->pRawGadgetCtx->aInterfaces[iface_num];
+
+    for (int j = 0; j < pIface->bNumEndpoints; j++)
+    {
+        libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+
+        pEp->worker_running = 1;
+        if (pthread_create(&pEp->worker, NULL, (void* (*)(void*))&libusbd_rawgadget_ep_worker, pEp)) {
+            pEp->worker_running = 0;
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// ep0
+//
+
+static int libusbd_rawgadget_ep0_io(libusbd_rawgadget_ctx_t* pImplCtx, unsigned long req, uint32_t len)
+{
+    struct usb_raw_ep_io* pIo = pImplCtx->ep0_buffer.pIo;
+
+    pIo->ep = 0;
+    pIo->flags = 0;
+    pIo->length = len;
+
+    int ret = ioctl(pImplCtx->fd, req, pIo);
+    if (ret < 0) {
+        LIBUSBD_LOG_DEBUG("libusbd raw-gadget: ep0 transfer failed (%s)", strerror(errno));
+        return libusbd_rawgadget_errno_to_ret(errno);
+    }
+
+    return ret;
+}
+
+// Standard requests, answered here instead of by a kernel function driver.
+// Returns the reply length, or LIBUSBD_STALLED.
+static int libusbd_rawgadget_standard_request(libusbd_ctx_t* pCtx, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t* pReply)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    uint8_t recipient = bmRequestType & 0x1F;
+    int ret;
+
+    if (bmRequestType == LIBUSBD_DEV2HOST_DEVICE && bRequest == LIBUSBD_GET_DESCRIPTOR)
+    {
+        uint8_t descType = wValue >> 8;
+        uint8_t descIdx = wValue & 0xFF;
+
+        if (descType == 0x01) {
+            uint16_t vid = pCtx->vid ? pCtx->vid : 0x1d6b;
+            uint16_t pid = pCtx->pid ? pCtx->pid : 0x0052;
+            uint16_t did = pCtx->did ? pCtx->did : 0x0100;
+            uint8_t dev[18] = {18, 0x01, 0x00, 0x02, pCtx->bClass, pCtx->bSubclass, pCtx->bProtocol, 64,
+                               vid & 0xFF, vid >> 8, pid & 0xFF, pid >> 8, did & 0xFF, did >> 8,
+                               pCtx->pManufacturerStr ? 1 : 0, pCtx->pProductStr ? 2 : 0, pCtx->pSerialStr ? 3 : 0, 1};
+            memcpy(pReply, dev, sizeof(dev));
+            return sizeof(dev);
+        }
+        else if (descType == 0x02 && descIdx == 0 && pImplCtx->pConfigDesc) {
+            memcpy(pReply, pImplCtx->pConfigDesc, pImplCtx->configDescSz);
+            return pImplCtx->configDescSz;
+        }
+        else if (descType == 0x03) {
+            return libusbd_rawgadget_string_desc(pCtx, descIdx, pReply);
+        }
+        else if (descType == 0x06) {
+            // Device qualifier, same config at either speed
+            uint8_t qual[10] = {10, 0x06, 0x00, 0x02, pCtx->bClass, pCtx->bSubclass, pCtx->bProtocol, 64, 1, 0};
+            memcpy(pReply, qual, sizeof(qual));
+            return sizeof(qual);
+        }
+
+        return LIBUSBD_STALLED;
+    }
+    else if (bmRequestType == LIBUSBD_DEV2HOST_INTERFACE && bRequest == LIBUSBD_GET_DESCRIPTOR)
+    {
+        if (wIndex >= pCtx->bNumInterfaces) return LIBUSBD_STALLED;
+
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[wIndex];
+        for (libusbd_rawgadget_descdata_t* pIter = pIface->pNonStandardDescs; pIter; pIter = pIter->pNext)
+        {
+            if (pIter->idx == (wValue >> 8)) {
+                memcpy(pReply, pIter->data, pIter->size);
+                return pIter->size;
+            }
+        }
+
+        return LIBUSBD_STALLED;
+    }
+    else if (bRequest == LIBUSBD_SET_CONFIGURATION && bmRequestType == LIBUSBD_HOST2DEV_DEVICE)
+    {
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+
+        if (wValue == 0) {
+            libusbd_rawgadget_disable_endpoints_locked(pCtx);
+            pthread_mutex_unlock(&pImplCtx->io_mutex);
+            return 0;
+        }
+        else if (wValue != 1) {
+            pthread_mutex_unlock(&pImplCtx->io_mutex);
+            return LIBUSBD_STALLED;
+        }
+
+        // A SET_CONFIGURATION while configured resets every endpoint
+        libusbd_rawgadget_disable_endpoints_locked(pCtx);
+
+        ret = libusbd_rawgadget_enable_endpoints_locked(pCtx);
+        if (ret == LIBUSBD_SUCCESS) {
+            ioctl(pImplCtx->fd, USB_RAW_IOCTL_VBUS_DRAW, 100 / 2);
+            ioctl(pImplCtx->fd, USB_RAW_IOCTL_CONFIGURE, 0);
+
+            pImplCtx->bConfigurationValue = wValue;
+            pImplCtx->has_enumerated = 1;
+        }
+
+        // Workers pick up anything started early or held over from before
+        for (int i = 0; i < pCtx->bNumInterfaces; i++)
+        {
+            for (int j = 0; j < pImplCtx->aInterfaces[i].bNumEndpoints; j++)
+            {
+                pthread_cond_broadcast(&pImplCtx->aInterfaces[i].aEndpoints[j].cond);
+            }
+        }
+
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+        return ret == LIBUSBD_SUCCESS ? 0 : LIBUSBD_STALLED;
+    }
+    else if (bRequest == LIBUSBD_GET_CONFIGURATION && bmRequestType == LIBUSBD_DEV2HOST_DEVICE)
+    {
+        pReply[0] = pImplCtx->bConfigurationValue;
+        return 1;
+    }
+    else if (bRequest == LIBUSBD_GET_STATUS && (bmRequestType & LIBUSBD_DEV2HOST_DIR))
+    {
+        pReply[0] = (recipient == 0) ? 0x01 : 0x00; // self-powered
+        pReply[1] = 0;
+
+        if (recipient == 2) {
+            uint8_t idx = LIBUSBD_RAWGADGET_EPADDR_IDX(wIndex);
+            if (pImplCtx->aEpAddrIface[idx] == 0xFF) return LIBUSBD_STALLED;
+
+            pReply[0] = pImplCtx->aInterfaces[pImplCtx->aEpAddrIface[idx]].aEndpoints[pImplCtx->aEpAddrIdx[idx]].halted;
+        }
+        return 2;
+    }
+    else if ((bRequest == LIBUSBD_CLEAR_FEATURE || bRequest == LIBUSBD_SET_FEATURE) && bmRequestType == LIBUSBD_HOST2DEV_ENDPOINT)
+    {
+        uint8_t idx = LIBUSBD_RAWGADGET_EPADDR_IDX(wIndex);
+        if (wValue != 0 || pImplCtx->aEpAddrIface[idx] == 0xFF) return LIBUSBD_STALLED;
+
+        libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[pImplCtx->aEpAddrIface[idx]].aEndpoints[pImplCtx->aEpAddrIdx[idx]];
+
+        // ENDPOINT_HALT, clearing it also resets the data toggle
+        pthread_mutex_lock(&pImplCtx->io_mutex);
+        ret = LIBUSBD_STALLED;
+        if (pEp->handle >= 0) {
+            unsigned long req = bRequest == LIBUSBD_SET_FEATURE ? USB_RAW_IOCTL_EP_SET_HALT : USB_RAW_IOCTL_EP_CLEAR_HALT;
+            if (ioctl(pImplCtx->fd, req, pEp->handle) >= 0) {
+                pEp->halted = bRequest == LIBUSBD_SET_FEATURE;
+                ret = 0;
+            }
+        }
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+        return ret;
+    }
+    else if (bRequest == LIBUSBD_GET_INTERFACE && bmRequestType == LIBUSBD_DEV2HOST_INTERFACE)
+    {
+        pReply[0] = 0;
+        return 1;
+    }
+    else if ((bRequest == LIBUSBD_SET_FEATURE || bRequest == LIBUSBD_CLEAR_FEATURE) && !(bmRequestType & LIBUSBD_DEV2HOST_DIR))
+    {
+        return 0;
+    }
+    else if (bRequest == 11 && bmRequestType == LIBUSBD_HOST2DEV_INTERFACE) // SET_INTERFACE
+    {
+        return 0;
+    }
+
+    return LIBUSBD_STALLED;
+}
+
+// Class/vendor requests go to the interface's callback. OUT data stages are
+// read first, which also completes the status stage, so those can't be
+// stalled after the fact.
+static int libusbd_rawgadget_class_request(libusbd_ctx_t* pCtx, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, int* pAcked)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    int is_in = bmRequestType & LIBUSBD_DEV2HOST_DIR;
+    uint8_t* pData = pImplCtx->ep0_buffer.data;
+    uint8_t iface_num = 0xFF;
+
+    if ((bmRequestType & 0x1F) == 1) {
+        iface_num = wIndex & 0xFF;
+    }
+    else if ((bmRequestType & 0x1F) == 2) {
+        iface_num = pImplCtx->aEpAddrIface[LIBUSBD_RAWGADGET_EPADDR_IDX(wIndex)];
+    }
+    else if (pCtx->bNumInterfaces) {
+        iface_num = 0;
+    }
+
+    if (iface_num >= pCtx->bNumInterfaces) {
+        return LIBUSBD_STALLED;
+    }
+
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    libusbd_setup_callback_info_t* pInfo = &pIface->setup_callback_info;
+
+    if (!is_in && wLength) {
+        int ret = libusbd_rawgadget_ep0_io(pImplCtx, USB_RAW_IOCTL_EP0_READ, wLength);
+        *pAcked = 1;
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!pIface->setup_callback) {
+        // Nobody to ask, ACK it like FunctionFS would
+        return is_in ? 0 : wLength;
+    }
+
+    if (wLength > pIface->setup_buffer.size) {
+        return LIBUSBD_STALLED;
+    }
+
+    pInfo->bmRequestType = bmRequestType;
+    pInfo->bRequest = bRequest;
+    pInfo->wValue = wValue;
+    pInfo->wIndex = wIndex;
+    pInfo->wLength = wLength;
+    pInfo->out_len = 0;
+    pInfo->out_data = pIface->setup_buffer.data;
+
+    if (!is_in && wLength) {
+        memcpy(pIface->setup_buffer.data, pData, wLength);
+    }
+
+    int ret = pIface->setup_callback(pInfo);
+    if (ret < 0) {
+        libusbd_record_setup(pCtx, iface_num, pInfo, NULL, LIBUSBD_STALLED);
+        return LIBUSBD_STALLED;
+    }
+
+    if (!is_in) {
+        libusbd_record_setup(pCtx, iface_num, pInfo, pIface->setup_buffer.data, wLength);
+        return wLength;
+    }
+
+    ret = pInfo->out_len > wLength ? wLength : pInfo->out_len;
+    memcpy(pData, pInfo->out_data, ret);
+    libusbd_record_setup(pCtx, iface_num, pInfo, pData, ret);
+
+    return ret;
+}
+
+static void libusbd_rawgadget_handle_setup(libusbd_ctx_t* pCtx, const struct usb_ctrlrequest* pSetup)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    uint8_t bmRequestType = pSetup->bRequestType;
+    uint8_t bRequest = pSetup->bRequest;
+    uint16_t wValue = le16toh(pSetup->wValue);
+    uint16_t wIndex = le16toh(pSetup->wIndex);
+    uint16_t wLength = le16toh(pSetup->wLength);
+    int is_in = bmRequestType & LIBUSBD_DEV2HOST_DIR;
+    int acked = 0;
+    int ret;
+
+    LIBUSBD_TRACE(pCtx, setup, LIBUSBD_TRACE_SETUP, 0xFF, 0,
+                  (uint32_t)bmRequestType << 24 | bRequest << 16 | wValue,
+                  (uint32_t)wIndex << 16 | wLength);
+
+    LIBUSBD_LOG_DEBUG("libusbd raw-gadget: Setup: %x %x", bmRequestType, bRequest);
+
+    const uint8_t* setup = (const uint8_t*)pSetup;
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_SUBMIT, setup, NULL, 0);
+    }
+
+    if (((bmRequestType >> 5) & 0x3) == 0) {
+        ret = libusbd_rawgadget_standard_request(pCtx, bmRequestType, bRequest, wValue, wIndex, pImplCtx->ep0_buffer.data);
+    }
+    else {
+        ret = libusbd_rawgadget_class_request(pCtx, bmRequestType, bRequest, wValue, wIndex, wLength, &acked);
+    }
+
+    if (ret < 0) {
+        if (!acked) {
+            ioctl(pImplCtx->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        }
+    }
+    else if (is_in) {
+        if (ret > wLength) ret = wLength;
+        ret = libusbd_rawgadget_ep0_io(pImplCtx, USB_RAW_IOCTL_EP0_WRITE, ret);
+    }
+    else if (!acked) {
+        // Status stage
+        int status = libusbd_rawgadget_ep0_io(pImplCtx, USB_RAW_IOCTL_EP0_READ, 0);
+        if (status < 0) ret = status;
+    }
+
+    if (pCtx->pPcap) {
+        libusbd_pcap_control(pCtx, LIBUSBD_PCAP_COMPLETE, setup, is_in && ret > 0 ? pImplCtx->ep0_buffer.data : NULL, ret);
+    }
+}
+
+static void* libusbd_rawgadget_ep0_thread(libusbd_ctx_t* pCtx)
+{
+    LIBUSBD_LOG_INFO("libusbd raw-gadget: Start ep0");
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    while (__atomic_load_n(&pImplCtx->ep0_running, __ATOMIC_ACQUIRE))
+    {
+        struct {
+            struct usb_raw_event inner;
+            struct usb_ctrlrequest ctrl;
+        } event;
+
+        event.inner.type = USB_RAW_EVENT_INVALID;
+        event.inner.length = sizeof(event.ctrl);
+
+        if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+            if (errno != EINTR) {
+                LIBUSBD_LOG_ERROR("libusbd raw-gadget: EVENT_FETCH failed (%s)", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        LIBUSBD_TRACE(pCtx, ep0_event, LIBUSBD_TRACE_EP0_EVENT, 0xFF, 0, event.inner.type, 0);
+
+        switch (event.inner.type)
+        {
+            case USB_RAW_EVENT_CONNECT:
+                LIBUSBD_LOG_DEBUG("libusbd raw-gadget: Event CONNECT");
+                break;
+            case USB_RAW_EVENT_CONTROL:
+                libusbd_rawgadget_handle_setup(pCtx, &event.ctrl);
+                break;
+            case LIBUSBD_RAWGADGET_EVENT_RESET:
+            case LIBUSBD_RAWGADGET_EVENT_DISCONNECT:
+                LIBUSBD_LOG_DEBUG("libusbd raw-gadget: Event %s", event.inner.type == LIBUSBD_RAWGADGET_EVENT_RESET ? "RESET" : "DISCONNECT");
+                pthread_mutex_lock(&pImplCtx->io_mutex);
+                libusbd_rawgadget_disable_endpoints_locked(pCtx);
+                pthread_mutex_unlock(&pImplCtx->io_mutex);
+                break;
+            default:
+                LIBUSBD_LOG_DEBUG("libusbd raw-gadget: Event %03u", event.inner.type);
+                break;
+        }
+    }
+
+    __atomic_store_n(&pImplCtx->ep0_exited, 1, __ATOMIC_RELEASE);
+
+    LIBUSBD_LOG_INFO("libusbd raw-gadget: Stopped ep0");
+
+    return NULL;
+}
+
+static void libusbd_rawgadget_stop_ep0_thread(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    if (!pImplCtx->ep0_running) return;
+
+    __atomic_store_n(&pImplCtx->ep0_running, 0, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&pImplCtx->ep0_exited, __ATOMIC_ACQUIRE))
+    {
+        pthread_kill(pImplCtx->ep0_thread, LIBUSBD_RAWGADGET_WAKE_SIGNAL);
+        usleep(1000);
+    }
+    pthread_join(pImplCtx->ep0_thread, NULL);
+}
+
+// Everything's in: bind to the UDC and start answering the host
+static int libusbd_rawgadget_run(libusbd_ctx_t* pCtx)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    struct usb_raw_init init;
+    int ret;
+
+    memset(&init, 0, sizeof(init));
+    ret = libusbd_rawgadget_find_udc(&init);
+    if (ret) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: No UDC to bind to");
+        return ret;
+    }
+
+    init.speed = USB_SPEED_HIGH;
+    if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: INIT on %s/%s failed (%s)", init.driver_name, init.device_name, strerror(errno));
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+
+    if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: RUN failed (%s)", strerror(errno));
+        return LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    pImplCtx->has_run = 1;
+
+    // The UDC's endpoints are known once it's bound
+    ret = libusbd_rawgadget_assign_endpoints(pCtx);
+    if (!ret) {
+        ret = libusbd_rawgadget_build_config_desc(pCtx);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    pImplCtx->ep0_running = 1;
+    pImplCtx->ep0_exited = 0;
+    if (pthread_create(&pImplCtx->ep0_thread, NULL, (void* (*)(void*))&libusbd_rawgadget_ep0_thread, pCtx)) {
+        pImplCtx->ep0_running = 0;
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    LIBUSBD_LOG_INFO("libusbd raw-gadget: Running on %s", init.device_name);
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Init/config
+//
+
+int libusbd_rawgadget_init(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int fd = open(LIBUSBD_RAWGADGET_DEV, O_RDWR);
+    if (fd < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: Failed to open `%s` (%s)", LIBUSBD_RAWGADGET_DEV, strerror(errno));
+        return LIBUSBD_NOT_IMPLEMENTED;
+    }
+
+    pCtx->pRawGadgetCtx = malloc(sizeof(libusbd_rawgadget_ctx_t));
+    if (!pCtx->pRawGadgetCtx) {
+        close(fd);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+    memset(pCtx->pRawGadgetCtx, 0, sizeof(*pCtx->pRawGadgetCtx));
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    pImplCtx->fd = fd;
+    pthread_mutex_init(&pImplCtx->io_mutex, NULL);
+
+    memset(pImplCtx->aEpAddrIface, 0xFF, sizeof(pImplCtx->aEpAddrIface));
+    memset(pImplCtx->aEpAddrIdx, 0xFF, sizeof(pImplCtx->aEpAddrIdx));
+
+    if (libusbd_rawgadget_buffer_alloc(NULL, &pImplCtx->ep0_buffer, LIBUSBD_RAWGADGET_EP0_BUFFER_SZ)) {
+        libusbd_rawgadget_free(pCtx);
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    libusbd_rawgadget_install_wake_handler();
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_free(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    libusbd_rawgadget_stop_ep0_thread(pCtx);
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+
+            libusbd_rawgadget_ep_cancel_locked(pCtx, pEp);
+            pEp->worker_running = 0;
+            pthread_cond_broadcast(&pEp->cond);
+        }
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[i];
+
+        for (int j = 0; j < pIface->bNumEndpoints; j++)
+        {
+            libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[j];
+
+            if (pEp->worker) {
+                pthread_join(pEp->worker, NULL);
+            }
+            pthread_cond_destroy(&pEp->cond);
+            libusbd_rawgadget_buffer_free(pCtx, &pEp->buffer);
+        }
+
+        libusbd_rawgadget_buffer_free(pCtx, &pIface->setup_buffer);
+    }
+
+    // Unbinds from the UDC, the host sees a disconnect
+    close(pImplCtx->fd);
+
+    libusbd_rawgadget_buffer_free(NULL, &pImplCtx->ep0_buffer);
+    pImplCtx->pConfigDesc = NULL;
+
+    pthread_mutex_destroy(&pImplCtx->io_mutex);
+
+    free(pImplCtx);
+    pCtx->pRawGadgetCtx = NULL;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_config_finalize(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    if (libusbd_rawgadget_buffer_alloc(pCtx, &pIface->setup_buffer, LIBUSBD_RAWGADGET_EP_BUFFER_SZ)) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    for (int j = 0; j < pIface->bNumEndpoints; j++)
+    {
+        if (libusbd_rawgadget_buffer_alloc(pCtx, &pIface->aEndpoints[j].buffer, LIBUSBD_RAWGADGET_EP_BUFFER_SZ)) {
+            return LIBUSBD_RESOURCE_LIMIT_REACHED;
+        }
+    }
+
+    int ret = libusbd_rawgadget_ep_start_workers(pCtx, iface_num);
+    if (ret) {
+        return ret;
+    }
+
+    pCtx->aInterfaces[iface_num].finalized = true;
+
+    for (int i = 0; i < pCtx->bNumInterfaces; i++)
+    {
+        if (!pCtx->aInterfaces[i].finalized) {
+            return LIBUSBD_SUCCESS;
+        }
+    }
+
+    return libusbd_rawgadget_run(pCtx);
+}
+
+int libusbd_rawgadget_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pDesc) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (!libusbd_rawgadget_desc_append(pCtx, &pIface->pStandardDescs, pDesc, descSz)) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pDesc) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    libusbd_rawgadget_descdata_t* pNewDesc = libusbd_rawgadget_desc_append(pCtx, &pIface->pNonStandardDescs, pDesc, descSz);
+    if (!pNewDesc) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    pNewDesc->idx = descType;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pEpOut) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+    if (pIface->bNumEndpoints >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    libusbd_rawgadget_ep_t* pEp = &pIface->aEndpoints[pIface->bNumEndpoints];
+    pEp->pCtx = pCtx;
+    pEp->iface_num = iface_num;
+    pEp->idx = pIface->bNumEndpoints;
+    pEp->maxPktSize = maxPktSize;
+    pEp->type = USB_EPATTR_TTYPE(type);
+    pEp->direction = direction;
+    pEp->interval = interval;
+    pEp->handle = -1;
+    pthread_cond_init(&pEp->cond, NULL);
+
+    *pEpOut = pIface->bNumEndpoints++;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !name) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Raw Gadget is the whole gadget, there are no kernel functions to mix in
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_rawgadget_iface_alloc(libusbd_ctx_t* pCtx)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char *desc)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pCtx->aInterfaces[iface_num].finalized) {
+        return LIBUSBD_ALREADY_FINALIZED;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_iface_t* pIface = &pImplCtx->aInterfaces[iface_num];
+
+    pIface->setup_callback = func;
+
+    return LIBUSBD_SUCCESS;
+}
+
+//
+// Device-side endpoints
+//
+
+static int libusbd_rawgadget_ep_sync(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int op, uint32_t len, uint64_t timeoutMs)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    struct timespec ts;
+    int timed_out = 0;
+
+    if (timeoutMs) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeoutMs / 1000;
+        ts.tv_nsec += (timeoutMs % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    while (pEp->busy && !timed_out)
+    {
+        if (!timeoutMs) {
+            pthread_cond_wait(&pEp->cond, &pImplCtx->io_mutex);
+        }
+        else if (pthread_cond_timedwait(&pEp->cond, &pImplCtx->io_mutex, &ts) == ETIMEDOUT) {
+            timed_out = 1;
+        }
+    }
+
+    if (timed_out) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_TIMEOUT;
+    }
+
+    if (!pImplCtx->has_enumerated || pEp->handle < 0) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    pEp->busy = 1;
+    pEp->is_async = 0;
+    pEp->op = op;
+    pEp->len = len;
+    pEp->done = 0;
+    pEp->cancel = 0;
+
+    uint64_t submit_ns = libusbd_rawgadget_ep_submitted(pCtx, iface_num, ep, len);
+
+    if (!timeoutMs) {
+        // Nothing to watch the clock for, skip the worker round trip
+        libusbd_rawgadget_ep_complete_locked(pEp, libusbd_rawgadget_ep_io_locked(pImplCtx, pEp, pEp->buffer.pIo, pEp->op, pEp->len));
+    }
+    else {
+        pthread_cond_broadcast(&pEp->cond);
+
+        while (!pEp->done)
+        {
+            if (pthread_cond_timedwait(&pEp->cond, &pImplCtx->io_mutex, &ts) != ETIMEDOUT) continue;
+
+            timed_out = 1;
+            pEp->cancel = 1;
+            if (pEp->in_io) {
+                libusbd_rawgadget_ep_interrupt_locked(pImplCtx, pEp);
+            }
+            else if (!pEp->done) {
+                // The worker never got to it
+                libusbd_rawgadget_ep_complete_locked(pEp, LIBUSBD_CANCELLED);
+            }
+
+            while (!pEp->done)
+            {
+                pthread_cond_wait(&pEp->cond, &pImplCtx->io_mutex);
+            }
+        }
+    }
+
+    int ret = pEp->status;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    // It may have finished just as we gave up on it
+    if (timed_out && ret == LIBUSBD_CANCELLED) {
+        ret = LIBUSBD_TIMEOUT;
+    }
+
+    libusbd_rawgadget_ep_completed(pCtx, iface_num, ep, ret, ret >= 0 ? submit_ns : 0);
+
+    return ret;
+}
+
+int libusbd_rawgadget_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_buffer_t* pBuffer = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep].buffer;
+
+    if (!pBuffer->data || len > pBuffer->size) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = libusbd_rawgadget_ep_sync(pCtx, iface_num, ep, LIBUSBD_RAWGADGET_OP_READ, len, timeoutMs);
+
+    if (ret > 0 && data && data != pBuffer->data) {
+        memcpy(data, pBuffer->data, ret);
+    }
+
+    return ret;
+}
+
+int libusbd_rawgadget_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_buffer_t* pBuffer = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep].buffer;
+
+    if (!pBuffer->data || len > pBuffer->size) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (data && data != pBuffer->data && len) {
+        memcpy(pBuffer->data, data, len);
+    }
+
+    return libusbd_rawgadget_ep_sync(pCtx, iface_num, ep, LIBUSBD_RAWGADGET_OP_WRITE, len, timeoutMs);
+}
+
+int libusbd_rawgadget_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    int ret = LIBUSBD_SUCCESS;
+
+    // Halted until the host sends CLEAR_FEATURE(ENDPOINT_HALT). The UDC
+    // won't halt an endpoint with a request queued on it.
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (pEp->handle < 0) {
+        ret = LIBUSBD_NOT_ENUMERATED;
+    }
+    else if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_EP_SET_HALT, pEp->handle) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: Failed to halt endpoint %02x (%s)", pEp->address, strerror(errno));
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    else {
+        pEp->halted = 1;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return ret;
+}
+
+int libusbd_rawgadget_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+    int ret = LIBUSBD_SUCCESS;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    if (pEp->handle < 0) {
+        ret = LIBUSBD_NOT_ENUMERATED;
+    }
+    else if (ioctl(pImplCtx->fd, USB_RAW_IOCTL_EP_CLEAR_HALT, pEp->handle) < 0) {
+        LIBUSBD_LOG_ERROR("libusbd raw-gadget: Failed to clear halt on endpoint %02x (%s)", pEp->address, strerror(errno));
+        ret = LIBUSBD_NONDESCRIPT_ERROR;
+    }
+    else {
+        pEp->halted = 0;
+    }
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return ret;
+}
+
+int libusbd_rawgadget_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    libusbd_rawgadget_xfer_t* pQueued = libusbd_rawgadget_xfer_take_queued_locked(pEp);
+    libusbd_rawgadget_ep_cancel_locked(pCtx, pEp);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_rawgadget_xfer_cancel_list(pQueued);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    *pOut = pEp->buffer.data;
+
+    return (pEp->buffer.size & 0x7FFFFFFF);
+}
+
+static int libusbd_rawgadget_ep_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int op, const void* data, uint32_t len)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    if (!pEp->buffer.data || len > pEp->buffer.size) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    if (!pImplCtx->has_enumerated && pEp->rearm_policy != LIBUSBD_REARM_ON_ENABLE) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    // Starting again replaces the last async transfer, a sync one is
+    // waited out
+    if (pEp->busy && pEp->is_async) {
+        libusbd_rawgadget_ep_cancel_locked(pCtx, pEp);
+    }
+    while (pEp->busy)
+    {
+        pthread_cond_wait(&pEp->cond, &pImplCtx->io_mutex);
+    }
+
+    if (data && data != pEp->buffer.data && len) {
+        memcpy(pEp->buffer.data, data, len);
+    }
+
+    pEp->busy = 1;
+    pEp->is_async = 1;
+    pEp->op = op;
+    pEp->len = len;
+    pEp->done = 0;
+    pEp->cancel = 0;
+    pEp->last_transferred = 0;
+    pEp->ep_async_done = 0;
+
+    pEp->submit_ns = libusbd_rawgadget_ep_submitted(pCtx, iface_num, ep, len);
+
+    pthread_cond_broadcast(&pEp->cond);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_rawgadget_ep_start(pCtx, iface_num, ep, LIBUSBD_RAWGADGET_OP_READ, NULL, len);
+}
+
+int libusbd_rawgadget_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_rawgadget_ep_start(pCtx, iface_num, ep, LIBUSBD_RAWGADGET_OP_WRITE, data, len);
+}
+
+int libusbd_rawgadget_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (policy != LIBUSBD_REARM_NONE && policy != LIBUSBD_REARM_ON_ENABLE) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+    pEp->rearm_policy = policy;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // Raw Gadget only moves data through EP_READ/EP_WRITE
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_rawgadget_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_rawgadget_ep_get_fifo_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_rawgadget_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    return __atomic_load_n(&pEp->ep_async_done, __ATOMIC_ACQUIRE);
+}
+
+int libusbd_rawgadget_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (iface_num >= LIBUSBD_MAX_IFACES) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (ep >= LIBUSBD_MAX_IFACE_EPS) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[iface_num].aEndpoints[ep];
+
+    return pEp->last_transferred;
+}
+
+//
+// Handoff
+//
+
+int libusbd_rawgadget_xfer_alloc(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_xfer_t* pRgXfer = calloc(1, sizeof(libusbd_rawgadget_xfer_t));
+    if (!pRgXfer) {
+        return LIBUSBD_RESOURCE_LIMIT_REACHED;
+    }
+
+    // The data lives behind its own usb_raw_ep_io, same as the endpoint buffer
+    int ret = libusbd_rawgadget_buffer_alloc(pCtx, &pRgXfer->buffer, pXfer->pub.buffer_size);
+    if (ret) {
+        free(pRgXfer);
+        return ret;
+    }
+
+    pRgXfer->pXfer = pXfer;
+    pXfer->pPlat = pRgXfer;
+    pXfer->pub.buffer = pRgXfer->buffer.data;
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_xfer_free(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_xfer_t* pRgXfer = pXfer->pPlat;
+
+    libusbd_rawgadget_buffer_free(pCtx, &pRgXfer->buffer);
+    free(pRgXfer);
+    pXfer->pub.buffer = NULL;
+    pXfer->pPlat = NULL;
+
+    return LIBUSBD_SUCCESS;
+}
+
+// Checks a transfer object's endpoint exists, for submit and prepare
+static int libusbd_rawgadget_xfer_check(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    uint8_t iface_num = pXfer->pub.iface_num;
+    uint64_t ep = pXfer->pub.ep;
+
+    if (iface_num >= pCtx->bNumInterfaces || ep >= pCtx->pRawGadgetCtx->aInterfaces[iface_num].bNumEndpoints) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return LIBUSBD_SUCCESS;
+}
+
+static int libusbd_rawgadget_xfer_queue(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[pXfer->pub.iface_num].aEndpoints[pXfer->pub.ep];
+    libusbd_rawgadget_xfer_t* pRgXfer = pXfer->pPlat;
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    // Same as ep_read_start, only held for the next enable when asked to be
+    if (!pImplCtx->has_enumerated && pEp->rearm_policy != LIBUSBD_REARM_ON_ENABLE) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_NOT_ENUMERATED;
+    }
+
+    pRgXfer->pNext = NULL;
+    if (pEp->pXferTail) {
+        pEp->pXferTail->pNext = pRgXfer;
+    }
+    else {
+        pEp->pXferHead = pRgXfer;
+    }
+    pEp->pXferTail = pRgXfer;
+
+    pthread_cond_broadcast(&pEp->cond);
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_xfer_submit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    int ret = libusbd_rawgadget_xfer_check(pCtx, pXfer);
+    if (ret) {
+        return ret;
+    }
+
+    return libusbd_rawgadget_xfer_queue(pCtx, pXfer);
+}
+
+int libusbd_rawgadget_xfer_cancel(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    libusbd_rawgadget_ctx_t* pImplCtx = pCtx->pRawGadgetCtx;
+    libusbd_rawgadget_xfer_t* pRgXfer = pXfer->pPlat;
+    libusbd_rawgadget_ep_t* pEp = &pImplCtx->aInterfaces[pXfer->pub.iface_num].aEndpoints[pXfer->pub.ep];
+
+    pthread_mutex_lock(&pImplCtx->io_mutex);
+
+    // In the ioctl, the worker completes it once it's out
+    if (pEp->pXferCur == pRgXfer) {
+        pEp->cancel = 1;
+        if (pEp->in_io) {
+            libusbd_rawgadget_ep_interrupt_locked(pImplCtx, pEp);
+        }
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_SUCCESS;
+    }
+
+    libusbd_rawgadget_xfer_t* pPrev = NULL;
+    libusbd_rawgadget_xfer_t* pIter = pEp->pXferHead;
+    while (pIter && pIter != pRgXfer)
+    {
+        pPrev = pIter;
+        pIter = pIter->pNext;
+    }
+
+    if (!pIter) {
+        pthread_mutex_unlock(&pImplCtx->io_mutex);
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    if (pPrev) {
+        pPrev->pNext = pRgXfer->pNext;
+    }
+    else {
+        pEp->pXferHead = pRgXfer->pNext;
+    }
+    if (pEp->pXferTail == pRgXfer) {
+        pEp->pXferTail = pPrev;
+    }
+    pRgXfer->pNext = NULL;
+    pthread_mutex_unlock(&pImplCtx->io_mutex);
+
+    libusbd_xfer_complete(pXfer, LIBUSBD_CANCELLED);
+
+    return LIBUSBD_SUCCESS;
+}
+
+int libusbd_rawgadget_xfer_prepare(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The usb_raw_ep_io is filled in by the worker right before the ioctl,
+    // so only the checks can be done up front
+    return libusbd_rawgadget_xfer_check(pCtx, pXfer);
+}
+
+int libusbd_rawgadget_xfer_resubmit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pXfer) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    return libusbd_rawgadget_xfer_queue(pCtx, pXfer);
+}
+
+int libusbd_rawgadget_handoff_export(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    if (!pCtx || !pCtx->pRawGadgetCtx || !pBuf) {
+        return LIBUSBD_INVALID_ARGUMENT;
+    }
+
+    // The fd could travel, but ep0 state and the endpoint handles live in
+    // this process's threads
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+int libusbd_rawgadget_handoff_adopt(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf)
+{
+    return LIBUSBD_NOT_IMPLEMENTED;
+}
+
+static int libusbd_rawgadget_probe(void)
+{
+    // Needs the raw_gadget module and a UDC to bind to (dummy_hcd will do)
+    if (access(LIBUSBD_RAWGADGET_DEV, R_OK | W_OK)) {
+        return LIBUSBD_NOT_IMPLEMENTED;
+    }
+
+    struct usb_raw_init init;
+    memset(&init, 0, sizeof(init));
+
+    return libusbd_rawgadget_find_udc(&init);
+}
+
+const libusbd_backend_ops_t libusbd_backend_rawgadget = {
+    .name = "raw-gadget",
+    // Hasn't been run against dummy_hcd yet, only use it when asked for
+    .flags = LIBUSBD_BACKEND_FLAG_EXPLICIT,
+    .probe = libusbd_rawgadget_probe,
+    LIBUSBD_BACKEND_OPS(rawgadget),
+};
@@ -0,0 +1,52 @@
+#ifndef _LIBUSBD_PLAT_RAWGADGET_IMPL_H
+#define _LIBUSBD_PLAT_RAWGADGET_IMPL_H
+
+#include "libusbd.h"
+
+typedef struct libusbd_rawgadget_ctx_t libusbd_rawgadget_ctx_t;
+typedef struct libusbd_handoff_buf_t libusbd_handoff_buf_t;
+typedef struct libusbd_xfer_t libusbd_xfer_t;
+
+int libusbd_rawgadget_init(libusbd_ctx_t* pCtx);
+int libusbd_rawgadget_free(libusbd_ctx_t* pCtx);
+
+int libusbd_rawgadget_config_finalize(libusbd_ctx_t* pCtx);
+
+int libusbd_rawgadget_iface_alloc_builtin(libusbd_ctx_t* pCtx, const char* name);
+int libusbd_rawgadget_iface_alloc(libusbd_ctx_t* pCtx);
+int libusbd_rawgadget_iface_finalize(libusbd_ctx_t* pCtx, uint8_t iface_num);
+int libusbd_rawgadget_iface_standard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+int libusbd_rawgadget_iface_nonstandard_desc(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t descType, uint8_t unk, const uint8_t* pDesc, uint64_t descSz);
+int libusbd_rawgadget_iface_add_endpoint(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t type, uint8_t direction, uint32_t maxPktSize, uint8_t interval, uint64_t unk, uint64_t* pEpOut);
+int libusbd_rawgadget_iface_set_description(libusbd_ctx_t* pCtx, uint8_t iface_num, const char * desc);
+int libusbd_rawgadget_iface_set_class(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+int libusbd_rawgadget_iface_set_subclass(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+int libusbd_rawgadget_iface_set_protocol(libusbd_ctx_t* pCtx, uint8_t iface_num, uint8_t val);
+int libusbd_rawgadget_iface_set_class_cmd_callback(libusbd_ctx_t* pCtx, uint8_t iface_num, libusbd_setup_callback_t func);
+
+int libusbd_rawgadget_ep_read(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void* data, uint32_t len, uint64_t timeoutMs);
+int libusbd_rawgadget_ep_write(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeoutMs);
+int libusbd_rawgadget_ep_stall(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_abort(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_clear_halt(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_get_buffer(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, void** pOut);
+int libusbd_rawgadget_ep_read_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint32_t len, uint64_t timeout_ms);
+int libusbd_rawgadget_ep_write_start(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, const void* data, uint32_t len, uint64_t timeout_ms);
+int libusbd_rawgadget_ep_set_rearm(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, uint8_t policy);
+int libusbd_rawgadget_ep_set_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep, int fd, uint64_t size);
+int libusbd_rawgadget_ep_get_dmabuf(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_get_fifo_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_transfer_done(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+int libusbd_rawgadget_ep_transferred_bytes(libusbd_ctx_t* pCtx, uint8_t iface_num, uint64_t ep);
+
+int libusbd_rawgadget_xfer_alloc(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+int libusbd_rawgadget_xfer_free(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+int libusbd_rawgadget_xfer_submit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+int libusbd_rawgadget_xfer_cancel(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+int libusbd_rawgadget_xfer_prepare(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+int libusbd_rawgadget_xfer_resubmit(libusbd_ctx_t* pCtx, libusbd_xfer_t* pXfer);
+
+int libusbd_rawgadget_handoff_export(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf);
+int libusbd_rawgadget_handoff_adopt(libusbd_ctx_t* pCtx, libusbd_handoff_buf_t* pBuf);
+
+#endif // _LIBUSBD_PLAT_RAWGADGET_IMPL_H
\ No newline at end of file
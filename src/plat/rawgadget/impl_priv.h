@@ -0,0 +1,136 @@
+#ifndef _LIBUSBD_PLAT_RAWGADGET_IMPL_PRIV_H
+#define _LIBUSBD_PLAT_RAWGADGET_IMPL_PRIV_H
+
+#include <pthread.h>
+
+#include <linux/usb/raw_gadget.h>
+
+typedef struct libusbd_rawgadget_descdata_t libusbd_rawgadget_descdata_t;
+typedef struct libusbd_rawgadget_xfer_t libusbd_rawgadget_xfer_t;
+typedef struct libusbd_xfer_t libusbd_xfer_t;
+
+#define LIBUSBD_RAWGADGET_OP_NONE  (0)
+#define LIBUSBD_RAWGADGET_OP_READ  (1)
+#define LIBUSBD_RAWGADGET_OP_WRITE (2)
+
+typedef struct libusbd_rawgadget_descdata_t
+{
+    void* data;
+    uint64_t size;
+
+    uint8_t idx;
+
+    libusbd_rawgadget_descdata_t* pNext;
+} libusbd_rawgadget_descdata_t;
+
+// The ioctl argument and the transfer data in one allocation, so transfers
+// go straight from the buffer `libusbd_ep_get_buffer` hands out
+typedef struct libusbd_rawgadget_buffer_t
+{
+    struct usb_raw_ep_io* pIo;
+    void* data;
+    uint64_t size;
+} libusbd_rawgadget_buffer_t;
+
+// Raw Gadget takes one request per endpoint at a time, so transfer objects
+// queue up here and the worker feeds them in one after another
+typedef struct libusbd_rawgadget_xfer_t
+{
+    libusbd_rawgadget_buffer_t buffer;
+    libusbd_xfer_t* pXfer;
+    libusbd_rawgadget_xfer_t* pNext;
+} libusbd_rawgadget_xfer_t;
+
+typedef struct libusbd_rawgadget_ep_t
+{
+    libusbd_ctx_t* pCtx;
+    uint8_t iface_num;
+    uint8_t idx;
+
+    uint64_t last_transferred;
+    uint64_t ep_async_done;
+    uint64_t maxPktSize;
+
+    uint8_t type;
+    uint8_t direction;
+    uint8_t interval;
+    uint8_t address;
+
+    // From USB_RAW_IOCTL_EP_ENABLE, -1 while the host hasn't configured us
+    int handle;
+    int halted;
+
+    uint8_t rearm_policy;
+    int rearm_pending;
+
+    // One transfer at a time owns the endpoint. Sync transfers without a
+    // timeout run on the caller's thread, everything else on the worker.
+    pthread_t worker;
+    int worker_running;
+    pthread_cond_t cond;
+
+    int busy;
+    int is_async;
+    int op;
+    uint32_t len;
+    int done;
+    int status;
+    uint64_t submit_ns;
+
+    // Whoever is sitting in the EP_READ/EP_WRITE ioctl, so it can be
+    // interrupted. Raw Gadget dequeues the request when that happens.
+    pthread_t io_thread;
+    int in_io;
+    int cancel;
+
+    libusbd_rawgadget_buffer_t buffer;
+
+    // Queued transfer objects. The one the worker is running is pXferCur,
+    // and it owns the endpoint (busy) like any other transfer would.
+    libusbd_rawgadget_xfer_t* pXferHead;
+    libusbd_rawgadget_xfer_t* pXferTail;
+    libusbd_rawgadget_xfer_t* pXferCur;
+} libusbd_rawgadget_ep_t;
+
+typedef struct libusbd_rawgadget_iface_t
+{
+    libusbd_rawgadget_buffer_t setup_buffer;
+
+    libusbd_setup_callback_t setup_callback;
+    libusbd_setup_callback_info_t setup_callback_info;
+
+    uint8_t bNumEndpoints;
+    libusbd_rawgadget_ep_t aEndpoints[16];
+
+    libusbd_rawgadget_descdata_t* pStandardDescs;
+    libusbd_rawgadget_descdata_t* pNonStandardDescs;
+} libusbd_rawgadget_iface_t;
+
+typedef struct libusbd_rawgadget_ctx_t
+{
+    int fd;
+
+    pthread_mutex_t io_mutex;
+
+    pthread_t ep0_thread;
+    int ep0_running;
+    int ep0_exited;
+
+    int has_run;
+    int has_enumerated;
+    uint8_t bConfigurationValue;
+
+    // bEndpointAddress -> (interface, endpoint), 0xFF if unused
+    uint8_t aEpAddrIface[32];
+    uint8_t aEpAddrIdx[32];
+
+    libusbd_rawgadget_iface_t aInterfaces[16];
+
+    // ep0 data stages, sized for the largest wLength
+    libusbd_rawgadget_buffer_t ep0_buffer;
+
+    void* pConfigDesc;
+    uint16_t configDescSz;
+} libusbd_rawgadget_ctx_t;
+
+#endif // _LIBUSBD_PLAT_RAWGADGET_IMPL_PRIV_H